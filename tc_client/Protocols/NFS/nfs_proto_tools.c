@@ -3645,6 +3645,27 @@ int nfs4_Fattr_To_FSAL_attr(struct attrlist *FSAL_attr, fattr4 *Fattr,
 	return Fattr4_To_FSAL_attr(FSAL_attr, Fattr, NULL, NULL, data);
 }
 
+/**
+ * @brief Convert NFSv4 attribute buffer to an FSAL attribute list and a handle
+ *
+ * Same as nfs4_Fattr_To_FSAL_attr(), but also decodes FATTR4_FILEHANDLE, if
+ * present, into the buffer of "hdl4", which should have NFS4_FHSIZE bytes.
+ *
+ * @param[out] FSAL_attr FSAL attributes
+ * @param[in]  Fattr     NFSv4 attributes
+ * @param[out] hdl4      NFSv4 file handle
+ * @param[in]  data      Compound data
+ *
+ * @return NFS4_OK if successful, NFS4ERR codes if not.
+ *
+ */
+int nfs4_Fattr_To_FSAL_attr_fh(struct attrlist *FSAL_attr, fattr4 *Fattr,
+			       nfs_fh4 *hdl4, compound_data_t *data)
+{
+	memset(FSAL_attr, 0, sizeof(struct attrlist));
+	return Fattr4_To_FSAL_attr(FSAL_attr, Fattr, hdl4, NULL, data);
+}
+
 /**
  *
  * nfs4_Fattr_To_fsinfo: Decode filesystem info out of NFSv4 attributes.
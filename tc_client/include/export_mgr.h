@@ -132,8 +132,23 @@ struct gsh_export {
 	uint64_t cache_size;
 	/** Cache expiration time for this tc cache */
 	uint64_t cache_expiration;
+	/** Data cache size in blocks of 256KB */
 	uint64_t data_cache_size;
 	uint64_t data_cache_expiration;
+	/** Back the data cache with huge pages */
+	bool data_cache_huge_pages;
+	/** Directory of the data cache on local storage */
+	char *data_cache_disk_path;
+	/** Data cache size on local storage in blocks of 256KB */
+	uint64_t data_cache_disk_size;
+	/** Name of the shared memory segment of the data cache */
+	char *data_cache_shm_name;
+	/** Bounds in seconds of the timeouts of cached attributes of regular
+	    files and directories */
+	uint32_t attr_cache_reg_min;
+	uint32_t attr_cache_reg_max;
+	uint32_t attr_cache_dir_min;
+	uint32_t attr_cache_dir_max;
 };
 
 void export_pkginit(void);
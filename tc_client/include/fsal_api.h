@@ -326,6 +326,7 @@ struct tcopen_kargs;
 
 struct fsal_up_vector;		/* From fsal_up.h */
 struct fsal_xattrent;
+struct nfs4_dir_update;		/* From nfs4_ddeleg.h */
 
 #ifndef SEEK_SET
 #define SEEK_SET 0
@@ -1340,7 +1341,8 @@ struct fsal_obj_ops {
 
 	vres (*vec_listdir)(const char **dirs, int count,
 			      struct vattrs_masks masks, int max_entries,
-			      bool recursive, vec_listdir_cb cb, void *cbarg);
+			      bool recursive, vec_listdir_batch_cb cb,
+			      void *cbarg);
 
 	vres (*vec_rename)(vfile_pair *pairs, int count);
 
@@ -1365,6 +1367,36 @@ struct fsal_obj_ops {
 	int (*sca_chdir)(const char *path);
 	char *(*sca_getcwd)();
 
+/**
+ * @brief Whether the file is delegated to us for reading
+ *
+ * While a read delegation is held, the file cannot be changed by other
+ * clients without recalling the delegation first, so cached data and
+ * attributes of the file need no revalidation.
+ */
+	bool (*tc_has_delegation)(const char *path);
+
+/**
+ * @brief Pop the changes of a delegated directory
+ *
+ * While a directory delegation is held, the server notifies us of the
+ * entries added to, removed from, and changed in the directory, so a cached
+ * listing of the directory stays valid once the changes are applied to it.
+ *
+ * @return The number of changes popped into "*updates", which the caller
+ * should free(), or -1 if the directory is not delegated.
+ */
+	int (*tc_pop_dir_changes)(const char *dir,
+				  struct nfs4_dir_update **updates);
+
+/**
+ * @brief Set the number of READDIR compounds kept in flight
+ *
+ * Overrides "Listdir_Parallelism" of the config file for the listings
+ * started afterwards.
+ */
+	void (*tc_set_listdir_parallelism)(unsigned int n);
+
 /**
  * @brief Create a directory
  *
@@ -55,7 +55,55 @@ struct viov_array *tc_split_iov_array(const struct viov_array *iova,
 bool vrestore_iov_array(struct viov_array *iova,
 			  struct viov_array **parts, int nparts);
 
-bool tc_merge_iov_array(struct viov_array *iova);
+/**
+ * Whether the split "parts" of a write can be sent in any order, i.e., no
+ * file is created by one part and written by another, and no two parts
+ * write the same bytes of a file.
+ */
+bool tc_iov_parts_are_independent(const struct viov_array *parts,
+				  int nparts);
+
+/**
+ * The result of merging an array of viovec.
+ */
+struct viov_merge {
+	struct viov_array merged;  /* the viovecs to be sent instead */
+	int *owners;     /* owners[i] is the merged viovec of iova->iovs[i] */
+	int *nmembers;   /* # of original viovecs of each merged viovec */
+};
+
+/**
+ * Coalesce viovecs of "iova" that access contiguous or overlapping ranges of
+ * the same file, so that they can be sent as fewer READs or WRITEs.  The
+ * viovecs of each file are sorted by offset, and neighbors are merged as long
+ * as the merged viovec is no larger than "size_limit" (e.g., maxread or
+ * maxwrite).  Merged viovecs use buffers of their own; for writes, the data
+ * is copied into them in the order of "iova" so later viovecs win when they
+ * overlap.
+ *
+ * Only non-transactional calls should be merged.  Viovecs using the current
+ * or saved filehandle, special offsets, or creation are left alone.
+ *
+ * Return NULL if nothing can be merged.  Otherwise, the caller should send
+ * the returned "merged" array and then call tc_unmerge_iov_array().
+ */
+struct viov_merge *tc_merge_iov_array(const struct viov_array *iova,
+				      size_t size_limit, bool is_write);
+
+/**
+ * Scatter the results of the merged viovecs back to the original "iova",
+ * including the data of reads, and release "merge".  The index of a failed
+ * "res", if any, is translated to the first original viovec of the merged
+ * one.
+ */
+void tc_unmerge_iov_array(struct viov_array *iova, struct viov_merge **merge,
+			  bool is_write, vres *res);
+
+/**
+ * Release "merge" without passing any results back, e.g., when the merged
+ * viovecs are not sent after all.
+ */
+void tc_free_iov_merge(struct viov_merge **merge);
 
 #ifdef __cplusplus
 }
@@ -285,6 +285,9 @@ bool nfs3_Sattr_To_FSALattr(struct attrlist *, sattr3 *);
 
 int nfs4_Fattr_To_FSAL_attr(struct attrlist *, fattr4 *, compound_data_t *);
 
+int nfs4_Fattr_To_FSAL_attr_fh(struct attrlist *, fattr4 *, nfs_fh4 *,
+			       compound_data_t *);
+
 int nfs4_Fattr_To_fsinfo(fsal_dynamicfsinfo_t *, fattr4 *);
 
 int nfs4_Fattr_Fill_Error(fattr4 *, nfsstat4);
@@ -164,6 +164,20 @@ static inline vfile vfile_from_cfh(const char *relpath) {
 	return tf;
 }
 
+/**
+ * Opt in to implicit batching of scalar calls across threads.
+ *
+ * When enabled, sca_open(), sca_stat(), sca_lstat(), sca_fstat() and
+ * sca_unlink() calls are held for up to "window_us" microseconds (or until
+ * "max_ops" calls of the same kind are queued) so that calls from different
+ * threads are sent together in one non-transactional compound.  Batching
+ * trades latency of each call for fewer round trips.
+ *
+ * @window_us: the longest time a call waits for others; 0 disables batching
+ * @max_ops: the most calls in one batch
+ */
+void sca_set_batching(unsigned int window_us, int max_ops);
+
 /**
  * Open a vfile using path.  Similar to "openat(2)".
  *
@@ -361,6 +375,14 @@ static inline vres vfailure(int i, int err) {
 
 vfile *vec_open(const char **paths, int count, int *flags, mode_t *modes);
 
+/**
+ * Same as vec_open(), but the files opened before a failed one are kept:
+ * "res" tells the file failed, and the returned array holds the
+ * "res->index" files before it, or is NULL if there is none.
+ */
+vfile *vec_open_partly(const char **paths, int count, int *flags,
+		       mode_t *modes, vres *res);
+
 vfile *vec_open_simple(const char **paths, int count, int flags, mode_t mode);
 
 /* |files| will be freed by vec_close(). */
@@ -380,6 +402,10 @@ off_t sca_fseek(vfile *tcf, off_t offset, int whence);
  * using the same "path" of the preceding array element.
  * @count: the count of reads in the preceding array
  * @is_transaction: whether to execute the compound as a transaction
+ *
+ * Unless @is_transaction, large vectors are sent in several compounds that may
+ * run concurrently; upon a failure, the index is that of the first failed
+ * read, but reads after it may have completed too.
  */
 vres vec_read(struct viovec *reads, int count, bool is_transaction);
 
@@ -388,6 +414,40 @@ static inline bool tx_vec_read(struct viovec *reads, int count)
 	return vokay(vec_read(reads, count, true));
 }
 
+/**
+ * A read-only reference to data in the client-side data cache.
+ */
+struct vlease
+{
+	const char *data;
+	size_t length;
+	void *handle;	/* internal use only */
+};
+
+/**
+ * The leases of the data of one read, in file order.  "count" is 0 if the
+ * data has been copied to the "data" buffer of the read instead.
+ */
+struct vleased_read
+{
+	int count;
+	struct vlease *leases;
+};
+
+/**
+ * Same as vec_read() except that reads fully served by the data cache are
+ * not copied to their "data" buffers; instead, @leases[i] references the
+ * cached data of the i-th read.  The cached data stays valid and unchanged
+ * until the leases are released by vec_release_leases(), even if the file
+ * is written meanwhile.
+ *
+ * @leases: an array of @count elements
+ */
+vres vec_read_leased(struct viovec *reads, int count, bool is_transaction,
+		     struct vleased_read *leases);
+
+void vec_release_leases(struct vleased_read *leases, int count);
+
 /**
  * Write to one or more files.
  *
@@ -396,6 +456,10 @@ static inline bool tx_vec_read(struct viovec *reads, int count)
  * using the same "path"
  * @count: the count of writes in the preceding array
  * @is_transaction: whether to execute the compound as a transaction
+ *
+ * Unless @is_transaction, large vectors are sent in several compounds that may
+ * run concurrently; upon a failure, the index is that of the first failed
+ * write, but writes after it may have been applied too.
  */
 vres vec_write(struct viovec *writes, int count, bool is_transaction);
 
@@ -404,6 +468,77 @@ static inline bool tx_vec_write(struct viovec *writes, int count)
 	return vokay(vec_write(writes, count, true));
 }
 
+/**
+ * Asynchronous submission and completion of vectorized operations.
+ *
+ * A vqueue owns up to "depth" outstanding compounds.  Each submission
+ * returns a ticket immediately; the caller later reaps the completion with
+ * vqueue_poll()/vqueue_wait(), or receives it through a callback if one was
+ * given at submission time (completions delivered by callback are not put on
+ * the completion queue).  The arrays passed to a submission are owned by the
+ * library until the operation completes, and must not be modified or freed
+ * by the caller before that.
+ */
+typedef struct _vqueue vqueue;
+
+/**
+ * Identify a submitted operation.  VTICKET_INVALID means submission failed.
+ */
+typedef uint64_t vticket;
+#define VTICKET_INVALID 0
+
+struct vcompletion
+{
+	vticket ticket;
+	vres res;
+	void *cbarg;	/* the "cbarg" given at submission */
+};
+
+/**
+ * Callback invoked on completion of an asynchronous operation.  It runs in a
+ * library thread, so it should be short and must not block on the same
+ * queue.
+ */
+typedef void (*vec_async_cb)(const struct vcompletion *cpl);
+
+/**
+ * Create a queue allowing up to "depth" compounds in flight at the same time.
+ * Return NULL on failure.
+ */
+vqueue *vqueue_create(int depth);
+
+/**
+ * Wait for all outstanding operations of "q" to finish and free the queue.
+ * Completions that have not been reaped are dropped.
+ */
+void vqueue_destroy(vqueue *q);
+
+vticket vec_read_async(vqueue *q, struct viovec *reads, int count,
+		       bool is_transaction, vec_async_cb cb, void *cbarg);
+
+vticket vec_write_async(vqueue *q, struct viovec *writes, int count,
+			bool is_transaction, vec_async_cb cb, void *cbarg);
+
+/**
+ * Reap up to "max" completions without blocking.
+ *
+ * Return the number of completions copied into "cpls".
+ */
+int vqueue_poll(vqueue *q, struct vcompletion *cpls, int max);
+
+/**
+ * Reap between "min" and "max" completions, blocking until at least "min" of
+ * them are available or nothing is outstanding any more.
+ *
+ * Return the number of completions copied into "cpls".
+ */
+int vqueue_wait(vqueue *q, struct vcompletion *cpls, int min, int max);
+
+/**
+ * Return the number of submitted operations that have not been reaped yet.
+ */
+int vqueue_pending(vqueue *q);
+
 /**
  * The bitmap indicating the presence of file attributes.
  */
@@ -421,6 +556,7 @@ struct vattrs_masks
 	unsigned int has_atime : 1; /* time of last access */
 	unsigned int has_mtime : 1; /* time of last modification */
 	unsigned int has_ctime : 1; /* time of last status change */
+	unsigned int has_change : 1; /* NFSv4 change attribute */
 };
 
 /**
@@ -441,6 +577,7 @@ struct vattrs
 	struct timespec atime;
 	struct timespec mtime;
 	struct timespec ctime;
+	uint64_t change;    /* changes whenever the file is changed */
 };
 
 static inline void vattrs_set_mode(struct vattrs *attrs, mode_t mode)
@@ -500,6 +637,12 @@ static inline void vattrs_set_ctime(struct vattrs *attrs,
 	attrs->masks.has_ctime = true;
 }
 
+static inline void vattrs_set_change(struct vattrs *attrs, uint64_t change)
+{
+	attrs->change = change;
+	attrs->masks.has_change = true;
+}
+
 static inline void vattrs_set_rdev(struct vattrs *attrs, dev_t rdev)
 {
 	attrs->rdev = rdev;
@@ -549,6 +692,8 @@ static inline void vstat2attrs(const struct stat *st, struct vattrs *attrs)
 		attrs->ctime.tv_sec = st->st_ctim.tv_sec;
 		attrs->ctime.tv_nsec = st->st_ctim.tv_nsec;;
 	}
+	/* struct stat has no change attribute */
+	attrs->masks.has_change = false;
 }
 
 static inline void tc_attrs2attrs(struct vattrs *dstAttrs,
@@ -584,6 +729,8 @@ static inline void tc_attrs2attrs(struct vattrs *dstAttrs,
 		dstAttrs->ctime.tv_sec = srcAttrs->ctime.tv_sec;
 		dstAttrs->ctime.tv_nsec = srcAttrs->ctime.tv_nsec;
 	}
+	if (dstAttrs->masks.has_change)
+		dstAttrs->change = srcAttrs->change;
 }
 
 
@@ -627,7 +774,8 @@ extern const struct vattrs_masks VATTRS_MASK_NONE;
 		.has_mode = true, .has_size = true, .has_nlink = true,         \
 		.has_fileid = true, .has_blocks = true,                        \
 		.has_uid = true, .has_gid = true, .has_rdev = true,            \
-		.has_atime = true, .has_mtime = true, .has_ctime = true        \
+		.has_atime = true, .has_mtime = true, .has_ctime = true,       \
+		.has_change = true                                             \
 	}
 
 #define VMASK_INIT_NONE                                                      \
@@ -635,7 +783,8 @@ extern const struct vattrs_masks VATTRS_MASK_NONE;
 		.has_mode = false, .has_size = false, .has_nlink = false,      \
 		.has_fileid = false, .has_blocks = false,                      \
                 .has_uid = false, .has_gid = false, .has_rdev = false,         \
-                .has_atime = false, .has_mtime = false, .has_ctime = false     \
+                .has_atime = false, .has_mtime = false, .has_ctime = false,    \
+		.has_change = false                                            \
 	}
 
 /**
@@ -658,6 +807,11 @@ static inline bool tx_vec_lgetattrs(struct vattrs *attrs, int count)
 	return vokay(vec_lgetattrs(attrs, count, true));
 }
 
+vticket vec_getattrs_async(vqueue *q, struct vattrs *attrs, int count,
+			   bool is_transaction, vec_async_cb cb, void *cbarg);
+vticket vec_lgetattrs_async(vqueue *q, struct vattrs *attrs, int count,
+			    bool is_transaction, vec_async_cb cb, void *cbarg);
+
 int sca_stat(const char *path, struct stat *buf);
 int sca_lstat(const char *path, struct stat *buf);
 int sca_fstat(vfile *tcf, struct stat *buf);
@@ -730,6 +884,41 @@ vres vec_listdir(const char **dirs, int count, struct vattrs_masks masks,
 		   int max_entries, bool recursive, vec_listdir_cb cb,
 		   void *cbarg, bool is_transaction);
 
+/**
+ * Callback of vec_listdir_batch().
+ *
+ * @entries [IN]: the entries listed, all in the directory @dir
+ * @count [IN]: the length of @entries
+ * @dir [IN]: the parent directory of @entries
+ * @cbarg [IN/OUT]: any extra user arguments or context of the callback.
+ *
+ * The entries, and their paths, are valid only during the callback; the paths
+ * of a batch live in one buffer released once the callback returns.
+ *
+ * Return whether vec_listdir_batch() should continue the processing or stop.
+ */
+typedef bool (*vec_listdir_batch_cb)(const struct vattrs *entries, int count,
+				     const char *dir, void *cbarg);
+
+/**
+ * Same as vec_listdir(), but pass the entries to "cb" in batches, e.g., one
+ * for each READDIR reply, instead of one at a time.  Preferred for listing
+ * large directories.
+ */
+vres vec_listdir_batch(const char **dirs, int count,
+		       struct vattrs_masks masks, int max_entries,
+		       bool recursive, vec_listdir_batch_cb cb, void *cbarg,
+		       bool is_transaction);
+
+/**
+ * Set the number of READDIR compounds that recursive listings keep in flight
+ * over different directories, overriding "Listdir_Parallelism" of the config
+ * file.  Only the NFS implementation lists directories in parallel.
+ *
+ * @n: the number of compounds in flight, from 1 to 64
+ */
+void vec_set_listdir_parallelism(unsigned int n);
+
 /**
  * Free an array of "vattrs".
  *
@@ -841,6 +1030,11 @@ static inline bool tx_copyv(struct vextent_pair *pairs, int count)
 /**
  * Copy the data from "src_path" to "dst_path" by reading from "src_path" and
  * then writing to "dst_path".
+ *
+ * The data are streamed through a bounded pool of buffers, reading the next
+ * chunks while the previous ones are being written, so files of any size can
+ * be duplicated with constant memory.  The whole duplication is not atomic
+ * even if "is_transaction" is true, as it may take many compounds.
  */
 vres vec_dup(struct vextent_pair *pairs, int count, bool is_transaction);
 vres vec_ldup(struct vextent_pair *pairs, int count, bool is_transaction);
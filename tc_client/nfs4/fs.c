@@ -90,6 +90,22 @@ static struct config_item kern_client_params[] = {
 		       fs_client_params, use_privileged_client_port),
 	CONF_ITEM_UI32("RPC_Client_Timeout", 1, 60*4, 60,
 		       fs_client_params, srv_timeout),
+	CONF_ITEM_UI32("NFS_Connections", 1, FS_MAX_RPC_CONNS, 1,
+		       fs_client_params, srv_nconns),
+	CONF_ITEM_UI32("Dentry_Cache_Size", 0, UINT32_MAX, 65536,
+		       fs_client_params, dcache_size),
+	CONF_ITEM_UI32("Dentry_Cache_Timeout", 0, UINT32_MAX, 30000,
+		       fs_client_params, dcache_timeout),
+	CONF_ITEM_UI32("Open_Cache_Size", 0, UINT32_MAX, 256,
+		       fs_client_params, ocache_size),
+	CONF_ITEM_UI32("Open_Cache_Timeout", 0, UINT32_MAX, 10000,
+		       fs_client_params, ocache_timeout),
+	CONF_ITEM_BOOL("Delegations", true,
+		       fs_client_params, delegations),
+	CONF_ITEM_UI32("Dir_Delegations", 0, UINT32_MAX, 1024,
+		       fs_client_params, dir_delegations),
+	CONF_ITEM_UI32("Listdir_Parallelism", 1, FS_MAX_LISTDIR_PARALLELISM, 1,
+		       fs_client_params, listdir_parallelism),
 #ifdef _USE_GSSRPC
 	CONF_ITEM_STR("Remote_PrincipalName", 0, MAXNAMLEN, NULL,
 		      fs_client_params, remote_principal),
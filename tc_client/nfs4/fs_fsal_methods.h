@@ -5,6 +5,9 @@
 #include "handle_mapping/handle_mapping.h"
 #endif
 
+/* Upper bound of TCP connections trunked into the NFSv4.1 session. */
+#define FS_MAX_RPC_CONNS 16
+
 typedef struct fs_client_params {
 	unsigned int retry_sleeptime;
 	struct sockaddr srv_addr;
@@ -14,6 +17,15 @@ typedef struct fs_client_params {
 	unsigned int srv_timeout;
 	unsigned short srv_port;
 	unsigned int use_privileged_client_port;
+	unsigned int srv_nconns;
+	unsigned int dcache_size;	/* # of entries; 0 disables it */
+	unsigned int dcache_timeout;	/* in milliseconds */
+	unsigned int ocache_size;	/* # of open files; 0 disables it */
+	unsigned int ocache_timeout;	/* in milliseconds */
+	bool delegations;	/* ask for read delegations of cached opens */
+	unsigned int dir_delegations;	/* # of dirs; 0 disables them */
+	unsigned int listdir_parallelism; /* # of compounds in flight */
+#define FS_MAX_LISTDIR_PARALLELISM 64
 	char *remote_principal;
 	char *keytab;
 	unsigned int cred_lifetime;
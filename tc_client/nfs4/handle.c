@@ -34,10 +34,13 @@
 #include <assert.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/sysmacros.h>
 #include "ganesha_list.h"
 #include "abstract_atomic.h"
@@ -52,6 +55,9 @@
 #include "nfs4_util.h"
 #include "tc_helper.h"
 #include "session_slots.h"
+#include "nfs4_dcache.h"
+#include "nfs4_ocache.h"
+#include "nfs4_ddeleg.h"
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -71,19 +77,63 @@ static sessionid4 fs_sessionid;
 static sequenceid4 fs_sequenceid;  /* per-ClientID sequence for creating sessions */
 static pthread_mutex_t fs_clientid_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char fs_hostname[MAXNAMLEN + 1];
-static pthread_t fs_recv_thread;
 static pthread_t fs_renewer_thread;
 static uint8_t fs_session_valid;
-static struct glist_head rpc_calls;
 static struct glist_head free_contexts;
-static int rpc_sock = -1;
 static uint32_t rpc_xid;
+/*
+ * Protects the sockets, the binding states, and the lists of outstanding calls
+ * of all connections.  It is never held while writing to or reading from a
+ * socket.
+ */
 static pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t sockless = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t need_context = PTHREAD_COND_INITIALIZER;
 
+/*
+ * A TCP connection to the server.  All connections are bound to the same
+ * NFSv4.1 session (session trunking).  Each connection has its own receiver
+ * thread and its own send lock, so sending a large compound on one connection
+ * does not hold up callers using the others.
+ */
+struct fs_rpc_conn {
+	int id;
+	int32_t sock;
+	uint8_t bound;		/* usable for calls of the session? */
+	uint8_t backchan;	/* carrying callbacks of the session? */
+	uint32_t inflight;	/* # of outstanding calls */
+	struct glist_head calls; /* outstanding calls */
+	pthread_mutex_t sendlock; /* serializes records written to "sock" */
+	pthread_t recv_thread;
+};
+
+#define FS_RPC_CONTEXTS_PER_CONN 16
+
+static struct fs_rpc_conn rpc_conns[FS_MAX_RPC_CONNS];
+static int rpc_nconns = 1;
+static const kernfs_specific_initinfo_t *rpc_info;
+/* The connection the current thread has to use; -1 means any. */
+static __thread int tc_pinned_conn = -1;
+
 static struct session_slot_table *sess_slot_tbl;
 
+/*
+ * Whether read delegations are asked for when files are opened for the
+ * open-file cache.  They are only asked for while the first connection is
+ * bound to the back channel so that the server can recall them.
+ */
+static bool fs_delegations;
+/* compounds of a listdir in flight at the same time */
+static unsigned int tc_listdir_parallelism = 1;
+/* The sequence id of the only slot of the back channel. */
+static sequenceid4 fs_cb_seqid;
+
+/* Whether the server is asked to call us back, for delegations of any kind. */
+static inline bool fs_wants_callbacks(void)
+{
+	return fs_delegations || nfs4_ddeleg_enabled();
+}
+
 static pthread_once_t tc_once;
 static pthread_key_t tc_compound_resources;
 
@@ -96,9 +146,40 @@ static __thread bool slot_allocated = false;
 static __thread char tc_saved_path[PATH_MAX + 1];
 
 #define MAX_BUFS_PER_COMPOUND (MAX_NUM_OPS_PER_COMPOUND * 4)
+/* header and payload segments of all WRITEs, padding, and the trailer */
+#define FS_SEND_IOV_MAX (MAX_NUM_OPS_PER_COMPOUND * 3 + 1)
 static __thread int tc_bufcnt;
 static __thread char* tc_bufs[MAX_BUFS_PER_COMPOUND];
 
+/*
+ * Result buffers of the GETFHs added after LOOKUPs to fill the dentry cache.
+ * These GETFHs are not asked for by the callers, and are removed from the
+ * compound once the reply is processed; see tc_dcache_learn().
+ */
+#define MAX_DCACHE_GETFHS (MAX_NUM_OPS_PER_COMPOUND / 2)
+static __thread int tc_dcache_fhcnt;
+static __thread char tc_dcache_fhs[MAX_DCACHE_GETFHS][NFS4_FHSIZE];
+
+/*
+ * PUTFHs of filehandles resolved by the dentry cache, and the components of
+ * the paths they stand for, so that a compound failing because one of these
+ * filehandles is stale can be retried by path; see tc_dcache_retry().
+ */
+#define MAX_DCACHE_PUTFHS (MAX_NUM_OPS_PER_COMPOUND / 4)
+struct tc_dcache_putfh {
+	int op;			/* index of the PUTFH in the compound */
+	const char *fh;		/* the resolved filehandle */
+	nfs_fh4 base;		/* where the path starts; empty for the root */
+	int comp;		/* first component in tc_dcache_comps */
+	int compcnt;
+};
+static __thread int tc_dcache_putfhcnt;
+static __thread struct tc_dcache_putfh tc_dcache_putfhs[MAX_DCACHE_PUTFHS];
+static __thread int tc_dcache_compcnt;
+static __thread slice_t tc_dcache_comps[MAX_NUM_OPS_PER_COMPOUND];
+/* results as set up by the callers, before being overwritten by a reply */
+static __thread nfs_resop4 tc_dcache_saved_res[MAX_NUM_OPS_PER_COMPOUND];
+
 /* Whether or not if the operation change current FH. */
 static const bool NFS4_CHANGE_CFH[] = {
 	[0] = false,
@@ -183,9 +264,24 @@ struct fs_rpc_io_context {
 	pthread_mutex_t iolock;
 	pthread_cond_t iowait;
 	struct glist_head calls;
+	struct fs_rpc_conn *conn; /* connection of the outstanding call */
 	uint32_t rpc_xid;
 	int iodone;
 	int ioresult;
+	/*
+	 * When not NULL, the receiver decodes the reply straight into "res"
+	 * and reads READ payloads into the buffers already set up in it,
+	 * instead of copying the reply into "recvbuf" first.
+	 */
+	COMPOUND4res *res;
+	bool decoded;		/* "res" is decoded by the receiver */
+	enum clnt_stat decode_stat;
+	/*
+	 * The encoded call: segments of "sendbuf" interleaved with WRITE
+	 * payloads referenced in place.
+	 */
+	struct iovec sendiov[FS_SEND_IOV_MAX];
+	int sendiov_cnt;
 	unsigned int nfs_prog;
 	unsigned int sendbuf_sz;
 	unsigned int recvbuf_sz;
@@ -511,6 +607,10 @@ static void tc_attr_masks_to_bitmap(const struct vattrs_masks *masks,
                 bm->map[1] |= PXY_ATTR_BIT2(FATTR4_TIME_METADATA);
                 bm->bitmap4_len = MAX(bm->bitmap4_len, 2);
         }
+        if (masks->has_change) {
+                bm->map[0] |= PXY_ATTR_BIT(FATTR4_CHANGE);
+                bm->bitmap4_len = MAX(bm->bitmap4_len, 1);
+        }
 }
 
 #undef PXY_ATTR_BIT
@@ -623,6 +723,9 @@ static inline void tc_save_path(slice_t path)
 static void tc_cleanup_compound(void *unused)
 {
         opcnt = 0;
+        tc_dcache_fhcnt = 0;
+        tc_dcache_putfhcnt = 0;
+        tc_dcache_compcnt = 0;
         while (tc_bufcnt) {
                 free(tc_bufs[--tc_bufcnt]);
         }
@@ -637,6 +740,13 @@ static void tc_pthread_init(void)
 	}
 }
 
+static void tc_alloc_sequence_slot(SEQUENCE4args *sa)
+{
+	sa->sa_slotid = alloc_session_slot(sess_slot_tbl, &sa->sa_sequenceid,
+					   &sa->sa_highest_slotid);
+	slot_allocated = true;
+}
+
 static void vreset_compound(bool has_sequence)
 {
 	SEQUENCE4args *sa;
@@ -662,9 +772,7 @@ static void vreset_compound(bool has_sequence)
 		argoparray->argop = NFS4_OP_SEQUENCE;
 		sa = &argoparray->nfs_argop4_u.opsequence;
 		memcpy(&sa->sa_sessionid, &fs_sessionid, NFS4_SESSIONID_SIZE);
-		sa->sa_slotid = alloc_session_slot(
-		    sess_slot_tbl, &sa->sa_sequenceid, &sa->sa_highest_slotid);
-		slot_allocated = true;
+		tc_alloc_sequence_slot(sa);
 		sa->sa_cachethis = false;
 		++opcnt;
 	}
@@ -743,8 +851,750 @@ static int fs_got_rpc_reply(struct fs_rpc_io_context *ctx, int sock, int sz,
 	return size;
 }
 
-static int fs_rpc_read_reply(int sock)
+static enum clnt_stat fs_reply_stat(const struct rpc_msg *reply)
+{
+	if (reply->rm_reply.rp_stat == MSG_ACCEPTED) {
+		switch (reply->rm_reply.rp_acpt.ar_stat) {
+		case SUCCESS:
+			return RPC_SUCCESS;
+		case PROG_UNAVAIL:
+			return RPC_PROGUNAVAIL;
+		case PROG_MISMATCH:
+			return RPC_PROGVERSMISMATCH;
+		case PROC_UNAVAIL:
+			return RPC_PROCUNAVAIL;
+		case GARBAGE_ARGS:
+			return RPC_CANTDECODEARGS;
+		case SYSTEM_ERR:
+			return RPC_SYSTEMERROR;
+		default:
+			return RPC_FAILED;
+		}
+	} else {
+		switch (reply->rm_reply.rp_rjct.rj_stat) {
+		case RPC_MISMATCH:
+			return RPC_VERSMISMATCH;
+		case AUTH_ERROR:
+			return RPC_AUTHERROR;
+		default:
+			return RPC_FAILED;
+		}
+	}
+}
+
+/*
+ * Zero-copy receive of READ replies.
+ *
+ * The reply is read from the socket in small chunks and decoded one unit
+ * (RPC header, compound header, or one operation) at a time.  When a READ
+ * result is reached, its payload is read with readv() straight into the
+ * viovec buffer that tc_prepare_rdwr() put into the result, so bulk data is
+ * never copied through "recvbuf".  At most one chunk of a payload may have
+ * been read ahead into "recvbuf" and needs copying.
+ */
+#define FS_ZC_CHUNK 4096
+#define FS_XDR_RNDUP(x) (((x) + 3) & ~3U)
+
+struct fs_zc_stream {
+	int sock;
+	char *buf;
+	u_int bufsz;
+	u_int head;	/* start of the undecoded bytes in "buf" */
+	u_int tail;	/* end of the bytes read into "buf" */
+	int left;	/* bytes of the record not read from "sock" yet */
+};
+
+/*
+ * Read the next chunk of the record.  Return the number of bytes read, 0 if
+ * no more bytes can be read, or -errno on socket errors.
+ */
+static int fs_zc_fill(struct fs_zc_stream *zs)
+{
+	int n;
+	int bc;
+
+	if (zs->head > 0) {
+		memmove(zs->buf, zs->buf + zs->head, zs->tail - zs->head);
+		zs->tail -= zs->head;
+		zs->head = 0;
+	}
+
+	n = MIN(zs->left, FS_ZC_CHUNK);
+	n = MIN(n, zs->bufsz - zs->tail);
+	if (n <= 0)
+		return 0;
+
+	bc = read(zs->sock, zs->buf + zs->tail, n);
+	if (bc <= 0)
+		return -((bc < 0) ? errno : ETIMEDOUT);
+	zs->tail += bc;
+	zs->left -= bc;
+	return bc;
+}
+
+/*
+ * Decode one unit with "dec", reading more of the record until the unit is
+ * complete.  Return 0 on success and a negative error otherwise.
+ *
+ * XDR decoders cannot resume where they ran out of bytes, so each attempt
+ * starts over from the beginning of the unit.  To keep that linear in the
+ * size of the unit, at least as many bytes as already buffered are read
+ * before trying again, instead of one chunk.
+ */
+static int fs_zc_decode(struct fs_zc_stream *zs,
+			bool (*dec)(XDR *x, void *obj), void *obj)
+{
+	XDR x;
+	u_int avail;
+	int rc;
+
+	while (true) {
+		avail = zs->tail - zs->head;
+		memset(&x, 0, sizeof(x));
+		xdrmem_create(&x, zs->buf + zs->head, avail, XDR_DECODE);
+		if (dec(&x, obj)) {
+			zs->head += xdr_getpos(&x);
+			return 0;
+		}
+		do {
+			rc = fs_zc_fill(zs);
+			if (rc < 0)
+				return rc;
+		} while (rc > 0 && zs->tail - zs->head < 2 * avail);
+		if (zs->tail - zs->head == avail)
+			return -EBADMSG;
+	}
+}
+
+/* Discard the rest of the record to keep the stream in sync. */
+static int fs_zc_drain(struct fs_zc_stream *zs)
+{
+	int rc;
+
+	do {
+		zs->head = zs->tail;
+		rc = fs_zc_fill(zs);
+	} while (rc > 0);
+
+	return (rc < 0 || zs->left > 0) ? -EIO : 0;
+}
+
+static bool fs_zc_dec_replymsg(XDR *x, void *obj)
+{
+	return xdr_replymsg(x, (struct rpc_msg *)obj);
+}
+
+struct fs_zc_compound_head {
+	COMPOUND4res *res;
+	u_int nops;
+};
+
+static bool fs_zc_dec_compound_head(XDR *x, void *obj)
+{
+	struct fs_zc_compound_head *ch = obj;
+
+	return xdr_nfsstat4(x, &ch->res->status) &&
+	       xdr_utf8str_cs(x, &ch->res->tag) && xdr_u_int(x, &ch->nops);
+}
+
+static bool fs_zc_dec_resop(XDR *x, void *obj)
+{
+	return xdr_nfs_resop4(x, (nfs_resop4 *)obj);
+}
+
+struct fs_zc_read_head {
+	nfs_resop4 *resop;
+	u_int len;
+};
+
+static bool fs_zc_dec_read_head(XDR *x, void *obj)
+{
+	struct fs_zc_read_head *rh = obj;
+	READ4res *rres = &rh->resop->nfs_resop4_u.opread;
+
+	rh->len = 0;
+	if (!xdr_nfs_opnum4(x, &rh->resop->resop) ||
+	    !xdr_nfsstat4(x, &rres->status))
+		return false;
+	if (rres->status != NFS4_OK)
+		return true;
+	return xdr_bool(x, &rres->READ4res_u.resok4.eof) &&
+	       xdr_u_int(x, &rh->len);
+}
+
+/* Skip "bc" bytes, which have been transferred, and any empty iovec. */
+static void fs_iov_advance(struct iovec **iov, int *iovcnt, size_t bc)
+{
+	while (*iovcnt > 0 && bc >= (*iov)->iov_len) {
+		bc -= (*iov)->iov_len;
+		++*iov;
+		--*iovcnt;
+	}
+	if (bc > 0) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + bc;
+		(*iov)->iov_len -= bc;
+	}
+}
+
+static int fs_readv_full(int sock, struct iovec *iov, int iovcnt)
+{
+	ssize_t bc;
+	int total = 0;
+
+	fs_iov_advance(&iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		bc = readv(sock, iov, iovcnt);
+		if (bc <= 0)
+			return -((bc < 0) ? errno : ETIMEDOUT);
+		total += bc;
+		fs_iov_advance(&iov, &iovcnt, bc);
+	}
+
+	return total;
+}
+
+/*
+ * Move the payload of the READ result just decoded into its viovec buffer:
+ * first the part already read ahead into the stream buffer, then the rest
+ * directly from the socket.
+ */
+static int fs_zc_read_payload(struct fs_zc_stream *zs, READ4resok *rok,
+			      u_int len)
+{
+	char pad[4];
+	struct iovec iov[2];
+	u_int padded = FS_XDR_RNDUP(len);
+	u_int have = MIN(padded, zs->tail - zs->head);
+	u_int copied = MIN(have, len);
+	int rc;
+
+	if (len > rok->data.data_len || rok->data.data_val == NULL)
+		return -EBADMSG;
+	if (padded - have > (u_int)zs->left)
+		return -EBADMSG;
+
+	memcpy(rok->data.data_val, zs->buf + zs->head, copied);
+	zs->head += have;
+
+	iov[0].iov_base = rok->data.data_val + copied;
+	iov[0].iov_len = len - copied;
+	iov[1].iov_base = pad;
+	iov[1].iov_len = padded - MAX(have, len);
+	rc = fs_readv_full(zs->sock, iov, 2);
+	if (rc < 0)
+		return rc;
+	zs->left -= rc;
+	rok->data.data_len = len;
+
+	return 0;
+}
+
+static int fs_zc_decode_compound(struct fs_zc_stream *zs, COMPOUND4res *res)
+{
+	struct fs_zc_compound_head ch = { .res = res };
+	struct fs_zc_read_head rh;
+	nfs_resop4 *resop;
+	uint32_t opnum;
+	u_int i;
+	int rc;
+
+	rc = fs_zc_decode(zs, fs_zc_dec_compound_head, &ch);
+	if (rc < 0)
+		return rc;
+	if (ch.nops > res->resarray.resarray_len)
+		return -EBADMSG;
+	res->resarray.resarray_len = ch.nops;
+
+	for (i = 0; i < ch.nops; ++i) {
+		resop = &res->resarray.resarray_val[i];
+		while (zs->tail - zs->head < sizeof(opnum)) {
+			rc = fs_zc_fill(zs);
+			if (rc <= 0)
+				return rc < 0 ? rc : -EBADMSG;
+		}
+		memcpy(&opnum, zs->buf + zs->head, sizeof(opnum));
+		if (ntohl(opnum) != NFS4_OP_READ) {
+			rc = fs_zc_decode(zs, fs_zc_dec_resop, resop);
+			if (rc < 0)
+				return rc;
+			continue;
+		}
+		rh.resop = resop;
+		rc = fs_zc_decode(zs, fs_zc_dec_read_head, &rh);
+		if (rc < 0)
+			return rc;
+		if (resop->nfs_resop4_u.opread.status == NFS4_OK) {
+			rc = fs_zc_read_payload(
+			    zs, &resop->nfs_resop4_u.opread.READ4res_u.resok4,
+			    rh.len);
+			if (rc < 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int fs_got_rpc_reply_zc(struct fs_rpc_io_context *ctx, int sock,
+			       int sz, u_int xid)
+{
+	struct fs_zc_stream zs = {
+		.sock = sock,
+		.buf = ctx->recvbuf,
+		.bufsz = ctx->recvbuf_sz,
+		.head = 0,
+		.tail = 4,
+		.left = sz - 4,
+	};
+	struct rpc_msg reply;
+	int rc;
+
+	pthread_mutex_lock(&ctx->iolock);
+	/* see fs_got_rpc_reply() for the 4 bytes of xid */
+	memcpy(zs.buf, &xid, sizeof(xid));
+
+	memset(&reply, 0, sizeof(reply));
+	reply.acpted_rply.ar_results.proc = (xdrproc_t) xdr_void;
+	reply.acpted_rply.ar_results.where = NULL;
+
+	rc = fs_zc_decode(&zs, fs_zc_dec_replymsg, &reply);
+	if (rc == 0) {
+		ctx->decode_stat = fs_reply_stat(&reply);
+		if (ctx->decode_stat == RPC_SUCCESS)
+			rc = fs_zc_decode_compound(&zs, ctx->res);
+		xdr_free((xdrproc_t) xdr_replymsg, &reply);
+	}
+	if (rc == -EBADMSG || (rc == 0 && zs.left > 0)) {
+		if (rc == -EBADMSG)
+			ctx->decode_stat = RPC_CANTDECODERES;
+		rc = fs_zc_drain(&zs);
+	}
+
+	ctx->decoded = (rc == 0);
+	ctx->ioresult = (rc == 0) ? sz : rc;
+	ctx->iodone = 1;
+	pthread_cond_signal(&ctx->iowait);
+	pthread_mutex_unlock(&ctx->iolock);
+	return rc;
+}
+
+/**
+ * Whether the reply of the compound can be received with
+ * fs_got_rpc_reply_zc(), i.e., it has READs and all of them have their
+ * buffers set up.
+ */
+static bool fs_zc_eligible(const COMPOUND4args *args, const COMPOUND4res *res)
+{
+	u_int i;
+	bool has_read = false;
+	const READ4resok *rok;
+
+	for (i = 0; i < args->argarray.argarray_len; ++i) {
+		if (args->argarray.argarray_val[i].argop != NFS4_OP_READ)
+			continue;
+		rok = &res->resarray.resarray_val[i]
+			   .nfs_resop4_u.opread.READ4res_u.resok4;
+		if (rok->data.data_val == NULL)
+			return false;
+		has_read = true;
+	}
+
+	return has_read;
+}
+
+/*
+ * Callbacks.
+ *
+ * The session is created with CREATE_SESSION4_FLAG_CONN_BACK_CHAN, so the
+ * server sends its CB_COMPOUNDs over the first connection, interleaved with
+ * the replies to our calls.  The receiver thread of the connection answers
+ * them itself and must never wait for a reply: a CB_RECALL only drops the
+ * file from the open-file cache and wakes up the clientid renewer, which
+ * returns the delegation together with the CLOSE of the file.  Likewise, a
+ * CB_NOTIFY only queues the changes of a delegated directory, which are
+ * applied by the next listing of the directory.
+ */
+#define FS_CB_BUFSZ 32768	/* ca_maxrequestsize of the back channel */
+#define FS_CB_MAX_OPS 2		/* ca_maxoperations of the back channel */
+
+static int fs_send_iov(int sock, struct iovec *iov, int iovcnt);
+
+/* Skip the credential or the verifier of a call. */
+static bool fs_cb_skip_auth(XDR *x)
+{
+	u_int flavor;
+	u_int len;
+
+	return xdr_u_int(x, &flavor) && xdr_u_int(x, &len) &&
+	       len <= MAX_AUTH_BYTES &&
+	       xdr_setpos(x, xdr_getpos(x) + FS_XDR_RNDUP(len));
+}
+
+static nfsstat4 fs_cb_sequence(const CB_SEQUENCE4args *args,
+			       CB_SEQUENCE4res *res)
+{
+	CB_SEQUENCE4resok *resok = &res->CB_SEQUENCE4res_u.csr_resok4;
+
+	if (memcmp(args->csa_sessionid, fs_sessionid, NFS4_SESSIONID_SIZE))
+		res->csr_status = NFS4ERR_BADSESSION;
+	else if (args->csa_slotid != 0)
+		res->csr_status = NFS4ERR_BADSLOT;
+	else if (args->csa_sequenceid == fs_cb_seqid)
+		res->csr_status = NFS4ERR_RETRY_UNCACHED_REP;
+	else if (args->csa_sequenceid != fs_cb_seqid + 1)
+		res->csr_status = NFS4ERR_SEQ_MISORDERED;
+	else
+		res->csr_status = NFS4_OK;
+	if (res->csr_status != NFS4_OK)
+		return res->csr_status;
+
+	fs_cb_seqid = args->csa_sequenceid;
+	memcpy(resok->csr_sessionid, args->csa_sessionid, NFS4_SESSIONID_SIZE);
+	resok->csr_sequenceid = args->csa_sequenceid;
+	resok->csr_slotid = 0;
+	resok->csr_highest_slotid = 0;
+	resok->csr_target_highest_slotid = 0;
+
+	return NFS4_OK;
+}
+
+/* Let the renewer return the recalled delegations now. */
+static void fs_cb_wake_renewer(void)
+{
+	pthread_mutex_lock(&listlock);
+	pthread_cond_broadcast(&sockless);
+	pthread_mutex_unlock(&listlock);
+}
+
+static nfsstat4 fs_cb_recall(const CB_RECALL4args *args)
+{
+	if (!nfs4_ocache_recall(args->stateid.other) &&
+	    !nfs4_ddeleg_recall(args->stateid.other)) {
+		/*
+		 * The recall may have raced with the reply granting the
+		 * delegation, which is returned once that reply is processed;
+		 * let the server try again until then.
+		 */
+		NFS4_DEBUG("recall of an unknown delegation");
+		return NFS4ERR_DELAY;
+	}
+
+	fs_cb_wake_renewer();
+
+	return NFS4_OK;
+}
+
+/*
+ * Append a change of the entry "ne" of the directory "dirfh" to "changes".
+ * Returns false if the change cannot be followed, e.g., because the name
+ * cannot be joined to the path of the directory.
+ */
+static bool fs_cb_dir_change(enum nfs4_dir_change_type type,
+			     const notify_entry4 *ne, const nfs_fh4 *dirfh,
+			     struct glist_head *changes)
+{
+	struct nfs4_dir_change *c;
+	const char *name = ne->ne_file.utf8string_val;
+	u_int namelen = ne->ne_file.utf8string_len;
+	u_int attrs_len = 0;
+
+	if (namelen == 0 || namelen > NAME_MAX ||
+	    memchr(name, '/', namelen) != NULL ||
+	    (namelen <= 2 && strncmp("..", name, namelen) == 0))
+		return false;
+	if (type != NFS4_DIR_ENTRY_REMOVED) {
+		if (ne->ne_attrs.attrmask.bitmap4_len > 3)
+			return false;
+		attrs_len = ne->ne_attrs.attr_vals.attrlist4_len;
+	}
+	if (type != NFS4_DIR_ENTRY_CHANGED) {
+		nfs4_dcache_remove(dirfh->nfs_fh4_val, dirfh->nfs_fh4_len,
+				   mkslice(name, namelen));
+	}
+
+	c = malloc(sizeof(*c) + namelen + 1 + attrs_len);
+	if (!c)
+		return false;
+	c->type = type;
+	memcpy(c->name, name, namelen);
+	c->name[namelen] = '\0';
+	c->attrs = c->name + namelen + 1;
+	c->attrs_len = attrs_len;
+	c->attrmask_len = 0;
+	if (type != NFS4_DIR_ENTRY_REMOVED) {
+		c->attrmask_len = ne->ne_attrs.attrmask.bitmap4_len;
+		memcpy(c->attrmask, ne->ne_attrs.attrmask.map,
+		       sizeof(c->attrmask));
+		memcpy(c->attrs, ne->ne_attrs.attr_vals.attrlist4_val,
+		       attrs_len);
+	}
+	glist_add_tail(changes, &c->list);
+
+	return true;
+}
+
+/* An addition may replace an existing entry of the same name. */
+static bool fs_cb_dir_add(const notify_add4 *add, const nfs_fh4 *dirfh,
+			  struct glist_head *changes)
+{
+	if (add->nad_old_entry.nad_old_entry_len > 0 &&
+	    !fs_cb_dir_change(NFS4_DIR_ENTRY_REMOVED,
+			      &add->nad_old_entry.nad_old_entry_val[0]
+				   .nrm_old_entry,
+			      dirfh, changes))
+		return false;
+
+	return fs_cb_dir_change(NFS4_DIR_ENTRY_ADDED, &add->nad_new_entry,
+				dirfh, changes);
+}
+
+/*
+ * Decode one notify4 of a CB_NOTIFY into "changes".  Its opaque value holds
+ * one notification per bit set in its mask, in the order of the bits.  A
+ * rename is followed as the removal of the old name and the addition of the
+ * new one; changes of the attributes and the cookie verifier of the
+ * directory itself do not affect its listing.
+ */
+static bool fs_cb_decode_notify(const notify4 *n, const nfs_fh4 *dirfh,
+				struct glist_head *changes)
+{
+	XDR x;
+	notify_add4 add;
+	notify_remove4 rm;
+	notify_rename4 rn;
+	notify_attr4 na;
+	notify_verifier4 nv;
+	u_int bit;
+	bool ok = true;
+
+	if (n->notify_mask.bitmap4_len > 3)
+		return false;
+
+	memset(&x, 0, sizeof(x));
+	xdrmem_create(&x, n->notify_vals.notifylist4_val,
+		      n->notify_vals.notifylist4_len, XDR_DECODE);
+	for (bit = 0; bit < 32 * n->notify_mask.bitmap4_len && ok; ++bit) {
+		if (!(n->notify_mask.map[bit / 32] & (1U << (bit % 32))))
+			continue;
+		switch (bit) {
+		case NOTIFY4_ADD_ENTRY:
+			memset(&add, 0, sizeof(add));
+			ok = xdr_notify_add4(&x, &add) &&
+			     fs_cb_dir_add(&add, dirfh, changes);
+			xdr_free((xdrproc_t)xdr_notify_add4, &add);
+			break;
+		case NOTIFY4_REMOVE_ENTRY:
+			memset(&rm, 0, sizeof(rm));
+			ok = xdr_notify_remove4(&x, &rm) &&
+			     fs_cb_dir_change(NFS4_DIR_ENTRY_REMOVED,
+					      &rm.nrm_old_entry, dirfh,
+					      changes);
+			xdr_free((xdrproc_t)xdr_notify_remove4, &rm);
+			break;
+		case NOTIFY4_RENAME_ENTRY:
+			memset(&rn, 0, sizeof(rn));
+			ok = xdr_notify_rename4(&x, &rn) &&
+			     fs_cb_dir_change(NFS4_DIR_ENTRY_REMOVED,
+					      &rn.nrn_old_entry.nrm_old_entry,
+					      dirfh, changes) &&
+			     fs_cb_dir_add(&rn.nrn_new_entry, dirfh, changes);
+			xdr_free((xdrproc_t)xdr_notify_rename4, &rn);
+			break;
+		case NOTIFY4_CHANGE_CHILD_ATTRS:
+			memset(&na, 0, sizeof(na));
+			ok = xdr_notify_attr4(&x, &na) &&
+			     fs_cb_dir_change(NFS4_DIR_ENTRY_CHANGED,
+					      &na.na_changed_entry, dirfh,
+					      changes);
+			xdr_free((xdrproc_t)xdr_notify_attr4, &na);
+			break;
+		case NOTIFY4_CHANGE_DIR_ATTRS:
+			memset(&na, 0, sizeof(na));
+			ok = xdr_notify_attr4(&x, &na);
+			xdr_free((xdrproc_t)xdr_notify_attr4, &na);
+			break;
+		case NOTIFY4_CHANGE_COOKIE_VERIFIER:
+			ok = xdr_notify_verifier4(&x, &nv);
+			break;
+		default:
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static nfsstat4 fs_cb_notify(const CB_NOTIFY4args *args)
+{
+	GLIST_HEAD(changes);
+	struct nfs4_dir_change *c;
+	bool ok = true;
+	u_int i;
+
+	for (i = 0; i < args->cna_changes.cna_changes_len && ok; ++i) {
+		ok = fs_cb_decode_notify(&args->cna_changes.cna_changes_val[i],
+					 &args->cna_fh, &changes);
+	}
+	while (!glist_empty(&changes)) {
+		c = glist_first_entry(&changes, struct nfs4_dir_change, list);
+		glist_del(&c->list);
+		if (!ok)
+			free(c);
+		else if (!nfs4_ddeleg_notify(args->cna_stateid.other, c))
+			ok = false;
+	}
+	if (ok)
+		return NFS4_OK;
+
+	/*
+	 * Stop trusting the listing, and return the delegation.  An unknown
+	 * delegation may have been granted by a reply not processed yet, and
+	 * is returned once it is.
+	 */
+	NFS4_DEBUG("cannot follow the changes of a delegated directory");
+	if (nfs4_ddeleg_recall(args->cna_stateid.other))
+		fs_cb_wake_renewer();
+
+	return NFS4_OK;
+}
+
+static void fs_cb_compound(const CB_COMPOUND4args *args, CB_COMPOUND4res *res)
+{
+	const nfs_cb_argop4 *op;
+	nfs_cb_resop4 *resop;
+	nfsstat4 status = NFS4_OK;
+	u_int i;
+
+	res->status = NFS4_OK;
+	res->tag = args->tag;
+	res->resarray.resarray_len = 0;
+	if (args->minorversion != 1) {
+		res->status = NFS4ERR_MINOR_VERS_MISMATCH;
+		return;
+	}
+	if (args->argarray.argarray_len > FS_CB_MAX_OPS) {
+		res->status = NFS4ERR_TOO_MANY_OPS;
+		return;
+	}
+
+	for (i = 0; i < args->argarray.argarray_len; ++i) {
+		op = &args->argarray.argarray_val[i];
+		resop = &res->resarray.resarray_val[i];
+		resop->resop = op->argop;
+		if (op->argop != NFS4_OP_CB_SEQUENCE && i == 0) {
+			status = NFS4ERR_OP_NOT_IN_SESSION;
+			resop->resop = NFS4_OP_CB_ILLEGAL;
+			resop->nfs_cb_resop4_u.opcbillegal.status = status;
+		} else if (op->argop == NFS4_OP_CB_SEQUENCE) {
+			status = (i == 0)
+				     ? fs_cb_sequence(
+					   &op->nfs_cb_argop4_u.opcbsequence,
+					   &resop->nfs_cb_resop4_u.opcbsequence)
+				     : NFS4ERR_SEQUENCE_POS;
+			resop->nfs_cb_resop4_u.opcbsequence.csr_status =
+			    status;
+		} else if (op->argop == NFS4_OP_CB_RECALL) {
+			status = fs_cb_recall(&op->nfs_cb_argop4_u.opcbrecall);
+			resop->nfs_cb_resop4_u.opcbrecall.status = status;
+		} else if (op->argop == NFS4_OP_CB_NOTIFY) {
+			status = fs_cb_notify(&op->nfs_cb_argop4_u.opcbnotify);
+			resop->nfs_cb_resop4_u.opcbnotify.cnr_status = status;
+		} else {
+			status = NFS4ERR_OP_ILLEGAL;
+			resop->resop = NFS4_OP_CB_ILLEGAL;
+			resop->nfs_cb_resop4_u.opcbillegal.status = status;
+		}
+		res->resarray.resarray_len = i + 1;
+		if (status != NFS4_OK) {
+			res->status = status;
+			break;
+		}
+	}
+}
+
+/*
+ * Answer a call of the server; "sz" is the size of the record, and its xid
+ * has been read already.
+ */
+static int fs_rpc_handle_callback(struct fs_rpc_conn *conn, int sz, u_int xid)
+{
+	char *buf;
+	char *repbuf;
+	XDR x;
+	u_int direction, rpcvers, prog, vers, proc;
+	u_int reply_direction = REPLY;
+	u_int reply_stat = MSG_ACCEPTED;
+	u_int verf[2] = { AUTH_NONE, 0 };
+	u_int accept_stat = SUCCESS;
+	CB_COMPOUND4args args = { 0 };
+	CB_COMPOUND4res res;
+	nfs_cb_resop4 resops[FS_CB_MAX_OPS];
+	bool compound = false;
+	u_int recmark;
+	struct iovec iov;
+	int rc;
+
+	sz -= 4;
+	if (sz <= 0 || sz > FS_CB_BUFSZ) {
+		NFS4_WARN("dropping a callback of %d bytes", sz);
+		return -E2BIG;
+	}
+	buf = malloc(2 * FS_CB_BUFSZ);
+	if (!buf)
+		return -ENOMEM;
+	repbuf = buf + FS_CB_BUFSZ;
+	iov.iov_base = buf;
+	iov.iov_len = sz;
+	rc = fs_readv_full(conn->sock, &iov, 1);
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
+
+	memset(&x, 0, sizeof(x));
+	xdrmem_create(&x, buf, sz, XDR_DECODE);
+	if (!xdr_u_int(&x, &direction) || !xdr_u_int(&x, &rpcvers) ||
+	    !xdr_u_int(&x, &prog) || !xdr_u_int(&x, &vers) ||
+	    !xdr_u_int(&x, &proc) || !fs_cb_skip_auth(&x) ||
+	    !fs_cb_skip_auth(&x)) {
+		accept_stat = GARBAGE_ARGS;
+	} else if (proc == CB_COMPOUND) {
+		if (xdr_CB_COMPOUND4args(&x, &args)) {
+			res.resarray.resarray_val = resops;
+			fs_cb_compound(&args, &res);
+			compound = true;
+		} else {
+			accept_stat = GARBAGE_ARGS;
+		}
+	} else if (proc != CB_NULL) {
+		accept_stat = PROC_UNAVAIL;
+	}
+
+	/* the record mark is filled in below */
+	xdrmem_create(&x, repbuf + 4, FS_CB_BUFSZ - 4, XDR_ENCODE);
+	if (xdr_u_int(&x, &xid) && xdr_u_int(&x, &reply_direction) &&
+	    xdr_u_int(&x, &reply_stat) && xdr_u_int(&x, &verf[0]) &&
+	    xdr_u_int(&x, &verf[1]) && xdr_u_int(&x, &accept_stat) &&
+	    (!compound || xdr_CB_COMPOUND4res(&x, &res))) {
+		recmark = htonl(xdr_getpos(&x) | (1U << 31));
+		memcpy(repbuf, &recmark, sizeof(recmark));
+		iov.iov_base = repbuf;
+		iov.iov_len = xdr_getpos(&x) + 4;
+		pthread_mutex_lock(&conn->sendlock);
+		if (fs_send_iov(conn->sock, &iov, 1) < 0)
+			NFS4_WARN("cannot reply to callback %u", xid);
+		pthread_mutex_unlock(&conn->sendlock);
+	}
+
+	xdr_free((xdrproc_t)xdr_CB_COMPOUND4args, &args);
+	free(buf);
+
+	return 0;
+}
+
+static int fs_rpc_read_reply(struct fs_rpc_conn *conn)
 {
+	int sock = conn->sock;
 	struct {
 		uint recmark;
 		uint xid;
@@ -752,7 +1602,10 @@ static int fs_rpc_read_reply(int sock)
 	char *buf = (char *)&h;
 	struct glist_head *c;
 	char sink[256];
+	uint32_t direction;
+	bool is_call = false;
 	int cnt = 0;
+	int rc;
 
 	while (cnt < 8) {
 		int bc = read(sock, buf + cnt, 8 - cnt);
@@ -768,19 +1621,42 @@ static int fs_rpc_read_reply(int sock)
 	LogDebug(COMPONENT_FSAL, "Recmark %x, xid %u\n", h.recmark, h.xid);
 	h.recmark &= ~(1U << 31);
 
+	/*
+	 * The server sends its callbacks over the connection of our calls, and
+	 * chooses their xids by itself, so they are told from the replies to
+	 * our calls by the type of the message that follows the xid.
+	 */
+	if (fs_wants_callbacks()) {
+		rc = recv(sock, &direction, sizeof(direction),
+			  MSG_PEEK | MSG_WAITALL);
+		if (rc != sizeof(direction))
+			return rc < 0 ? -errno : -ECONNRESET;
+		is_call = (ntohl(direction) == CALL);
+	}
+	if (is_call) {
+		if (h.recmark - 4 <= FS_CB_BUFSZ)
+			return fs_rpc_handle_callback(conn, h.recmark, h.xid);
+		goto skip;
+	}
+
 	pthread_mutex_lock(&listlock);
-	glist_for_each(c, &rpc_calls) {
+	glist_for_each(c, &conn->calls) {
 		struct fs_rpc_io_context *ctx =
 		    container_of(c, struct fs_rpc_io_context, calls);
 
 		if (ctx->rpc_xid == h.xid) {
 			glist_del(c);
+			atomic_dec_uint32_t(&conn->inflight);
 			pthread_mutex_unlock(&listlock);
+			if (ctx->res)
+				return fs_got_rpc_reply_zc(ctx, sock,
+							   h.recmark, h.xid);
 			return fs_got_rpc_reply(ctx, sock, h.recmark, h.xid);
 		}
 	}
 	pthread_mutex_unlock(&listlock);
 
+skip:
 	cnt = h.recmark - 4;
 	LogDebug(COMPONENT_FSAL, "xid %u is not on the list, skip %d bytes\n",
 		 h.xid, cnt);
@@ -796,7 +1672,7 @@ static int fs_rpc_read_reply(int sock)
 	return 0;
 }
 
-static void fs_new_socket_ready(void)
+static void fs_new_socket_ready(struct fs_rpc_conn *conn)
 {
 	struct glist_head *nxt;
 	struct glist_head *c;
@@ -806,11 +1682,12 @@ static void fs_new_socket_ready(void)
 	pthread_cond_broadcast(&sockless);
 
 	/* If there are any outstanding calls then tell them to resend */
-	glist_for_each_safe(c, nxt, &rpc_calls) {
+	glist_for_each_safe(c, nxt, &conn->calls) {
 		struct fs_rpc_io_context *ctx =
 		    container_of(c, struct fs_rpc_io_context, calls);
 
 		glist_del(c);
+		atomic_dec_uint32_t(&conn->inflight);
 
 		pthread_mutex_lock(&ctx->iolock);
 		ctx->iodone = 1;
@@ -821,7 +1698,7 @@ static void fs_new_socket_ready(void)
 }
 
 static int fs_connect(const kernfs_specific_initinfo_t *info,
-		       struct sockaddr_in *dest)
+		       struct sockaddr_in *dest, struct fs_rpc_conn *conn)
 {
 	int sock;
 	if (info->use_privileged_client_port) {
@@ -842,20 +1719,23 @@ static int fs_connect(const kernfs_specific_initinfo_t *info,
 			close(sock);
 			sock = -1;
 		} else {
-			fs_new_socket_ready();
+			conn->sock = sock;
+			fs_new_socket_ready(conn);
 		}
 	}
 	return sock;
 }
 
 /*
- * NB! rpc_sock can be closed by the sending thread but it will not be
- *     changing its value. Only this function will change rpc_sock which
- *     means that it can look at the value without holding the lock.
+ * NB! The socket of a connection can be shut down by a sending thread but it
+ *     will not be changing its value.  Only the receiver thread of the
+ *     connection changes "conn->sock", which means that it can look at the
+ *     value without holding the lock.
  */
 static void *fs_rpc_recv(void *arg)
 {
-	const kernfs_specific_initinfo_t *info = arg;
+	struct fs_rpc_conn *conn = arg;
+	const kernfs_specific_initinfo_t *info = rpc_info;
 	struct sockaddr_in addr_rpc;
 	struct sockaddr_in *info_sock = (struct sockaddr_in *)&info->srv_addr;
 	char addr[INET_ADDRSTRLEN];
@@ -871,9 +1751,14 @@ static void *fs_rpc_recv(void *arg)
 	for (;;) {
 		int nsleeps = 0;
 		pthread_mutex_lock(&listlock);
+		/*
+		 * The session is created on the first connection; other
+		 * connections have to be (re-)bound to it before use.
+		 */
+		conn->bound = (conn->id == 0);
+		conn->backchan = 0;
 		do {
-			rpc_sock = fs_connect(info, &addr_rpc);
-			if (rpc_sock < 0) {
+			if (fs_connect(info, &addr_rpc, conn) < 0) {
 				if (nsleeps == 0)
 					LogCrit(COMPONENT_FSAL,
 						"Cannot connect to server %s:%u",
@@ -888,17 +1773,17 @@ static void *fs_rpc_recv(void *arg)
 				pthread_mutex_lock(&listlock);
 			} else {
 				LogDebug(COMPONENT_FSAL,
-					 "Connected after %d sleeps, "
-					 "resending outstanding calls",
-					 nsleeps);
+					 "Connection %d connected after %d "
+					 "sleeps, resending outstanding calls",
+					 conn->id, nsleeps);
 			}
-		} while (rpc_sock < 0);
+		} while (conn->sock < 0);
 		pthread_mutex_unlock(&listlock);
 
-		pfd.fd = rpc_sock;
+		pfd.fd = conn->sock;
 		pfd.events = POLLIN | POLLRDHUP;
 
-		while (rpc_sock >= 0) {
+		while (conn->sock >= 0) {
 			switch (poll(&pfd, 1, millisec)) {
 			case 0:
 				LogDebug(COMPONENT_FSAL,
@@ -912,20 +1797,21 @@ static void *fs_rpc_recv(void *arg)
 				if (pfd.revents & POLLRDHUP) {
 					LogEvent(COMPONENT_FSAL,
 						 "Other end has closed "
-						 "connection, reconnecting...");
+						 "connection %d, reconnecting...",
+						 conn->id);
 				} else if (pfd.revents & POLLNVAL) {
 					LogEvent(COMPONENT_FSAL,
 						 "Socket is closed");
 				} else {
-					if (fs_rpc_read_reply(rpc_sock) >= 0)
+					if (fs_rpc_read_reply(conn) >= 0)
 						continue;
 				}
 				break;
 			}
 
 			pthread_mutex_lock(&listlock);
-			close(rpc_sock);
-			rpc_sock = -1;
+			close(conn->sock);
+			conn->sock = -1;
 			pthread_mutex_unlock(&listlock);
 		}
 	}
@@ -954,6 +1840,11 @@ static enum clnt_stat fs_process_reply(struct fs_rpc_io_context *ctx,
 	ctx->iodone = 0;
 	pthread_mutex_unlock(&ctx->iolock);
 
+	if (ctx->ioresult > 0 && ctx->decoded) {
+		ctx->decoded = false;
+		return ctx->decode_stat;
+	}
+
 	if (ctx->ioresult > 0) {
 		struct rpc_msg reply;
 		XDR x;
@@ -968,43 +1859,7 @@ static enum clnt_stat fs_process_reply(struct fs_rpc_io_context *ctx,
 
 		/* macro is defined, GCC 4.7.2 ignoring */
 		if (xdr_replymsg(&x, &reply)) {
-			if (reply.rm_reply.rp_stat == MSG_ACCEPTED) {
-				switch (reply.rm_reply.rp_acpt.ar_stat) {
-				case SUCCESS:
-					rc = RPC_SUCCESS;
-					break;
-				case PROG_UNAVAIL:
-					rc = RPC_PROGUNAVAIL;
-					break;
-				case PROG_MISMATCH:
-					rc = RPC_PROGVERSMISMATCH;
-					break;
-				case PROC_UNAVAIL:
-					rc = RPC_PROCUNAVAIL;
-					break;
-				case GARBAGE_ARGS:
-					rc = RPC_CANTDECODEARGS;
-					break;
-				case SYSTEM_ERR:
-					rc = RPC_SYSTEMERROR;
-					break;
-				default:
-					rc = RPC_FAILED;
-					break;
-				}
-			} else {
-				switch (reply.rm_reply.rp_rjct.rj_stat) {
-				case RPC_MISMATCH:
-					rc = RPC_VERSMISMATCH;
-					break;
-				case AUTH_ERROR:
-					rc = RPC_AUTHERROR;
-					break;
-				default:
-					rc = RPC_FAILED;
-					break;
-				}
-			}
+			rc = fs_reply_stat(&reply);
 		} else {
 			rc = RPC_CANTDECODERES;
 		}
@@ -1017,14 +1872,60 @@ static enum clnt_stat fs_process_reply(struct fs_rpc_io_context *ctx,
 	return rc;
 }
 
-static void fs_rpc_need_sock(void)
+static inline bool fs_rpc_conn_usable(struct fs_rpc_conn *conn)
+{
+	return atomic_fetch_int32_t(&conn->sock) >= 0 &&
+	       atomic_fetch_uint8_t(&conn->bound);
+}
+
+static bool fs_rpc_any_conn_usable(void)
+{
+	int i;
+
+	for (i = 0; i < rpc_nconns; ++i) {
+		if (fs_rpc_conn_usable(&rpc_conns[i]))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Wait until "conn" is connected, or until any connection is usable if "conn"
+ * is NULL.
+ */
+static void fs_rpc_need_sock(struct fs_rpc_conn *conn)
 {
 	pthread_mutex_lock(&listlock);
-	while (rpc_sock < 0)
+	while (conn ? conn->sock < 0 : !fs_rpc_any_conn_usable())
 		pthread_cond_wait(&sockless, &listlock);
 	pthread_mutex_unlock(&listlock);
 }
 
+/**
+ * Pick the usable connection with the fewest outstanding calls.
+ */
+static struct fs_rpc_conn *fs_rpc_pick_conn(void)
+{
+	struct fs_rpc_conn *best = &rpc_conns[0];
+	struct fs_rpc_conn *c;
+	int i;
+
+	if (tc_pinned_conn >= 0)
+		return &rpc_conns[tc_pinned_conn];
+
+	for (i = 1; i < rpc_nconns; ++i) {
+		c = &rpc_conns[i];
+		if (!fs_rpc_conn_usable(c))
+			continue;
+		if (!fs_rpc_conn_usable(best) ||
+		    atomic_fetch_uint32_t(&c->inflight) <
+			atomic_fetch_uint32_t(&best->inflight))
+			best = c;
+	}
+
+	return best;
+}
+
 static int fs_rpc_renewer_wait(int timeout)
 {
 	struct timespec ts;
@@ -1039,91 +1940,546 @@ static int fs_rpc_renewer_wait(int timeout)
 	return (rc == ETIMEDOUT);
 }
 
+static char fs_xdr_zeros[4];
+
+/*
+ * Encode "args" like xdr_COMPOUND4args() except that WRITE payloads are not
+ * copied into "pcontext->sendbuf".  The encoded call is described by
+ * "pcontext->sendiov" instead: segments of the send buffer, each followed by
+ * the payload of a WRITE and its padding.  Room for the record mark is left
+ * at the beginning of the first segment.
+ *
+ * Return the length of the encoded call excluding the record mark, or 0 on
+ * failure.
+ */
+static u_int fs_encode_compound(struct fs_rpc_io_context *pcontext,
+				struct rpc_msg *rmsg, COMPOUND4args *args)
+{
+	XDR x;
+	struct iovec *iov = pcontext->sendiov;
+	char *base = pcontext->sendbuf + 4;
+	u_int seg = 0;	/* start of the current segment in "base" */
+	u_int total = 0;
+	u_int pos;
+	u_int pad;
+	u_int i;
+	nfs_argop4 *op;
+	WRITE4args *wa;
+
+	memset(&x, 0, sizeof(x));
+	xdrmem_create(&x, base, pcontext->sendbuf_sz - 4, XDR_ENCODE);
+	if (!xdr_callmsg(&x, rmsg) || !xdr_utf8str_cs(&x, &args->tag) ||
+	    !inline_xdr_u_int32_t(&x, &args->minorversion) ||
+	    !xdr_u_int(&x, &args->argarray.argarray_len))
+		return 0;
+
+	for (i = 0; i < args->argarray.argarray_len; ++i) {
+		op = &args->argarray.argarray_val[i];
+		if (op->argop != NFS4_OP_WRITE) {
+			if (!xdr_nfs_argop4(&x, op))
+				return 0;
+			continue;
+		}
+
+		wa = &op->nfs_argop4_u.opwrite;
+		if (!xdr_nfs_opnum4(&x, &op->argop) ||
+		    !xdr_stateid4(&x, &wa->stateid) ||
+		    !xdr_offset4(&x, &wa->offset) ||
+		    !xdr_stable_how4(&x, &wa->stable) ||
+		    !xdr_u_int(&x, &wa->data.data_len))
+			return 0;
+
+		pos = xdr_getpos(&x);
+		iov->iov_base = base + seg;
+		iov->iov_len = pos - seg;
+		++iov;
+		iov->iov_base = wa->data.data_val;
+		iov->iov_len = wa->data.data_len;
+		++iov;
+		pad = FS_XDR_RNDUP(wa->data.data_len) - wa->data.data_len;
+		if (pad > 0) {
+			iov->iov_base = fs_xdr_zeros;
+			iov->iov_len = pad;
+			++iov;
+		}
+		total += FS_XDR_RNDUP(wa->data.data_len);
+		seg = pos;
+	}
+
+	pos = xdr_getpos(&x);
+	iov->iov_base = base + seg;
+	iov->iov_len = pos - seg;
+	++iov;
+	total += pos;
+
+	/* prepend the record mark to the first segment */
+	pcontext->sendiov[0].iov_base = pcontext->sendbuf;
+	pcontext->sendiov[0].iov_len += 4;
+	pcontext->sendiov_cnt = iov - pcontext->sendiov;
+
+	return total;
+}
+
+static int fs_send_iov(int sock, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t bc;
+
+	fs_iov_advance(&iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = MIN(iovcnt, IOV_MAX);
+		bc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (bc <= 0)
+			return -1;
+		fs_iov_advance(&iov, &iovcnt, bc);
+	}
+
+	return 0;
+}
+
 static int fs_compoundv4_call(struct fs_rpc_io_context *pcontext,
 			       const struct user_cred *cred,
 			       COMPOUND4args *args, COMPOUND4res *res)
 {
-	XDR x;
 	struct rpc_msg rmsg;
 	AUTH *au;
 	enum clnt_stat rc;
+	u_int pos;
+	struct fs_rpc_conn *conn = fs_rpc_pick_conn();
+
+	rmsg.rm_xid = atomic_postinc_uint32_t(&rpc_xid);
+	rmsg.rm_direction = CALL;
+
+	rmsg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	rmsg.rm_call.cb_prog = pcontext->nfs_prog;
+	rmsg.rm_call.cb_vers = FSAL_PROXY_NFS_V4;
+	rmsg.rm_call.cb_proc = NFSPROC4_COMPOUND;
+
+	if (cred) {
+		au = authunix_create(fs_hostname, cred->caller_uid,
+				     cred->caller_gid, cred->caller_glen,
+				     cred->caller_garray);
+	} else {
+		au = authunix_create_default();
+	}
+	if (au == NULL)
+		return RPC_AUTHERROR;
+
+	rmsg.rm_call.cb_cred = au->ah_cred;
+	rmsg.rm_call.cb_verf = au->ah_verf;
+
+	pos = fs_encode_compound(pcontext, &rmsg, args);
+	if (pos > 0) {
+		u_int recmark = ntohl(pos | (1U << 31));
+		int first_try = 1;
+
+		pcontext->rpc_xid = rmsg.rm_xid;
+		pcontext->conn = conn;
+		pcontext->res = fs_zc_eligible(args, res) ? res : NULL;
+		pcontext->decoded = false;
+
+		memcpy(pcontext->sendbuf, &recmark, sizeof(recmark));
+		pos += 4;
+
+		do {
+			struct iovec iov[FS_SEND_IOV_MAX];
+			int sent = -1;
+			int sock;
+			LogDebug(COMPONENT_FSAL,
+				 "%ssend XID %u with %d bytes on connection %d",
+				 (first_try ? "First attempt to " : "Re"),
+				 rmsg.rm_xid, pos, conn->id);
+
+			/*
+			 * Register the call before sending it, because the
+			 * receiver thread can get the reply before write()
+			 * returns now that listlock is not held while writing.
+			 */
+			pthread_mutex_lock(&listlock);
+			if (first_try) {
+				pthread_mutex_lock(&pcontext->iolock);
+				pcontext->iodone = 0;
+				pthread_mutex_unlock(&pcontext->iolock);
+				glist_add_tail(&conn->calls, &pcontext->calls);
+				atomic_inc_uint32_t(&conn->inflight);
+				first_try = 0;
+			}
+			sock = conn->sock;
+			pthread_mutex_unlock(&listlock);
+
+			/* sending consumes the iovecs; keep the originals */
+			memcpy(iov, pcontext->sendiov,
+			       sizeof(iov[0]) * pcontext->sendiov_cnt);
+			pthread_mutex_lock(&conn->sendlock);
+			if (sock >= 0) {
+				sent = fs_send_iov(sock, iov,
+						   pcontext->sendiov_cnt);
+				if (sent < 0) {
+					/* let the receiver reconnect */
+					shutdown(sock, SHUT_RDWR);
+				}
+			}
+			pthread_mutex_unlock(&conn->sendlock);
+
+			if (sent == 0) {
+				rc = fs_process_reply(pcontext, res);
+			} else {
+				pthread_mutex_lock(&listlock);
+				if (!glist_null(&pcontext->calls)) {
+					glist_del(&pcontext->calls);
+					atomic_dec_uint32_t(&conn->inflight);
+				}
+				pthread_mutex_unlock(&listlock);
+				rc = RPC_CANTSEND;
+			}
+		} while (rc == RPC_TIMEDOUT);
+	} else {
+		rc = RPC_CANTENCODEARGS;
+	}
+	if (au)
+		auth_destroy(au);
+	return rc;
+}
+
+static nfsstat4 get_nfs4_op_status(const nfs_resop4 *op_res);
+
+static inline slice_t tc_component_slice(const component4 *c)
+{
+	return mkslice(c->utf8string_val, c->utf8string_len);
+}
+
+static inline bool tc_is_dot(slice_t comp)
+{
+	return comp.size == 0 || (comp.size == 1 && comp.data[0] == '.');
+}
+
+static inline bool tc_is_dcache_getfh(int i)
+{
+	const char *fh;
+
+	if (argoparray[i].argop != NFS4_OP_GETFH)
+		return false;
+	fh = resoparray[i].nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object
+		 .nfs_fh4_val;
+	return fh >= tc_dcache_fhs[0] && fh < tc_dcache_fhs[tc_dcache_fhcnt];
+}
+
+/**
+ * Fill the dentry cache with the results of the first "nres" operations of
+ * the compound, and then remove the GETFHs added by tc_prepare_lookups() so
+ * that the callers see only the operations they have asked for.
+ *
+ * A LOOKUP (or a CREATE, or an OPEN by name) followed by a GETFH tells the
+ * filehandle of the (parent, name) entry if the filehandle of the parent is
+ * known, i.e., it was set by a PUTFH or learned from an earlier GETFH.
+ */
+static void tc_dcache_learn(int nres)
+{
+	const nfs_fh4 *cur = NULL;
+	const nfs_fh4 *saved = NULL;
+	const nfs_fh4 *parent = NULL;
+	const nfs_fh4 *fh;
+	const OPEN4args *oa;
+	bool is_root = false;
+	slice_t name;
+	nfsstat4 st;
+	int i, n;
+
+	for (i = 0; i < nres; ++i) {
+		st = get_nfs4_op_status(&resoparray[i]);
+		if (st == NFS4ERR_STALE || st == NFS4ERR_FHEXPIRED ||
+		    st == NFS4ERR_BADHANDLE) {
+			NFS4_DEBUG("purging dentry cache after error %d", st);
+			nfs4_dcache_purge();
+		}
+		if (st != NFS4_OK)
+			break;
+
+		switch (argoparray[i].argop) {
+		case NFS4_OP_PUTROOTFH:
+			cur = parent = NULL;
+			is_root = true;
+			break;
+		case NFS4_OP_PUTFH:
+			cur = &argoparray[i].nfs_argop4_u.opputfh.object;
+			parent = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_LOOKUP:
+			name = tc_component_slice(
+			    &argoparray[i].nfs_argop4_u.oplookup.objname);
+			parent = cur;
+			cur = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_CREATE:
+			name = tc_component_slice(
+			    &argoparray[i].nfs_argop4_u.opcreate.objname);
+			parent = cur;
+			cur = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_OPEN:
+			oa = &argoparray[i].nfs_argop4_u.opopen;
+			if (oa->claim.claim == CLAIM_NULL) {
+				name = tc_component_slice(
+				    &oa->claim.open_claim4_u.file);
+				parent = cur;
+			} else {
+				parent = NULL;
+			}
+			cur = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_GETFH:
+			fh = &resoparray[i]
+				  .nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
+			if (is_root) {
+				nfs4_dcache_set_root(fh->nfs_fh4_val,
+						     fh->nfs_fh4_len);
+			} else if (parent) {
+				nfs4_dcache_add(parent->nfs_fh4_val,
+						parent->nfs_fh4_len, name,
+						fh->nfs_fh4_val, fh->nfs_fh4_len);
+			}
+			cur = fh;
+			parent = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_SAVEFH:
+			saved = cur;
+			break;
+		case NFS4_OP_RESTOREFH:
+			cur = saved;
+			parent = NULL;
+			is_root = false;
+			break;
+		case NFS4_OP_REMOVE:
+			if (cur) {
+				nfs4_dcache_remove(
+				    cur->nfs_fh4_val, cur->nfs_fh4_len,
+				    tc_component_slice(&argoparray[i]
+							    .nfs_argop4_u.opremove
+							    .target));
+			}
+			break;
+		case NFS4_OP_RENAME:
+			if (saved) {
+				nfs4_dcache_remove(
+				    saved->nfs_fh4_val, saved->nfs_fh4_len,
+				    tc_component_slice(&argoparray[i]
+							    .nfs_argop4_u.oprename
+							    .oldname));
+			}
+			if (cur) {
+				nfs4_dcache_remove(
+				    cur->nfs_fh4_val, cur->nfs_fh4_len,
+				    tc_component_slice(&argoparray[i]
+							    .nfs_argop4_u.oprename
+							    .newname));
+			}
+			break;
+		default:
+			if (NFS4_CHANGE_CFH[argoparray[i].argop]) {
+				cur = parent = NULL;
+				is_root = false;
+			}
+		}
+	}
+
+	if (tc_dcache_fhcnt == 0)
+		return;
+
+	for (i = n = 0; i < opcnt; ++i) {
+		if (tc_is_dcache_getfh(i))
+			continue;
+		if (n != i) {
+			argoparray[n] = argoparray[i];
+			resoparray[n] = resoparray[i];
+		}
+		++n;
+	}
+	opcnt = n;
+	tc_dcache_fhcnt = 0;
+}
+
+static enum clnt_stat fs_compoundv4_send(const char *caller,
+					 const struct user_cred *creds,
+					 COMPOUND4args *arg, COMPOUND4res *res)
+{
+	enum clnt_stat rc;
+	struct fs_rpc_io_context *ctx;
+        TC_DECLARE_COUNTER(rpc);
+
+	pthread_mutex_lock(&context_lock);
+	while (glist_empty(&free_contexts))
+		pthread_cond_wait(&need_context, &context_lock);
+	ctx =
+	    glist_first_entry(&free_contexts, struct fs_rpc_io_context, calls);
+	glist_del(&ctx->calls);
+	pthread_mutex_unlock(&context_lock);
+
+        TC_START_COUNTER(rpc);
+
+	do {
+		rc = fs_compoundv4_call(ctx, creds, arg, res);
+		if (rc != RPC_SUCCESS)
+			NFS4_DEBUG("RPC by %s failed with %d", caller, rc);
+		if (rc == RPC_CANTSEND)
+			fs_rpc_need_sock(tc_pinned_conn >= 0
+					     ? &rpc_conns[tc_pinned_conn]
+					     : NULL);
+	} while ((rc == RPC_CANTRECV && (ctx->ioresult == -EAGAIN))
+		 || (rc == RPC_CANTSEND));
+
+	TC_STOP_COUNTER(rpc, opcnt, rc == RPC_SUCCESS);
+
+	pthread_mutex_lock(&context_lock);
+	pthread_cond_signal(&need_context);
+	glist_add(&free_contexts, &ctx->calls);
+	pthread_mutex_unlock(&context_lock);
 
-	pthread_mutex_lock(&listlock);
-	rmsg.rm_xid = rpc_xid++;
-	pthread_mutex_unlock(&listlock);
-	rmsg.rm_direction = CALL;
+	return rc;
+}
 
-	rmsg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
-	rmsg.rm_call.cb_prog = pcontext->nfs_prog;
-	rmsg.rm_call.cb_vers = FSAL_PROXY_NFS_V4;
-	rmsg.rm_call.cb_proc = NFSPROC4_COMPOUND;
+/* Whether op "i" is a PUTFH of a filehandle resolved by the dentry cache. */
+static struct tc_dcache_putfh *tc_dcache_find_putfh(const nfs_argop4 *args,
+						    int i)
+{
+	int k;
 
-	if (cred) {
-		au = authunix_create(fs_hostname, cred->caller_uid,
-				     cred->caller_gid, cred->caller_glen,
-				     cred->caller_garray);
-	} else {
-		au = authunix_create_default();
+	if (args[i].argop != NFS4_OP_PUTFH)
+		return NULL;
+	for (k = 0; k < tc_dcache_putfhcnt; ++k) {
+		if (tc_dcache_putfhs[k].op == i &&
+		    tc_dcache_putfhs[k].fh ==
+			args[i].nfs_argop4_u.opputfh.object.nfs_fh4_val) {
+			return &tc_dcache_putfhs[k];
+		}
 	}
-	if (au == NULL)
-		return RPC_AUTHERROR;
-
-	rmsg.rm_call.cb_cred = au->ah_cred;
-	rmsg.rm_call.cb_verf = au->ah_verf;
+	return NULL;
+}
 
-	memset(&x, 0, sizeof(x));
-	xdrmem_create(&x, pcontext->sendbuf + 4, pcontext->sendbuf_sz,
-		      XDR_ENCODE);
-	if (xdr_callmsg(&x, &rmsg) && xdr_COMPOUND4args(&x, args)) {
-		u_int pos = xdr_getpos(&x);
-		u_int recmark = ntohl(pos | (1U << 31));
-		int first_try = 1;
+/**
+ * Retry the compound by path if it failed at a PUTFH of a filehandle resolved
+ * by the dentry cache because the filehandle is no longer valid.  Each such
+ * PUTFH is replaced by the LOOKUPs of the path it stands for; the results are
+ * then moved back to the places of the original operations, the LOOKUPs of a
+ * PUTFH showing as the result of that PUTFH, so that callers see the
+ * operations they have asked for.
+ *
+ * Compounds that changed anything on the server before the failed PUTFH are
+ * not retried, because those changes would be made twice.
+ *
+ * Returns whether the compound was retried; if so, "rc" is the status of the
+ * new RPC.
+ */
+static bool tc_dcache_retry(const char *caller, const struct user_cred *creds,
+			    COMPOUND4args *arg, COMPOUND4res *res,
+			    enum clnt_stat *rc)
+{
+	int first[MAX_NUM_OPS_PER_COMPOUND + 1];
+	uint32_t ops[MAX_NUM_OPS_PER_COMPOUND];
+	bool bypath[MAX_NUM_OPS_PER_COMPOUND];
+	struct tc_dcache_putfh *p;
+	nfs_argop4 *args;
+	int failed = (int)res->resarray.resarray_len - 1;
+	int nops = opcnt;
+	int i, k, n, len;
+	nfsstat4 st;
+	slice_t c;
+
+	if (failed < 0 || failed >= nops)
+		return false;
+	st = get_nfs4_op_status(&resoparray[failed]);
+	if ((st != NFS4ERR_STALE && st != NFS4ERR_BADHANDLE &&
+	     st != NFS4ERR_FHEXPIRED) ||
+	    !tc_dcache_find_putfh(argoparray, failed)) {
+		return false;
+	}
+	for (i = 0; i < failed; ++i)
+		ops[i] = argoparray[i].argop;
+	if (!nfs4_dcache_can_retry(ops, failed)) {
+		NFS4_DEBUG("compound of %s changed the server before error %d",
+			   caller, st);
+		return false;
+	}
 
-		pcontext->rpc_xid = rmsg.rm_xid;
+	n = nops;
+	for (k = 0; k < tc_dcache_putfhcnt; ++k)
+		n += tc_dcache_putfhs[k].compcnt;
+	if (n > MAX_NUM_OPS_PER_COMPOUND)
+		return false;
+	args = memdup(argoparray, nops * sizeof(nfs_argop4));
+	if (!args)
+		return false;
 
-		memcpy(pcontext->sendbuf, &recmark, sizeof(recmark));
-		pos += 4;
+	NFS4_DEBUG("retrying compound of %s by path after error %d", caller,
+		   st);
+	nfs4_dcache_purge();
+	/* the only results allocated by the decoder rather than the callers */
+	for (i = 0; i < failed; ++i) {
+		if (resoparray[i].resop == NFS4_OP_READDIR)
+			xdr_free((xdrproc_t)xdr_nfs_resop4, &resoparray[i]);
+	}
+	if (args[0].argop == NFS4_OP_SEQUENCE) {
+		tc_update_sequence(argoparray, resoparray, true);
+		tc_alloc_sequence_slot(&args[0].nfs_argop4_u.opsequence);
+	}
 
-		do {
-			int bc = 0;
-			char *buf = pcontext->sendbuf;
-			LogDebug(COMPONENT_FSAL, "%ssend XID %u with %d bytes",
-				 (first_try ? "First attempt to " : "Re"),
-				 rmsg.rm_xid, pos);
-			pthread_mutex_lock(&listlock);
-			while (bc < pos) {
-				int wc = write(rpc_sock, buf, pos - bc);
-				if (wc <= 0) {
-					close(rpc_sock);
-					break;
-				}
-				bc += wc;
-				buf += wc;
+	opcnt = 0;
+	for (i = 0; i < nops; ++i) {
+		first[i] = opcnt;
+		p = tc_dcache_find_putfh(args, i);
+		bypath[i] = p != NULL;
+		if (!p) {
+			argoparray[opcnt] = args[i];
+			resoparray[opcnt++] = tc_dcache_saved_res[i];
+			continue;
+		}
+		if (p->base.nfs_fh4_len == 0) {
+			COMPOUNDV4_ARG_ADD_OP_PUTROOTFH(opcnt, argoparray);
+		} else {
+			COMPOUNDV4_ARG_ADD_OP_PUTFH(opcnt, argoparray,
+						    p->base);
+		}
+		for (k = 0; k < p->compcnt; ++k) {
+			c = tc_dcache_comps[p->comp + k];
+			if (!tc_is_dot(c)) {
+				COMPOUNDV4_ARG_ADD_OP_LOOKUPNAME(
+				    opcnt, argoparray, c.data, c.size);
 			}
+		}
+	}
+	first[nops] = opcnt;
 
-			if (bc == pos) {
-				if (first_try) {
-					glist_add_tail(&rpc_calls,
-						       &pcontext->calls);
-					first_try = 0;
-				}
-			} else {
-				if (!first_try)
-					glist_del(&pcontext->calls);
-			}
-			pthread_mutex_unlock(&listlock);
+	arg->argarray.argarray_len = opcnt;
+	res->resarray.resarray_len = opcnt;
+	*rc = fs_compoundv4_send(caller, creds, arg, res);
+	len = *rc == RPC_SUCCESS ? (int)res->resarray.resarray_len : 0;
 
-			if (bc == pos)
-				rc = fs_process_reply(pcontext, res);
-			else
-				rc = RPC_CANTSEND;
-		} while (rc == RPC_TIMEDOUT);
-	} else {
-		rc = RPC_CANTENCODEARGS;
+	/* ops only move to lower indexes, so this works in place */
+	for (i = n = 0; i < nops && first[i] < len; ++i) {
+		if (!bypath[i]) {
+			resoparray[i] = resoparray[first[i]];
+		} else {
+			st = NFS4_OK;
+			for (k = first[i];
+			     k < first[i + 1] && k < len && st == NFS4_OK; ++k)
+				st = get_nfs4_op_status(&resoparray[k]);
+			resoparray[i].resop = NFS4_OP_PUTFH;
+			resoparray[i].nfs_resop4_u.opputfh.status = st;
+		}
+		n = i + 1;
 	}
-	if (au)
-		auth_destroy(au);
-	return rc;
+	memcpy(argoparray, args, nops * sizeof(nfs_argop4));
+	free(args);
+	opcnt = nops;
+	arg->argarray.argarray_len = nops;
+	res->resarray.resarray_len = n;
+	return true;
 }
 
 /**
@@ -1132,13 +2488,17 @@ static int fs_compoundv4_call(struct fs_rpc_io_context *pcontext,
  * the whole call (both RPC and NFS).  If "nfsstat" is not NULL, the return
  * value is the status of RPC call and "nfsstat" is the status of the NFS
  * request.
+ *
+ * A compound failing at a stale filehandle from the dentry cache is retried
+ * once by path.
  */
 static int fs_compoundv4_execute(const char *caller,
 				 const struct user_cred *creds,
 				 int *nfsstat)
 {
 	enum clnt_stat rc;
-	struct fs_rpc_io_context *ctx;
+	bool retried = false;
+	bool replied;
 	COMPOUND4args arg = {
 		.minorversion = 1,
 		.argarray.argarray_val = argoparray,
@@ -1148,47 +2508,38 @@ static int fs_compoundv4_execute(const char *caller,
 		.resarray.resarray_val = resoparray,
 		.resarray.resarray_len = opcnt
 	};
-        TC_DECLARE_COUNTER(rpc);
 
         if (opcnt == 0) {
                 *nfsstat = NFS4_OK;
                 return RPC_SUCCESS;
         }
 
-	pthread_mutex_lock(&context_lock);
-	while (glist_empty(&free_contexts))
-		pthread_cond_wait(&need_context, &context_lock);
-	ctx =
-	    glist_first_entry(&free_contexts, struct fs_rpc_io_context, calls);
-	glist_del(&ctx->calls);
-	pthread_mutex_unlock(&context_lock);
-
-        TC_START_COUNTER(rpc);
-
-	do {
-		rc = fs_compoundv4_call(ctx, creds, &arg, &res);
-		if (rc != RPC_SUCCESS)
-			NFS4_DEBUG("RPC by %s failed with %d", caller, rc);
-		if (rc == RPC_CANTSEND)
-			fs_rpc_need_sock();
-	} while ((rc == RPC_CANTRECV && (ctx->ioresult == -EAGAIN))
-		 || (rc == RPC_CANTSEND));
-
-	TC_STOP_COUNTER(rpc, opcnt, rc == RPC_SUCCESS);
-
-	pthread_mutex_lock(&context_lock);
-	pthread_cond_signal(&need_context);
-	glist_add(&free_contexts, &ctx->calls);
-	pthread_mutex_unlock(&context_lock);
+	if (tc_dcache_putfhcnt > 0) {
+		memcpy(tc_dcache_saved_res, resoparray,
+		       opcnt * sizeof(nfs_resop4));
+	}
+	rc = fs_compoundv4_send(caller, creds, &arg, &res);
+	if (rc == RPC_SUCCESS && res.status != NFS4_OK &&
+	    tc_dcache_putfhcnt > 0) {
+		retried = tc_dcache_retry(caller, creds, &arg, &res, &rc);
+	}
 
-	if (rc == RPC_SUCCESS) {
+	/* NFS errors still come with results to learn from */
+	replied = rc == RPC_SUCCESS;
+	if (replied) {
                if (nfsstat != NULL) {
                         *nfsstat = nfsstat4_to_errno(res.status);
                } else {
                        rc = res.status;
                }
         }
-        tc_update_sequence(argoparray, resoparray, rc == RPC_SUCCESS);
+	if (nfs4_dcache_enabled()) {
+		/* after a retry, the PUTFHs may be of stale filehandles */
+		tc_dcache_learn(replied && !retried
+				    ? MIN(res.resarray.resarray_len, opcnt)
+				    : 0);
+	}
+        tc_update_sequence(argoparray, resoparray, replied);
 	return rc;
 }
 
@@ -1227,7 +2578,7 @@ static int fs_setclientid(clientid4 *resultclientid, uint32_t *lease_time)
 	LogEvent(COMPONENT_FSAL,
 		 "Negotiating a new ClientId with the remote server");
 
-	if (getsockname(rpc_sock, &sin, &slen))
+	if (getsockname(rpc_conns[0].sock, &sin, &slen))
 		return -errno;
 
 	snprintf(clientid_name, MAXNAMLEN, "%s(%d) - GANESHA NFSv4 Proxy",
@@ -1299,10 +2650,18 @@ static int fs_setclientid(clientid4 *resultclientid, uint32_t *lease_time)
 }
 #endif
 
+static void tc_close_cached_files(void);
+static void tc_return_dir_delegations(void);
+
 static fsal_status_t fs_destroy_session()
 {
         int rc;
 
+        nfs4_ocache_deinit();
+        tc_close_cached_files();
+        nfs4_ddeleg_deinit();
+        tc_return_dir_delegations();
+
         vreset_compound(false);
 
         argoparray->argop = NFS4_OP_DESTROY_SESSION;
@@ -1317,6 +2676,7 @@ static fsal_status_t fs_destroy_session()
 
 	atomic_store_uint8_t(&fs_session_valid, 0);
 	del_session_slot_table(&sess_slot_tbl);
+	nfs4_dcache_deinit();
 
 	return fsalstat(ERR_FSAL_NO_ERROR, 0);
 }
@@ -1352,13 +2712,14 @@ static int fs_create_session()
 						   4616,
 					       .ca_maxoperations =
 						   MAX_NUM_OPS_PER_COMPOUND,
-					       .ca_maxrequests = 128 };
+					       .ca_maxrequests =
+						   SESSION_SLOT_TABLE_CAPACITY };
 
 	channel_attrs4 csa_back_chan_attrs = { .ca_headerpadsize = 0,
-					       .ca_maxrequestsize = 4096,
+					       .ca_maxrequestsize = FS_CB_BUFSZ,
 					       .ca_maxresponsesize = 4096,
 					       .ca_maxresponsesize_cached = 0,
-					       .ca_maxoperations = 2,
+					       .ca_maxoperations = FS_CB_MAX_OPS,
 					       .ca_maxrequests = 1 };
 	char clientid_name[MAXNAMLEN + 1];
 	struct timespec now;
@@ -1378,7 +2739,7 @@ static int fs_create_session()
         LogEvent(COMPONENT_FSAL,
                  "Negotiating a new v4.1 session with the remote server");
 
-        if (getsockname(rpc_sock, &sin, &slen))
+        if (getsockname(rpc_conns[0].sock, &sin, &slen))
                 return -errno;
 
         snprintf(clientid_name, MAXNAMLEN, "%s(%d) - GANESHA NFSv4 Proxy",
@@ -1434,6 +2795,8 @@ static int fs_create_session()
 	csa_sec_parms_val.callback_sec_parms4_u.cbsp_sys_cred.aup_len = 0;
 
 	csa_flags |= CREATE_SESSION4_FLAG_PERSIST;
+	if (fs_wants_callbacks())
+		csa_flags |= CREATE_SESSION4_FLAG_CONN_BACK_CHAN;
 
         vreset_compound(false);
 
@@ -1441,7 +2804,7 @@ static int fs_create_session()
 	argoparray[opcnt++].argop = NFS4_OP_CREATE_SESSION;
 	csa->csa_clientid = eir->eir_clientid;
 	csa->csa_sequence = eir->eir_sequenceid;
-	csa->csa_flags = 1;
+	csa->csa_flags = csa_flags;
 	csa->csa_fore_chan_attrs = csa_fore_chan_attrs;
 	csa->csa_back_chan_attrs = csa_back_chan_attrs;
 	csa->csa_cb_program = 0x40000000;
@@ -1459,16 +2822,25 @@ static int fs_create_session()
 		   .csr_resok4;
 	memcpy(&fs_sessionid, csr->csr_sessionid, NFS4_SESSIONID_SIZE);
 	fs_sequenceid = csr->csr_sequence;
+	fs_cb_seqid = 0;
+	atomic_store_uint8_t(&rpc_conns[0].backchan,
+			     !!(csr->csr_flags &
+				CREATE_SESSION4_FLAG_CONN_BACK_CHAN));
+	if (fs_wants_callbacks() && !rpc_conns[0].backchan)
+		NFS4_WARN("no back channel; delegations are not used");
 
         if (sess_slot_tbl) {
                 NFS4_WARN("currently only one session is supported\n");
                 del_session_slot_table(&sess_slot_tbl);
         }
-        sess_slot_tbl = new_session_slot_table();
+        sess_slot_tbl = new_session_slot_table(
+            csr->csr_fore_chan_attrs.ca_maxrequests);
         if (!sess_slot_tbl) {
                 NFS4_ERR("cannot create session slot table");
                 return -ENOMEM;
         }
+        LogEvent(COMPONENT_FSAL, "session created with %u slots",
+                 sess_slot_tbl->nslots);
 
 	//fs_destroy_session();
 	rc = fs_reclaim_complete();
@@ -1480,6 +2852,74 @@ static int fs_create_session()
 	return 0;
 }
 
+/**
+ * Bind an extra connection to the session so that the server accepts
+ * compounds of the session on it, or (re-)bind the first connection to the
+ * back channel if "dir" is CDFC4_BACK_OR_BOTH.
+ */
+static int fs_bind_conn_to_session(struct fs_rpc_conn *conn,
+				   channel_dir_from_client4 dir)
+{
+	int rc;
+	BIND_CONN_TO_SESSION4args *bcsa;
+	BIND_CONN_TO_SESSION4resok *bcsr;
+
+	tc_pinned_conn = conn->id;
+	vreset_compound(false);
+
+	bcsa = &argoparray[opcnt].nfs_argop4_u.opbind_conn_to_session;
+	argoparray[opcnt++].argop = NFS4_OP_BIND_CONN_TO_SESSION;
+	memcpy(&bcsa->bctsa_sessid, &fs_sessionid, NFS4_SESSIONID_SIZE);
+	bcsa->bctsa_dir = dir;
+	bcsa->bctsa_use_conn_in_rdma_mode = false;
+	bcsr = &resoparray[opcnt - 1]
+		    .nfs_resop4_u.opbind_conn_to_session
+		    .BIND_CONN_TO_SESSION4res_u.bctsr_resok4;
+
+	rc = fs_nfsv4_call(NULL, NULL);
+	tc_pinned_conn = -1;
+	if (rc != NFS4_OK) {
+		NFS4_WARN("cannot bind connection %d to session: %d", conn->id,
+			  rc);
+		return rc;
+	}
+
+	pthread_mutex_lock(&listlock);
+	atomic_store_uint8_t(&conn->bound, 1);
+	if (bcsr->bctsr_dir & CDFS4_BACK)
+		atomic_store_uint8_t(&conn->backchan, 1);
+	pthread_cond_broadcast(&sockless);
+	pthread_mutex_unlock(&listlock);
+
+	LogDebug(COMPONENT_FSAL, "Connection %d bound to session", conn->id);
+	return 0;
+}
+
+/**
+ * (Re-)bind the connected connections that are not bound yet, and the first
+ * connection to the back channel if it has reconnected.
+ */
+static void fs_bind_conns(void)
+{
+	int i;
+	struct fs_rpc_conn *conn = &rpc_conns[0];
+
+	if (fs_wants_callbacks() && atomic_fetch_int32_t(&conn->sock) >= 0 &&
+	    !atomic_fetch_uint8_t(&conn->backchan)) {
+		/* callbacks may have been missed while disconnected */
+		nfs4_ocache_drop_delegs();
+		nfs4_ddeleg_drop_all();
+		fs_bind_conn_to_session(conn, CDFC4_BACK_OR_BOTH);
+	}
+
+	for (i = 1; i < rpc_nconns; ++i) {
+		conn = &rpc_conns[i];
+		if (atomic_fetch_int32_t(&conn->sock) >= 0 &&
+		    !atomic_fetch_uint8_t(&conn->bound))
+			fs_bind_conn_to_session(conn, CDFC4_FORE);
+	}
+}
+
 static void *fs_clientid_renewer(void *arg)
 {
 	int rc;
@@ -1487,6 +2927,7 @@ static void *fs_clientid_renewer(void *arg)
 	while (true) {
                 fs_rpc_renewer_wait(1);
 		if (atomic_fetch_uint8_t(&fs_session_valid)) {
+			fs_bind_conns();
 			/* Simply renew the client id you've got */
 			LogEvent(COMPONENT_FSAL, "Renewing session");
                         vreset_compound(true);
@@ -1494,6 +2935,9 @@ static void *fs_clientid_renewer(void *arg)
 			if (rc == NFS4_OK) {
 				LogDebug(COMPONENT_FSAL,
 					 "Renewed session");
+				nfs4_ocache_expire();
+				tc_close_cached_files();
+				tc_return_dir_delegations();
 				continue;
 			}
 		} else {
@@ -1514,14 +2958,42 @@ void free_io_contexts(void)
 	}
 }
 
+static int fs_start_conn(struct fs_rpc_conn *conn)
+{
+	int rc;
+
+	rc = pthread_create(&conn->recv_thread, NULL, fs_rpc_recv, conn);
+	if (rc) {
+		LogCrit(COMPONENT_FSAL,
+			"Cannot create kern rpc receiver thread - %s",
+			strerror(rc));
+	}
+	return rc;
+}
+
 int fs_init_rpc(const struct fs_fsal_module *pm)
 {
 	int rc;
-	int i = 16;
+	int i;
 
-	glist_init(&rpc_calls);
 	glist_init(&free_contexts);
 
+	rpc_info = &pm->special;
+	rpc_nconns = pm->special.srv_nconns;
+	if (rpc_nconns < 1)
+		rpc_nconns = 1;
+	else if (rpc_nconns > FS_MAX_RPC_CONNS)
+		rpc_nconns = FS_MAX_RPC_CONNS;
+	for (i = 0; i < rpc_nconns; ++i) {
+		rpc_conns[i].id = i;
+		rpc_conns[i].sock = -1;
+		rpc_conns[i].bound = (i == 0);
+		rpc_conns[i].backchan = 0;
+		rpc_conns[i].inflight = 0;
+		glist_init(&rpc_conns[i].calls);
+		pthread_mutex_init(&rpc_conns[i].sendlock, NULL);
+	}
+
 /**
  * @todo this lock is not really necessary so long as we can
  *       only do one export at a time.  This is a reminder that
@@ -1540,8 +3012,30 @@ int fs_init_rpc(const struct fs_fsal_module *pm)
 		 pm->special.srv_sendsize);
 	LogEvent(COMPONENT_INIT, "RPC recv buf size: %u",
 		 pm->special.srv_recvsize);
+	LogEvent(COMPONENT_INIT, "RPC connections: %d", rpc_nconns);
+	LogEvent(COMPONENT_INIT, "dentry cache: %u entries, %u ms",
+		 pm->special.dcache_size, pm->special.dcache_timeout);
 
-	for (i = 16; i > 0; i--) {
+	rc = nfs4_dcache_init(pm->special.dcache_size,
+			      pm->special.dcache_timeout);
+	if (rc) {
+		NFS4_ERR("Cannot create dentry cache - %s", strerror(rc));
+		return rc;
+	}
+	LogEvent(COMPONENT_INIT, "open-file cache: %u files, %u ms",
+		 pm->special.ocache_size, pm->special.ocache_timeout);
+	nfs4_ocache_init(pm->special.ocache_size, pm->special.ocache_timeout);
+	fs_delegations = pm->special.delegations && pm->special.ocache_size > 0;
+	LogEvent(COMPONENT_INIT, "read delegations: %s",
+		 fs_delegations ? "on" : "off");
+	LogEvent(COMPONENT_INIT, "directory delegations: %u",
+		 pm->special.dir_delegations);
+	nfs4_ddeleg_init(pm->special.dir_delegations);
+	tc_listdir_parallelism = pm->special.listdir_parallelism;
+	LogEvent(COMPONENT_INIT, "listdir parallelism: %u",
+		 tc_listdir_parallelism);
+
+	for (i = FS_RPC_CONTEXTS_PER_CONN * rpc_nconns; i > 0; i--) {
 		struct fs_rpc_io_context *c =
 		    gsh_calloc(1, sizeof(*c) + pm->special.srv_sendsize +
 			       pm->special.srv_recvsize);
@@ -1560,23 +3054,27 @@ int fs_init_rpc(const struct fs_fsal_module *pm)
 		glist_add(&free_contexts, &c->calls);
 	}
 
-	rc = pthread_create(&fs_recv_thread, NULL, fs_rpc_recv,
-			    (void *)&pm->special);
+	rc = fs_start_conn(&rpc_conns[0]);
 	if (rc) {
-		LogCrit(COMPONENT_FSAL,
-			"Cannot create kern rpc receiver thread - %s",
-			strerror(rc));
 		free_io_contexts();
 		return rc;
 	}
 
-	fs_rpc_need_sock();
+	fs_rpc_need_sock(&rpc_conns[0]);
 	rc = fs_create_session();
 	if (rc) {
 		NFS4_ERR("Cannot create session - %s", strerror(rc));
 		free_io_contexts();
 	}
 	fs_session_valid = 1;
+
+	/* Trunk the other connections into the session. */
+	for (i = 1; i < rpc_nconns; ++i) {
+		if (fs_start_conn(&rpc_conns[i]) != 0)
+			break;
+		fs_rpc_need_sock(&rpc_conns[i]);
+		fs_bind_conn_to_session(&rpc_conns[i], CDFC4_FORE);
+	}
 	
 	rc = pthread_create(&fs_renewer_thread, NULL, fs_clientid_renewer,
 			    NULL);
@@ -1973,16 +3471,76 @@ static inline bool tc_prepare_putfh(const nfs_fh4 *fh)
 	return true;
 }
 
+/**
+ * Add a GETFH whose result goes to the dentry cache, if there are spare
+ * operations and buffers in the compound.
+ */
+static inline void tc_prepare_dcache_getfh(void)
+{
+	GETFH4resok *fhok;
+
+	if (!nfs4_dcache_enabled() || tc_dcache_fhcnt == MAX_DCACHE_GETFHS ||
+	    !tc_has_enough_ops(2)) {
+		return;
+	}
+
+	fhok = &resoparray[opcnt].nfs_resop4_u.opgetfh.GETFH4res_u.resok4;
+	fhok->object.nfs_fh4_val = tc_dcache_fhs[tc_dcache_fhcnt++];
+	fhok->object.nfs_fh4_len = NFS4_FHSIZE;
+	COMPOUNDV4_ARG_ADD_OP_GETFH(opcnt, argoparray);
+}
+
+/**
+ * Remember that the PUTFH at "op" puts "fh", which the dentry cache resolved
+ * from "comps" starting at "base" (the root if NULL).
+ */
+static void tc_dcache_note_putfh(int op, const nfs_fh4 *fh,
+				 const nfs_fh4 *base, const slice_t *comps,
+				 int compcnt)
+{
+	struct tc_dcache_putfh *p;
+
+	if (tc_dcache_putfhcnt == MAX_DCACHE_PUTFHS ||
+	    tc_dcache_compcnt + compcnt > MAX_NUM_OPS_PER_COMPOUND) {
+		return;
+	}
+	p = &tc_dcache_putfhs[tc_dcache_putfhcnt++];
+	p->op = op;
+	p->fh = fh->nfs_fh4_val;
+	if (base) {
+		p->base = *base;
+	} else {
+		p->base.nfs_fh4_val = NULL;
+		p->base.nfs_fh4_len = 0;
+	}
+	p->comp = tc_dcache_compcnt;
+	p->compcnt = compcnt;
+	memcpy(tc_dcache_comps + tc_dcache_compcnt, comps,
+	       compcnt * sizeof(slice_t));
+	tc_dcache_compcnt += compcnt;
+}
+
+static inline bool tc_is_dotdot(slice_t comp)
+{
+	return comp.size == 2 && comp.data[0] == '.' && comp.data[1] == '.';
+}
+
+/**
+ * Add LOOKUPs of the path components.  The filehandles of all but the last
+ * component, which are directories, are fetched for the dentry cache.
+ */
 static inline bool tc_prepare_lookups(slice_t *comps, int compcnt)
 {
         int i;
         bool r = true;
         int saved_opcnt = opcnt;
+        int last = compcnt - 1;
+
+        while (last >= 0 && tc_is_dot(comps[last]))
+                --last;
 
         for (i = 0; i < compcnt; ++i) {
-                if (comps[i].size == 0)
-                        continue;
-                if (comps[i].data[0] == '.' && comps[i].size == 1)
+                if (tc_is_dot(comps[i]))
                         continue;
                 if (!tc_has_enough_ops(1)) {
                         r = false;
@@ -1994,12 +3552,43 @@ static inline bool tc_prepare_lookups(slice_t *comps, int compcnt)
 			COMPOUNDV4_ARG_ADD_OP_LOOKUPNAME(opcnt, argoparray,
 							 comps[i].data,
 							 comps[i].size);
+			if (i < last)
+				tc_prepare_dcache_getfh();
 		}
 	}
         if (!r) opcnt = saved_opcnt;
         return r;
 }
 
+/**
+ * Resolve the leading components of "comps" starting from the directory
+ * "fh" using the dentry cache.  On return, "fh" is the filehandle of the
+ * longest cached prefix; the return value is the number of components in
+ * that prefix.
+ */
+static int tc_dcache_resolve(nfs_fh4 *fh, slice_t *comps, int compcnt)
+{
+	char buf[DCACHE_FHSIZE];
+	uint32_t len;
+	int i;
+	int n = 0;
+
+	for (i = 0; i < compcnt; ++i) {
+		if (tc_is_dot(comps[i]))
+			continue;
+		if (tc_is_dotdot(comps[i]) ||
+		    !nfs4_dcache_lookup(fh->nfs_fh4_val, fh->nfs_fh4_len,
+					comps[i], buf, &len)) {
+			break;
+		}
+		memcpy(fh->nfs_fh4_val, buf, len);
+		fh->nfs_fh4_len = len;
+		n = i + 1;
+	}
+
+	return n;
+}
+
 static slice_t tc_get_abspath_from_cwd(slice_t rel_path)
 {
         struct tc_cwd_data *cwd;
@@ -2033,14 +3622,32 @@ static bool tc_set_cfh_from_cfh(const char *path, slice_t *leaf)
 
 static bool tc_set_cfh_from_root(slice_t *comps, int compcnt)
 {
+        nfs_fh4 fh;
         int saved_opcnt = opcnt;
+        int n = 0;
         bool r;
 
         if (!tc_has_enough_ops(1)) return false;
-        COMPOUNDV4_ARG_ADD_OP_PUTROOTFH(opcnt, argoparray);
         comps[0].data++;  // skip the leading '/'
         comps[0].size--;
-        r = tc_prepare_lookups(comps, compcnt);
+
+        fh.nfs_fh4_val = NULL;
+        if (nfs4_dcache_enabled()) {
+                fh.nfs_fh4_val = tc_alloca(NFS4_FHSIZE);
+                if (fh.nfs_fh4_val &&
+                    !nfs4_dcache_get_root(fh.nfs_fh4_val, &fh.nfs_fh4_len)) {
+                        fh.nfs_fh4_val = NULL;
+                }
+        }
+        if (fh.nfs_fh4_val) {
+                n = tc_dcache_resolve(&fh, comps, compcnt);
+                if (tc_prepare_putfh(&fh))
+                        tc_dcache_note_putfh(opcnt - 1, &fh, NULL, comps, n);
+        } else {
+                COMPOUNDV4_ARG_ADD_OP_PUTROOTFH(opcnt, argoparray);
+                tc_prepare_dcache_getfh();
+        }
+        r = tc_prepare_lookups(comps + n, compcnt - n);
 
         if (!r) opcnt = saved_opcnt;
         return r;
@@ -2049,8 +3656,10 @@ static bool tc_set_cfh_from_root(slice_t *comps, int compcnt)
 static bool tc_set_cfh_from_cwd(slice_t *comps, int compcnt)
 {
         nfs_fh4 cwdfh;
+        nfs_fh4 base;
         struct tc_cwd_data *cwd;
         bool r;
+        int n = 0;
         int saved_opcnt = opcnt;
 
         if (!tc_has_enough_ops(1)) return false;
@@ -2061,8 +3670,18 @@ static bool tc_set_cfh_from_cwd(slice_t *comps, int compcnt)
 	memmove(cwdfh.nfs_fh4_val, cwd->fh.nfs_fh4_val, cwd->fh.nfs_fh4_len);
         tc_put_cwd(cwd);
 
-	tc_prepare_putfh(&cwdfh);
-        r = tc_prepare_lookups(comps, compcnt);
+        base = cwdfh;
+        if (nfs4_dcache_enabled()) {
+                base.nfs_fh4_val = tc_alloca(NFS4_FHSIZE);
+                if (base.nfs_fh4_val) {
+                        memcpy(base.nfs_fh4_val, cwdfh.nfs_fh4_val,
+                               cwdfh.nfs_fh4_len);
+                        n = tc_dcache_resolve(&cwdfh, comps, compcnt);
+                }
+        }
+	if (tc_prepare_putfh(&cwdfh) && n > 0)
+                tc_dcache_note_putfh(opcnt - 1, &cwdfh, &base, comps, n);
+        r = tc_prepare_lookups(comps + n, compcnt - n);
 
         if (!r) opcnt = saved_opcnt;
         return r;
@@ -2377,6 +3996,8 @@ static nfsstat4 get_nfs4_op_status(const nfs_resop4 *op_res)
                 return op_res->nfs_resop4_u.opdestroy_session.dsr_status;
         case NFS4_OP_FREE_STATEID: /* 45 */
                 return op_res->nfs_resop4_u.opfree_stateid.fsr_status;
+	case NFS4_OP_GET_DIR_DELEGATION: /* 46 */
+		return op_res->nfs_resop4_u.opget_dir_delegation.gddr_status;
         case NFS4_OP_SEQUENCE: /* 53 */
                 return op_res->nfs_resop4_u.opsequence.sr_status;
         case NFS4_OP_DESTROY_CLIENTID: /* 57 */
@@ -2386,31 +4007,356 @@ static nfsstat4 get_nfs4_op_status(const nfs_resop4 *op_res)
 	default:
 		NFS4_ERR("not supported operation: %d", op_res->resop);
 	}
-	return NFS4ERR_IO;
+	return NFS4ERR_IO;
+}
+
+static inline bool tc_prepare_rdwr(struct viovec *iov, bool write,
+				   bool need_close);
+
+static bool sca_open_file_if_necessary(const vfile *tcf, int flags,
+				      buf_t *pbuf_owner, fattr4 *attrs4,
+				      const vfile **opened_file);
+
+static inline OPEN4resok *tc_prepare_open(slice_t name, int flags,
+                                          buf_t *owner_pbuf, fattr4 *attrs);
+
+static inline GETFH4resok *tc_prepare_getfh(char *fh);
+
+static inline bool tc_prepare_close(seqid4 *seqid, stateid4 *sid);
+
+/**
+ * Set up the GETATTR operation.
+ */
+static inline GETATTR4resok *tc_prepare_getattr(char *fattr_blob,
+                                                const struct bitmap4 *bm4)
+{
+        GETATTR4resok *atok;
+
+        if (!tc_has_enough_ops(1)) return NULL;
+
+        atok = fs_fill_getattr_reply(resoparray + opcnt, fattr_blob,
+                                     FATTR_BLOB_SZ);
+        COMPOUNDV4_ARG_ADD_OP_GETATTR(opcnt, argoparray, *bm4);
+
+        return atok;
+}
+
+/*
+ * Readers close evicted files themselves when more than this many are waiting
+ * for the clientid renewer to close them.
+ */
+#define TC_OCACHE_CLOSE_BATCH 32
+
+/**
+ * Whether a file being read can be kept open in the open-file cache.  Only
+ * absolute paths are cached so that the key does not depend on the cwd.
+ */
+static inline bool tc_is_open_cacheable(const vfile *tcf)
+{
+	return nfs4_ocache_enabled() && tcf->type == VFILE_PATH &&
+	       tcf->path != NULL && tcf->path[0] == '/';
+}
+
+/**
+ * Whether the server can recall delegations from us, i.e., whether read
+ * delegations can be asked for.
+ */
+static inline bool fs_can_recall(void)
+{
+	return fs_delegations && atomic_fetch_uint8_t(&rpc_conns[0].backchan);
+}
+
+/**
+ * Likewise, whether directory delegations can be asked for, i.e., whether the
+ * server can notify us of the changes of the directories.
+ */
+static inline bool fs_can_notify(void)
+{
+	return nfs4_ddeleg_enabled() &&
+	       atomic_fetch_uint8_t(&rpc_conns[0].backchan);
+}
+
+/* Files of the open-file cache used by one compound of reads. */
+struct tc_read_opens {
+	const char *cur_path;		/* path of the cached file set as CFH */
+	struct nfs4_open_file *cur;	/* NULL if opened by this compound */
+	int nfiles;
+	struct nfs4_open_file **files;	/* to be released after the compound */
+	int nopens;
+	const char **opens;		/* paths opened by this compound */
+};
+
+/**
+ * Set up a READ of "iov" whose file is either found in the open-file cache,
+ * in which case it is read with the cached stateid after a PUTFH, or opened
+ * (followed by a GETFH) and added to the cache after the compound; see
+ * tc_cache_read_opens().  "*of" is set to the cached file used, if any.
+ */
+static bool tc_prepare_cached_read(struct viovec *iov, struct tc_read_opens *ro,
+				   const vfile **opened_file,
+				   struct nfs4_open_file **of)
+{
+	const char *path = iov->file.path;
+	struct nfs4_open_file *f = NULL;
+	stateid4 *sid;
+	nfs_fh4 fh;
+	slice_t name;
+	char *fhbuf;
+
+	if (!ro->cur_path || strcmp(ro->cur_path, path) != 0) {
+		if (*opened_file) {
+			if (!tc_prepare_close(NULL, NULL))
+				return false;
+			*opened_file = NULL;
+		}
+		f = nfs4_ocache_get(path);
+		if (f) {
+			ro->files[ro->nfiles++] = f;
+			/* "f" is referenced until the compound is done. */
+			fh.nfs_fh4_val = f->fh;
+			fh.nfs_fh4_len = f->fh_len;
+			if (!tc_prepare_putfh(&fh))
+				return false;
+		} else {
+			fhbuf = tc_alloca(NFS4_FHSIZE);
+			if (!fhbuf || !tc_set_current_fh(&iov->file, &name, true) ||
+			    !tc_prepare_open(name, O_RDONLY, tc_auto_buf(64),
+					     NULL)) {
+				return false;
+			}
+			if (fs_can_recall()) {
+				argoparray[opcnt - 1].nfs_argop4_u.opopen
+				    .share_access =
+				    OPEN4_SHARE_ACCESS_READ |
+				    OPEN4_SHARE_ACCESS_WANT_READ_DELEG;
+			}
+			if (!tc_prepare_getfh(fhbuf)) {
+				return false;
+			}
+			ro->opens[ro->nopens++] = path;
+		}
+		ro->cur_path = path;
+		ro->cur = f;
+	}
+
+	if (!tc_prepare_rdwr(iov, false, false))
+		return false;
+	if (ro->cur) {
+		sid = &argoparray[opcnt - 1].nfs_argop4_u.opread.stateid;
+		sid->seqid = ro->cur->sid_seqid;
+		memcpy(sid->other, ro->cur->sid_other, sizeof(sid->other));
+	}
+	*of = ro->cur;
+
+	return true;
 }
 
-static inline bool tc_prepare_rdwr(struct viovec *iov, bool write,
-				   bool need_close);
+/**
+ * Add files opened by tc_prepare_cached_read() to the open-file cache.  They
+ * are the OPENs followed by a GETFH; other OPENs are closed in the compound.
+ */
+static void tc_cache_read_opens(struct tc_read_opens *ro)
+{
+	OPEN4resok *opok;
+	open_delegation4 *deleg;
+	nfs_fh4 *fh;
+	int j;
+	int k = 0;
 
-static bool sca_open_file_if_necessary(const vfile *tcf, int flags,
-				      buf_t *pbuf_owner, fattr4 *attrs4,
-				      const vfile **opened_file);
+	for (j = 0; j < opcnt && k < ro->nopens; ++j) {
+		if (get_nfs4_op_status(&resoparray[j]) != NFS4_OK)
+			break;
+		if (resoparray[j].resop != NFS4_OP_OPEN || j + 1 == opcnt ||
+		    argoparray[j + 1].argop != NFS4_OP_GETFH) {
+			continue;
+		}
+		if (get_nfs4_op_status(&resoparray[j + 1]) != NFS4_OK)
+			break;
+		opok = &resoparray[j].nfs_resop4_u.opopen.OPEN4res_u.resok4;
+		fh = &resoparray[j + 1]
+			  .nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
+		deleg = &opok->delegation;
+		if (deleg->delegation_type == OPEN_DELEGATE_READ) {
+			nfs4_ocache_add(
+			    ro->opens[k++], fh->nfs_fh4_val, fh->nfs_fh4_len,
+			    opok->stateid.seqid, opok->stateid.other,
+			    deleg->open_delegation4_u.read.stateid.seqid,
+			    deleg->open_delegation4_u.read.stateid.other);
+			xdr_free((xdrproc_t)xdr_nfsace4,
+				 &deleg->open_delegation4_u.read.permissions);
+		} else {
+			nfs4_ocache_add(ro->opens[k++], fh->nfs_fh4_val,
+					fh->nfs_fh4_len, opok->stateid.seqid,
+					opok->stateid.other, 0, NULL);
+		}
+	}
+}
+
+static void tc_release_read_opens(struct tc_read_opens *ro)
+{
+	while (ro->nfiles > 0) {
+		nfs4_ocache_put(ro->files[--ro->nfiles]);
+	}
+	ro->cur_path = NULL;
+	ro->cur = NULL;
+	ro->nopens = 0;
+}
 
 /**
- * Set up the GETATTR operation.
+ * Errors after which the state of a cached open file cannot be used again.
  */
-static inline GETATTR4resok *tc_prepare_getattr(char *fattr_blob,
-                                                const struct bitmap4 *bm4)
+static inline bool tc_is_bad_open_state(nfsstat4 st)
 {
-        GETATTR4resok *atok;
+	return st == NFS4ERR_BAD_STATEID || st == NFS4ERR_OLD_STATEID ||
+	       st == NFS4ERR_EXPIRED || st == NFS4ERR_ADMIN_REVOKED ||
+	       st == NFS4ERR_DELEG_REVOKED || st == NFS4ERR_STALE ||
+	       st == NFS4ERR_FHEXPIRED;
+}
 
-        if (!tc_has_enough_ops(1)) return NULL;
+static inline void tc_prepare_delegreturn(const stateid4 *sid)
+{
+	nfs_argop4 *op = argoparray + opcnt++;
 
-        atok = fs_fill_getattr_reply(resoparray + opcnt, fattr_blob,
-                                     FATTR_BLOB_SZ);
-        COMPOUNDV4_ARG_ADD_OP_GETATTR(opcnt, argoparray, *bm4);
+	op->argop = NFS4_OP_DELEGRETURN;
+	op->nfs_argop4_u.opdelegreturn.deleg_stateid = *sid;
+}
 
-        return atok;
+/**
+ * Close the files evicted from the open-file cache, and return their
+ * delegations.  This sends its own compounds, so it must not be called while
+ * a compound is being set up.
+ */
+static void tc_close_cached_files(void)
+{
+	/* PUTFH, DELEGRETURN, and CLOSE of each file */
+	struct nfs4_open_file *files[MAX_NUM_OPS_PER_COMPOUND / 3 - 1];
+	int first_ops[ARRAY_SIZE(files)];
+	nfs_fh4 fh;
+	stateid4 sid;
+	seqid4 seqid = 0;
+	nfsstat4 op_status;
+	int n, i, j, k;
+	int st;
+	int rc;
+
+	while ((n = nfs4_ocache_pop_closing(files, ARRAY_SIZE(files))) > 0) {
+		i = 0;
+		while (i < n) {
+			vreset_compound(true);
+			for (j = i; j < n; ++j) {
+				first_ops[j] = opcnt;
+				fh.nfs_fh4_val = files[j]->fh;
+				fh.nfs_fh4_len = files[j]->fh_len;
+				tc_prepare_putfh(&fh);
+				if (files[j]->deleg) {
+					sid.seqid = files[j]->deleg_seqid;
+					memcpy(sid.other, files[j]->deleg_other,
+					       sizeof(sid.other));
+					tc_prepare_delegreturn(&sid);
+				}
+				sid.seqid = files[j]->sid_seqid;
+				memcpy(sid.other, files[j]->sid_other,
+				       sizeof(sid.other));
+				tc_prepare_close(&seqid, &sid);
+			}
+			rc = fs_nfsv4_call(op_ctx->creds, &st);
+			if (rc != RPC_SUCCESS) {
+				NFS4_ERR("failed to close cached files: %d",
+					 rc);
+				break;
+			}
+			if (st == 0)
+				break;
+			/* skip the file failed to close, and close the rest */
+			for (j = 0; j < opcnt; ++j) {
+				op_status = get_nfs4_op_status(&resoparray[j]);
+				if (op_status != NFS4_OK)
+					break;
+			}
+			if (j == 0 || j == opcnt)
+				break;
+			for (k = i; k + 1 < n && first_ops[k + 1] <= j; ++k)
+				;
+			if (resoparray[j].resop == NFS4_OP_DELEGRETURN) {
+				/* e.g., revoked; the file still needs closing */
+				NFS4_DEBUG("cannot return delegation of %s: %d",
+					   files[k]->path, op_status);
+				files[k]->deleg = false;
+				i = k;
+				continue;
+			}
+			NFS4_DEBUG("cannot close %s: %d", files[k]->path,
+				   op_status);
+			i = k + 1;
+		}
+		for (i = 0; i < n; ++i) {
+			free(files[i]);
+		}
+	}
+}
+
+/**
+ * Return the directory delegations recalled or dropped.  Like
+ * tc_close_cached_files(), this sends its own compounds.
+ */
+static void tc_return_dir_delegations(void)
+{
+	/* PUTFH and DELEGRETURN of each directory */
+	struct nfs4_dir_deleg *dirs[MAX_NUM_OPS_PER_COMPOUND / 2 - 1];
+	nfs_fh4 fh;
+	stateid4 sid;
+	int n, i, j;
+	int st;
+	int rc;
+
+	while ((n = nfs4_ddeleg_pop_returning(dirs, ARRAY_SIZE(dirs))) > 0) {
+		i = 0;
+		while (i < n) {
+			vreset_compound(true);
+			for (j = i; j < n; ++j) {
+				fh.nfs_fh4_val = dirs[j]->fh;
+				fh.nfs_fh4_len = dirs[j]->fh_len;
+				tc_prepare_putfh(&fh);
+				sid.seqid = dirs[j]->sid_seqid;
+				memcpy(sid.other, dirs[j]->sid_other,
+				       sizeof(sid.other));
+				tc_prepare_delegreturn(&sid);
+			}
+			rc = fs_nfsv4_call(op_ctx->creds, &st);
+			if (rc != RPC_SUCCESS) {
+				NFS4_ERR("failed to return dir delegations: %d",
+					 rc);
+				break;
+			}
+			if (st == 0)
+				break;
+			/* skip the one failed, e.g., revoked, and go on */
+			for (j = 0; j < opcnt; ++j) {
+				if (get_nfs4_op_status(&resoparray[j]) !=
+				    NFS4_OK)
+					break;
+			}
+			if (j == 0 || j == opcnt)
+				break;
+			NFS4_DEBUG("cannot return delegation of %s",
+				   dirs[i + (j - 1) / 2]->path);
+			i += (j - 1) / 2 + 1;
+		}
+		for (i = 0; i < n; ++i) {
+			free(dirs[i]);
+		}
+	}
+}
+
+/**
+ * Drop the cached open of "file" if it holds a delegation, which we return
+ * before modifying the file, or the server would have to recall it first.
+ * Returns whether tc_close_cached_files() is to be called to return it.
+ */
+static bool tc_drop_deleg(const vfile *file)
+{
+	return fs_delegations && tc_is_open_cacheable(file) &&
+	       nfs4_ocache_return_deleg(file->path);
 }
 
 /**
@@ -2421,6 +4367,10 @@ static inline GETATTR4resok *tc_prepare_getattr(char *fattr_blob,
  * close, vres.index  would only point to the read call because it is unaware
  * of the putrootfh, lookup, open or close.
  * Caller has to make sure iovs and fields inside are allocated and freed.
+ *
+ * Files read by absolute paths are kept open in the open-file cache, and are
+ * read by PUTFH and READ with the cached stateids later.  If a cached state
+ * turns out to be invalid, the state is dropped and the reads are retried.
  */
 static vres tc_nfs4_readv(struct viovec *iovs, int count,
 			    struct vattrs *attrs)
@@ -2435,26 +4385,58 @@ static vres tc_nfs4_readv(struct viovec *iovs, int count,
         bool r;
         int saved_opcnt;
         const vfile *saved_file;
+	struct tc_read_opens ro = { 0 };
+	struct tc_read_opens saved_ro;
+	struct nfs4_open_file **iov_files = NULL;
+	bool retried = false;
+	const int total = count;
 	char *fattr_blobs;
 	fattr_blobs = (char *)malloc(count * FATTR_BLOB_SZ);
 	int attr_count = 0;
 
 	LogDebug(COMPONENT_FSAL, "ktcread() called\n");
 
+	if (nfs4_ocache_enabled()) {
+		iov_files = calloc(count, sizeof(*iov_files));
+		ro.files = calloc(count, sizeof(*ro.files));
+		ro.opens = calloc(count, sizeof(*ro.opens));
+		if (!iov_files || !ro.files || !ro.opens) {
+			free(iov_files);
+			free(ro.files);
+			free(ro.opens);
+			iov_files = NULL;
+			ro.files = NULL;
+			ro.opens = NULL;
+		}
+	}
+
+again:
         vreset_compound(true);
 
 	for (i = 0; i < count; ++i) {
 		saved_opcnt = opcnt;
 		saved_file = opened_file;
-		r = sca_open_file_if_necessary(&iovs[i].file, O_RDONLY,
-					       tc_auto_buf(64), NULL,
-					       &opened_file) &&
-		    tc_prepare_rdwr(&iovs[i], false, opened_file != NULL) &&
-		    tc_prepare_getattr(fattr_blobs + i * FATTR_BLOB_SZ,
-				       &fs_bitmap_getattr);
+		saved_ro = ro;
+		if (ro.files && tc_is_open_cacheable(&iovs[i].file)) {
+			r = tc_prepare_cached_read(&iovs[i], &ro, &opened_file,
+						   &iov_files[i]);
+		} else {
+			ro.cur_path = NULL;
+			ro.cur = NULL;
+			r = sca_open_file_if_necessary(&iovs[i].file, O_RDONLY,
+						       tc_auto_buf(64), NULL,
+						       &opened_file) &&
+			    tc_prepare_rdwr(&iovs[i], false,
+					    opened_file != NULL);
+		}
+		r = r && tc_prepare_getattr(fattr_blobs + i * FATTR_BLOB_SZ,
+					    &fs_bitmap_getattr);
 		if (!r || !tc_has_enough_ops(1)) { // reserve for CLOSE
 			opcnt = saved_opcnt;
 			opened_file = saved_file;
+			/* keep the references taken for the rolled-back one */
+			saved_ro.nfiles = ro.nfiles;
+			ro = saved_ro;
 			count = i;
 			break;
 		}
@@ -2471,12 +4453,34 @@ static vres tc_nfs4_readv(struct viovec *iovs, int count,
                 tcres = vfailure(0, rc);
                 goto exit;
         }
+	if (ro.nopens > 0) {
+		tc_cache_read_opens(&ro);
+	}
 
         /* No matter NFS failed or succeeded, we need to fill in results */
         i = 0;
         for (j = 0; j < opcnt; ++j) {
                 op_status = get_nfs4_op_status(&resoparray[j]);
                 if (op_status != NFS4_OK) {
+			if (iov_files && iov_files[i] && !retried &&
+			    tc_is_bad_open_state(op_status)) {
+				NFS4_DEBUG("dropping open state of %s: %d",
+					   iov_files[i]->path, op_status);
+				nfs4_ocache_drop(iov_files[i]);
+				tc_release_read_opens(&ro);
+				memset(iov_files, 0,
+				       total * sizeof(*iov_files));
+				retried = true;
+				count = total;
+				attr_count = 0;
+				goto again;
+			}
+			if (ro.files && resoparray[j].resop == NFS4_OP_OPEN &&
+			    (op_status == NFS4ERR_RESOURCE ||
+			     op_status == NFS4ERR_DELAY)) {
+				/* the server may be short of open states */
+				nfs4_ocache_shrink();
+			}
 			iovs[i].is_failure = 1;
 			NFS4_ERR("the %d-th viovec failed (NFS op: %d)", i,
 				 resoparray[j].resop);
@@ -2501,6 +4505,15 @@ static vres tc_nfs4_readv(struct viovec *iovs, int count,
 	}
 
 exit:
+	if (ro.files) {
+		tc_release_read_opens(&ro);
+		free(ro.files);
+		free(ro.opens);
+		free(iov_files);
+		if (nfs4_ocache_closing_count() >= TC_OCACHE_CLOSE_BATCH) {
+			tc_close_cached_files();
+		}
+	}
 	free(fattr_blobs);
         return tcres;
 }
@@ -2572,6 +4585,18 @@ static vres tc_nfs4_writev(struct viovec *iovs, int count,
 
 	LogDebug(COMPONENT_FSAL, "ktcwrite() called\n");
 
+	/*
+	 * Return our own delegations of the files first, or the server would
+	 * have to recall them before letting us write.
+	 */
+	r = false;
+	for (i = 0; i < count; ++i) {
+		if (tc_drop_deleg(&iovs[i].file))
+			r = true;
+	}
+	if (r)
+		tc_close_cached_files();
+
         vreset_compound(true);
 
 	input_attr = calloc(count, sizeof(fattr4));
@@ -2747,7 +4772,8 @@ static inline OPEN4resok *tc_prepare_open(slice_t name, int flags,
 	argoparray[opcnt].argop = NFS4_OP_OPEN;
 	args = &argoparray[opcnt].nfs_argop4_u.opopen;
 	args->seqid = 0;
-	args->share_access = sca_open_flags_to_access(flags);
+	args->share_access =
+	    sca_open_flags_to_access(flags) | OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
 	args->share_deny = OPEN4_SHARE_DENY_NONE;
 
 	args->owner.clientid = cid;
@@ -2769,6 +4795,12 @@ static inline OPEN4resok *tc_prepare_open(slice_t name, int flags,
 	args->claim.open_claim4_u.file.utf8string_len = name.size;
 
 	opok = &resoparray[opcnt].nfs_resop4_u.opopen.OPEN4res_u.resok4;
+	/* a granted delegation comes with an ACE allocated by the decoder */
+	opok->delegation.delegation_type = OPEN_DELEGATE_NONE;
+	opok->delegation.open_delegation4_u.read.permissions.who
+	    .utf8string_val = NULL;
+	opok->delegation.open_delegation4_u.write.permissions.who
+	    .utf8string_val = NULL;
 	opcnt += 1;
 
 	return opok;
@@ -2789,6 +4821,32 @@ static inline READDIR4resok *tc_prepare_readdir(nfs_cookie4 *cookie,
 	return rdok;
 }
 
+/* The changes of a delegated directory that keep its listing up to date. */
+static const uint32_t tc_dir_notifications =
+    (1U << NOTIFY4_CHANGE_CHILD_ATTRS) | (1U << NOTIFY4_REMOVE_ENTRY) |
+    (1U << NOTIFY4_ADD_ENTRY) | (1U << NOTIFY4_RENAME_ENTRY);
+
+/**
+ * Ask for the delegation of the current directory, with notifications of the
+ * changes of its entries, including the attributes "attrbm" of the entries.
+ */
+static inline GET_DIR_DELEGATION4res *
+tc_prepare_get_dir_delegation(const struct bitmap4 *attrbm)
+{
+	GET_DIR_DELEGATION4args *args;
+
+	if (!tc_has_enough_ops(1)) return NULL;
+	args = &argoparray[opcnt].nfs_argop4_u.opget_dir_delegation;
+	memset(args, 0, sizeof(*args));
+	args->gdda_signal_deleg_avail = false;
+	args->gdda_notification_types.map[0] = tc_dir_notifications;
+	args->gdda_notification_types.bitmap4_len = 1;
+	args->gdda_child_attributes = *attrbm;
+	argoparray[opcnt].argop = NFS4_OP_GET_DIR_DELEGATION;
+
+	return &resoparray[opcnt++].nfs_resop4_u.opget_dir_delegation;
+}
+
 static inline REMOVE4resok *tc_prepare_remove(char *name)
 {
         REMOVE4resok *rmok;
@@ -3755,13 +5813,19 @@ static void set_mode_type(mode_t *mode, object_file_type_t type)
 	}
 }
 
-void fattr4_to_vattrs(const fattr4 *attr4, struct vattrs *tca)
+/**
+ * Decode "attr4" into "tca", and FATTR4_FILEHANDLE, if any, into "fh" unless
+ * it is NULL.  The buffer of "fh" should have NFS4_FHSIZE bytes; its length
+ * is left untouched if "attr4" has no filehandle.
+ */
+static void fattr4_to_vattrs_fh(const fattr4 *attr4, struct vattrs *tca,
+				nfs_fh4 *fh)
 {
         struct attrlist attrlist;
 
         /* FIXME: void the const cast */
-	if (nfs4_Fattr_To_FSAL_attr(&attrlist, (fattr4 *)attr4, NULL) !=
-	    NFS4_OK) {
+	if (nfs4_Fattr_To_FSAL_attr_fh(&attrlist, (fattr4 *)attr4, fh,
+				       NULL) != NFS4_OK) {
 		NFS4_ERR("cannot decode NFS attributes");
                 assert(false);
         }
@@ -3807,6 +5871,9 @@ void fattr4_to_vattrs(const fattr4 *attr4, struct vattrs *tca)
                 tca->masks.has_ctime = true;
                 tca->ctime = attrlist.ctime;
         }
+        if (attrlist.mask & ATTR_CHANGE) {
+                vattrs_set_change(tca, attrlist.change);
+        }
         if (attrlist.mask & ATTR_SPACEUSED) {
                 tca->masks.has_blocks = true;
                 tca->blocks = attrlist.spaceused / 512;
@@ -3815,6 +5882,11 @@ void fattr4_to_vattrs(const fattr4 *attr4, struct vattrs *tca)
         set_mode_type(&tca->mode, attrlist.type);
 }
 
+void fattr4_to_vattrs(const fattr4 *attr4, struct vattrs *tca)
+{
+	fattr4_to_vattrs_fh(attr4, tca, NULL);
+}
+
 static bool sca_open_file_if_necessary(const vfile *tcf, int flags,
 				      buf_t *pbuf_owner, fattr4 *attrs4,
 				      const vfile **opened_file)
@@ -4113,6 +6185,16 @@ static vres tc_nfs4_lsetattrsv(struct vattrs *attrs, int count)
 	int saved_opcnt;
 
 	NFS4_DEBUG("tc_nfs4_lsetattrsv");
+
+	/* see tc_nfs4_writev() */
+	r = false;
+	for (i = 0; i < count; ++i) {
+		if (tc_drop_deleg(&attrs[i].file))
+			r = true;
+	}
+	if (r)
+		tc_close_cached_files();
+
 	vreset_compound(true);
 	fattrs = calloc(count, sizeof(fattr4));
 	fattr_blobs = malloc(count * FATTR_BLOB_SZ);
@@ -4280,6 +6362,7 @@ struct tc_dir_to_list {
 	int origin_index; /* index of the dir that this dir originate from */
 	int nchildren;
         bool need_free_path;
+	bool no_deleg;	/* do not ask for its delegation (again) */
 };
 
 struct nfsoparray {
@@ -4317,6 +6400,7 @@ enqueue_dir_to_list(struct glist_head *dir_queue, const char *path, int index,
 	dle->fh.nfs_fh4_len = 0;
 	dle->origin_index = index;
 	dle->nchildren = 0;
+	dle->no_deleg = false;
 	glist_add_tail(dir_queue, &dle->list);
 
 	return dle;
@@ -4334,69 +6418,146 @@ static inline void dequeue_dir_to_list(struct glist_head *dir_queue)
 	free(dle);
 }
 
-static int tc_parse_dir_entries(struct glist_head *dir_queue,
+static inline bool tc_is_dot_entry(const entry4 *entry)
+{
+	// Occasionally but mostly not, NFS-Ganesha server lists "..".
+	// Ignore it as well as ".".
+	return strncmp("..", entry->name.utf8string_val,
+		       entry->name.utf8string_len) == 0;
+}
+
+/**
+ * Pass the entries of a READDIR reply of "parent" to "cb" as one batch.  The
+ * paths of the batch are put in one arena freed once "cb" returns, so the
+ * subdirectories to be listed get their own copies of their paths.
+ *
+ * Returns the number of entries listed; "*limit" becomes 0 if "cb" asks to
+ * stop.
+ */
+static int tc_parse_dir_entries(struct glist_head *subdir_queue,
 				struct tc_dir_to_list *parent,
 				const entry4 *entries, int *limit,
                                 bool recursive, bool has_mode,
-                                vec_listdir_cb cb, void *cbarg)
+                                vec_listdir_batch_cb cb, void *cbarg)
 {
+	const entry4 *e;
 	bool success;
-	char *path;
+	char *arena;
+	size_t arena_size = 0;
+	size_t arena_used = 0;
+	size_t parent_len = strlen(parent->path);
 	buf_t buf;
 	int ret;
-	struct vattrs attrs;
+	struct vattrs *batch;
+	struct tc_dir_to_list *subdir;
+	char fhbuf[NFS4_FHSIZE];
+	nfs_fh4 fh;
+	slice_t name;
 	int n = 0;
+	int i;
         TC_DECLARE_COUNTER(listdircb);
 
-	while (entries && (*limit == -1 || *limit > 0)) {
-		// Occasionally but mostly not, NFS-Ganesha server lists "..".
-		// Ignore it as well as ".".
-		if (strncmp("..", entries->name.utf8string_val,
-			    entries->name.utf8string_len) == 0) {
-			parent->cookie = entries->cookie;
-			entries = entries->nextentry;
+	if (*limit == 0) {
+		return 0;
+	}
+
+	for (e = entries; e && (*limit == -1 || n < *limit); e = e->nextentry) {
+		if (!tc_is_dot_entry(e)) {
+			arena_size += parent_len + e->name.utf8string_len + 2;
+			++n;
+		}
+	}
+	if (n == 0) {
+		/* only "." and ".." */
+		for (e = entries; e; e = e->nextentry) {
+			parent->cookie = e->cookie;
+		}
+		return 0;
+	}
+
+	batch = malloc(n * sizeof(*batch));
+	arena = malloc(arena_size);
+	if (!batch || !arena) {
+		free(batch);
+		free(arena);
+		return -ENOMEM;
+	}
+
+	for (i = 0, e = entries; i < n; e = e->nextentry) {
+		parent->cookie = e->cookie;
+		if (tc_is_dot_entry(e)) {
 			continue;
 		}
-		path = malloc(PATH_MAX);
-		buf = mkbuf(path, PATH_MAX);
-		ret = tc_path_join_s(toslice(parent->path),
-				     mkslice(entries->name.utf8string_val,
-					     entries->name.utf8string_len),
-				     &buf);
+		name = mkslice(e->name.utf8string_val, e->name.utf8string_len);
+		buf = mkbuf(arena + arena_used, arena_size - arena_used);
+		ret = tc_path_join_s(toslice(parent->path), name, &buf);
 		assert(ret > 0);
-		attrs.file = vfile_from_path(asstr(&buf));
-		fattr4_to_vattrs(&entries->attrs, &attrs);
-                attrs.masks.has_mode = has_mode;
-
-		TC_START_COUNTER(listdircb);
-		success = cb(&attrs, parent->path, cbarg);
-                TC_STOP_COUNTER(listdircb, 1, success);
+		batch[i].file = vfile_from_path(asstr(&buf));
+		arena_used += buf.size + 1;
+		fh.nfs_fh4_val = fhbuf;
+		fh.nfs_fh4_len = 0;
+		fattr4_to_vattrs_fh(&e->attrs, &batch[i], &fh);
+		batch[i].masks.has_mode = has_mode;
+
+		/* Later operations on the entry by path, e.g., from "cb",
+		 * then start from its handle instead of LOOKUPs. */
+		if (fh.nfs_fh4_len > 0 && parent->fh.nfs_fh4_len > 0) {
+			nfs4_dcache_add(parent->fh.nfs_fh4_val,
+					parent->fh.nfs_fh4_len, name,
+					fh.nfs_fh4_val, fh.nfs_fh4_len);
+		}
 
-		if (!success) {
-			free(path);
-			return -1;
+		if (recursive && S_ISDIR(batch[i].mode)) {
+			subdir = enqueue_dir_to_list(subdir_queue,
+						     strdup(batch[i].file.path),
+						     parent->origin_index, true);
+			/* only the listings of the given dirs are cached */
+			subdir->no_deleg = true;
+			/* list it with PUTFH instead of walking "path" */
+			if (fh.nfs_fh4_len > 0) {
+				memcpy(subdir->fhbuf, fh.nfs_fh4_val,
+				       fh.nfs_fh4_len);
+				subdir->fh.nfs_fh4_val = subdir->fhbuf;
+				subdir->fh.nfs_fh4_len = fh.nfs_fh4_len;
+			}
 		}
+		++i;
+	}
 
-		if (recursive && S_ISDIR(attrs.mode)) {
-			enqueue_dir_to_list(dir_queue, path,
-					    parent->origin_index, true);
-		} else {
-                        free(path);
-                }
+	TC_START_COUNTER(listdircb);
+	success = cb(batch, n, parent->path, cbarg);
+	TC_STOP_COUNTER(listdircb, n, success);
 
-		parent->cookie = entries->cookie;
-		entries = entries->nextentry;
-		++n;
-		if (*limit != -1) {
-			--*limit;
-                }
+	free(arena);
+	free(batch);
+
+	if (!success) {
+		*limit = 0;
+	} else if (*limit != -1) {
+		*limit -= n;
 	}
 	return n;
 }
 
-static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
-                             struct vattrs_masks masks, bool recursive,
-			     vec_listdir_cb cb, void *cbarg)
+#define TC_MAX_READDIRS_PER_COMPOUND 64
+
+/**
+ * List the directories in "dir_queue" with one compound, and enqueue the
+ * subdirectories found into "subdir_queue" if "recursive".
+ *
+ * If "lock" is NULL, the replies are processed in order, and processing stops
+ * at the first directory not listed to the end, so that the callbacks of a
+ * directory never come after those of a later one.  Otherwise, the compound
+ * runs in parallel with those of other threads, the replies are processed
+ * with "lock" held (so that "cb" is never called concurrently), and
+ * directories not listed to the end are left in "dir_queue" to be continued
+ * later; "lock" is still held on return.
+ */
+static vres tc_do_listdirv(struct glist_head *dir_queue,
+			   struct glist_head *subdir_queue, int *limit,
+                           struct vattrs_masks masks, bool recursive,
+			   vec_listdir_batch_cb cb, void *cbarg,
+			   pthread_mutex_t *lock)
 {
 	struct tc_dir_to_list *next_dle;
 	struct tc_dir_to_list *dle;
@@ -4404,11 +6565,14 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 	vres tcres;
 	nfsstat4 op_status;
 	READDIR4resok *rdok;
+	GET_DIR_DELEGATION4res_non_fatal *gddres;
+	GET_DIR_DELEGATION4resok *gddok;
 	int i = 0, j;
 	int rc;
-	static const int MAX_READDIRS_PER_COMPOUND = 64;
+	bool locked = false;
         bool has_mode = masks.has_mode;
         bitmap4 bitmap = fs_bitmap_readdir;
+	bitmap4 rdbitmap;
         slice_t name;
         bool r;
         int saved_opcnt;
@@ -4417,6 +6581,10 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 
         masks.has_mode = true;  // to detect directory
         tc_attr_masks_to_bitmap(&masks, &bitmap);
+	/* to reach subdirectories and seed the dentry cache; notifications
+	 * of delegated directories need not carry handles */
+	rdbitmap = bitmap;
+	rdbitmap.map[0] |= 1U << FATTR4_FILEHANDLE;
 
         NFS4_INFO("starting listdir with a limit of %d entries", *limit);
 	glist_for_each_entry(dle, dir_queue, list)
@@ -4429,9 +6597,14 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 		} else {
 			r = tc_prepare_putfh(&dle->fh);
 		}
+		/* keep the listing up to date as long as it is cached */
+		if (r && dle->cookie == 0 && !dle->no_deleg &&
+		    fs_can_notify() && nfs4_ddeleg_wanted(dle->path)) {
+			r = tc_prepare_get_dir_delegation(&bitmap);
+		}
                 NFS4_INFO("dir (%p) %s added at %d", dle, dle->path, opcnt);
-		r = r && tc_prepare_readdir(&dle->cookie, &bitmap);
-		if (++i >= MAX_READDIRS_PER_COMPOUND || !r) {
+		r = r && tc_prepare_readdir(&dle->cookie, &rdbitmap);
+		if (++i >= TC_MAX_READDIRS_PER_COMPOUND || !r) {
 			opcnt = saved_opcnt;
 			break;
 		}
@@ -4443,7 +6616,10 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 	if (rc != RPC_SUCCESS) {
 		NFS4_ERR("rpc failed: %d", rc);
 		tcres = vfailure(0, rc);
-		goto exit;
+		if (lock) {
+			pthread_mutex_lock(lock);
+		}
+		return tcres;
 	}
 
         /* Make a copy of argoparray and resoparray so that they can be reused
@@ -4453,11 +6629,28 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
         nfsops.argoparray = memdup(argoparray, opcnt * sizeof(nfs_argop4));
         nfsops.resoparray = memdup(resoparray, opcnt * sizeof(nfs_resop4));
 
+	if (lock) {
+		pthread_mutex_lock(lock);
+		locked = true;
+	}
+
         NFS4_INFO("starting processing %d listdirv ops", nfsops.opcnt);
 	dle = glist_first_entry(dir_queue, struct tc_dir_to_list, list);
 	i = 0;
 	for (j = 0; j < nfsops.opcnt; ++j) {
 		op_status = get_nfs4_op_status(nfsops.resoparray + j);
+		if (op_status != NFS4_OK && nfsops.resoparray[j].resop ==
+						NFS4_OP_GET_DIR_DELEGATION) {
+			/* list the rest in another compound without it */
+			NFS4_DEBUG("no delegation of %s: %d", dle->path,
+				   op_status);
+			if (op_status == NFS4ERR_NOTSUPP)
+				nfs4_ddeleg_deinit();
+			dle->no_deleg = true;
+			tcres.err_no = 0;
+			tcres.index = i;
+			goto exit;
+		}
 		if (op_status != NFS4_OK) {
 			NFS4_ERR("%d-th NFS operation (%d) failed: %d",
 				 j, nfsops.resoparray[j].resop, op_status);
@@ -4470,17 +6663,37 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 			    nfsops.resoparray[j]
 				.nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
 			break;
+		case NFS4_OP_GET_DIR_DELEGATION:
+			gddres = &nfsops.resoparray[j]
+				      .nfs_resop4_u.opget_dir_delegation
+				      .GET_DIR_DELEGATION4res_u
+				      .gddr_res_non_fatal4;
+			if (gddres->gddrnf_status != GDD4_OK)
+				break;
+			gddok = &gddres->GET_DIR_DELEGATION4res_non_fatal_u
+				     .gddrnf_resok4;
+			nfs4_ddeleg_add(dle->path, dle->fh.nfs_fh4_val,
+					dle->fh.nfs_fh4_len,
+					gddok->gddr_stateid.seqid,
+					gddok->gddr_stateid.other);
+			if (gddok->gddr_notification.bitmap4_len < 1 ||
+			    (gddok->gddr_notification.map[0] &
+			     tc_dir_notifications) != tc_dir_notifications) {
+				/* useless if some changes are not notified */
+				nfs4_ddeleg_recall(gddok->gddr_stateid.other);
+			}
+			break;
 		case NFS4_OP_READDIR:
                         NFS4_INFO("op-%d is READDIR to %s", j, dle->path);
 			rdok =
 			    &nfsops.resoparray[j]
 				 .nfs_resop4_u.opreaddir.READDIR4res_u.resok4;
 			rc = tc_parse_dir_entries(
-			    dir_queue, dle, rdok->reply.entries, limit,
+			    subdir_queue, dle, rdok->reply.entries, limit,
 			    recursive, has_mode, cb, cbarg);
 			if (rc < 0) {
                                 NFS4_ERR("failed to listdir %s", dle->path);
-				tcres = vfailure(i, rc);
+				tcres = vfailure(i, -rc);
 				goto exit;
 			}
 			dle->nchildren += rc;
@@ -4494,6 +6707,11 @@ static vres tc_do_listdirv(struct glist_head *dir_queue, int *limit,
 					free((char *)dle->path);
 				}
 				free(dle);
+			} else if (locked) {
+				/* continued by a later compound */
+				NFS4_INFO(
+				    "partial listing of %s (%d listed) (%p)",
+				    dle->path, dle->nchildren, dle);
 			} else {
 				/* To avoid out-of-order callbacks, we stop
 				 * processing the directories after the first
@@ -4527,8 +6745,140 @@ exit:
 	return tcres;
 }
 
+/**
+ * A listdir walked by several threads, each with a compound in flight.
+ */
+struct tc_listdir_walk {
+	pthread_mutex_t lock;	/* protects all below, and calls of "cb" */
+	pthread_cond_t cond;
+	struct glist_head queue; /* directories not being listed */
+	int nworkers;
+	int busy;		/* workers with a compound in flight */
+	bool done;
+	int limit;
+	struct vattrs_masks masks;
+	bool recursive;
+	vec_listdir_batch_cb cb;
+	void *cbarg;
+	vres res;
+};
+
+static void *tc_listdir_worker(void *arg)
+{
+	struct tc_listdir_walk *w = arg;
+	struct tc_dir_to_list *dle;
+	struct glist_head *node;
+	GLIST_HEAD(batch);
+	vres tcres;
+	int n;
+
+	pthread_mutex_lock(&w->lock);
+	while (true) {
+		while (glist_empty(&w->queue) && w->busy > 0 && !w->done) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (glist_empty(&w->queue) || w->done) {
+			break;
+		}
+
+		/* share the queued directories among the workers */
+		n = 0;
+		glist_for_each(node, &w->queue) {
+			if (++n >= TC_MAX_READDIRS_PER_COMPOUND * w->nworkers)
+				break;
+		}
+		n = (n + w->nworkers - 1) / w->nworkers;
+		while (n-- > 0) {
+			dle = glist_first_entry(&w->queue,
+						struct tc_dir_to_list, list);
+			glist_del(&dle->list);
+			glist_add_tail(&batch, &dle->list);
+		}
+		++w->busy;
+		pthread_mutex_unlock(&w->lock);
+
+		tcres = tc_do_listdirv(&batch, &w->queue, &w->limit, w->masks,
+				       w->recursive, w->cb, w->cbarg, &w->lock);
+
+		--w->busy;
+		if (!vokay(tcres) && vokay(w->res)) {
+			w->res = tcres;
+		}
+		if (!vokay(tcres) || w->limit == 0) {
+			w->done = true;
+		}
+		/* the partially listed ones */
+		glist_splice_tail(&w->queue, &batch);
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/**
+ * Keep up to "tc_listdir_parallelism" compounds in flight, each listing
+ * different directories.  Entries of a directory are still passed to "cb" in
+ * order, but those of different directories are interleaved.
+ */
+static vres tc_listdirv_parallel(const char **dirs, int count,
+				 struct vattrs_masks masks, int max_entries,
+				 bool recursive, vec_listdir_batch_cb cb,
+				 void *cbarg)
+{
+	struct tc_listdir_walk w;
+	int nworkers = tc_listdir_parallelism;
+	pthread_t threads[nworkers];
+	int nthreads = 0;
+	int i;
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	glist_init(&w.queue);
+	w.nworkers = nworkers;
+	w.busy = 0;
+	w.done = false;
+	w.limit = max_entries;
+	w.masks = masks;
+	w.recursive = recursive;
+	w.cb = cb;
+	w.cbarg = cbarg;
+	w.res.index = count;
+	w.res.err_no = 0;
+
+	for (i = 0; i < count; ++i) {
+		enqueue_dir_to_list(&w.queue, dirs[i], i, false);
+	}
+
+	/* the calling thread is one of the workers */
+	for (i = 1; i < w.nworkers; ++i) {
+		if (pthread_create(&threads[nthreads], NULL, tc_listdir_worker,
+				   &w) == 0) {
+			++nthreads;
+		}
+	}
+	tc_listdir_worker(&w);
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	while (!glist_empty(&w.queue)) {
+		dequeue_dir_to_list(&w.queue);
+	}
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+
+	return w.res;
+}
+
+static void tc_nfs4_set_listdir_parallelism(unsigned int n)
+{
+	tc_listdir_parallelism = MIN(MAX(n, 1), FS_MAX_LISTDIR_PARALLELISM);
+}
+
 vres tc_nfs4_listdirv(const char **dirs, int count, struct vattrs_masks masks,
-		      int max_entries, bool recursive, vec_listdir_cb cb,
+		      int max_entries, bool recursive, vec_listdir_batch_cb cb,
 		      void *cbarg)
 {
         int i = 0;
@@ -4543,6 +6893,11 @@ vres tc_nfs4_listdirv(const char **dirs, int count, struct vattrs_masks masks,
                 max_entries = -1;
         }
 
+	if (tc_listdir_parallelism > 1 && (recursive || count > 1)) {
+		return tc_listdirv_parallel(dirs, count, masks, max_entries,
+					    recursive, cb, cbarg);
+	}
+
         for (i = 0; i < count; ++i) {
 		enqueue_dir_to_list(&dir_queue, dirs[i], i, false);
 	}
@@ -4554,9 +6909,9 @@ vres tc_nfs4_listdirv(const char **dirs, int count, struct vattrs_masks masks,
          * When "recursive" is true, a subdirectory is enqueued whenever we
          * encounter the subdirectory.
          */
-	while (!glist_empty(&dir_queue)) {
-		tcres = tc_do_listdirv(&dir_queue, &max_entries, masks,
-				       recursive, cb, cbarg);
+	while (!glist_empty(&dir_queue) && max_entries != 0) {
+		tcres = tc_do_listdirv(&dir_queue, &dir_queue, &max_entries,
+				       masks, recursive, cb, cbarg, NULL);
 		if (!vokay(tcres)) {
 			goto exit;
 		}
@@ -4582,6 +6937,28 @@ static vres tc_nfs4_renamev(vfile_pair *pairs, int count)
         int saved_opcnt;
 
         NFS4_DEBUG("tc_nfs4_renamev");
+
+	/*
+	 * Return the delegations of the files and directories moved or
+	 * replaced first, or the server would have to recall them.
+	 */
+	r = false;
+	for (i = 0; i < count; ++i) {
+		if (tc_is_open_cacheable(&pairs[i].src_file) &&
+		    nfs4_ocache_invalidate(pairs[i].src_file.path))
+			r = true;
+		if (tc_is_open_cacheable(&pairs[i].dst_file) &&
+		    nfs4_ocache_invalidate(pairs[i].dst_file.path))
+			r = true;
+		if (pairs[i].src_file.type == VFILE_PATH)
+			nfs4_ddeleg_invalidate(pairs[i].src_file.path);
+		if (pairs[i].dst_file.type == VFILE_PATH)
+			nfs4_ddeleg_invalidate(pairs[i].dst_file.path);
+	}
+	if (r)
+		tc_close_cached_files();
+	tc_return_dir_delegations();
+
         vreset_compound(true);
 
         for (i = 0; i < count; ++i) {
@@ -4634,6 +7011,20 @@ static vres tc_nfs4_removev(vfile *files, int count)
 	int saved_opcnt;
 
 	NFS4_DEBUG("tc_nfs4_removev");
+
+	/* see tc_nfs4_renamev() */
+	r = false;
+	for (i = 0; i < count; ++i) {
+		if (tc_is_open_cacheable(&files[i]) &&
+		    nfs4_ocache_invalidate(files[i].path))
+			r = true;
+		if (files[i].type == VFILE_PATH)
+			nfs4_ddeleg_invalidate(files[i].path);
+	}
+	if (r)
+		tc_close_cached_files();
+	tc_return_dir_delegations();
+
 	vreset_compound(true);
 
 	for (i = 0; i < count; ++i) {
@@ -4974,6 +7365,71 @@ static int tc_nfs4_chdir(const char *path)
 	return 0;
 }
 
+/**
+ * A delegation is only trusted while the server is able to recall it.
+ */
+static bool tc_nfs4_has_delegation(const char *path)
+{
+	return fs_can_recall() && nfs4_ocache_has_deleg(path);
+}
+
+/**
+ * Pop the changes of the delegated directory "dir" into "*updates", which the
+ * caller should free().  Returns the number of changes, or -1 if the listing
+ * of "dir" is not kept up to date by a delegation.
+ */
+static int tc_nfs4_pop_dir_changes(const char *dir,
+				   struct nfs4_dir_update **updates)
+{
+	GLIST_HEAD(changes);
+	struct nfs4_dir_change *c;
+	struct nfs4_dir_update *u;
+	fattr4 attrs;
+	char *names = NULL;
+	size_t size = 0;
+	int n = 0;
+
+	*updates = NULL;
+	if (!fs_can_notify() || !nfs4_ddeleg_pop_changes(dir, &changes))
+		return -1;
+
+	glist_for_each_entry(c, &changes, list) {
+		size += sizeof(*u) + strlen(c->name) + 1;
+		++n;
+	}
+	u = malloc(size ? size : 1);
+	if (!u) {
+		/* the changes are lost, and so is the listing */
+		nfs4_ddeleg_invalidate(dir);
+		n = -1;
+	} else {
+		*updates = u;
+		names = (char *)(u + n);
+	}
+	while (!glist_empty(&changes)) {
+		c = glist_first_entry(&changes, struct nfs4_dir_change, list);
+		glist_del(&c->list);
+		if (n >= 0) {
+			u->type = c->type;
+			u->name = strcpy(names, c->name);
+			names += strlen(names) + 1;
+			memset(&u->attrs, 0, sizeof(u->attrs));
+			if (c->type != NFS4_DIR_ENTRY_REMOVED) {
+				attrs.attrmask.bitmap4_len = c->attrmask_len;
+				memcpy(attrs.attrmask.map, c->attrmask,
+				       sizeof(attrs.attrmask.map));
+				attrs.attr_vals.attrlist4_len = c->attrs_len;
+				attrs.attr_vals.attrlist4_val = c->attrs;
+				fattr4_to_vattrs(&attrs, &u->attrs);
+			}
+			++u;
+		}
+		free(c);
+	}
+
+	return n;
+}
+
 static char *tc_nfs4_getcwd()
 {
 	struct tc_cwd_data *cwd;
@@ -5027,6 +7483,9 @@ void fs_handle_ops_init(struct fsal_obj_ops *ops)
         ops->vec_readlink = tc_nfs4_readlinkv;
         ops->sca_chdir = tc_nfs4_chdir;
         ops->sca_getcwd = tc_nfs4_getcwd;
+	ops->tc_has_delegation = tc_nfs4_has_delegation;
+	ops->tc_pop_dir_changes = tc_nfs4_pop_dir_changes;
+	ops->tc_set_listdir_parallelism = tc_nfs4_set_listdir_parallelism;
 	ops->tc_destroysession = fs_destroy_session;
 	ops->root_lookup = fs_root_lookup;
         ops->vec_open = tc_nfs4_openv;
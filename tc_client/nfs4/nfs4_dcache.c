@@ -0,0 +1,333 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "nfs4_dcache.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "ganesha_list.h"
+#include "nfsv41.h"
+
+#define DCACHE_NBUCKETS 1024
+
+struct dcache_entry {
+	struct glist_head list;	/* in its bucket; most recently used first */
+	uint64_t hash;
+	uint64_t expire_ns;
+	uint32_t pfh_len;
+	uint32_t fh_len;
+	uint32_t name_len;
+	char pfh[DCACHE_FHSIZE];
+	char fh[DCACHE_FHSIZE];
+	char name[];
+};
+
+struct dcache_bucket {
+	pthread_mutex_t lock;
+	struct glist_head entries;
+	uint32_t count;
+};
+
+static struct dcache_bucket *dcache_buckets;
+static uint32_t dcache_bucket_cap;	/* max # of entries per bucket */
+static uint64_t dcache_timeout_ns;
+
+static pthread_mutex_t dcache_root_lock = PTHREAD_MUTEX_INITIALIZER;
+static char dcache_root_fh[DCACHE_FHSIZE];
+static uint32_t dcache_root_fh_len;
+
+static uint64_t dcache_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a over the parent filehandle and the name */
+static uint64_t dcache_hash(const char *pfh, uint32_t pfh_len, slice_t name)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < pfh_len; ++i) {
+		h = (h ^ (unsigned char)pfh[i]) * 1099511628211ULL;
+	}
+	h = (h ^ '/') * 1099511628211ULL;
+	for (i = 0; i < name.size; ++i) {
+		h = (h ^ (unsigned char)name.data[i]) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+static inline struct dcache_bucket *dcache_bucket_of(uint64_t hash)
+{
+	return dcache_buckets + (hash % DCACHE_NBUCKETS);
+}
+
+/* Caller must hold the lock of the bucket. */
+static struct dcache_entry *dcache_find(struct dcache_bucket *b,
+					uint64_t hash, const char *pfh,
+					uint32_t pfh_len, slice_t name)
+{
+	struct glist_head *node;
+	struct dcache_entry *e;
+
+	glist_for_each(node, &b->entries) {
+		e = glist_entry(node, struct dcache_entry, list);
+		if (e->hash == hash && e->pfh_len == pfh_len &&
+		    e->name_len == name.size &&
+		    memcmp(e->pfh, pfh, pfh_len) == 0 &&
+		    memcmp(e->name, name.data, name.size) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/* Caller must hold the lock of the bucket. */
+static void dcache_drop(struct dcache_bucket *b, struct dcache_entry *e)
+{
+	glist_del(&e->list);
+	--b->count;
+	free(e);
+}
+
+int nfs4_dcache_init(uint32_t max_entries, uint32_t timeout_ms)
+{
+	int i;
+
+	if (max_entries == 0) {
+		return 0;
+	}
+
+	dcache_buckets = calloc(DCACHE_NBUCKETS, sizeof(*dcache_buckets));
+	if (!dcache_buckets) {
+		return ENOMEM;
+	}
+	for (i = 0; i < DCACHE_NBUCKETS; ++i) {
+		pthread_mutex_init(&dcache_buckets[i].lock, NULL);
+		glist_init(&dcache_buckets[i].entries);
+	}
+	dcache_bucket_cap = (max_entries + DCACHE_NBUCKETS - 1) /
+			    DCACHE_NBUCKETS;
+	dcache_timeout_ns = timeout_ms * 1000000ULL;
+
+	return 0;
+}
+
+void nfs4_dcache_deinit(void)
+{
+	int i;
+
+	if (!dcache_buckets) {
+		return;
+	}
+	nfs4_dcache_purge();
+	for (i = 0; i < DCACHE_NBUCKETS; ++i) {
+		pthread_mutex_destroy(&dcache_buckets[i].lock);
+	}
+	free(dcache_buckets);
+	dcache_buckets = NULL;
+	dcache_root_fh_len = 0;
+}
+
+bool nfs4_dcache_enabled(void)
+{
+	return dcache_buckets != NULL;
+}
+
+void nfs4_dcache_set_root(const char *fh, uint32_t fh_len)
+{
+	if (fh_len > DCACHE_FHSIZE) {
+		return;
+	}
+	pthread_mutex_lock(&dcache_root_lock);
+	memcpy(dcache_root_fh, fh, fh_len);
+	dcache_root_fh_len = fh_len;
+	pthread_mutex_unlock(&dcache_root_lock);
+}
+
+bool nfs4_dcache_get_root(char *fh, uint32_t *fh_len)
+{
+	bool found;
+
+	pthread_mutex_lock(&dcache_root_lock);
+	found = dcache_root_fh_len > 0;
+	if (found) {
+		memcpy(fh, dcache_root_fh, dcache_root_fh_len);
+		*fh_len = dcache_root_fh_len;
+	}
+	pthread_mutex_unlock(&dcache_root_lock);
+
+	return found;
+}
+
+bool nfs4_dcache_lookup(const char *pfh, uint32_t pfh_len, slice_t name,
+			char *fh, uint32_t *fh_len)
+{
+	uint64_t hash;
+	struct dcache_bucket *b;
+	struct dcache_entry *e;
+	bool found = false;
+
+	if (!dcache_buckets) {
+		return false;
+	}
+
+	hash = dcache_hash(pfh, pfh_len, name);
+	b = dcache_bucket_of(hash);
+	pthread_mutex_lock(&b->lock);
+	e = dcache_find(b, hash, pfh, pfh_len, name);
+	if (e && e->expire_ns < dcache_now_ns()) {
+		dcache_drop(b, e);
+	} else if (e) {
+		memcpy(fh, e->fh, e->fh_len);
+		*fh_len = e->fh_len;
+		glist_del(&e->list);
+		glist_add(&b->entries, &e->list);
+		found = true;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return found;
+}
+
+void nfs4_dcache_add(const char *pfh, uint32_t pfh_len, slice_t name,
+		     const char *fh, uint32_t fh_len)
+{
+	uint64_t hash;
+	struct dcache_bucket *b;
+	struct dcache_entry *e;
+
+	if (!dcache_buckets || pfh_len > DCACHE_FHSIZE ||
+	    fh_len > DCACHE_FHSIZE) {
+		return;
+	}
+
+	hash = dcache_hash(pfh, pfh_len, name);
+	b = dcache_bucket_of(hash);
+	pthread_mutex_lock(&b->lock);
+	e = dcache_find(b, hash, pfh, pfh_len, name);
+	if (e) {
+		glist_del(&e->list);
+	} else {
+		e = malloc(sizeof(*e) + name.size);
+		if (!e) {
+			pthread_mutex_unlock(&b->lock);
+			return;
+		}
+		e->hash = hash;
+		e->pfh_len = pfh_len;
+		memcpy(e->pfh, pfh, pfh_len);
+		e->name_len = name.size;
+		memcpy(e->name, name.data, name.size);
+		++b->count;
+	}
+	e->fh_len = fh_len;
+	memcpy(e->fh, fh, fh_len);
+	e->expire_ns = dcache_now_ns() + dcache_timeout_ns;
+	glist_add(&b->entries, &e->list);
+
+	while (b->count > dcache_bucket_cap) {
+		dcache_drop(b, glist_last_entry(&b->entries,
+						struct dcache_entry, list));
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+void nfs4_dcache_remove(const char *pfh, uint32_t pfh_len, slice_t name)
+{
+	uint64_t hash;
+	struct dcache_bucket *b;
+	struct dcache_entry *e;
+
+	if (!dcache_buckets) {
+		return;
+	}
+
+	hash = dcache_hash(pfh, pfh_len, name);
+	b = dcache_bucket_of(hash);
+	pthread_mutex_lock(&b->lock);
+	e = dcache_find(b, hash, pfh, pfh_len, name);
+	if (e) {
+		dcache_drop(b, e);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+bool nfs4_dcache_can_retry(const uint32_t *ops, int failed)
+{
+	int i;
+
+	for (i = 0; i < failed; ++i) {
+		switch (ops[i]) {
+		/* a new slot is taken for the retry */
+		case NFS4_OP_SEQUENCE:
+		case NFS4_OP_PUTFH:
+		case NFS4_OP_PUTPUBFH:
+		case NFS4_OP_PUTROOTFH:
+		case NFS4_OP_SAVEFH:
+		case NFS4_OP_RESTOREFH:
+		case NFS4_OP_LOOKUP:
+		case NFS4_OP_LOOKUPP:
+		case NFS4_OP_GETFH:
+		case NFS4_OP_GETATTR:
+		case NFS4_OP_VERIFY:
+		case NFS4_OP_NVERIFY:
+		case NFS4_OP_ACCESS:
+		case NFS4_OP_READ:
+		case NFS4_OP_READDIR:
+		case NFS4_OP_READLINK:
+		case NFS4_OP_SECINFO:
+		case NFS4_OP_SECINFO_NO_NAME:
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void nfs4_dcache_purge(void)
+{
+	int i;
+	struct glist_head *node;
+	struct glist_head *next;
+	struct dcache_bucket *b;
+
+	if (!dcache_buckets) {
+		return;
+	}
+
+	for (i = 0; i < DCACHE_NBUCKETS; ++i) {
+		b = dcache_buckets + i;
+		pthread_mutex_lock(&b->lock);
+		glist_for_each_safe(node, next, &b->entries) {
+			dcache_drop(b, glist_entry(node, struct dcache_entry,
+						   list));
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+}
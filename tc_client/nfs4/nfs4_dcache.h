@@ -0,0 +1,91 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * A per-component dentry cache: it maps (parent filehandle, name) to the
+ * filehandle of the child, so that a path can be resolved to the filehandle
+ * of its longest cached prefix, and the compound can start with a PUTFH of
+ * that prefix instead of a PUTROOTFH followed by a LOOKUP per component.
+ *
+ * Entries expire after a timeout, and the cache is bounded in the number of
+ * entries.  All functions are thread-safe.
+ */
+
+#ifndef __TC_NFS4_DCACHE_H__
+#define __TC_NFS4_DCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DCACHE_FHSIZE 128
+
+/**
+ * Initialize the cache to hold at most "max_entries" entries, each valid for
+ * "timeout_ms" milliseconds.  The cache is disabled if "max_entries" is 0.
+ */
+int nfs4_dcache_init(uint32_t max_entries, uint32_t timeout_ms);
+
+void nfs4_dcache_deinit(void);
+
+bool nfs4_dcache_enabled(void);
+
+/**
+ * Remember/get the root filehandle, i.e., the result of PUTROOTFH.  The
+ * "fh" buffer of nfs4_dcache_get_root() should have DCACHE_FHSIZE bytes.
+ */
+void nfs4_dcache_set_root(const char *fh, uint32_t fh_len);
+bool nfs4_dcache_get_root(char *fh, uint32_t *fh_len);
+
+/**
+ * Look up the child "name" of the directory "pfh".  On success, the child
+ * filehandle is copied to "fh", which should have DCACHE_FHSIZE bytes.
+ */
+bool nfs4_dcache_lookup(const char *pfh, uint32_t pfh_len, slice_t name,
+			char *fh, uint32_t *fh_len);
+
+void nfs4_dcache_add(const char *pfh, uint32_t pfh_len, slice_t name,
+		     const char *fh, uint32_t fh_len);
+
+void nfs4_dcache_remove(const char *pfh, uint32_t pfh_len, slice_t name);
+
+/**
+ * Drop all entries, e.g., after the server reports a stale filehandle.
+ */
+void nfs4_dcache_purge(void);
+
+/**
+ * Whether a compound that failed at op "failed" because of a stale cached
+ * filehandle can be sent again by path.  It can only if none of the ops
+ * before "failed" changed anything on the server, or they would run twice.
+ * "ops" are the NFSv4 operation numbers of the compound.
+ */
+bool nfs4_dcache_can_retry(const uint32_t *ops, int failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __TC_NFS4_DCACHE_H__ */
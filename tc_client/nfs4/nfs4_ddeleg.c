@@ -0,0 +1,353 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "nfs4_ddeleg.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DDELEG_NBUCKETS 256
+#define DDELEG_NEARLY 16
+
+/*
+ * Like the open-file cache, the table is bounded by the state the server is
+ * willing to keep for us, so one lock protects everything.
+ */
+static pthread_mutex_t ddeleg_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct glist_head ddeleg_buckets[DDELEG_NBUCKETS];
+static struct glist_head ddeleg_held = {&ddeleg_held, &ddeleg_held};
+static struct glist_head ddeleg_returning = {&ddeleg_returning,
+					     &ddeleg_returning};
+static uint32_t ddeleg_count;
+static uint32_t ddeleg_max;		/* 0 means disabled */
+/* stateids of the delegations called back before they are added */
+static char ddeleg_early[DDELEG_NEARLY][DDELEG_OTHERSIZE];
+static unsigned int ddeleg_nearly;
+
+/* FNV-1a of the path */
+static uint64_t ddeleg_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*path) {
+		h = (h ^ (unsigned char)*path++) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/* Caller must hold ddeleg_lock. */
+static struct nfs4_dir_deleg *ddeleg_find(const char *path, uint64_t hashval)
+{
+	struct glist_head *node;
+	struct nfs4_dir_deleg *dd;
+
+	glist_for_each(node, &ddeleg_buckets[hashval % DDELEG_NBUCKETS]) {
+		dd = glist_entry(node, struct nfs4_dir_deleg, hash);
+		if (dd->hashval == hashval && strcmp(dd->path, path) == 0) {
+			return dd;
+		}
+	}
+
+	return NULL;
+}
+
+/* Caller must hold ddeleg_lock. */
+static struct nfs4_dir_deleg *ddeleg_find_sid(const char *sid_other)
+{
+	struct glist_head *node;
+	struct nfs4_dir_deleg *dd;
+
+	glist_for_each(node, &ddeleg_held) {
+		dd = glist_entry(node, struct nfs4_dir_deleg, list);
+		if (memcmp(dd->sid_other, sid_other, DDELEG_OTHERSIZE) == 0) {
+			return dd;
+		}
+	}
+
+	return NULL;
+}
+
+static void ddeleg_free_changes(struct glist_head *changes)
+{
+	struct nfs4_dir_change *c;
+
+	while (!glist_empty(changes)) {
+		c = glist_first_entry(changes, struct nfs4_dir_change, list);
+		glist_del(&c->list);
+		free(c);
+	}
+}
+
+/*
+ * Stop using "dd" and queue it for returning; the changes not popped yet are
+ * of no use anymore.  Caller must hold ddeleg_lock.
+ */
+static void ddeleg_unlink(struct nfs4_dir_deleg *dd)
+{
+	if (!dd->held) {
+		return;
+	}
+	dd->held = false;
+	glist_del(&dd->hash);
+	glist_del(&dd->list);
+	--ddeleg_count;
+	ddeleg_free_changes(&dd->changes);
+	dd->nchanges = 0;
+	glist_add_tail(&ddeleg_returning, &dd->list);
+}
+
+int nfs4_ddeleg_init(uint32_t max_dirs)
+{
+	int i;
+
+	pthread_mutex_lock(&ddeleg_lock);
+	for (i = 0; i < DDELEG_NBUCKETS; ++i) {
+		glist_init(&ddeleg_buckets[i]);
+	}
+	glist_init(&ddeleg_held);
+	ddeleg_count = 0;
+	ddeleg_max = max_dirs;
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return 0;
+}
+
+void nfs4_ddeleg_deinit(void)
+{
+	pthread_mutex_lock(&ddeleg_lock);
+	ddeleg_max = 0;
+	pthread_mutex_unlock(&ddeleg_lock);
+	nfs4_ddeleg_drop_all();
+}
+
+bool nfs4_ddeleg_enabled(void)
+{
+	return ddeleg_max > 0;
+}
+
+bool nfs4_ddeleg_wanted(const char *path)
+{
+	uint64_t hashval;
+	bool wanted;
+
+	if (!nfs4_ddeleg_enabled() || path[0] != '/') {
+		return false;
+	}
+
+	hashval = ddeleg_hash(path);
+	pthread_mutex_lock(&ddeleg_lock);
+	wanted = ddeleg_count < ddeleg_max && !ddeleg_find(path, hashval);
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return wanted;
+}
+
+bool nfs4_ddeleg_held(const char *path)
+{
+	uint64_t hashval;
+	bool held;
+
+	if (!nfs4_ddeleg_enabled()) {
+		return false;
+	}
+
+	hashval = ddeleg_hash(path);
+	pthread_mutex_lock(&ddeleg_lock);
+	held = ddeleg_find(path, hashval) != NULL;
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return held;
+}
+
+void nfs4_ddeleg_add(const char *path, const char *fh, uint32_t fh_len,
+		     uint32_t sid_seqid, const char *sid_other)
+{
+	struct nfs4_dir_deleg *dd;
+	size_t pathlen = strlen(path);
+	bool early = false;
+	int i;
+
+	if (fh_len > DDELEG_FHSIZE) {
+		return;
+	}
+
+	dd = malloc(sizeof(*dd) + pathlen + 1);
+	if (!dd) {
+		return;
+	}
+	dd->hashval = ddeleg_hash(path);
+	dd->fh_len = fh_len;
+	memcpy(dd->fh, fh, fh_len);
+	dd->sid_seqid = sid_seqid;
+	memcpy(dd->sid_other, sid_other, DDELEG_OTHERSIZE);
+	dd->nchanges = 0;
+	glist_init(&dd->changes);
+	memcpy(dd->path, path, pathlen + 1);
+
+	pthread_mutex_lock(&ddeleg_lock);
+	for (i = 0; i < DDELEG_NEARLY; ++i) {
+		if (memcmp(ddeleg_early[i], sid_other, DDELEG_OTHERSIZE) == 0) {
+			/* the changes since it was granted may be lost */
+			memset(ddeleg_early[i], 0, DDELEG_OTHERSIZE);
+			early = true;
+		}
+	}
+	if (!early && ddeleg_count < ddeleg_max &&
+	    !ddeleg_find(path, dd->hashval)) {
+		dd->held = true;
+		glist_add(&ddeleg_buckets[dd->hashval % DDELEG_NBUCKETS],
+			  &dd->hash);
+		glist_add_tail(&ddeleg_held, &dd->list);
+		++ddeleg_count;
+	} else {
+		dd->held = false;
+		glist_add_tail(&ddeleg_returning, &dd->list);
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+}
+
+bool nfs4_ddeleg_notify(const char *sid_other, struct nfs4_dir_change *change)
+{
+	struct nfs4_dir_deleg *dd;
+
+	pthread_mutex_lock(&ddeleg_lock);
+	dd = ddeleg_find_sid(sid_other);
+	if (dd && dd->nchanges >= DDELEG_MAX_CHANGES) {
+		/* nobody is looking at the listing */
+		ddeleg_unlink(dd);
+		dd = NULL;
+	}
+	if (dd) {
+		glist_add_tail(&dd->changes, &change->list);
+		++dd->nchanges;
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	if (!dd) {
+		free(change);
+	}
+	return dd != NULL;
+}
+
+bool nfs4_ddeleg_recall(const char *sid_other)
+{
+	struct glist_head *node;
+	struct nfs4_dir_deleg *dd;
+	bool found;
+
+	pthread_mutex_lock(&ddeleg_lock);
+	dd = ddeleg_find_sid(sid_other);
+	found = (dd != NULL);
+	if (dd) {
+		ddeleg_unlink(dd);
+	} else {
+		/* already dropped, and to be returned anyway */
+		glist_for_each(node, &ddeleg_returning) {
+			dd = glist_entry(node, struct nfs4_dir_deleg, list);
+			if (memcmp(dd->sid_other, sid_other,
+				   DDELEG_OTHERSIZE) == 0) {
+				found = true;
+				break;
+			}
+		}
+	}
+	if (!found) {
+		memcpy(ddeleg_early[ddeleg_nearly++ % DDELEG_NEARLY], sid_other,
+		       DDELEG_OTHERSIZE);
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return found;
+}
+
+void nfs4_ddeleg_invalidate(const char *path)
+{
+	struct glist_head *node;
+	struct glist_head *next;
+	struct nfs4_dir_deleg *dd;
+	size_t len = strlen(path);
+
+	if (!nfs4_ddeleg_enabled()) {
+		return;
+	}
+
+	while (len > 1 && path[len - 1] == '/') {
+		--len;
+	}
+
+	pthread_mutex_lock(&ddeleg_lock);
+	glist_for_each_safe(node, next, &ddeleg_held) {
+		dd = glist_entry(node, struct nfs4_dir_deleg, list);
+		if (strncmp(dd->path, path, len) == 0 &&
+		    (dd->path[len] == '\0' || dd->path[len] == '/')) {
+			ddeleg_unlink(dd);
+		}
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+}
+
+void nfs4_ddeleg_drop_all(void)
+{
+	pthread_mutex_lock(&ddeleg_lock);
+	while (!glist_empty(&ddeleg_held)) {
+		ddeleg_unlink(glist_first_entry(&ddeleg_held,
+						struct nfs4_dir_deleg, list));
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+}
+
+bool nfs4_ddeleg_pop_changes(const char *path, struct glist_head *changes)
+{
+	struct nfs4_dir_deleg *dd;
+	uint64_t hashval;
+
+	if (!nfs4_ddeleg_enabled()) {
+		return false;
+	}
+
+	hashval = ddeleg_hash(path);
+	pthread_mutex_lock(&ddeleg_lock);
+	dd = ddeleg_find(path, hashval);
+	if (dd) {
+		glist_splice_tail(changes, &dd->changes);
+		dd->nchanges = 0;
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return dd != NULL;
+}
+
+int nfs4_ddeleg_pop_returning(struct nfs4_dir_deleg **dirs, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&ddeleg_lock);
+	while (n < max && !glist_empty(&ddeleg_returning)) {
+		dirs[n] = glist_first_entry(&ddeleg_returning,
+					    struct nfs4_dir_deleg, list);
+		glist_del(&dirs[n]->list);
+		++n;
+	}
+	pthread_mutex_unlock(&ddeleg_lock);
+
+	return n;
+}
@@ -0,0 +1,172 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * Directory delegations, keyed by the absolute paths of the directories.
+ *
+ * While we hold the delegation of a directory, the server tells us about the
+ * entries added to, removed from, or renamed in the directory with CB_NOTIFYs,
+ * so a listing of the directory cached above can be kept up to date with the
+ * notified changes instead of being listed again once it gets old.
+ *
+ * The receiver of callbacks queues the changes on the delegation, and the
+ * cache of listings pops and applies them.  A delegation that is recalled, or
+ * whose changes cannot be followed, is moved to a "returning" list, and the
+ * caller pops it from there to send the DELEGRETURN.  All functions are
+ * thread-safe.
+ */
+
+#ifndef __TC_NFS4_DDELEG_H__
+#define __TC_NFS4_DDELEG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ganesha_list.h"
+#include "tc_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DDELEG_FHSIZE 128
+#define DDELEG_OTHERSIZE 12
+/* beyond which the delegation is returned and the directory listed again */
+#define DDELEG_MAX_CHANGES 1024
+
+enum nfs4_dir_change_type {
+	NFS4_DIR_ENTRY_ADDED,
+	NFS4_DIR_ENTRY_REMOVED,
+	NFS4_DIR_ENTRY_CHANGED,	/* attributes of the entry */
+};
+
+/**
+ * A change notified by the server.  The attributes of added and changed
+ * entries are kept XDR-encoded (as the attrmask and attr_vals of a fattr4),
+ * because decoding them needs the context of a TC call.  The change is one
+ * allocation, which the owner releases with free().
+ */
+struct nfs4_dir_change {
+	struct glist_head list;
+	enum nfs4_dir_change_type type;
+	uint32_t attrmask_len;
+	uint32_t attrmask[3];
+	uint32_t attrs_len;
+	char *attrs;		/* within this allocation */
+	char name[];
+};
+
+/**
+ * A change as given to the caches above, with its attributes decoded.
+ */
+struct nfs4_dir_update {
+	enum nfs4_dir_change_type type;
+	const char *name;
+	struct vattrs attrs;	/* of added and changed entries */
+};
+
+struct nfs4_dir_deleg {
+	struct glist_head hash;	/* in its hash bucket */
+	struct glist_head list;	/* in the list of held or returning ones */
+	uint64_t hashval;
+	bool held;		/* not recalled or dropped yet */
+	uint32_t fh_len;
+	char fh[DDELEG_FHSIZE];
+	uint32_t sid_seqid;	/* the delegation stateid */
+	char sid_other[DDELEG_OTHERSIZE];
+	int nchanges;
+	struct glist_head changes;	/* oldest first */
+	char path[];
+};
+
+/**
+ * Initialize the table to hold at most "max_dirs" delegations.  Directory
+ * delegations are not used if "max_dirs" is 0.
+ */
+int nfs4_ddeleg_init(uint32_t max_dirs);
+
+/**
+ * Move all delegations to the returning list and stop using them.
+ */
+void nfs4_ddeleg_deinit(void);
+
+bool nfs4_ddeleg_enabled(void);
+
+/**
+ * Whether the delegation of "path" should be asked for, i.e., it is not
+ * held yet and there is room for it.
+ */
+bool nfs4_ddeleg_wanted(const char *path);
+
+/**
+ * Whether the listing of "path" is kept up to date by a delegation.
+ */
+bool nfs4_ddeleg_held(const char *path);
+
+/**
+ * Add a delegation just granted.  If it cannot be kept, e.g., because the
+ * table is full, it is queued for returning.
+ */
+void nfs4_ddeleg_add(const char *path, const char *fh, uint32_t fh_len,
+		     uint32_t sid_seqid, const char *sid_other);
+
+/**
+ * Queue "change" of the directory delegated by "sid_other", which takes the
+ * ownership of "change".  Returns false if no such delegation is held.
+ */
+bool nfs4_ddeleg_notify(const char *sid_other, struct nfs4_dir_change *change);
+
+/**
+ * Stop using the delegation "sid_other" and queue it for returning, e.g.,
+ * because of a CB_RECALL, or a notification we cannot follow.  Returns false
+ * if we do not know the delegation (yet): it may have been granted by a
+ * reply not processed yet, so it is returned as soon as it is added.
+ */
+bool nfs4_ddeleg_recall(const char *sid_other);
+
+/**
+ * Drop the delegations of "path" and of all directories under it, e.g.,
+ * because "path" has been removed or renamed.
+ */
+void nfs4_ddeleg_invalidate(const char *path);
+
+/**
+ * Drop all delegations, e.g., because notifications may have been missed
+ * while the back channel was down.
+ */
+void nfs4_ddeleg_drop_all(void);
+
+/**
+ * Move the changes of "path" notified since the last call to "changes".
+ * Returns false, and moves nothing, if the delegation of "path" is not held.
+ */
+bool nfs4_ddeleg_pop_changes(const char *path, struct glist_head *changes);
+
+/**
+ * Pop at most "max" delegations to return into "dirs".  The caller should
+ * free() them after returning.  Returns the number of delegations popped.
+ */
+int nfs4_ddeleg_pop_returning(struct nfs4_dir_deleg **dirs, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __TC_NFS4_DDELEG_H__ */
@@ -0,0 +1,443 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "nfs4_ocache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OCACHE_NBUCKETS 256
+#define OCACHE_NEARLY 16
+
+/*
+ * The cache is small (bounded by the open states the server is willing to
+ * keep for us), so one lock protects everything.
+ */
+static pthread_mutex_t ocache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct glist_head ocache_buckets[OCACHE_NBUCKETS];
+static struct glist_head ocache_lru;	/* most recently used first */
+static struct glist_head ocache_closing = {&ocache_closing, &ocache_closing};
+/* dropped files still in use; they are closed by the last user */
+static struct glist_head ocache_dropped = {&ocache_dropped, &ocache_dropped};
+static uint32_t ocache_count;
+static uint32_t ocache_max;		/* 0 means disabled */
+static int ocache_nclosing;
+static uint64_t ocache_timeout_ns;
+/* delegations recalled before they are added */
+static char ocache_early[OCACHE_NEARLY][OCACHE_OTHERSIZE];
+static unsigned int ocache_nearly;
+
+static uint64_t ocache_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a of the path */
+static uint64_t ocache_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*path) {
+		h = (h ^ (unsigned char)*path++) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/* Caller must hold ocache_lock. */
+static struct nfs4_open_file *ocache_find(const char *path, uint64_t hashval)
+{
+	struct glist_head *node;
+	struct nfs4_open_file *of;
+
+	glist_for_each(node, &ocache_buckets[hashval % OCACHE_NBUCKETS]) {
+		of = glist_entry(node, struct nfs4_open_file, hash);
+		if (of->hashval == hashval && strcmp(of->path, path) == 0) {
+			return of;
+		}
+	}
+
+	return NULL;
+}
+
+/* Caller must hold ocache_lock. */
+static void ocache_close_later(struct nfs4_open_file *of)
+{
+	glist_add_tail(&ocache_closing, &of->lru);
+	++ocache_nclosing;
+}
+
+/*
+ * Make "of" unreachable by its path; it is queued for closing now if unused,
+ * or by the last nfs4_ocache_put() otherwise.  Caller must hold ocache_lock.
+ */
+static void ocache_unlink(struct nfs4_open_file *of)
+{
+	if (!of->cached) {
+		return;
+	}
+	of->cached = false;
+	glist_del(&of->hash);
+	glist_del(&of->lru);
+	--ocache_count;
+	if (of->refs == 0) {
+		ocache_close_later(of);
+	} else {
+		glist_add_tail(&ocache_dropped, &of->lru);
+	}
+}
+
+/* Caller must hold ocache_lock. */
+static bool ocache_holds_deleg(struct glist_head *list, const char *deleg_other)
+{
+	struct glist_head *node;
+	struct nfs4_open_file *of;
+
+	glist_for_each(node, list) {
+		of = glist_entry(node, struct nfs4_open_file, lru);
+		if (of->deleg &&
+		    memcmp(of->deleg_other, deleg_other, OCACHE_OTHERSIZE) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Caller must hold ocache_lock. */
+static void ocache_evict(uint32_t max)
+{
+	while (ocache_count > max) {
+		ocache_unlink(glist_last_entry(&ocache_lru,
+					       struct nfs4_open_file, lru));
+	}
+}
+
+int nfs4_ocache_init(uint32_t max_files, uint32_t timeout_ms)
+{
+	int i;
+
+	pthread_mutex_lock(&ocache_lock);
+	for (i = 0; i < OCACHE_NBUCKETS; ++i) {
+		glist_init(&ocache_buckets[i]);
+	}
+	glist_init(&ocache_lru);
+	ocache_count = 0;
+	ocache_max = max_files;
+	ocache_timeout_ns = timeout_ms * 1000000ULL;
+	pthread_mutex_unlock(&ocache_lock);
+
+	return 0;
+}
+
+void nfs4_ocache_deinit(void)
+{
+	pthread_mutex_lock(&ocache_lock);
+	if (ocache_max > 0) {
+		ocache_evict(0);
+		ocache_max = 0;
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+bool nfs4_ocache_enabled(void)
+{
+	return ocache_max > 0;
+}
+
+struct nfs4_open_file *nfs4_ocache_get(const char *path)
+{
+	struct nfs4_open_file *of = NULL;
+	uint64_t hashval;
+
+	if (!nfs4_ocache_enabled()) {
+		return NULL;
+	}
+
+	hashval = ocache_hash(path);
+	pthread_mutex_lock(&ocache_lock);
+	if (ocache_max > 0) {
+		of = ocache_find(path, hashval);
+	}
+	if (of) {
+		++of->refs;
+		of->last_used_ns = ocache_now_ns();
+		glist_del(&of->lru);
+		glist_add(&ocache_lru, &of->lru);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+
+	return of;
+}
+
+void nfs4_ocache_put(struct nfs4_open_file *of)
+{
+	pthread_mutex_lock(&ocache_lock);
+	if (--of->refs == 0 && !of->cached) {
+		glist_del(&of->lru);
+		ocache_close_later(of);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+void nfs4_ocache_add(const char *path, const char *fh, uint32_t fh_len,
+		     uint32_t sid_seqid, const char *sid_other,
+		     uint32_t deleg_seqid, const char *deleg_other)
+{
+	struct nfs4_open_file *of;
+	struct nfs4_open_file *old;
+	size_t pathlen = strlen(path);
+	bool early = false;
+	int i;
+
+	if (fh_len > OCACHE_FHSIZE) {
+		return;
+	}
+
+	of = malloc(sizeof(*of) + pathlen + 1);
+	if (!of) {
+		return;
+	}
+	of->hashval = ocache_hash(path);
+	of->last_used_ns = ocache_now_ns();
+	of->refs = 0;
+	of->fh_len = fh_len;
+	memcpy(of->fh, fh, fh_len);
+	of->sid_seqid = sid_seqid;
+	memcpy(of->sid_other, sid_other, OCACHE_OTHERSIZE);
+	of->deleg = (deleg_other != NULL);
+	if (of->deleg) {
+		of->deleg_seqid = deleg_seqid;
+		memcpy(of->deleg_other, deleg_other, OCACHE_OTHERSIZE);
+	}
+	memcpy(of->path, path, pathlen + 1);
+
+	pthread_mutex_lock(&ocache_lock);
+	for (i = 0; of->deleg && i < OCACHE_NEARLY; ++i) {
+		if (memcmp(ocache_early[i], deleg_other, OCACHE_OTHERSIZE) == 0) {
+			memset(ocache_early[i], 0, OCACHE_OTHERSIZE);
+			early = true;
+		}
+	}
+	old = (ocache_max > 0) ? ocache_find(path, of->hashval) : NULL;
+	if (old && of->deleg && !early &&
+	    (!old->deleg || memcmp(old->deleg_other, of->deleg_other,
+				   OCACHE_OTHERSIZE) == 0)) {
+		/* a client has at most one delegation of a file */
+		old->deleg = true;
+		old->deleg_seqid = of->deleg_seqid;
+		memcpy(old->deleg_other, of->deleg_other, OCACHE_OTHERSIZE);
+		of->deleg = false;
+	}
+	/* a recalled delegation is returned along with the CLOSE */
+	if (ocache_max == 0 || old || early) {
+		of->cached = false;
+		ocache_close_later(of);
+	} else {
+		of->cached = true;
+		glist_add(&ocache_buckets[of->hashval % OCACHE_NBUCKETS],
+			  &of->hash);
+		glist_add(&ocache_lru, &of->lru);
+		++ocache_count;
+		ocache_evict(ocache_max);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+bool nfs4_ocache_has_deleg(const char *path)
+{
+	struct nfs4_open_file *of;
+	uint64_t hashval;
+	bool deleg;
+
+	if (!nfs4_ocache_enabled()) {
+		return false;
+	}
+
+	hashval = ocache_hash(path);
+	pthread_mutex_lock(&ocache_lock);
+	of = ocache_find(path, hashval);
+	deleg = of && of->deleg;
+	pthread_mutex_unlock(&ocache_lock);
+
+	return deleg;
+}
+
+bool nfs4_ocache_recall(const char *deleg_other)
+{
+	struct glist_head *node;
+	struct nfs4_open_file *of;
+	bool found = false;
+
+	pthread_mutex_lock(&ocache_lock);
+	glist_for_each(node, &ocache_lru) {
+		of = glist_entry(node, struct nfs4_open_file, lru);
+		if (of->deleg &&
+		    memcmp(of->deleg_other, deleg_other, OCACHE_OTHERSIZE) == 0) {
+			ocache_unlink(of);
+			found = true;
+			break;
+		}
+	}
+	/* already dropped, and to be returned anyway */
+	found = found || ocache_holds_deleg(&ocache_dropped, deleg_other) ||
+		ocache_holds_deleg(&ocache_closing, deleg_other);
+	if (!found) {
+		memcpy(ocache_early[ocache_nearly++ % OCACHE_NEARLY],
+		       deleg_other, OCACHE_OTHERSIZE);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+
+	return found;
+}
+
+bool nfs4_ocache_return_deleg(const char *path)
+{
+	struct nfs4_open_file *of;
+	uint64_t hashval;
+	bool dropped = false;
+
+	if (!nfs4_ocache_enabled()) {
+		return false;
+	}
+
+	hashval = ocache_hash(path);
+	pthread_mutex_lock(&ocache_lock);
+	of = ocache_find(path, hashval);
+	if (of && of->deleg) {
+		ocache_unlink(of);
+		dropped = true;
+	}
+	pthread_mutex_unlock(&ocache_lock);
+
+	return dropped;
+}
+
+void nfs4_ocache_drop(struct nfs4_open_file *of)
+{
+	pthread_mutex_lock(&ocache_lock);
+	ocache_unlink(of);
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+void nfs4_ocache_drop_delegs(void)
+{
+	struct glist_head *node;
+	struct glist_head *next;
+	struct nfs4_open_file *of;
+
+	pthread_mutex_lock(&ocache_lock);
+	glist_for_each_safe(node, next, &ocache_lru) {
+		of = glist_entry(node, struct nfs4_open_file, lru);
+		if (of->deleg) {
+			ocache_unlink(of);
+		}
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+bool nfs4_ocache_invalidate(const char *path)
+{
+	struct glist_head *node;
+	struct glist_head *next;
+	struct nfs4_open_file *of;
+	size_t len = strlen(path);
+	bool deleg = false;
+
+	if (!nfs4_ocache_enabled()) {
+		return false;
+	}
+
+	while (len > 1 && path[len - 1] == '/') {
+		--len;
+	}
+
+	pthread_mutex_lock(&ocache_lock);
+	glist_for_each_safe(node, next, &ocache_lru) {
+		of = glist_entry(node, struct nfs4_open_file, lru);
+		if (strncmp(of->path, path, len) == 0 &&
+		    (of->path[len] == '\0' || of->path[len] == '/')) {
+			deleg = deleg || of->deleg;
+			ocache_unlink(of);
+		}
+	}
+	pthread_mutex_unlock(&ocache_lock);
+
+	return deleg;
+}
+
+void nfs4_ocache_shrink(void)
+{
+	pthread_mutex_lock(&ocache_lock);
+	if (ocache_max > 1) {
+		ocache_max /= 2;
+		ocache_evict(ocache_max);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+void nfs4_ocache_expire(void)
+{
+	struct nfs4_open_file *of;
+	uint64_t now;
+
+	if (!nfs4_ocache_enabled()) {
+		return;
+	}
+
+	now = ocache_now_ns();
+	pthread_mutex_lock(&ocache_lock);
+	while (ocache_count > 0) {
+		of = glist_last_entry(&ocache_lru, struct nfs4_open_file, lru);
+		if (of->last_used_ns + ocache_timeout_ns > now) {
+			break;
+		}
+		ocache_unlink(of);
+	}
+	pthread_mutex_unlock(&ocache_lock);
+}
+
+int nfs4_ocache_pop_closing(struct nfs4_open_file **files, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&ocache_lock);
+	while (n < max && !glist_empty(&ocache_closing)) {
+		files[n] = glist_first_entry(&ocache_closing,
+					     struct nfs4_open_file, lru);
+		glist_del(&files[n]->lru);
+		--ocache_nclosing;
+		++n;
+	}
+	pthread_mutex_unlock(&ocache_lock);
+
+	return n;
+}
+
+int nfs4_ocache_closing_count(void)
+{
+	return ocache_nclosing;
+}
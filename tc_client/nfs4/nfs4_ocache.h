@@ -0,0 +1,167 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * A cache of files opened for reading, keyed by their absolute paths.  It
+ * keeps the filehandle and the open stateid of each file so that reads can
+ * be sent as PUTFH + READ without an OPEN and a CLOSE around them.
+ *
+ * Files are not closed by the cache itself: files evicted (in LRU order),
+ * idle for longer than the timeout, or invalidated are moved to a "closing"
+ * list once nobody uses them, and the caller pops them from that list to
+ * send the CLOSEs.  All functions are thread-safe.
+ *
+ * A file may also hold a read delegation granted by its OPEN.  While it is
+ * held, nobody else can change the file, so the caches above may use their
+ * copies of it without asking the server.  The delegation is returned along
+ * with the CLOSE of the file, which is how a recall by the server is served.
+ */
+
+#ifndef __TC_NFS4_OCACHE_H__
+#define __TC_NFS4_OCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ganesha_list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OCACHE_FHSIZE 128
+#define OCACHE_OTHERSIZE 12
+
+struct nfs4_open_file {
+	struct glist_head hash;	/* in its hash bucket */
+	struct glist_head lru;	/* in the LRU list, or the closing list */
+	uint64_t hashval;
+	uint64_t last_used_ns;
+	int refs;		/* # of users, not counting the cache */
+	bool cached;		/* still reachable by its path */
+	uint32_t fh_len;
+	char fh[OCACHE_FHSIZE];
+	uint32_t sid_seqid;	/* the open stateid */
+	char sid_other[OCACHE_OTHERSIZE];
+	bool deleg;		/* holding a read delegation? */
+	uint32_t deleg_seqid;	/* the delegation stateid */
+	char deleg_other[OCACHE_OTHERSIZE];
+	char path[];
+};
+
+/**
+ * Initialize the cache to keep at most "max_files" files open, each for at
+ * most "timeout_ms" milliseconds after its last use.  The cache is disabled
+ * if "max_files" is 0.
+ */
+int nfs4_ocache_init(uint32_t max_files, uint32_t timeout_ms);
+
+/**
+ * Move all files to the closing list and disable the cache.  The files
+ * still have to be popped and closed by the caller.
+ */
+void nfs4_ocache_deinit(void);
+
+bool nfs4_ocache_enabled(void);
+
+/**
+ * Get the opened file of "path".  The returned file should be released by
+ * nfs4_ocache_put().
+ */
+struct nfs4_open_file *nfs4_ocache_get(const char *path);
+
+void nfs4_ocache_put(struct nfs4_open_file *of);
+
+/**
+ * Add a file just opened.  If the path is already cached, e.g., opened
+ * concurrently by another thread, the new state is queued for closing.
+ * "deleg_other" is the delegation stateid granted by the OPEN, if any; if it
+ * has been recalled already, the file is queued for closing as well.
+ */
+void nfs4_ocache_add(const char *path, const char *fh, uint32_t fh_len,
+		     uint32_t sid_seqid, const char *sid_other,
+		     uint32_t deleg_seqid, const char *deleg_other);
+
+/**
+ * Whether the file of "path" is open with a read delegation.
+ */
+bool nfs4_ocache_has_deleg(const char *path);
+
+/**
+ * Serve a CB_RECALL of the delegation "deleg_other": the file holding it is
+ * dropped so that the delegation is returned when the file is closed.
+ * Returns false if no file holds the delegation (yet): it may have been
+ * granted by an OPEN whose reply is not processed yet, so the file is closed
+ * as soon as it is added.
+ */
+bool nfs4_ocache_recall(const char *deleg_other);
+
+/**
+ * Drop the file of "path" if it holds a delegation, e.g., because we are
+ * about to write the file ourselves.  Returns whether the file is dropped.
+ */
+bool nfs4_ocache_return_deleg(const char *path);
+
+/**
+ * Stop using the cached state of "of", e.g., because the server has
+ * rejected its stateid.
+ */
+void nfs4_ocache_drop(struct nfs4_open_file *of);
+
+/**
+ * Drop all files holding delegations, e.g., because the server has not been
+ * able to recall them for a while.
+ */
+void nfs4_ocache_drop_delegs(void);
+
+/**
+ * Drop the files of "path" and of all paths under it, e.g., because "path"
+ * has been removed or renamed.  Returns whether any of them holds a
+ * delegation.
+ */
+bool nfs4_ocache_invalidate(const char *path);
+
+/**
+ * Halve the number of files that can be kept open, e.g., because the server
+ * has run out of resources for open states.
+ */
+void nfs4_ocache_shrink(void);
+
+/**
+ * Drop files that have not been used in the timeout.
+ */
+void nfs4_ocache_expire(void);
+
+/**
+ * Pop at most "max" files to close into "files".  The caller should free()
+ * them after closing.  Returns the number of files popped.
+ */
+int nfs4_ocache_pop_closing(struct nfs4_open_file **files, int max);
+
+/**
+ * Number of files waiting to be closed.
+ */
+int nfs4_ocache_closing_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __TC_NFS4_OCACHE_H__ */
@@ -19,69 +19,152 @@
  */
 
 #include "session_slots.h"
+#include "tc_helper.h"
 
-// number of bits per word
-#define NBITSPW (sizeof(int) * 8)
+#define NWORDS(nslots)                                                         \
+	(((nslots) + SESSION_SLOT_BITS_PER_WORD - 1) /                         \
+	 SESSION_SLOT_BITS_PER_WORD)
 
-struct session_slot_table *new_session_slot_table()
+struct session_slot_table *new_session_slot_table(uint32_t nslots)
 {
-        int i;
+	int i;
 	struct session_slot_table *sst;
 
-	sst = malloc(sizeof(*sst));
+	if (nslots == 0 || nslots > SESSION_SLOT_TABLE_CAPACITY) {
+		nslots = SESSION_SLOT_TABLE_CAPACITY;
+	}
+
+	sst = malloc(sizeof(*sst) + nslots * sizeof(sst->slots[0]));
 	if (!sst) {
 		return NULL;
 	}
 
-	sst->free_slots = new_bitset(SESSION_SLOT_TABLE_CAPACITY);
+	sst->free_slots = calloc(NWORDS(nslots), sizeof(uint64_t));
 	if (!sst->free_slots) {
 		free(sst);
 		return NULL;
 	}
-	bs_set_all(sst->free_slots);
-
-        for (i = 0; i < SESSION_SLOT_TABLE_CAPACITY; ++i) {
-                sst->slots[i] = 1;
-        }
+	for (i = 0; i < nslots; ++i) {
+		sst->free_slots[i / SESSION_SLOT_BITS_PER_WORD] |=
+		    (1ULL << (i % SESSION_SLOT_BITS_PER_WORD));
+		sst->slots[i] = 1;
+	}
 
 	pthread_mutex_init(&sst->mutex, NULL);
 	pthread_cond_init(&sst->slot_cv, NULL);
-        sst->highest_used_slotid_plus1 = 0;
-	sst->server_highest_slotid = SESSION_SLOT_TABLE_CAPACITY - 1;
-	sst->target_highest_slotid = SESSION_SLOT_TABLE_CAPACITY - 1;
+	sst->waiters = 0;
+	sst->nslots = nslots;
+	sst->server_highest_slotid = nslots - 1;
+	sst->target_highest_slotid = nslots - 1;
 
 	return sst;
 }
 
 void del_session_slot_table(struct session_slot_table **sst)
 {
+	uint32_t i;
+
 	if (*sst) {
-		assert((*sst)->highest_used_slotid_plus1 == 0);
-		del_bitset((*sst)->free_slots);
+		for (i = 0; i < (*sst)->nslots; ++i) {
+			assert((*sst)->free_slots[i / SESSION_SLOT_BITS_PER_WORD] &
+			       (1ULL << (i % SESSION_SLOT_BITS_PER_WORD)));
+		}
+		pthread_cond_destroy(&(*sst)->slot_cv);
+		pthread_mutex_destroy(&(*sst)->mutex);
+		free((*sst)->free_slots);
 		free(*sst);
 		*sst = NULL;
 	}
 }
 
+/* The number of slots we may use now. */
+static uint32_t slot_limit(struct session_slot_table *sst)
+{
+	uint32_t limit = atomic_fetch_uint32_t(&sst->target_highest_slotid);
+	uint32_t server = atomic_fetch_uint32_t(&sst->server_highest_slotid);
+
+	limit = MIN(limit, server) + 1;
+	return MIN(limit, sst->nslots);
+}
+
+/* Try to take the lowest free slot below the limit; return -1 if none. */
+static int try_alloc_slot(struct session_slot_table *sst)
+{
+	uint32_t limit = slot_limit(sst);
+	uint32_t w;
+	uint32_t nbits;
+	uint64_t word;
+	uint64_t mask;
+	int bit;
+
+	for (w = 0; w * SESSION_SLOT_BITS_PER_WORD < limit; ++w) {
+		nbits = limit - w * SESSION_SLOT_BITS_PER_WORD;
+		mask = nbits >= SESSION_SLOT_BITS_PER_WORD
+			   ? ~0ULL
+			   : ((1ULL << nbits) - 1);
+		word = atomic_fetch_uint64_t(sst->free_slots + w);
+		while (word & mask) {
+			bit = __builtin_ctzll(word & mask);
+			if (__sync_bool_compare_and_swap(sst->free_slots + w,
+							 word,
+							 word & ~(1ULL << bit)))
+				return w * SESSION_SLOT_BITS_PER_WORD + bit;
+			word = atomic_fetch_uint64_t(sst->free_slots + w);
+		}
+	}
+
+	return -1;
+}
+
+/* The highest slotid in use, which is at least "slotid". */
+static uint32_t highest_used_slotid(struct session_slot_table *sst,
+				    int slotid)
+{
+	int w = NWORDS(sst->nslots) - 1;
+	uint64_t used;
+
+	for (; w >= slotid / SESSION_SLOT_BITS_PER_WORD; --w) {
+		used = ~atomic_fetch_uint64_t(sst->free_slots + w);
+		if (w == NWORDS(sst->nslots) - 1 &&
+		    sst->nslots % SESSION_SLOT_BITS_PER_WORD) {
+			used &= (1ULL << (sst->nslots %
+					  SESSION_SLOT_BITS_PER_WORD)) - 1;
+		}
+		if (used) {
+			return MAX(w * SESSION_SLOT_BITS_PER_WORD + 63 -
+				       __builtin_clzll(used),
+				   slotid);
+		}
+	}
+
+	return slotid;
+}
+
 int alloc_session_slot(struct session_slot_table *sst, uint32_t *sequence,
 		       uint32_t *highest_slotid)
 {
-	int slotid = -1;
+	int slotid;
+	TC_DECLARE_COUNTER(slot_wait);
 
-	pthread_mutex_lock(&sst->mutex);
-	slotid = bs_ffs(sst->free_slots);
-	while (slotid == -1 || slotid > sst->target_highest_slotid) {
-		// wait until a slot becomes available
-		pthread_cond_wait(&sst->slot_cv, &sst->mutex);
-		slotid = bs_ffs(sst->free_slots);
+	slotid = try_alloc_slot(sst);
+	if (slotid < 0) {
+		TC_START_COUNTER(slot_wait);
+		/*
+		 * Announce ourselves before retrying under the mutex, so that
+		 * free_session_slot() either sees us or we see its slot.
+		 */
+		atomic_inc_uint32_t(&sst->waiters);
+		pthread_mutex_lock(&sst->mutex);
+		while ((slotid = try_alloc_slot(sst)) < 0) {
+			pthread_cond_wait(&sst->slot_cv, &sst->mutex);
+		}
+		pthread_mutex_unlock(&sst->mutex);
+		atomic_dec_uint32_t(&sst->waiters);
+		TC_STOP_COUNTER(slot_wait, 1, true);
 	}
-	bs_reset(sst->free_slots, slotid);
-	if (slotid >= sst->highest_used_slotid_plus1) {
-		sst->highest_used_slotid_plus1 = slotid + 1;
-	}
-	*sequence = sst->slots[slotid];
-	*highest_slotid = sst->highest_used_slotid_plus1 - 1;
-	pthread_mutex_unlock(&sst->mutex);
+
+	*sequence = atomic_fetch_uint32_t(sst->slots + slotid);
+	*highest_slotid = highest_used_slotid(sst, slotid);
 
 	return slotid; /* slotid index starts from 0 instead of 1 */
 }
@@ -90,23 +173,30 @@ void free_session_slot(struct session_slot_table *sst, int slotid,
 		       uint32_t server_highest, uint32_t target_highest,
 		       bool sent)
 {
-	pthread_mutex_lock(&sst->mutex);
-	assert(!bs_get(sst->free_slots, slotid));
-	bs_set(sst->free_slots, slotid);
-	if (slotid + 1 == sst->highest_used_slotid_plus1) {
-		int s = slotid - 1;
-		while (s >= 0 && bs_get(sst->free_slots, s))
-			--s;
-		sst->highest_used_slotid_plus1 = s + 1;
-	}
+	uint32_t old_limit = slot_limit(sst);
+	uint64_t bit = 1ULL << (slotid % SESSION_SLOT_BITS_PER_WORD);
+	uint64_t *word = sst->free_slots + slotid / SESSION_SLOT_BITS_PER_WORD;
+
+	assert(slotid < sst->nslots);
+	assert(!(atomic_fetch_uint64_t(word) & bit));
 	if (sent) {
-		assert(server_highest + 1 >= sst->highest_used_slotid_plus1);
-		sst->server_highest_slotid = server_highest;
-		sst->target_highest_slotid = target_highest;
+		atomic_store_uint32_t(&sst->server_highest_slotid,
+				      server_highest);
+		atomic_store_uint32_t(&sst->target_highest_slotid,
+				      target_highest);
 		/* increment sequenceid */
 		atomic_inc_uint32_t(sst->slots + slotid);
 	}
-	if (slotid <= target_highest) {
+	atomic_set_uint64_t_bits(word, bit);
+
+	if (atomic_fetch_uint32_t(&sst->waiters) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&sst->mutex);
+	if (slot_limit(sst) > old_limit) {
+		/* the server raised its target: more than one can proceed */
+		pthread_cond_broadcast(&sst->slot_cv);
+	} else if (slotid < slot_limit(sst)) {
 		pthread_cond_signal(&sst->slot_cv);
 	}
 	pthread_mutex_unlock(&sst->mutex);
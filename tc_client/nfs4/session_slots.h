@@ -19,7 +19,12 @@
  */
 
 /**
- * A very simple session slot table for NFSv4.1 client.
+ * Session slot table for NFSv4.1 client.
+ *
+ * Slots are allocated from an atomic bitmap without locking.  The number of
+ * slots in use follows the target_highest_slotid of the server, up to the
+ * number of slots negotiated with CREATE_SESSION.  A mutex and a condition
+ * variable are only used by threads that have to wait for a slot.
  */
 
 #ifndef __TC_NFS4_SESSION_SLOTS_H__
@@ -31,22 +36,30 @@
 #include "abstract_atomic.h"
 #include "common_types.h"
 
-#define SESSION_SLOT_TABLE_CAPACITY 128
+/* the ca_maxrequests we ask for in CREATE_SESSION */
+#define SESSION_SLOT_TABLE_CAPACITY 1024
+
+#define SESSION_SLOT_BITS_PER_WORD 64
 
 struct session_slot_table {
-	pthread_mutex_t mutex;   /* protect used_slots */
+	pthread_mutex_t mutex;   /* only used to wait for slots */
 	pthread_cond_t slot_cv;  /* to wait for slots */
+	uint32_t waiters;        /* # of threads waiting for a slot */
+	uint32_t nslots;         /* # of slots negotiated with the server */
+	uint32_t server_highest_slotid;     /* highest slot server allows */
+	uint32_t target_highest_slotid;     /* target hightest server desires */
+	uint64_t *free_slots;    /* bitmap of free slots */
 	/**
 	 * A slotid is an index; each elements in slots is a sequenceid4.
 	 */
-	uint32_t slots[SESSION_SLOT_TABLE_CAPACITY];
-	uint32_t highest_used_slotid_plus1; /* highest outstanding slotid + 1*/
-	uint32_t server_highest_slotid;     /* highest slot server allows */
-	uint32_t target_highest_slotid;     /* target hightest server desires */
-        bitset_t *free_slots;               /* bitset of free slots */
+	uint32_t slots[];
 };
 
-struct session_slot_table *new_session_slot_table();
+/**
+ * Create a slot table of "nslots" slots, which is the ca_maxrequests the
+ * server returned in CREATE_SESSION.
+ */
+struct session_slot_table *new_session_slot_table(uint32_t nslots);
 
 /**
  * Not thread-safe; should not be called concurrently.
@@ -55,7 +68,8 @@ void del_session_slot_table(struct session_slot_table **sst);
 
 /**
  * Allocate a session slot to use.  When no slot is available, it puts the
- * calling thread to sleep until a slot becomes available.
+ * calling thread to sleep until a slot becomes available.  The time spent
+ * waiting is accounted in the "slot_wait" counter.
  *
  * It is called before a compound.  It is thread-safe.
  *
@@ -80,7 +94,7 @@ void free_session_slot(struct session_slot_table *sst, int slotid,
 static inline uint32_t get_slot_sequence(struct session_slot_table *sst,
 					 int slotid)
 {
-	assert(slotid < SESSION_SLOT_TABLE_CAPACITY);
+	assert(slotid < sst->nslots);
 	return atomic_fetch_uint32_t(sst->slots + slotid);
 }
 
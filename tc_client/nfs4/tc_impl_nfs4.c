@@ -18,6 +18,7 @@
  */
 
 #include <unistd.h>
+#include <pthread.h>
 #include "tc_impl_nfs4.h"
 #include "nfs4_util.h"
 #include "tc_helper.h"
@@ -26,6 +27,7 @@
 #include "../MainNFSD/nfs_init.h"
 #include "path_utils.h"
 #include "iovec_utils.h"
+#include "abstract_atomic.h"
 
 /*
  * Initialize tc_client
@@ -187,6 +189,14 @@ void *nfs4_init(const char *config_path, const char *log_path,
 	ctx->data_cache_size = exp->data_cache_size;
 	ctx->cache_expiration = exp->cache_expiration;
 	ctx->data_cache_expiration = exp->data_cache_expiration;
+	ctx->data_cache_huge_pages = exp->data_cache_huge_pages;
+	ctx->data_cache_disk_path = exp->data_cache_disk_path;
+	ctx->data_cache_disk_size = exp->data_cache_disk_size;
+	ctx->data_cache_shm_name = exp->data_cache_shm_name;
+	ctx->attr_cache_reg_min = exp->attr_cache_reg_min;
+	ctx->attr_cache_reg_max = exp->attr_cache_reg_max;
+	ctx->attr_cache_dir_min = exp->attr_cache_dir_min;
+	ctx->attr_cache_dir_max = exp->attr_cache_dir_max;
 	return (void*)ctx;
 }
 
@@ -405,7 +415,179 @@ static int nfs4_fill_fd_iovecs(struct viovec *iovs, int count)
 	return 0;
 }
 
-vres nfs4_do_iovec(struct viovec *iovs, int count, bool istxn,
+/*
+ * Parts of a non-transactional vector are independent, so they are sent
+ * concurrently by up to NFS4_MAX_PARALLEL_PARTS threads.  The threads are
+ * further throttled by the RPC contexts and session slots they block on.
+ *
+ * No part is started after a failed one, but parts already in flight are
+ * not undone: viovecs after the failed one may have been read or written.
+ */
+#define NFS4_MAX_PARALLEL_PARTS 16
+
+typedef vres (*nfs4_iovec_fn)(struct viovec *iovs, int count, bool istxn,
+			      struct vattrs *old_attrs,
+			      struct vattrs *new_attrs);
+
+struct nfs4_iovec_job {
+	struct viov_array *parts;
+	int nparts;
+	/* index of the first viovec (and attrs) of each part in the array
+	 * that was split */
+	int *attr_offsets;
+	bool istxn;
+	nfs4_iovec_fn fn;
+	struct vattrs *old_attrs;
+	struct vattrs *new_attrs;
+	uint32_t next_part;	/* the next part to be claimed */
+	pthread_mutex_t lock;	/* protect failed_part and res */
+	int failed_part;	/* the first failed part or nparts */
+	vres res;
+};
+
+/*
+ * Translate the index of a viovec of "part", whose first viovec is the
+ * "first"-th of the array that was split, to the index in that array.
+ */
+static int nfs4_part_index(const struct viov_array *part, int first,
+			   int index)
+{
+	int k;
+
+	for (k = 0; k < index && k < part->size; ++k) {
+		if (part->iovs[k].__is_last_of_multiparts) {
+			++first;
+		}
+	}
+	return first;
+}
+
+static void *nfs4_iovec_worker(void *arg)
+{
+	struct nfs4_iovec_job *job = arg;
+	struct viov_array *part;
+	vres tcres;
+	int i;
+
+	while ((i = atomic_postinc_uint32_t(&job->next_part)) < job->nparts) {
+		pthread_mutex_lock(&job->lock);
+		if (job->failed_part < i) {
+			/* do not start parts after a failed one */
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		pthread_mutex_unlock(&job->lock);
+
+		part = &job->parts[i];
+		tcres = job->fn(part->iovs, part->size, job->istxn,
+				job->old_attrs + job->attr_offsets[i],
+				job->new_attrs + job->attr_offsets[i]);
+		if (!vokay(tcres)) {
+			pthread_mutex_lock(&job->lock);
+			if (i < job->failed_part) {
+				job->failed_part = i;
+				job->res = tcres;
+				job->res.index = nfs4_part_index(
+				    part, job->attr_offsets[i], tcres.index);
+			}
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static vres nfs4_do_parts_concurrently(struct viov_array *parts, int nparts,
+				       bool istxn, nfs4_iovec_fn fn,
+				       struct vattrs *old_attrs,
+				       struct vattrs *new_attrs)
+{
+	struct nfs4_iovec_job job = {
+		.parts = parts,
+		.nparts = nparts,
+		.istxn = istxn,
+		.fn = fn,
+		.old_attrs = old_attrs,
+		.new_attrs = new_attrs,
+		.next_part = 0,
+		.failed_part = nparts,
+		.res = { .index = 0, .err_no = 0 },
+	};
+	pthread_t threads[NFS4_MAX_PARALLEL_PARTS - 1];
+	int nthreads = MIN(nparts, NFS4_MAX_PARALLEL_PARTS) - 1;
+	int i, k, j = 0;
+
+	job.attr_offsets = malloc(nparts * sizeof(int));
+	if (!job.attr_offsets) {
+		job.res.err_no = ENOMEM;
+		return job.res;
+	}
+	for (i = 0; i < nparts; ++i) {
+		job.attr_offsets[i] = j;
+		for (k = 0; k < parts[i].size; ++k) {
+			if (parts[i].iovs[k].__is_last_of_multiparts) {
+				++j;
+			}
+		}
+	}
+	pthread_mutex_init(&job.lock, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, nfs4_iovec_worker,
+				   &job) != 0) {
+			NFS4_WARN("only %d threads for %d parts", i + 1,
+				  nparts);
+			nthreads = i;
+			break;
+		}
+	}
+	/* the calling thread works too */
+	nfs4_iovec_worker(&job);
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.attr_offsets);
+	return job.res;
+}
+
+/*
+ * Make an array of vattrs for the merged viovecs: each starts as a copy of
+ * the vattrs of its first original viovec.
+ */
+static struct vattrs *nfs4_merge_attrs(const struct viov_merge *merge,
+				       const struct vattrs *attrs, int count)
+{
+	struct vattrs *mattrs;
+	int i;
+
+	if (!attrs)
+		return NULL;
+	mattrs = calloc(merge->merged.size, sizeof(*mattrs));
+	if (!mattrs)
+		return NULL;
+	for (i = count - 1; i >= 0; --i) {
+		mattrs[merge->owners[i]] = attrs[i];
+	}
+	return mattrs;
+}
+
+static void nfs4_unmerge_attrs(const struct viov_merge *merge,
+			       struct vattrs *mattrs, struct vattrs *attrs,
+			       int count)
+{
+	int i;
+
+	if (!mattrs)
+		return;
+	for (i = 0; i < count; ++i) {
+		tc_copy_attrs(&mattrs[merge->owners[i]], &attrs[i]);
+	}
+	free(mattrs);
+}
+
+vres nfs4_do_iovec(struct viovec *iovs, int count, bool istxn, bool is_write,
 		   vres (*fn)(struct viovec *iovs, int count, bool istxn,
 			      struct vattrs *old_attrs,
 			      struct vattrs *new_attrs),
@@ -416,6 +598,10 @@ vres nfs4_do_iovec(struct viovec *iovs, int count, bool istxn,
 	int nparts;
 	struct viov_array iova = VIOV_ARRAY_INITIALIZER(iovs, count);
 	struct viov_array *parts;
+	struct viov_merge *merge = NULL;
+	struct vattrs *orig_old_attrs = old_attrs;
+	struct vattrs *orig_new_attrs = new_attrs;
+	struct fsal_export *exp;
 	vres tcres;
 
 	for (i = 0; i < count; ++i) {
@@ -430,14 +616,48 @@ vres nfs4_do_iovec(struct viovec *iovs, int count, bool istxn,
 		return tcres;
 	}
 
+	if (!istxn && op_ctx->export) {
+		exp = op_ctx->export->fsal_export;
+		merge = tc_merge_iov_array(&iova,
+					   is_write ? exp->ops->fs_maxwrite(exp)
+						    : exp->ops->fs_maxread(exp),
+					   is_write);
+	}
+	if (merge) {
+		old_attrs = nfs4_merge_attrs(merge, orig_old_attrs, count);
+		new_attrs = nfs4_merge_attrs(merge, orig_new_attrs, count);
+		if ((orig_old_attrs && !old_attrs) ||
+		    (orig_new_attrs && !new_attrs)) {
+			/* send the viovecs as they are */
+			free(old_attrs);
+			free(new_attrs);
+			old_attrs = orig_old_attrs;
+			new_attrs = orig_new_attrs;
+			tc_free_iov_merge(&merge);
+		} else {
+			NFS4_DEBUG("merged %d iovecs into %d", count,
+				   merge->merged.size);
+			iova = merge->merged;
+		}
+	}
+
 	parts = tc_split_iov_array(&iova, CPD_LIMIT, &nparts);
 
+	/* parts of a write may reach the server in any order */
+	if (!istxn && nparts > 1 &&
+	    (!is_write || tc_iov_parts_are_independent(parts, nparts))) {
+		tcres = nfs4_do_parts_concurrently(parts, nparts, istxn, fn,
+						   old_attrs, new_attrs);
+		goto exit;
+	}
+
 	j = 0;
 	for (i = 0; i < nparts; ++i) {
 		tcres = fn(parts[i].iovs, parts[i].size, istxn, old_attrs + j,
 			   new_attrs + j);
 		if (!vokay(tcres)) {
-			/* TODO: FIX tcres */
+			tcres.index = nfs4_part_index(&parts[i], j,
+						      tcres.index);
 			goto exit;
 		}
 		for (k = 0; k < parts[i].size; ++k) {
@@ -449,6 +669,12 @@ vres nfs4_do_iovec(struct viovec *iovs, int count, bool istxn,
 
 exit:
 	vrestore_iov_array(&iova, &parts, nparts);
+	if (merge) {
+		nfs4_unmerge_attrs(merge, old_attrs, orig_old_attrs, count);
+		nfs4_unmerge_attrs(merge, new_attrs, orig_new_attrs, count);
+		iova = viovs2array(iovs, count);
+		tc_unmerge_iov_array(&iova, &merge, is_write, &tcres);
+	}
 	nfs4_clear_fd_iovecs(iovs, count);
 	return tcres;
 }
@@ -456,7 +682,8 @@ exit:
 vres nfs4_readv(struct viovec *iovs, int count, bool istxn,
 		struct vattrs *attrs)
 {
-	return nfs4_do_iovec(iovs, count, istxn, nfs4_do_readv, NULL, attrs);
+	return nfs4_do_iovec(iovs, count, istxn, false, nfs4_do_readv, NULL,
+			     attrs);
 }
 
 /*
@@ -499,12 +726,12 @@ vres nfs4_do_writev(struct viovec *iovs, int write_count, bool istxn,
 vres nfs4_writev(struct viovec *iovs, int count, bool istxn,
 		 struct vattrs *old_attrs, struct vattrs *new_attrs)
 {
-	return nfs4_do_iovec(iovs, count, istxn, nfs4_do_writev, old_attrs,
-			     new_attrs);
+	return nfs4_do_iovec(iovs, count, istxn, true, nfs4_do_writev,
+			     old_attrs, new_attrs);
 }
 
 vfile *nfs4_openv(const char **paths, int count, int *flags, mode_t *modes,
-		    struct vattrs *attrs)
+		    struct vattrs *attrs, vres *res)
 {
 	int i;
 	int finished;
@@ -516,9 +743,11 @@ vfile *nfs4_openv(const char **paths, int count, int *flags, mode_t *modes,
 	nfs_fh4 fh4;
 
 	if (export->fsal_export->obj_ops->vec_open == NULL) {
+		*res = vfailure(0, ENOTSUP);
 		return NULL;
 	}
 
+	*res = vfailure(count, 0);
 	sids = calloc(count, sizeof(*sids));
 	for (i = 0; i < count; ++i) {
 		if (flags[i] & O_CREAT) {
@@ -534,12 +763,8 @@ vfile *nfs4_openv(const char **paths, int count, int *flags, mode_t *modes,
 		tcres = export->fsal_export->obj_ops->vec_open(
 		    attrs + finished, count - finished, flags + finished,
 		    sids + finished);
-		if (!vokay(tcres)) {
-			nfs4_closev(tcfs, finished);
-			tcfs = NULL;
-			goto exit;
-		}
 
+		/* keep the files opened before a failed one */
 		for (i = finished; i < finished + tcres.index; ++i) {
 			fh4.nfs_fh4_len = attrs[i].file.handle->handle_bytes;
 			fh4.nfs_fh4_val =
@@ -551,9 +776,16 @@ vfile *nfs4_openv(const char **paths, int count, int *flags, mode_t *modes,
 			tc_put_fd_struct(&tcfd);
 		}
 		finished += tcres.index;
+		if (!vokay(tcres)) {
+			*res = vfailure(finished, tcres.err_no);
+			break;
+		}
+	}
+	if (finished == 0 && count > 0) {
+		free(tcfs);
+		tcfs = NULL;
 	}
 
-exit:
 	for (i = 0; i < count; ++i) {
 		if (attrs[i].file.type == VFILE_HANDLE) {
 			del_file_handle(
@@ -799,7 +1031,7 @@ vres nfs4_mkdirv(struct vattrs *dirs, int count, bool is_transaction)
 }
 
 vres nfs4_listdirv(const char **dirs, int count, struct vattrs_masks masks,
-		     int max_entries, bool recursive, vec_listdir_cb cb,
+		     int max_entries, bool recursive, vec_listdir_batch_cb cb,
 		     void *cbarg, bool is_transaction)
 {
 	struct gsh_export *exp = op_ctx->export;
@@ -941,3 +1173,27 @@ char *nfs4_getcwd()
 {
 	return op_ctx->fsal_export->obj_ops->sca_getcwd();
 }
+
+bool nfs4_has_delegation(const char *path)
+{
+	struct fsal_obj_ops *ops = op_ctx->fsal_export->obj_ops;
+
+	return ops->tc_has_delegation && ops->tc_has_delegation(path);
+}
+
+int nfs4_pop_dir_changes(const char *dir, struct nfs4_dir_update **updates)
+{
+	struct fsal_obj_ops *ops = op_ctx->fsal_export->obj_ops;
+
+	*updates = NULL;
+	return ops->tc_pop_dir_changes ? ops->tc_pop_dir_changes(dir, updates)
+				       : -1;
+}
+
+void nfs4_set_listdir_parallelism(unsigned int n)
+{
+	struct fsal_obj_ops *ops = op_ctx->fsal_export->obj_ops;
+
+	if (ops->tc_set_listdir_parallelism)
+		ops->tc_set_listdir_parallelism(n);
+}
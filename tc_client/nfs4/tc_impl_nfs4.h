@@ -40,6 +40,14 @@ struct cache_context {
 	uint64_t cache_expiration;
 	uint64_t data_cache_size;
 	uint64_t data_cache_expiration;
+	bool data_cache_huge_pages;
+	const char *data_cache_disk_path;
+	uint64_t data_cache_disk_size;
+	const char *data_cache_shm_name;
+	uint32_t attr_cache_reg_min;
+	uint32_t attr_cache_reg_max;
+	uint32_t attr_cache_dir_min;
+	uint32_t attr_cache_dir_max;
 };
 
 void *nfs4_init(const char *config_path, const char *log_path,
@@ -69,10 +77,12 @@ vres nfs4_writev(struct viovec *writes, int write_count,
 /**
  * Open a list of files specified by paths
  *
- * Returns a list of vfile that the caller is responsible for freeing.
+ * Returns a list of vfile that the caller is responsible for freeing.  Upon
+ * failure, "res" tells the file failed, and the files before it are open;
+ * NULL is returned if there is none.
  */
 vfile *nfs4_openv(const char **paths, int count, int *flags, mode_t *modes,
-		 struct vattrs *attrs);
+		 struct vattrs *attrs, vres *res);
 
 /**
  *
@@ -127,7 +137,7 @@ vres nfs4_removev(vfile *tc_files, int count, bool is_transaction);
 vres nfs4_mkdirv(struct vattrs *dirs, int count, bool is_transaction);
 
 vres nfs4_listdirv(const char **dirs, int count, struct vattrs_masks masks,
-		     int max_entries, bool recursive, vec_listdir_cb cb,
+		     int max_entries, bool recursive, vec_listdir_batch_cb cb,
 		     void *cbarg, bool is_transaction);
 
 vres nfs4_lcopyv(struct vextent_pair *pairs, int count, bool is_transaction);
@@ -145,6 +155,23 @@ int nfs4_chdir(const char *path);
 
 char *nfs4_getcwd();
 
+/**
+ * Whether "path" is delegated to us for reading, in which case its cached
+ * data and attributes need no revalidation.
+ */
+bool nfs4_has_delegation(const char *path);
+
+struct nfs4_dir_update;
+
+/**
+ * Pop the changes of "dir" notified by the server into "*updates", which the
+ * caller should free().  Returns the number of changes, or -1 if the listing
+ * of "dir" is not kept up to date by a directory delegation.
+ */
+int nfs4_pop_dir_changes(const char *dir, struct nfs4_dir_update **updates);
+
+void nfs4_set_listdir_parallelism(unsigned int n);
+
 #ifdef __cplusplus
 }
 #endif
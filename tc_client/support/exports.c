@@ -1155,6 +1155,22 @@ static struct config_item export_params[] = {
 			gsh_export, cache_expiration),
 	CONF_ITEM_UI64("DataCacheExpiration", 0, 10000000, 60000,
 		       gsh_export, data_cache_expiration),
+	CONF_ITEM_BOOL("DataCacheHugePages", false,
+		       gsh_export, data_cache_huge_pages),
+	CONF_ITEM_PATH("DataCacheDiskPath", 1, MAXPATHLEN, NULL,
+		       gsh_export, data_cache_disk_path),
+	CONF_ITEM_UI64("DataCacheDiskSize", 0, UINT64_MAX, 0,
+		       gsh_export, data_cache_disk_size),
+	CONF_ITEM_STR("DataCacheShmName", 1, MAXPATHLEN, NULL,
+		      gsh_export, data_cache_shm_name),
+	CONF_ITEM_UI32("AttrCacheRegMin", 0, 3600, 5,
+		       gsh_export, attr_cache_reg_min),
+	CONF_ITEM_UI32("AttrCacheRegMax", 0, 3600, 60,
+		       gsh_export, attr_cache_reg_max),
+	CONF_ITEM_UI32("AttrCacheDirMin", 0, 3600, 5,
+		       gsh_export, attr_cache_dir_min),
+	CONF_ITEM_UI32("AttrCacheDirMax", 0, 3600, 60,
+		       gsh_export, attr_cache_dir_max),
 	CONFIG_EOL
 };
 
@@ -1433,6 +1449,10 @@ void free_export_resources(struct gsh_export *export)
 		gsh_free(export->pseudopath);
 	if (export->FS_tag != NULL)
 		gsh_free(export->FS_tag);
+	if (export->data_cache_disk_path != NULL)
+		gsh_free(export->data_cache_disk_path);
+	if (export->data_cache_shm_name != NULL)
+		gsh_free(export->data_cache_shm_name);
 }
 
 /**
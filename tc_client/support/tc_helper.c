@@ -136,6 +136,8 @@ void tc_copy_attrs(const struct vattrs *src, struct vattrs *dst)
 		vattrs_set_mtime(dst, src->mtime);
 	if (src->masks.has_ctime)
 		vattrs_set_ctime(dst, src->ctime);
+	if (src->masks.has_change)
+		vattrs_set_change(dst, src->change);
 }
 
 bool tc_cmp_file(const vfile *tcf1, const vfile *tcf2)
@@ -147,9 +149,9 @@ bool tc_cmp_file(const vfile *tcf1, const vfile *tcf2)
 		return tcf1->fd == tcf2->fd;
 	case VFILE_PATH:
 	case VFILE_CURRENT:
-		return tcf1->type == tcf2->type &&
-		       ((tcf1->path == NULL && tcf2->path == NULL) ||
-			(strcmp(tcf1->path, tcf2->path) == 0));
+		if (tcf1->path == NULL || tcf2->path == NULL)
+			return tcf1->path == tcf2->path;
+		return strcmp(tcf1->path, tcf2->path) == 0;
 	case VFILE_HANDLE:
 		if (tcf1->handle->handle_bytes != tcf2->handle->handle_bytes)
 			return false;
@@ -157,7 +159,7 @@ bool tc_cmp_file(const vfile *tcf1, const vfile *tcf2)
 			return false;
 		return memcmp(tcf1->handle->f_handle,
 			      tcf2->handle->f_handle,
-			      tcf1->handle->handle_bytes);
+			      tcf1->handle->handle_bytes) == 0;
 	default:
 		return true;
 	}
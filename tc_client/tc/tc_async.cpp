@@ -0,0 +1,240 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/**
+ * Submission/completion queues on top of the blocking vec_* API.
+ *
+ * Each queue runs "depth" workers that issue the blocking calls, so up to
+ * "depth" compounds of one application thread are in flight at once.  The
+ * RPC layer already multiplexes concurrent callers over its pool of
+ * fs_rpc_io_context (matching replies by XID), which is what lets those
+ * compounds overlap on the wire.
+ */
+
+#include <errno.h>
+#include <assert.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tc_api.h"
+#include "tc_helper.h"
+
+#define VQUEUE_MAX_DEPTH 256
+
+struct vsubmission {
+	vticket ticket;
+	std::function<vres()> fn;
+	vec_async_cb cb;
+	void *cbarg;
+};
+
+struct _vqueue {
+	std::mutex mtx;
+	std::condition_variable sq_cond; /* signaled on new submissions */
+	std::condition_variable cq_cond; /* signaled on new completions */
+	std::deque<vsubmission> sq;
+	std::deque<vcompletion> cq;
+	std::vector<std::thread> workers;
+	vticket next_ticket;
+	int outstanding; /* submitted but not completed */
+	bool stopping;
+};
+
+static void vqueue_worker(vqueue *q)
+{
+	TC_DECLARE_COUNTER(async);
+
+	std::unique_lock<std::mutex> lk(q->mtx);
+	while (true) {
+		q->sq_cond.wait(lk, [q] { return q->stopping || !q->sq.empty(); });
+		if (q->sq.empty()) {
+			break; /* stopping and drained */
+		}
+		vsubmission sub = std::move(q->sq.front());
+		q->sq.pop_front();
+		lk.unlock();
+
+		TC_START_COUNTER(async);
+		vcompletion cpl;
+		cpl.ticket = sub.ticket;
+		cpl.res = sub.fn();
+		cpl.cbarg = sub.cbarg;
+		TC_STOP_COUNTER(async, 1, vokay(cpl.res));
+
+		if (sub.cb) {
+			sub.cb(&cpl);
+		}
+
+		lk.lock();
+		if (!sub.cb) {
+			q->cq.push_back(cpl);
+		}
+		--q->outstanding;
+		q->cq_cond.notify_all();
+	}
+}
+
+vqueue *vqueue_create(int depth)
+{
+	vqueue *q;
+
+	if (depth <= 0 || depth > VQUEUE_MAX_DEPTH) {
+		return NULL;
+	}
+
+	q = new vqueue();
+	q->next_ticket = VTICKET_INVALID + 1;
+	q->outstanding = 0;
+	q->stopping = false;
+	for (int i = 0; i < depth; ++i) {
+		q->workers.emplace_back(vqueue_worker, q);
+	}
+
+	return q;
+}
+
+void vqueue_destroy(vqueue *q)
+{
+	if (!q) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(q->mtx);
+		q->stopping = true;
+	}
+	q->sq_cond.notify_all();
+	for (auto &t : q->workers) {
+		t.join();
+	}
+	delete q;
+}
+
+static vticket vqueue_submit(vqueue *q, std::function<vres()> fn,
+			     vec_async_cb cb, void *cbarg)
+{
+	vticket t;
+
+	if (!q) {
+		return VTICKET_INVALID;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(q->mtx);
+		if (q->stopping) {
+			return VTICKET_INVALID;
+		}
+		t = q->next_ticket++;
+		q->sq.push_back(vsubmission{t, std::move(fn), cb, cbarg});
+		++q->outstanding;
+	}
+	q->sq_cond.notify_one();
+
+	return t;
+}
+
+vticket vec_read_async(vqueue *q, struct viovec *reads, int count,
+		       bool is_transaction, vec_async_cb cb, void *cbarg)
+{
+	return vqueue_submit(q,
+			     [=]() {
+				     return vec_read(reads, count,
+						     is_transaction);
+			     },
+			     cb, cbarg);
+}
+
+vticket vec_write_async(vqueue *q, struct viovec *writes, int count,
+			bool is_transaction, vec_async_cb cb, void *cbarg)
+{
+	return vqueue_submit(q,
+			     [=]() {
+				     return vec_write(writes, count,
+						      is_transaction);
+			     },
+			     cb, cbarg);
+}
+
+vticket vec_getattrs_async(vqueue *q, struct vattrs *attrs, int count,
+			   bool is_transaction, vec_async_cb cb, void *cbarg)
+{
+	return vqueue_submit(q,
+			     [=]() {
+				     return vec_getattrs(attrs, count,
+							 is_transaction);
+			     },
+			     cb, cbarg);
+}
+
+vticket vec_lgetattrs_async(vqueue *q, struct vattrs *attrs, int count,
+			    bool is_transaction, vec_async_cb cb, void *cbarg)
+{
+	return vqueue_submit(q,
+			     [=]() {
+				     return vec_lgetattrs(attrs, count,
+							  is_transaction);
+			     },
+			     cb, cbarg);
+}
+
+/* Caller must hold q->mtx */
+static int vqueue_reap(vqueue *q, struct vcompletion *cpls, int max)
+{
+	int n = 0;
+
+	while (n < max && !q->cq.empty()) {
+		cpls[n++] = q->cq.front();
+		q->cq.pop_front();
+	}
+
+	return n;
+}
+
+int vqueue_poll(vqueue *q, struct vcompletion *cpls, int max)
+{
+	std::lock_guard<std::mutex> lk(q->mtx);
+	return vqueue_reap(q, cpls, max);
+}
+
+int vqueue_wait(vqueue *q, struct vcompletion *cpls, int min, int max)
+{
+	std::unique_lock<std::mutex> lk(q->mtx);
+
+	assert(min <= max);
+	/*
+	 * Stop waiting when everything outstanding has completed, otherwise
+	 * we may wait forever for completions delivered by callbacks.
+	 */
+	q->cq_cond.wait(lk, [q, min] {
+		return (int)q->cq.size() >= min || q->outstanding == 0;
+	});
+
+	return vqueue_reap(q, cpls, max);
+}
+
+int vqueue_pending(vqueue *q)
+{
+	std::lock_guard<std::mutex> lk(q->mtx);
+	return q->outstanding + q->cq.size();
+}
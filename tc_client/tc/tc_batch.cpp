@@ -0,0 +1,263 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "tc_batch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "tc_helper.h"
+
+#define TC_BATCH_MAX_OPS 256
+
+static std::atomic<unsigned int> batch_window_us(0);
+static std::atomic<int> batch_max_ops(1);
+
+void sca_set_batching(unsigned int window_us, int max_ops)
+{
+	batch_max_ops = std::max(1, std::min(max_ops, TC_BATCH_MAX_OPS));
+	batch_window_us = window_us;
+}
+
+bool tc_batching_enabled(void)
+{
+	return batch_window_us > 0 && batch_max_ops > 1;
+}
+
+/**
+ * Collects requests of one kind from concurrent callers.  There is no
+ * dedicated thread: the first caller without a leader becomes the leader of
+ * the next batch, waits for the window to pass (or the batch to fill up),
+ * executes the batch on behalf of everyone, and wakes the others up.
+ */
+template <typename Req> class ScalarBatcher
+{
+public:
+	explicit ScalarBatcher(std::function<void(std::vector<Req *> &)> exec)
+	    : exec_(exec), has_leader_(false)
+	{
+	}
+
+	/* Block until "req" has been executed as part of a batch. */
+	void submit(Req *req)
+	{
+		std::unique_lock<std::mutex> lk(mtx_);
+		const size_t max_ops = batch_max_ops;
+
+		req->done = false;
+		pending_.push_back(req);
+		if (pending_.size() >= max_ops) {
+			cv_.notify_all(); /* the batch is full */
+		}
+
+		while (!req->done) {
+			if (has_leader_ || pending_.empty()) {
+				cv_.wait(lk);
+				continue;
+			}
+
+			has_leader_ = true;
+			auto deadline =
+			    std::chrono::steady_clock::now() +
+			    std::chrono::microseconds(batch_window_us.load());
+			cv_.wait_until(lk, deadline, [this, max_ops] {
+				return pending_.size() >= max_ops;
+			});
+			size_t n = std::min(pending_.size(), max_ops);
+			std::vector<Req *> batch(pending_.begin(),
+						 pending_.begin() + n);
+			pending_.erase(pending_.begin(), pending_.begin() + n);
+			has_leader_ = false;
+			cv_.notify_all(); /* somebody else can lead the rest */
+			lk.unlock();
+
+			exec_(batch);
+
+			lk.lock();
+			for (Req *r : batch) {
+				r->done = true;
+			}
+			cv_.notify_all();
+		}
+	}
+
+private:
+	std::function<void(std::vector<Req *> &)> exec_;
+	std::mutex mtx_;
+	std::condition_variable cv_;
+	std::vector<Req *> pending_;
+	bool has_leader_;
+};
+
+/*
+ * A non-transactional vec_* call stops at the first failure.  Run "fn" on
+ * [start, n) repeatedly: the failed request gets its errno, and the ones
+ * after it are retried.  "fail" records the errno of the i-th request.
+ */
+static void run_all(size_t n, std::function<vres(size_t start)> fn,
+		    std::function<void(size_t i, int err)> fail)
+{
+	size_t start = 0;
+
+	while (start < n) {
+		vres res = fn(start);
+		if (vokay(res)) {
+			break;
+		}
+		fail(start + res.index, res.err_no);
+		start += res.index + 1;
+	}
+}
+
+struct lgetattrs_req {
+	struct vattrs *attrs;
+	int err;
+	bool done;
+};
+
+static ScalarBatcher<lgetattrs_req> lgetattrs_batcher(
+    [](std::vector<lgetattrs_req *> &batch) {
+	    std::vector<struct vattrs> attrs(batch.size());
+	    for (size_t i = 0; i < batch.size(); ++i) {
+		    attrs[i] = *batch[i]->attrs;
+		    batch[i]->err = 0;
+	    }
+	    run_all(batch.size(),
+		    [&attrs](size_t start) {
+			    return vec_lgetattrs(attrs.data() + start,
+						 attrs.size() - start, false);
+		    },
+		    [&batch](size_t i, int err) { batch[i]->err = err; });
+	    for (size_t i = 0; i < batch.size(); ++i) {
+		    if (batch[i]->err == 0) {
+			    *batch[i]->attrs = attrs[i];
+		    }
+	    }
+    });
+
+int tc_batch_lgetattrs(struct vattrs *attrs)
+{
+	lgetattrs_req req;
+
+	req.attrs = attrs;
+	lgetattrs_batcher.submit(&req);
+	return req.err;
+}
+
+struct remove_req {
+	vfile file;
+	int err;
+	bool done;
+};
+
+static ScalarBatcher<remove_req> remove_batcher(
+    [](std::vector<remove_req *> &batch) {
+	    std::vector<vfile> files(batch.size());
+	    for (size_t i = 0; i < batch.size(); ++i) {
+		    files[i] = batch[i]->file;
+		    batch[i]->err = 0;
+	    }
+	    run_all(batch.size(),
+		    [&files](size_t start) {
+			    return vec_remove(files.data() + start,
+					      files.size() - start, false);
+		    },
+		    [&batch](size_t i, int err) { batch[i]->err = err; });
+    });
+
+int tc_batch_remove(const vfile *file)
+{
+	remove_req req;
+
+	req.file = *file;
+	remove_batcher.submit(&req);
+	return req.err;
+}
+
+struct open_req {
+	const char *path;
+	int flags;
+	mode_t mode;
+	vfile *file;
+	int err;
+	bool done;
+};
+
+static ScalarBatcher<open_req> open_batcher(
+    [](std::vector<open_req *> &batch) {
+	    std::vector<open_req *> reqs;
+	    std::vector<const char *> paths;
+	    std::vector<int> flags;
+	    std::vector<mode_t> modes;
+	    /* every caller owns and closes its own vfile */
+	    for (open_req *req : batch) {
+		    req->err = 0;
+		    req->file = (vfile *)malloc(sizeof(vfile));
+		    if (!req->file) {
+			    req->err = ENOMEM;
+			    continue;
+		    }
+		    reqs.push_back(req);
+		    paths.push_back(req->path);
+		    flags.push_back(req->flags);
+		    modes.push_back(req->mode);
+	    }
+	    run_all(reqs.size(),
+		    [&](size_t start) {
+			    vres res;
+			    vfile *files = vec_open_partly(
+				paths.data() + start, reqs.size() - start,
+				flags.data() + start, modes.data() + start,
+				&res);
+			    size_t n =
+				vokay(res) ? reqs.size() - start : res.index;
+			    for (size_t i = 0; i < n; ++i) {
+				    *reqs[start + i]->file = files[i];
+			    }
+			    free(files);
+			    return res;
+		    },
+		    [&reqs](size_t i, int err) {
+			    free(reqs[i]->file);
+			    reqs[i]->file = NULL;
+			    reqs[i]->err = err;
+		    });
+    });
+
+vfile *tc_batch_open(const char *path, int flags, mode_t mode)
+{
+	open_req req;
+
+	req.path = path;
+	req.flags = flags;
+	req.mode = mode;
+	open_batcher.submit(&req);
+	if (!req.file) {
+		errno = req.err;
+	}
+	return req.file;
+}
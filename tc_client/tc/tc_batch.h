@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/**
+ * Implicit batching of scalar calls made by different threads.
+ *
+ * When enabled with sca_set_batching(), a scalar call is held for a short
+ * window so that calls of the same kind from other threads can join it; the
+ * whole batch is then issued as one vec_* call (i.e., one compound).
+ */
+
+#ifndef __TC_BATCH_H__
+#define __TC_BATCH_H__
+
+#include "tc_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool tc_batching_enabled(void);
+
+/**
+ * Same as vec_lgetattrs(attrs, 1, false) but batched with other threads.
+ * Return the errno.
+ */
+int tc_batch_lgetattrs(struct vattrs *attrs);
+
+/**
+ * Same as vec_remove(file, 1, false) but batched with other threads.
+ * Return the errno.
+ */
+int tc_batch_remove(const vfile *file);
+
+/**
+ * Same as vec_open(&path, 1, &flags, &mode) but batched with other threads.
+ * Set errno upon failure.
+ */
+vfile *tc_batch_open(const char *path, int flags, mode_t mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TC_BATCH_H__
@@ -2,6 +2,7 @@
 #include <vector>
 
 #include "nfs4/tc_impl_nfs4.h"
+#include "nfs4/nfs4_ddeleg.h"
 #include "tc_nfs.h"
 #include "tc_helper.h"
 #include "path_utils.h"
@@ -9,11 +10,19 @@
 
 #include "../tc_cache/TC_MetaDataCache.h"
 #include "../tc_cache/TC_DataCache.h"
+#include "../tc_cache/TC_NegativeCache.h"
+#include "../tc_cache/TC_SingleFlight.h"
 
 using namespace std;
 
 TC_MetaDataCache<string, DirEntry > *mdCache = NULL;
 TC_DataCache *dataCache = NULL;
+TC_NegativeCache *negCache = NULL;
+// attributes of paths, and blocks of files, being fetched
+static TC_SingleFlight attrFlights;
+static TC_SingleFlight dataFlights;
+static AttrCacheTimeouts attrTimeouts = {MD_REFRESH_TIME, MD_REFRESH_TIME,
+					 MD_REFRESH_TIME, MD_REFRESH_TIME};
 
 // TODO: merge fd_to_path_map into tc_kfd
 unordered_map<int, string> *fd_to_path_map = NULL;;
@@ -30,14 +39,24 @@ int get_miss_count() {
 	return g_miss_count;
 }
 
-void init_page_cache(uint64_t size, uint64_t time)
+void init_page_cache(uint64_t size, uint64_t time, uint32_t reg_min,
+		     uint32_t reg_max, uint32_t dir_min, uint32_t dir_max)
 {
 	mdCache = new TC_MetaDataCache<string, DirEntry>(size, time);
+	negCache = new TC_NegativeCache(size);
+	attrTimeouts.reg_min = reg_min;
+	attrTimeouts.reg_max = std::max(reg_max, reg_min);
+	attrTimeouts.dir_min = dir_min;
+	attrTimeouts.dir_max = std::max(dir_max, dir_min);
 }
 
-void init_data_cache(uint64_t size, uint64_t time)
+void init_data_cache(uint64_t size, uint64_t time, bool huge_pages,
+		     const char *disk_path, uint64_t disk_size,
+		     const char *shm_name)
 {
-	dataCache = new TC_DataCache(size, time);
+	dataCache = new TC_DataCache(size * CACHE_BLOCK_SIZE, time, huge_pages,
+				     disk_path ? disk_path : "", disk_size,
+				     shm_name ? shm_name : "");
 	fd_to_path_map = new unordered_map<int, string>();
 	fd_to_path_mutex = new std::mutex();
 }
@@ -45,6 +64,7 @@ void init_data_cache(uint64_t size, uint64_t time)
 void deinit_page_cache()
 {
 	mdCache->clear();
+	negCache->clear();
 }
 
 void deinit_data_cache()
@@ -73,6 +93,39 @@ static void clear_fd_to_path(int fd)
 	fd_to_path_map->erase(fd);
 }
 
+// Our own changes of a directory are not necessarily notified to us, so the
+// next listing of the parent of "path" has to go to the server.
+static void invalidate_parent_listing(const char *path)
+{
+	slice_t dir = tc_path_dirname(path);
+	SharedPtr<DirEntry> dirElem =
+	    mdCache->get(std::string(dir.data, dir.size));
+
+	if (!dirElem.isNull()) {
+		dirElem->setDirListed(false);
+	}
+	negCache->remove(path);
+}
+
+// The version of the cached parent of "path", or 0 if it is not cached.
+static uint64_t parent_version(const char *path)
+{
+	slice_t dir = tc_path_dirname(path);
+	SharedPtr<DirEntry> dirElem =
+	    mdCache->get(std::string(dir.data, dir.size));
+
+	return dirElem.isNull() ? 0 : dirElem->version();
+}
+
+// Whether "path" is known not to exist.  Negative entries are kept as long as
+// the attributes of directories are when they have just changed.
+static bool is_negative(const char *path)
+{
+	return mdCache->get(path).isNull() &&
+	       negCache->lookup(path, parent_version(path),
+				attrTimeouts.dir_min);
+}
+
 /*
  * Update fileHandle for single vfile object
  */
@@ -160,15 +213,29 @@ void nfs_restoreIovec_FhToFilename(struct viovec *iovs, int count,
 	}
 }
 
-vfile *nfs_openv(const char **paths, int count, int *flags, mode_t *modes)
+vfile *nfs_openv(const char **paths, int count, int *flags, mode_t *modes,
+		 vres *res)
 {
 	vector<struct vattrs> attrs(count);
-	vres tcres = { .index = count, .err_no = 0 };
-	vfile *file;
+	vfile *file = NULL;
+	int n;
 
-	file = nfs4_openv(paths, count, flags, modes, attrs.data());
+	// Open the files before the first one known to be missing.
+	for (n = 0; n < count; n++) {
+		if (!(flags[n] & O_CREAT) && is_negative(paths[n])) {
+			break;
+		}
+	}
+	*res = vfailure(n, n < count ? ENOENT : 0);
+	if (n > 0) {
+		vres tcres;
+		file = nfs4_openv(paths, n, flags, modes, attrs.data(), &tcres);
+		if (!vokay(tcres)) {
+			*res = tcres;
+		}
+	}
 
-	for (int i = 0; file && i < tcres.index; i++) {
+	for (int i = 0; file && i < res->index; i++) {
 		SharedPtr<DirEntry> ptrElem = mdCache->get(paths[i]);
 		if (!ptrElem.isNull()) {
 			if (!ptrElem->refreshAttrs(&attrs[i], true)) {
@@ -181,6 +248,9 @@ vfile *nfs_openv(const char **paths, int count, int *flags, mode_t *modes)
 			mdCache->add(paths[i], de);
 		}
 		add_fd_to_path(file[i].fd, paths[i]);
+		if (flags[i] & O_CREAT) {
+			invalidate_parent_listing(paths[i]);
+		}
 	}
 	return file;
 }
@@ -235,18 +305,62 @@ static const char *get_path(const vfile *vf)
 	return p;
 }
 
+// Whether the cached metadata of "p" can be used without asking the server:
+// either it has been validated recently, or the file is delegated to us so
+// that nobody else can have changed it.
+static bool md_is_fresh(const char *p, const SharedPtr<DirEntry> &ptrElem)
+{
+	return !ptrElem.isNull() &&
+	       (ptrElem->isFresh(attrTimeouts) || nfs4_has_delegation(p));
+}
+
+// Read "iov" from the data cache, including the disk cache, given the
+// attributes of the file just validated with the server.  Returns the number
+// of bytes read.
+static size_t load_dataCache(struct viovec *iov, SharedPtr<DirEntry> ptrElem,
+			     const struct vattrs *attrs, size_t *miss_offset,
+			     size_t *miss_length)
+{
+	const char *p = get_path(&iov->file);
+	bool revalidate = false;
+
+	if (ptrElem.isNull()) {
+		DirEntry de(p, attrs);
+		mdCache->add(p, de);
+	} else if (!ptrElem->refreshAttrs(attrs, true)) {
+		dataCache->remove(p);
+		ptrElem->refreshAttrs(attrs, false);
+		return 0;
+	}
+	size_t hit = dataCache->get(p, iov->offset, iov->length, iov->data,
+				    &revalidate, miss_offset, miss_length,
+				    &attrs->ctime);
+	if (hit > 0 && attrs->size <= iov->offset + iov->length) {
+		iov->is_eof = true;
+	}
+	return hit;
+}
+
 // hitArray[i] tells where the i-th I/O is a full cache hit.
+//
+// For I/Os that are partially cached, only the range covering the bytes not
+// cached is read, and "req_lengths" saves the requested length of each read.
 struct viovec *check_dataCache(struct viovec *siovec, int count,
-			       int *miss_count, std::vector<bool> &hitArray)
+			       int *miss_count, std::vector<bool> &hitArray,
+			       std::vector<size_t> &req_lengths)
 {
 	struct viovec *final_iovec = NULL;
 	struct viovec *cur_siovec = NULL;
 	struct viovec *cur_fiovec = NULL;
 	vector<size_t> hits(count, 0);
+	vector<size_t> miss_offsets(count, 0);
+	vector<size_t> miss_lengths(count, 0);
 	int revalidate_count = 0;
 	int i = 0;
 	bool revalidate = false;
 	vector<bool> reval(count, false);
+	// whether to read again from the cache once the ctime is validated
+	vector<bool> reload(count, false);
 	vector<struct vattrs> attrs(count);
 
 	final_iovec = (struct viovec *)malloc(sizeof(struct viovec) * count);
@@ -263,17 +377,35 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 			continue;
 		}
 		const char *p = get_path(&cur_siovec->file);
+		SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+		bool md_fresh = md_is_fresh(p, ptrElem);
+		struct timespec ctime;
+		if (md_fresh) {
+			ctime = ptrElem->getCtime();
+		}
 		int hit =
 		    dataCache->get(p, cur_siovec->offset, cur_siovec->length,
-				   cur_siovec->data, &revalidate);
+				   cur_siovec->data, &revalidate,
+				   &miss_offsets[i], &miss_lengths[i],
+				   md_fresh ? &ctime : nullptr);
 		if (hit == 0) {
 			hits[i] = 0;
 			reval[i] = false;
+			// Blocks in the disk cache can be used once the ctime
+			// is validated.
+			if (!md_fresh &&
+			    dataCache->isOnDisk(p, cur_siovec->offset,
+						cur_siovec->length)) {
+				reval[i] = true;
+				reload[i] = true;
+				attrs[revalidate_count].file = cur_siovec->file;
+				attrs[revalidate_count].masks = VATTRS_MASK_ALL;
+				revalidate_count++;
+			}
 			continue;
 		}
-		SharedPtr<DirEntry> ptrElem = mdCache->get(p);
-		if (revalidate == false && !ptrElem.isNull() &&
-		    (time(NULL) - ptrElem->getTimestamp() <= MD_REFRESH_TIME)) {
+		// Blocks of a delegated file need no revalidation either.
+		if (md_fresh && (!revalidate || nfs4_has_delegation(p))) {
 			hits[i] = hit;
 			reval[i] = false;
 			if (ptrElem->getFileSize() <=
@@ -290,9 +422,15 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 			revalidate_count++;
 		}
 		else {
+			// The data was cached by another process sharing the
+			// cache, or before the metadata expired; it can be
+			// used once the ctime is validated.
 			hits[i] = 0;
-			reval[i] = false;
-			//Remove from data cache?
+			reval[i] = true;
+			reload[i] = true;
+			attrs[revalidate_count].file = cur_siovec->file;
+			attrs[revalidate_count].masks = VATTRS_MASK_ALL;
+			revalidate_count++;
 		}
 	}
 
@@ -310,8 +448,16 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 				cur_siovec = siovec + k;
 				const char *p = get_path(&cur_siovec->file);
 				SharedPtr<DirEntry> ptrElem = mdCache->get(p);
-				if (ptrElem.isNull() ||
-				    !ptrElem->validate(&attrs[l].ctime)) {
+				if (reload[k]) {
+					hits[k] = load_dataCache(
+					    cur_siovec, ptrElem, &attrs[l],
+					    &miss_offsets[k], &miss_lengths[k]);
+				} else if (ptrElem.isNull()) {
+					hits[k] = 0;
+				} else if (!ptrElem->refreshAttrs(&attrs[l],
+								  true)) {
+					dataCache->remove(p);
+					ptrElem->refreshAttrs(&attrs[l], false);
 					hits[k] = 0;
 				} else if (ptrElem->getFileSize() <=
 					   cur_siovec->offset +
@@ -327,6 +473,7 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 	}
 
 	*miss_count = 0;
+	req_lengths.clear();
 	for (i = 0; i < count; ++i) {
 		cur_siovec = siovec + i;
 		if (hits[i] == 0) {
@@ -346,6 +493,7 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 				cur_fiovec->file.path = new_path;
 				cur_fiovec->file.type = VFILE_PATH;
 			}
+			req_lengths.push_back(cur_fiovec->length);
 			(*miss_count)++;
 		} else if (hits[i] >= cur_siovec->length) {
 			/* Cache hit */
@@ -355,9 +503,11 @@ struct viovec *check_dataCache(struct viovec *siovec, int count,
 			// requires miss_count to be initialized by user
 			cur_fiovec = final_iovec + *miss_count;
 			fill_newIovec(cur_fiovec, cur_siovec);
-			cur_fiovec->offset += hits[i];
-			cur_fiovec->length = cur_fiovec->length - hits[i];
-			cur_fiovec->data = cur_fiovec->data + hits[i];
+			cur_fiovec->offset = miss_offsets[i];
+			cur_fiovec->length = miss_lengths[i];
+			cur_fiovec->data = cur_siovec->data +
+					   (miss_offsets[i] - cur_siovec->offset);
+			req_lengths.push_back(cur_fiovec->length);
 			(*miss_count)++;
 		}
 	}
@@ -367,7 +517,8 @@ exit:
 }
 
 static void update_dataCache(struct viovec *siovec, struct viovec *final_iovec,
-			     int count, std::vector<bool> &hitArray)
+			     int count, std::vector<bool> &hitArray,
+			     const std::vector<size_t> &req_lengths)
 {
         int j = 0;
         struct viovec *cur_siovec = NULL;
@@ -386,28 +537,83 @@ static void update_dataCache(struct viovec *siovec, struct viovec *final_iovec,
 		}
 
 		const char *p = get_path(&cur_siovec->file);
+		SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+		struct timespec ctime = {0, 0};
+		if (!ptrElem.isNull()) {
+			ctime = ptrElem->getCtime();
+		}
 		dataCache->put(p, cur_fiovec->offset, cur_fiovec->length,
-			       cur_fiovec->data);
-		cur_siovec->length = cur_fiovec->length + cur_fiovec->offset -
-				     cur_siovec->offset;
+			       cur_fiovec->data, &ctime);
+		// The read of a partial hit may end before the cached bytes.
+		bool read_to_end = cur_fiovec->offset + req_lengths[j - 1] ==
+				   cur_siovec->offset + cur_siovec->length;
+		if (cur_fiovec->length < req_lengths[j - 1]) {
+			cur_siovec->length = cur_fiovec->length +
+					     cur_fiovec->offset -
+					     cur_siovec->offset;
+		}
+		if (read_to_end || cur_fiovec->length < req_lengths[j - 1]) {
+			cur_siovec->is_eof = cur_fiovec->is_eof;
+		}
 		cur_siovec->is_failure = cur_fiovec->is_failure;
-		cur_siovec->is_eof = cur_fiovec->is_eof;
 		cur_siovec->is_write_stable = cur_fiovec->is_write_stable;
         }
 }
 
+// Keys of the blocks read by "iovs".
+static vector<string> block_keys(const struct viovec *iovs, int count)
+{
+	vector<string> keys;
+
+	for (int i = 0; i < count; ++i) {
+		if ((iovs[i].file.type != VFILE_PATH &&
+		     iovs[i].file.type != VFILE_DESCRIPTOR) ||
+		    iovs[i].length == 0) {
+			continue;
+		}
+		string p = get_path(&iovs[i].file);
+		size_t first = iovs[i].offset / CACHE_BLOCK_SIZE;
+		size_t last =
+		    (iovs[i].offset + iovs[i].length - 1) / CACHE_BLOCK_SIZE;
+		for (size_t b = first; b <= last; ++b) {
+			keys.push_back(p + ":" + std::to_string(b));
+		}
+	}
+
+	return keys;
+}
+
 vres nfs_readv(struct viovec *iovs, int count, bool istxn)
 {
 	vres tcres = { .index = count, .err_no = 0 };
 	std::vector<bool> hitArray(count, false);
+	std::vector<size_t> req_lengths;
 	int miss_count = 0;
 	std::vector<struct vattrs> attrs(count);
 
+	std::vector<string> keys;
+	std::vector<string> led;
+
 	viovec *final_iovec =
-	    check_dataCache(iovs, count, &miss_count, hitArray);
+	    check_dataCache(iovs, count, &miss_count, hitArray, req_lengths);
 	if (final_iovec == NULL) {
 		return vfailure(0, ENOMEM);
 	}
+	keys = block_keys(final_iovec, miss_count);
+	if (!dataFlights.begin(keys, &led)) {
+		// others are reading some of the blocks; use their reads
+		dataFlights.end(led);
+		led.clear();
+		free(final_iovec);
+		dataFlights.wait(keys);
+		hitArray.assign(count, false);
+		final_iovec = check_dataCache(iovs, count, &miss_count,
+					      hitArray, req_lengths);
+		if (final_iovec == NULL) {
+			return vfailure(0, ENOMEM);
+		}
+		dataFlights.begin(block_keys(final_iovec, miss_count), &led);
+	}
 
 	vector<vfile> saved_tcfs =
 	    nfs_updateIovec_FilenameToFh(final_iovec, miss_count);
@@ -430,15 +636,141 @@ vres nfs_readv(struct viovec *iovs, int count, bool istxn)
 				mdCache->add(p, de);
 			}
 		}
-		update_dataCache(iovs, final_iovec, count, hitArray);
+		update_dataCache(iovs, final_iovec, count, hitArray,
+				 req_lengths);
 	}
 
 exit:
+	dataFlights.end(led);
 	// TODO fix new_path memory leak
 	free(final_iovec);
 	return tcres;
 }
 
+// Lease the cached data of "iov" if both the data and the metadata of the
+// file are fresh.
+static bool lease_dataCache(struct viovec *iov, vector<DataLease> *dls)
+{
+	bool revalidate = false;
+	size_t nleased = dls->size();
+
+	if (!cacheable(&iov->file)) {
+		return false;
+	}
+	const char *p = get_path(&iov->file);
+	SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+	if (!md_is_fresh(p, ptrElem)) {
+		return false;
+	}
+	struct timespec ctime = ptrElem->getCtime();
+	if (!dataCache->lease(p, iov->offset, iov->length, dls, &revalidate,
+			      &ctime)) {
+		return false;
+	}
+	if (revalidate && !nfs4_has_delegation(p)) {
+		while (dls->size() > nleased) {
+			dataCache->release(dls->back());
+			dls->pop_back();
+		}
+		return false;
+	}
+	if (ptrElem->getFileSize() <= iov->offset + iov->length) {
+		iov->is_eof = true;
+	}
+	return true;
+}
+
+vres nfs_readv_leased(struct viovec *iovs, int count, bool istxn,
+		      struct vleased_read *leases)
+{
+	vres tcres = { .index = count, .err_no = 0 };
+	vector<DataLease> dls;
+	vector<int> misses;
+	vector<struct viovec> miss_iovs;
+	size_t nleased = 0;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (iovs[i].length > 0 && lease_dataCache(iovs + i, &dls)) {
+			leases[i].count = dls.size() - nleased;
+			nleased = dls.size();
+			continue;
+		}
+		// The current filehandle is set by the preceding read, which
+		// is not sent if leased.
+		if (iovs[i].file.type == VFILE_CURRENT && i > 0 &&
+		    leases[i - 1].count > 0) {
+			for (auto &dl : dls) {
+				dataCache->release(dl);
+			}
+			for (int k = 0; k < count; ++k) {
+				leases[k].count = 0;
+			}
+			return nfs_readv(iovs, count, istxn);
+		}
+		misses.push_back(i);
+		miss_iovs.push_back(iovs[i]);
+	}
+
+	if (!misses.empty()) {
+		tcres = nfs_readv(miss_iovs.data(), misses.size(), istxn);
+		if (!vokay(tcres)) {
+			for (auto &dl : dls) {
+				dataCache->release(dl);
+			}
+			for (i = 0; i < count; ++i) {
+				leases[i].count = 0;
+			}
+			tcres.index = misses[tcres.index];
+			return tcres;
+		}
+		for (size_t k = 0; k < misses.size(); ++k) {
+			iovs[misses[k]] = miss_iovs[k];
+		}
+	}
+
+	auto dl = dls.begin();
+	for (i = 0; i < count; ++i) {
+		if (leases[i].count == 0) {
+			continue;
+		}
+		leases[i].leases = (struct vlease *)malloc(
+		    sizeof(struct vlease) * leases[i].count);
+		if (leases[i].leases == NULL) {
+			// Fall back to copying.
+			char *buf = iovs[i].data;
+			for (int k = 0; k < leases[i].count; ++k, ++dl) {
+				memcpy(buf, dl->data, dl->length);
+				buf += dl->length;
+				dataCache->release(*dl);
+			}
+			leases[i].count = 0;
+			continue;
+		}
+		for (int k = 0; k < leases[i].count; ++k, ++dl) {
+			leases[i].leases[k].data = dl->data;
+			leases[i].leases[k].length = dl->length;
+			leases[i].leases[k].handle = dl->block;
+		}
+	}
+
+	return tcres;
+}
+
+void nfs_release_leases(struct vleased_read *leases, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		for (int k = 0; k < leases[i].count; ++k) {
+			struct vlease *l = leases[i].leases + k;
+			dataCache->release(
+			    DataLease{l->data, l->length, l->handle});
+		}
+		free(leases[i].leases);
+		leases[i].count = 0;
+		leases[i].leases = NULL;
+	}
+}
+
 vres check_and_remove(const struct viovec *writes, int write_count,
 		      const struct vattrs *old_attrs)
 {
@@ -454,7 +786,7 @@ vres check_and_remove(const struct viovec *writes, int write_count,
 		SharedPtr<DirEntry> ptrElem = mdCache->get(p);
 		if (!ptrElem.isNull() && dataCache->isCached(p)) {
 			//If present in both, validate
-			if (!ptrElem->validate(&old_attrs[i].ctime)) {
+			if (!ptrElem->validate(&old_attrs[i])) {
 				dataCache->remove(p);
 			}
 		}
@@ -499,7 +831,10 @@ vres nfs_writev(struct viovec *writes, int write_count, bool is_transaction)
 						 writes[i].length;
 				}
 				dataCache->put(p, offset, writes[i].length,
-					       writes[i].data);
+					       writes[i].data, &attrs[i].ctime);
+				if (writes[i].is_creation) {
+					invalidate_parent_listing(p);
+				}
 			}
 		}
 	}
@@ -565,8 +900,7 @@ static struct vattrs *getattr_check_metacache(struct vattrs *sAttrs, int count,
 		}
 
 		SharedPtr<DirEntry> ptrElem = mdCache->get(p);
-		if (!ptrElem.isNull() &&
-		    (time(NULL) - ptrElem->getTimestamp() <= MD_REFRESH_TIME)) {
+		if (md_is_fresh(p, ptrElem)) {
 			/* Cache hit */
 			ptrElem->getAttrs(&sAttrs[i]);
 			hitArray[i] = true;
@@ -598,14 +932,25 @@ static void getattr_update_metacache(struct vattrs *sAttrs,
 		cur_fAttr = final_attrs + j++;
 		if (cacheable(&cur_fAttr->file)) {
 			const char *p = get_path(&cur_fAttr->file);
-			DirEntry de1(p, cur_fAttr);
-			mdCache->add(p, de1);
+			SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+			if (ptrElem.isNull()) {
+				DirEntry de1(p, cur_fAttr);
+				mdCache->add(p, de1);
+			} else if (!ptrElem->refreshAttrs(cur_fAttr, true)) {
+				// the listing of a changed directory is stale,
+				// unless we are notified of the changes
+				if (!nfs4_ddeleg_held(p)) {
+					ptrElem->setDirListed(false);
+				}
+				ptrElem->refreshAttrs(cur_fAttr, false);
+			}
 		}
 		tc_attrs2attrs(cur_sAttr, cur_fAttr);
 	}
 }
 
-vres nfs_lgetattrsv(struct vattrs *attrs, int count, bool is_transaction)
+static vres lgetattrs_cached(struct vattrs *attrs, int count,
+			     bool is_transaction)
 {
 	vres tcres = { .index = count, .err_no = 0 };
 	struct vattrs *final_attrs = NULL;
@@ -627,6 +972,10 @@ vres nfs_lgetattrsv(struct vattrs *attrs, int count, bool is_transaction)
 
 	if (vokay(tcres)) {
 		getattr_update_metacache(attrs, final_attrs, count, hitArray);
+	} else if (tcres.err_no == ENOENT && tcres.index < miss_count &&
+		   final_attrs[tcres.index].file.type == VFILE_PATH) {
+		const char *p = final_attrs[tcres.index].file.path;
+		negCache->add(p, parent_version(p));
 	}
 
 exit:
@@ -645,6 +994,53 @@ exit:
 	return tcres;
 }
 
+// Keys of the attributes of "attrs" that are to be got from the server.
+static vector<string> attr_keys(const struct vattrs *attrs, int count)
+{
+	vector<string> keys;
+
+	for (int i = 0; i < count; ++i) {
+		const char *p = attrs[i].file.path;
+		if (attrs[i].file.type == VFILE_PATH &&
+		    !md_is_fresh(p, mdCache->get(p))) {
+			keys.push_back(p);
+		}
+	}
+
+	return keys;
+}
+
+vres nfs_lgetattrsv(struct vattrs *attrs, int count, bool is_transaction)
+{
+	int n = 0;
+
+	while (n < count && !(attrs[n].file.type == VFILE_PATH &&
+			      is_negative(attrs[n].file.path))) {
+		++n;
+	}
+
+	vector<string> led;
+	if (!attrFlights.begin(attr_keys(attrs, n), &led)) {
+		// others are getting some of the attributes; use theirs
+		attrFlights.end(led);
+		led.clear();
+		attrFlights.wait(attr_keys(attrs, n));
+		attrFlights.begin(attr_keys(attrs, n), &led);
+	}
+
+	vres tcres = { .index = n, .err_no = 0 };
+	if (n > 0) {
+		tcres = lgetattrs_cached(attrs, n, is_transaction);
+	}
+	attrFlights.end(led);
+	if (n < count && vokay(tcres)) {
+		// answered locally: attrs[n] does not exist
+		return vfailure(n, ENOENT);
+	}
+
+	return tcres;
+}
+
 static void setattr_update_pagecache(struct vattrs *sAttrs, int count)
 {
 	int i = 0;
@@ -682,38 +1078,117 @@ vres nfs_lsetattrsv(struct vattrs *attrs, int count, bool is_transaction)
 
 struct ListDirCbData
 {
-	vec_listdir_cb cb;
+	vec_listdir_batch_cb cb;
 	void *cbarg;
 	struct vattrs_masks masks;
+	int nentries;	// entries passed to "cb"
+	bool stopped;	// "cb" asked to stop the listing
 };
 
-static bool poco_direntry(const struct vattrs *dentry, const char *dir,
-			  void *cbarg)
+static bool poco_direntries(const struct vattrs *dentries, int count,
+			    const char *dir, void *cbarg)
 {
 	struct ListDirCbData *cbdata = (struct ListDirCbData *)cbarg;
-	struct vattrs finalDentry;
+	vector<struct vattrs> finalDentries(count);
 
 	SharedPtr<DirEntry> parentElem = mdCache->get(dir);
 	if (!parentElem.isNull()) {
-		SharedPtr<DirEntry> ptrElem = mdCache->get(dentry->file.path);
-		if (ptrElem.isNull()) {
-			DirEntry de1(dentry, parentElem);
-			mdCache->add(dentry->file.path, de1);
-			ptrElem = mdCache->get(dentry->file.path);
-		} else {
-			ptrElem->setAttrsAndParent(dentry, parentElem);
+		vector<pair<string, SharedPtr<DirEntry>>> children;
+		children.reserve(count);
+		for (int i = 0; i < count; ++i) {
+			const char *p = dentries[i].file.path;
+			SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+			if (ptrElem.isNull()) {
+				ptrElem = new DirEntry(&dentries[i], parentElem);
+				mdCache->add(p, ptrElem);
+			} else {
+				ptrElem->setAttrsAndParent(&dentries[i],
+							   parentElem);
+			}
+			children.emplace_back(p, ptrElem);
 		}
+		parentElem->addChildren(children);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		finalDentries[i].masks = cbdata->masks;
+		tc_attrs2attrs(&finalDentries[i], &dentries[i]);
+	}
+
+	cbdata->nentries += count;
+	if (!(cbdata->cb)(finalDentries.data(), count, dir, cbdata->cbarg)) {
+		cbdata->stopped = true;
+		return false;
+	}
+	return true;
+}
 
-		parentElem->addChild(dentry->file.path, ptrElem);
+// Apply a change of "dir" notified by the server to its cached listing.
+// Returns false if the listing cannot be kept up to date with it.
+static bool apply_dir_update(const char *dir, SharedPtr<DirEntry> &dirElem,
+			     struct nfs4_dir_update *u)
+{
+	char p[PATH_MAX];
+
+	if (tc_path_join(dir, u->name, p, PATH_MAX) < 0) {
+		return false;
+	}
+
+	if (u->type == NFS4_DIR_ENTRY_REMOVED) {
+		dirElem->removeChild(p);
+		mdCache->remove(p);
+		dataCache->remove(p);
+		return true;
 	}
 
-	finalDentry.masks = cbdata->masks;
-	tc_attrs2attrs(&finalDentry, dentry);
-	(cbdata->cb)(&finalDentry, dir, cbdata->cbarg);
+	// the type of an entry is needed to list it
+	if (!u->attrs.masks.has_mode) {
+		return false;
+	}
+	u->attrs.file = vfile_from_path(p);
+	SharedPtr<DirEntry> ptrElem = mdCache->get(p);
+	if (ptrElem.isNull()) {
+		DirEntry de(&u->attrs, dirElem);
+		mdCache->add(p, de);
+		ptrElem = mdCache->get(p);
+	} else {
+		if (!ptrElem->validate(&u->attrs)) {
+			dataCache->remove(p);
+		}
+		ptrElem->refreshAttrs(&u->attrs, false);
+	}
+	dirElem->addChild(p, ptrElem);
 
 	return true;
 }
 
+// Whether the cached listing of "dir" can be used without asking the server:
+// either it has been listed recently, or it is kept up to date by the
+// changes the server notifies us of while the directory is delegated to us.
+static bool listing_is_fresh(const char *dir, SharedPtr<DirEntry> &dirElem)
+{
+	struct nfs4_dir_update *updates;
+	bool fresh = true;
+
+	int n = nfs4_pop_dir_changes(dir, &updates);
+	if (n < 0) {
+		return !dirElem.isNull() && dirElem->hasDirListed() &&
+		       dirElem->isFresh(attrTimeouts);
+	}
+
+	// changes of a listing that is not cached are of no use
+	fresh = !dirElem.isNull() && dirElem->hasDirListed();
+	for (int i = 0; i < n && fresh; ++i) {
+		fresh = apply_dir_update(dir, dirElem, &updates[i]);
+	}
+	free(updates);
+	if (!dirElem.isNull() && !fresh) {
+		dirElem->setDirListed(false);
+	}
+
+	return fresh;
+}
+
 static vector<const char *> listdir_check_metacache(vector<bool> &hits,
 						    const char **dirs,
 						    int count)
@@ -722,8 +1197,7 @@ static vector<const char *> listdir_check_metacache(vector<bool> &hits,
 
 	for (int i = 0; i < count; ++i) {
 		SharedPtr<DirEntry> curElem = mdCache->get(dirs[i]);
-		if (curElem.isNull() || !(curElem)->hasDirListed() ||
-		    (time(NULL) - curElem->getTimestamp() > MD_REFRESH_TIME)) {
+		if (!listing_is_fresh(dirs[i], curElem)) {
 			uncached_dirs.push_back(dirs[i]);
 		} else {
 			hits[i] = true;
@@ -733,27 +1207,39 @@ static vector<const char *> listdir_check_metacache(vector<bool> &hits,
 	return uncached_dirs;
 }
 
-void invoke_callback(const char *curDir, SharedPtr<DirEntry> &curElem,
-		     vec_listdir_cb cb, void *cbarg,
+// Pass the cached listing of "curDir" to "cb" as one batch.
+bool invoke_callback(const char *curDir, SharedPtr<DirEntry> &curElem,
+		     vec_listdir_batch_cb cb, void *cbarg,
 		     struct vattrs_masks masks)
 {
-	SharedPtr<DirEntry> fileEntry = NULL;
+	vector<string> paths;
+	vector<struct vattrs> finalDentries;
 	struct vattrs finalDentry;
 
 	for (const auto &mypair : (curElem)->children) {
-		fileEntry = mypair.second;
-		std::string path = fileEntry->path();
 		finalDentry.masks = masks;
-		finalDentry.file = vfile_from_path(path.c_str());
-		fileEntry->getAttrs(&finalDentry);
+		mypair.second->getAttrs(&finalDentry);
+		paths.push_back(mypair.second->path());
+		finalDentries.push_back(finalDentry);
+	}
+	// the paths do not move any more
+	for (size_t i = 0; i < paths.size(); ++i) {
+		finalDentries[i].file = vfile_from_path(paths[i].c_str());
+	}
 
-		cb(&finalDentry, curDir, cbarg);
+	if (finalDentries.empty()) {
+		return true;
 	}
+	return cb(finalDentries.data(), finalDentries.size(), curDir, cbarg);
 }
 
+// Pass the cached listings to "cb", unless "more" is false because the
+// caller already stopped the listing.  The directories just listed from the
+// server are marked as cached only if "listed" says they were listed to the
+// end, as a truncated listing must not be served later.
 void reply_from_metacache(const char **dirs, int count, vector<bool> &hits,
-			  vec_listdir_cb cb, void *cbarg,
-			  struct vattrs_masks masks)
+			  bool listed, bool more, vec_listdir_batch_cb cb,
+			  void *cbarg, struct vattrs_masks masks)
 {
 	SharedPtr<DirEntry> curElem;
 
@@ -761,22 +1247,26 @@ void reply_from_metacache(const char **dirs, int count, vector<bool> &hits,
 		// FIXME: what if dir listed get evicted in the middle?
 		curElem = mdCache->get(dirs[i]);
 		if (!curElem.isNull()) {
-			(curElem)->setDirListed(true);
-			if (hits[i] == true) {
-				invoke_callback(dirs[i], curElem, cb, cbarg,
-						masks);
+			if (hits[i] || listed) {
+				(curElem)->setDirListed(true);
+			}
+			if (hits[i] == true && more) {
+				more = invoke_callback(dirs[i], curElem, cb,
+						       cbarg, masks);
 			}
 		}
 	}
 }
 
 vres nfs_listdirv(const char **dirs, int count, struct vattrs_masks masks,
-		  int max_entries, bool recursive, vec_listdir_cb cb,
+		  int max_entries, bool recursive, vec_listdir_batch_cb cb,
 		  void *cbarg, bool is_transaction)
 {
 	vres tcres = { .index = count, .err_no = 0 };
 	struct ListDirCbData cbdata;
 	vector<bool> hits(count, false);
+	bool listed = true;
+	bool more = true;
 
 	vector<const char *> uncached_dirs =
 	    listdir_check_metacache(hits, dirs, count);
@@ -785,14 +1275,22 @@ vres nfs_listdirv(const char **dirs, int count, struct vattrs_masks masks,
 		cbdata.cb = cb;
 		cbdata.cbarg = cbarg;
 		cbdata.masks = masks;
+		cbdata.nentries = 0;
+		cbdata.stopped = false;
 		masks = VMASK_INIT_ALL;
 		tcres =
 		    nfs4_listdirv(uncached_dirs.data(), uncached_dirs.size(),
-				  masks, max_entries, recursive, poco_direntry,
+				  masks, max_entries, recursive, poco_direntries,
 				  &cbdata, is_transaction);
+		// Whether the listing went on to the end of the directories,
+		// rather than being stopped by "cb" or by "max_entries".
+		more = !cbdata.stopped &&
+		       (max_entries == 0 || cbdata.nentries < max_entries);
+		listed = more && vokay(tcres);
 	}
 
-	reply_from_metacache(dirs, count, hits, cb, cbarg, masks);
+	reply_from_metacache(dirs, count, hits, listed, more, cb, cbarg,
+			     masks);
 
 	return tcres;
 }
@@ -863,6 +1361,16 @@ vres nfs_renamev(vfile_pair *pairs, int count, bool is_transaction)
 
 	nfs_restorePair_FhToFilename(pairs, count, saved_tcfs);
 
+	for (int i = 0; i < count; i++) {
+		if (pairs[i].src_file.type == VFILE_PATH) {
+			invalidate_parent_listing(pairs[i].src_file.path);
+		}
+		if (pairs[i].dst_file.type == VFILE_PATH) {
+			invalidate_parent_listing(pairs[i].dst_file.path);
+			negCache->removeUnder(pairs[i].dst_file.path);
+		}
+	}
+
 	return tcres;
 }
 
@@ -915,6 +1423,7 @@ vres nfs_removev(vfile *vfiles, int count, bool is_transaction)
 			if (vfiles[i].type == VFILE_PATH) {
 				dataCache->remove(vfiles[i].path);
 				mdCache->remove(vfiles[i].path);
+				invalidate_parent_listing(vfiles[i].path);
 			}
 		}
 	}
@@ -929,30 +1438,100 @@ vres nfs_mkdirv(struct vattrs *dirs, int count, bool is_transaction)
 
 	nfs_restoreAttr_FhToFilename(dirs, count, saved_tcfs);
 
+	for (int i = 0; i < count; i++) {
+		if (dirs[i].file.type == VFILE_PATH) {
+			invalidate_parent_listing(dirs[i].file.path);
+		}
+	}
+
 	return tcres;
 }
 
 vres nfs_lcopyv(struct vextent_pair *pairs, int count, bool is_transaction)
 {
-	return nfs4_lcopyv(pairs, count, is_transaction);
+	vres tcres = nfs4_lcopyv(pairs, count, is_transaction);
+
+	// Destinations may have been created, and their contents changed.
+	for (int i = 0; i < count; i++) {
+		invalidate_parent_listing(pairs[i].dst_path);
+		mdCache->remove(pairs[i].dst_path);
+		dataCache->remove(pairs[i].dst_path);
+	}
+
+	return tcres;
 }
 
 vres nfs_hardlinkv(const char **oldpaths, const char **newpaths, int count,
 		     bool istxn)
 {
+	for (int i = 0; i < count; i++) {
+		invalidate_parent_listing(newpaths[i]);
+	}
 	return nfs4_hardlinkv(oldpaths, newpaths, count, istxn);
 }
 
 vres nfs_symlinkv(const char **oldpaths, const char **newpaths, int count,
 		    bool istxn)
 {
+	for (int i = 0; i < count; i++) {
+		invalidate_parent_listing(newpaths[i]);
+	}
 	return nfs4_symlinkv(oldpaths, newpaths, count, istxn);
 }
 
+// The content of a symlink never changes, but the symlink may be replaced by
+// another one; so the cached content is used only while the cached attributes
+// of the symlink are.
 vres nfs_readlinkv(const char **paths, char **bufs, size_t *bufsizes,
 		     int count, bool istxn)
 {
-	return nfs4_readlinkv(paths, bufs, bufsizes, count, istxn);
+	vres tcres = { .index = count, .err_no = 0 };
+	vector<const char *> miss_paths;
+	vector<char *> miss_bufs;
+	vector<size_t> miss_bufsizes;
+	vector<int> miss_indices;
+	string target;
+
+	for (int i = 0; i < count; ++i) {
+		SharedPtr<DirEntry> ptrElem = mdCache->get(paths[i]);
+		if (md_is_fresh(paths[i], ptrElem) &&
+		    ptrElem->getLinkTarget(&target) &&
+		    target.size() < bufsizes[i]) {
+			memcpy(bufs[i], target.c_str(), target.size() + 1);
+			bufsizes[i] = target.size();
+			continue;
+		}
+		miss_paths.push_back(paths[i]);
+		miss_bufs.push_back(bufs[i]);
+		miss_bufsizes.push_back(bufsizes[i]);
+		miss_indices.push_back(i);
+	}
+
+	g_miss_count += miss_paths.size();
+	if (miss_paths.empty()) {
+		return tcres;
+	}
+
+	tcres = nfs4_readlinkv(miss_paths.data(), miss_bufs.data(),
+			       miss_bufsizes.data(), miss_paths.size(), istxn);
+	int done = vokay(tcres) ? miss_paths.size() : tcres.index;
+	for (int j = 0; j < done; ++j) {
+		int i = miss_indices[j];
+		// a content that does not fit is not terminated
+		bool whole = miss_bufsizes[j] < bufsizes[i];
+		bufsizes[i] = miss_bufsizes[j];
+		SharedPtr<DirEntry> ptrElem = mdCache->get(paths[i]);
+		if (!ptrElem.isNull() && whole) {
+			ptrElem->setLinkTarget(string(bufs[i], bufsizes[i]));
+		}
+	}
+	if (!vokay(tcres)) {
+		tcres.index = miss_indices[tcres.index];
+	} else {
+		tcres.index = count;
+	}
+
+	return tcres;
 }
 
 int nfs_chdir(const char *path)
@@ -28,7 +28,7 @@ TEST(TC_DataCacheTest, CacheEntryExpireAfterTimeout)
 {
 	const int expire_sec = 5;
 	const string PATH = "/foo/bar";
-	TC_DataCache cache(1024, expire_sec * 1000);
+	TC_DataCache cache(1024 * CACHE_BLOCK_SIZE, expire_sec * 1000);
 	char *buf = getRandomBytes(CACHE_BLOCK_SIZE);
 	bool revalidate = false;
 
@@ -43,10 +43,388 @@ TEST(TC_DataCacheTest, CacheEntryExpireAfterTimeout)
 	sleep(expire_sec + 1);
 
 	EXPECT_EQ(0, cache.get(PATH, 0, CACHE_BLOCK_SIZE, read_buf, &revalidate));
-	// Poco's cache eviction happens passively, so we need to do
-	// PocoCache::get() first before we check the cache absence.
+	// Expired blocks are dropped lazily, so we need to do
+	// TC_DataCache::get() first before we check the cache absence.
 	EXPECT_FALSE(cache.isCached(PATH));
 
 	free(buf);
 	free(read_buf);
 }
+
+TEST(TC_DataCacheTest, SmallUnalignedIOIsCached)
+{
+	const string PATH = "/foo/small";
+	TC_DataCache cache(1024 * CACHE_BLOCK_SIZE, 60 * 1000);
+	const size_t offset = CACHE_BLOCK_SIZE - 4096 + 100;
+	const size_t length = 8192;  // spans two blocks
+	char *buf = getRandomBytes(length);
+	char *read_buf = (char *)malloc(length);
+	bool revalidate = false;
+	size_t miss_offset = 0;
+	size_t miss_length = 0;
+
+	cache.put(PATH, offset, length, buf);
+
+	EXPECT_EQ(length, cache.get(PATH, offset, length, read_buf,
+				    &revalidate, &miss_offset, &miss_length));
+	EXPECT_EQ(0, miss_length);
+	EXPECT_EQ(0, memcmp(buf, read_buf, length));
+
+	// A sub-range is a hit as well.
+	EXPECT_EQ(100, cache.get(PATH, offset + 4000, 100, read_buf,
+				 &revalidate, &miss_offset, &miss_length));
+	EXPECT_EQ(0, memcmp(buf + 4000, read_buf, 100));
+
+	free(buf);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, PartialHitReturnsMissingRange)
+{
+	const string PATH = "/foo/partial";
+	TC_DataCache cache(1024 * CACHE_BLOCK_SIZE, 60 * 1000);
+	char *buf = getRandomBytes(3 * 4096);
+	char *read_buf = (char *)malloc(3 * 4096);
+	bool revalidate = false;
+	size_t miss_offset = 0;
+	size_t miss_length = 0;
+
+	// Cache [0, 4K) and [8K, 12K), leaving a hole at [4K, 8K).
+	cache.put(PATH, 0, 4096, buf);
+	cache.put(PATH, 8192, 4096, buf + 8192);
+
+	EXPECT_EQ(8192, cache.get(PATH, 0, 3 * 4096, read_buf, &revalidate,
+				  &miss_offset, &miss_length));
+	EXPECT_EQ(4096, miss_offset);
+	EXPECT_EQ(4096, miss_length);
+	EXPECT_EQ(0, memcmp(buf, read_buf, 4096));
+	EXPECT_EQ(0, memcmp(buf + 8192, read_buf + 8192, 4096));
+
+	// A missing prefix is reported as well.
+	EXPECT_EQ(4096, cache.get(PATH, 4096, 2 * 4096, read_buf, &revalidate,
+				  &miss_offset, &miss_length));
+	EXPECT_EQ(4096, miss_offset);
+	EXPECT_EQ(4096, miss_length);
+
+	// Filling the hole merges the ranges into a full hit.
+	cache.put(PATH, 4096, 4096, buf + 4096);
+	EXPECT_EQ(3 * 4096, cache.get(PATH, 0, 3 * 4096, read_buf,
+				      &revalidate, &miss_offset, &miss_length));
+	EXPECT_EQ(0, miss_length);
+	EXPECT_EQ(0, memcmp(buf, read_buf, 3 * 4096));
+
+	free(buf);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, BytesOfOtherCtimesAreNotMerged)
+{
+	const string PATH = "/foo/changed";
+	TC_DataCache cache(1024 * CACHE_BLOCK_SIZE, 60 * 1000);
+	const struct timespec ctime1 = {1, 0};
+	const struct timespec ctime2 = {2, 0};
+	char *buf = getRandomBytes(3 * 4096);
+	char *read_buf = (char *)malloc(3 * 4096);
+	bool revalidate = false;
+	size_t miss_offset = 0;
+	size_t miss_length = 0;
+
+	cache.put(PATH, 0, 4096, buf, &ctime1);
+	cache.put(PATH, 8192, 4096, buf + 8192, &ctime2);
+
+	// [0, 4K) was cached before the file changed.
+	EXPECT_EQ(4096, cache.get(PATH, 0, 3 * 4096, read_buf, &revalidate,
+				  &miss_offset, &miss_length, &ctime2));
+	EXPECT_EQ(0, miss_offset);
+	EXPECT_EQ(8192, miss_length);
+	EXPECT_EQ(0, memcmp(buf + 8192, read_buf + 8192, 4096));
+
+	free(buf);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, SizeIsBoundedByByteBudget)
+{
+	const string PATH = "/foo/big";
+	const size_t nblocks = kNumCacheShards;
+	TC_DataCache cache(nblocks * CACHE_BLOCK_SIZE, 60 * 1000);
+	char *buf = getRandomBytes(CACHE_BLOCK_SIZE);
+	char *read_buf = (char *)malloc(CACHE_BLOCK_SIZE);
+	bool revalidate = false;
+	size_t cached = 0;
+
+	for (size_t i = 0; i < 4 * nblocks; ++i) {
+		cache.put(PATH, i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE, buf);
+	}
+	for (size_t i = 0; i < 4 * nblocks; ++i) {
+		cached += cache.get(PATH, i * CACHE_BLOCK_SIZE,
+				    CACHE_BLOCK_SIZE, read_buf, &revalidate);
+	}
+	EXPECT_LE(cached, nblocks * CACHE_BLOCK_SIZE);
+
+	// The most recent block is always cached.
+	cache.put(PATH, 0, CACHE_BLOCK_SIZE, buf);
+	EXPECT_EQ(CACHE_BLOCK_SIZE, cache.get(PATH, 0, CACHE_BLOCK_SIZE,
+					      read_buf, &revalidate));
+	EXPECT_EQ(0, memcmp(buf, read_buf, CACHE_BLOCK_SIZE));
+
+	cache.remove(PATH);
+	EXPECT_FALSE(cache.isCached(PATH));
+
+	free(buf);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, LeasedDataIsStableUntilReleased)
+{
+	const string PATH = "/foo/leased";
+	TC_DataCache cache(1024 * CACHE_BLOCK_SIZE, 60 * 1000);
+	const size_t offset = CACHE_BLOCK_SIZE - 4096;
+	const size_t length = 8192;  // spans two blocks
+	char *buf1 = getRandomBytes(length);
+	char *buf2 = getRandomBytes(length);
+	char *read_buf = (char *)malloc(length);
+	std::vector<DataLease> leases;
+	bool revalidate = false;
+
+	EXPECT_FALSE(cache.lease(PATH, offset, length, &leases, &revalidate));
+	EXPECT_TRUE(leases.empty());
+
+	cache.put(PATH, offset, length, buf1);
+	EXPECT_TRUE(cache.lease(PATH, offset, length, &leases, &revalidate));
+	ASSERT_EQ(2, leases.size());
+	EXPECT_EQ(4096, leases[0].length);
+	EXPECT_EQ(0, memcmp(buf1, leases[0].data, 4096));
+	EXPECT_EQ(0, memcmp(buf1 + 4096, leases[1].data, 4096));
+
+	// Writes go to copies of the leased blocks.
+	cache.put(PATH, offset, length, buf2);
+	EXPECT_EQ(0, memcmp(buf1, leases[0].data, 4096));
+	EXPECT_EQ(0, memcmp(buf1 + 4096, leases[1].data, 4096));
+	EXPECT_EQ(length, cache.get(PATH, offset, length, read_buf,
+				    &revalidate));
+	EXPECT_EQ(0, memcmp(buf2, read_buf, length));
+
+	for (const auto &l : leases) {
+		cache.release(l);
+	}
+
+	// A range not fully cached cannot be leased.
+	leases.clear();
+	EXPECT_FALSE(cache.lease(PATH, offset, length + 1, &leases,
+				 &revalidate));
+	EXPECT_TRUE(leases.empty());
+
+	// Nor can data cached before the file changed.
+	const struct timespec ctime1 = {1, 0};
+	const struct timespec ctime2 = {2, 0};
+	cache.put(PATH, offset, length, buf1, &ctime1);
+	EXPECT_FALSE(cache.lease(PATH, offset, length, &leases, &revalidate,
+				 &ctime2));
+	EXPECT_TRUE(leases.empty());
+	EXPECT_TRUE(cache.lease(PATH, offset, length, &leases, &revalidate,
+				&ctime1));
+	for (const auto &l : leases) {
+		cache.release(l);
+	}
+
+	free(buf1);
+	free(buf2);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, EvictedBlocksAreKeptOnDisk)
+{
+	const string PATH = "/foo/spilled";
+	const size_t nblocks = kNumCacheShards;
+	const struct timespec ctime = {1234, 5678};
+	const struct timespec new_ctime = {1234, 5679};
+	char dir[] = "/tmp/tc_disk_cache_XXXXXX";
+	ASSERT_NE(nullptr, mkdtemp(dir));
+	char *buf = getRandomBytes(4 * nblocks * CACHE_BLOCK_SIZE);
+	char *read_buf = (char *)malloc(CACHE_BLOCK_SIZE);
+	bool revalidate = false;
+
+	{
+		TC_DataCache cache(nblocks * CACHE_BLOCK_SIZE, 60 * 1000,
+				   false, dir, 8 * nblocks);
+		for (size_t i = 0; i < 4 * nblocks; ++i) {
+			cache.put(PATH, i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE,
+				  buf + i * CACHE_BLOCK_SIZE, &ctime);
+		}
+		// Without a validated ctime, only blocks in memory are used.
+		size_t cached = 0;
+		for (size_t i = 0; i < 4 * nblocks; ++i) {
+			cached += cache.get(PATH, i * CACHE_BLOCK_SIZE,
+					    CACHE_BLOCK_SIZE, read_buf,
+					    &revalidate);
+		}
+		EXPECT_LE(cached, nblocks * CACHE_BLOCK_SIZE);
+		EXPECT_TRUE(cache.isOnDisk(PATH, 0, CACHE_BLOCK_SIZE));
+		// The directory cannot be used by another cache meanwhile.
+		{
+			TC_DataCache other(nblocks * CACHE_BLOCK_SIZE,
+					   60 * 1000, false, dir, 8 * nblocks);
+			EXPECT_FALSE(other.isOnDisk(PATH, 0, CACHE_BLOCK_SIZE));
+		}
+		for (size_t i = 0; i < 4 * nblocks; ++i) {
+			EXPECT_EQ(CACHE_BLOCK_SIZE,
+				  cache.get(PATH, i * CACHE_BLOCK_SIZE,
+					    CACHE_BLOCK_SIZE, read_buf,
+					    &revalidate, nullptr, nullptr,
+					    &ctime));
+			EXPECT_EQ(0, memcmp(buf + i * CACHE_BLOCK_SIZE,
+					    read_buf, CACHE_BLOCK_SIZE));
+		}
+		cache.clear();
+	}
+
+	// The blocks survive restarts, but not changes of the file.
+	{
+		TC_DataCache cache(nblocks * CACHE_BLOCK_SIZE, 60 * 1000,
+				   false, dir, 8 * nblocks);
+		EXPECT_EQ(CACHE_BLOCK_SIZE,
+			  cache.get(PATH, CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE,
+				    read_buf, &revalidate, nullptr, nullptr,
+				    &ctime));
+		EXPECT_EQ(0, memcmp(buf + CACHE_BLOCK_SIZE, read_buf,
+				    CACHE_BLOCK_SIZE));
+		EXPECT_EQ(0, cache.get(PATH, 2 * CACHE_BLOCK_SIZE,
+				       CACHE_BLOCK_SIZE, read_buf, &revalidate,
+				       nullptr, nullptr, &new_ctime));
+		EXPECT_FALSE(cache.isOnDisk(PATH, 2 * CACHE_BLOCK_SIZE,
+					    CACHE_BLOCK_SIZE));
+		cache.remove(PATH);
+		EXPECT_FALSE(cache.isOnDisk(PATH, 0, 4 * nblocks *
+							 CACHE_BLOCK_SIZE));
+	}
+
+	unlink((string(dir) + "/data").c_str());
+	unlink((string(dir) + "/index").c_str());
+	rmdir(dir);
+	free(buf);
+	free(read_buf);
+}
+
+// Replacing a leased block may evict a block whose slot receives the copy of
+// the leased one; the evicted data must still reach the disk.
+TEST(TC_DataCacheTest, BlocksEvictedForLeasedCopiesAreKeptOnDisk)
+{
+	const string LEASED = "/foo/leased";
+	const string PATH = "/foo/victims";
+	const size_t nblocks = 2 * kNumCacheShards;
+	const struct timespec ctime = {1234, 5678};
+	char dir[] = "/tmp/tc_disk_cache_XXXXXX";
+	ASSERT_NE(nullptr, mkdtemp(dir));
+	char *leased_buf = getRandomBytes(2 * CACHE_BLOCK_SIZE);
+	char *buf = getRandomBytes(4 * nblocks * CACHE_BLOCK_SIZE);
+	char *read_buf = (char *)malloc(CACHE_BLOCK_SIZE);
+	std::vector<DataLease> leases;
+	bool revalidate = false;
+
+	{
+		TC_DataCache cache(nblocks * CACHE_BLOCK_SIZE, 60 * 1000,
+				   false, dir, 8 * nblocks);
+		cache.put(LEASED, 0, CACHE_BLOCK_SIZE, leased_buf, &ctime);
+		ASSERT_TRUE(cache.lease(LEASED, 0, CACHE_BLOCK_SIZE, &leases,
+					&revalidate));
+		for (size_t i = 0; i < 4 * nblocks; ++i) {
+			cache.put(PATH, i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE,
+				  buf + i * CACHE_BLOCK_SIZE, &ctime);
+		}
+		// The shard of the leased block is full, so its copy takes
+		// the slot of a victim.
+		cache.put(LEASED, 0, CACHE_BLOCK_SIZE,
+			  leased_buf + CACHE_BLOCK_SIZE, &ctime);
+		EXPECT_EQ(0, memcmp(leased_buf, leases[0].data,
+				    CACHE_BLOCK_SIZE));
+		for (const auto &l : leases) {
+			cache.release(l);
+		}
+
+		for (size_t i = 0; i < 4 * nblocks; ++i) {
+			EXPECT_EQ(CACHE_BLOCK_SIZE,
+				  cache.get(PATH, i * CACHE_BLOCK_SIZE,
+					    CACHE_BLOCK_SIZE, read_buf,
+					    &revalidate, nullptr, nullptr,
+					    &ctime));
+			EXPECT_EQ(0, memcmp(buf + i * CACHE_BLOCK_SIZE,
+					    read_buf, CACHE_BLOCK_SIZE))
+			    << "block " << i;
+		}
+		EXPECT_EQ(CACHE_BLOCK_SIZE,
+			  cache.get(LEASED, 0, CACHE_BLOCK_SIZE, read_buf,
+				    &revalidate, nullptr, nullptr, &ctime));
+		EXPECT_EQ(0, memcmp(leased_buf + CACHE_BLOCK_SIZE, read_buf,
+				    CACHE_BLOCK_SIZE));
+		cache.clear();
+	}
+
+	unlink((string(dir) + "/data").c_str());
+	unlink((string(dir) + "/index").c_str());
+	rmdir(dir);
+	free(leased_buf);
+	free(buf);
+	free(read_buf);
+}
+
+TEST(TC_DataCacheTest, SharedMemoryCacheIsShared)
+{
+	const string PATH = "/foo/shared";
+	const string SHM_NAME = "/tc_datacache_test." + std::to_string(getpid());
+	const struct timespec ctime = {1234, 5678};
+	const struct timespec new_ctime = {1234, 5679};
+	char *buf = getRandomBytes(2 * CACHE_BLOCK_SIZE);
+	char *read_buf = (char *)malloc(2 * CACHE_BLOCK_SIZE);
+	bool revalidate = false;
+
+	// Two caches opening the same segment, as if in two processes.
+	TC_DataCache cache1(64 * CACHE_BLOCK_SIZE, 60 * 1000, false, "", 0,
+			    SHM_NAME);
+	TC_DataCache cache2(64 * CACHE_BLOCK_SIZE, 60 * 1000, false, "", 0,
+			    SHM_NAME);
+
+	cache1.put(PATH, 100, 2 * CACHE_BLOCK_SIZE - 100, buf + 100, &ctime);
+	EXPECT_TRUE(cache2.isCached(PATH));
+	EXPECT_EQ(2 * CACHE_BLOCK_SIZE - 100,
+		  cache2.get(PATH, 100, 2 * CACHE_BLOCK_SIZE - 100,
+			     read_buf + 100, &revalidate, nullptr, nullptr,
+			     &ctime));
+	EXPECT_EQ(0, memcmp(buf + 100, read_buf + 100,
+			    2 * CACHE_BLOCK_SIZE - 100));
+
+	size_t miss_offset = 0;
+	size_t miss_length = 0;
+	EXPECT_EQ(2 * CACHE_BLOCK_SIZE - 100,
+		  cache2.get(PATH, 0, 2 * CACHE_BLOCK_SIZE, read_buf,
+			     &revalidate, &miss_offset, &miss_length));
+	EXPECT_EQ(0, miss_offset);
+	EXPECT_EQ(100, miss_length);
+
+	// Data cached before the file changed is not used.
+	EXPECT_EQ(0, cache2.get(PATH, 100, 100, read_buf, &revalidate,
+				nullptr, nullptr, &new_ctime));
+
+	std::vector<DataLease> leases;
+	EXPECT_FALSE(cache2.lease(PATH, CACHE_BLOCK_SIZE, 4096, &leases,
+				  &revalidate, &new_ctime));
+	EXPECT_TRUE(cache2.lease(PATH, CACHE_BLOCK_SIZE, 4096, &leases,
+				 &revalidate, &ctime));
+	ASSERT_EQ(1, leases.size());
+	EXPECT_EQ(0, memcmp(buf + CACHE_BLOCK_SIZE, leases[0].data, 4096));
+	cache2.release(leases[0]);
+
+	// Nor is it merged with data cached after.
+	cache1.put(PATH, 0, 100, buf, &new_ctime);
+	EXPECT_EQ(100, cache2.get(PATH, 0, 200, read_buf, &revalidate,
+				  &miss_offset, &miss_length, &new_ctime));
+	EXPECT_EQ(100, miss_offset);
+	EXPECT_EQ(100, miss_length);
+
+	cache2.remove(PATH);
+	EXPECT_FALSE(cache1.isCached(PATH));
+
+	shm_unlink(SHM_NAME.c_str());
+	free(buf);
+	free(read_buf);
+}
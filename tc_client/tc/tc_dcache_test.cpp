@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <string.h>
+#include <gtest/gtest.h>
+#include "nfsv41.h"
+#include "nfs4/nfs4_dcache.h"
+
+TEST(TC_DentryCacheTest, CompoundsThatOnlyReadAreRetried)
+{
+	// SEQUENCE, PUTFH a/b, GETATTR, PUTFH a/c (stale), READ
+	const uint32_t ops[] = { NFS4_OP_SEQUENCE, NFS4_OP_PUTFH,
+				 NFS4_OP_GETATTR,  NFS4_OP_PUTFH,
+				 NFS4_OP_READ };
+
+	EXPECT_TRUE(nfs4_dcache_can_retry(ops, 1));
+	EXPECT_TRUE(nfs4_dcache_can_retry(ops, 3));
+	// the failed op itself is not run by the server
+	EXPECT_TRUE(nfs4_dcache_can_retry(ops, 0));
+}
+
+TEST(TC_DentryCacheTest, CompoundsThatChangedServerAreNotRetried)
+{
+	const uint32_t mutating[] = { NFS4_OP_REMOVE, NFS4_OP_CREATE,
+				      NFS4_OP_OPEN,   NFS4_OP_WRITE,
+				      NFS4_OP_RENAME, NFS4_OP_SETATTR,
+				      NFS4_OP_CLOSE,  NFS4_OP_LINK };
+
+	for (uint32_t op : mutating) {
+		// SEQUENCE, PUTFH a, <op>, PUTFH b (stale), GETATTR
+		const uint32_t ops[] = { NFS4_OP_SEQUENCE, NFS4_OP_PUTFH, op,
+					 NFS4_OP_PUTFH, NFS4_OP_GETATTR };
+
+		EXPECT_FALSE(nfs4_dcache_can_retry(ops, 3)) << "op " << op;
+		// a stale PUTFH before the change is still retried
+		EXPECT_TRUE(nfs4_dcache_can_retry(ops, 1)) << "op " << op;
+	}
+}
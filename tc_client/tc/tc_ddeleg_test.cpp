@@ -0,0 +1,237 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtest/gtest.h>
+#include "nfs4/nfs4_ddeleg.h"
+
+using std::string;
+
+namespace {
+
+const char FH[] = "filehandle";
+
+// A stateid "other" unique to "i", which is not 0.
+string Sid(int i)
+{
+	string sid(DDELEG_OTHERSIZE, '\0');
+	memcpy(&sid[0], &i, sizeof(i));
+	return sid;
+}
+
+void Add(const char *path, int i)
+{
+	nfs4_ddeleg_add(path, FH, sizeof(FH), i, Sid(i).data());
+}
+
+struct nfs4_dir_change *NewChange(enum nfs4_dir_change_type type,
+				  const char *name)
+{
+	struct nfs4_dir_change *c = (struct nfs4_dir_change *)calloc(
+	    1, sizeof(*c) + strlen(name) + 1);
+	c->type = type;
+	strcpy(c->name, name);
+	return c;
+}
+
+// Pop the oldest of "changes"; glist_first_entry() is not C++.
+struct nfs4_dir_change *PopChange(struct glist_head *changes)
+{
+	struct nfs4_dir_change *c;
+
+	if (glist_empty(changes))
+		return NULL;
+	c = (struct nfs4_dir_change *)((char *)changes->next -
+				       offsetof(struct nfs4_dir_change, list));
+	glist_del(&c->list);
+	return c;
+}
+
+// Pop all delegations to return, and free them; returns their paths.
+std::vector<string> PopReturning()
+{
+	std::vector<string> paths;
+	struct nfs4_dir_deleg *dirs[4];
+	int n;
+
+	while ((n = nfs4_ddeleg_pop_returning(dirs, 4)) > 0) {
+		for (int i = 0; i < n; ++i) {
+			paths.push_back(dirs[i]->path);
+			free(dirs[i]);
+		}
+	}
+	return paths;
+}
+
+} // namespace
+
+class TC_DirDelegTest : public ::testing::Test
+{
+protected:
+	void SetUp() override { nfs4_ddeleg_init(4); }
+
+	void TearDown() override
+	{
+		nfs4_ddeleg_deinit();
+		PopReturning();
+	}
+};
+
+TEST_F(TC_DirDelegTest, AddedDelegationsAreHeld)
+{
+	EXPECT_TRUE(nfs4_ddeleg_wanted("/foo"));
+	Add("/foo", 1);
+	EXPECT_TRUE(nfs4_ddeleg_held("/foo"));
+	EXPECT_FALSE(nfs4_ddeleg_wanted("/foo"));
+
+	EXPECT_FALSE(nfs4_ddeleg_held("/bar"));
+	EXPECT_TRUE(nfs4_ddeleg_wanted("/bar"));
+	// Only absolute paths are delegated.
+	EXPECT_FALSE(nfs4_ddeleg_wanted("foo"));
+
+	// A second delegation of the same directory is returned.
+	Add("/foo", 2);
+	EXPECT_TRUE(nfs4_ddeleg_held("/foo"));
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopReturning());
+}
+
+TEST_F(TC_DirDelegTest, RecalledDelegationsAreReturned)
+{
+	struct nfs4_dir_deleg *dd;
+
+	Add("/foo", 1);
+	Add("/bar", 2);
+	EXPECT_TRUE(nfs4_ddeleg_recall(Sid(1).data()));
+	EXPECT_FALSE(nfs4_ddeleg_held("/foo"));
+	EXPECT_TRUE(nfs4_ddeleg_held("/bar"));
+	// Recalling it again is fine before it is returned.
+	EXPECT_TRUE(nfs4_ddeleg_recall(Sid(1).data()));
+
+	ASSERT_EQ(1, nfs4_ddeleg_pop_returning(&dd, 1));
+	EXPECT_STREQ("/foo", dd->path);
+	EXPECT_EQ(sizeof(FH), dd->fh_len);
+	EXPECT_EQ(0, memcmp(FH, dd->fh, sizeof(FH)));
+	EXPECT_EQ(1, dd->sid_seqid);
+	EXPECT_EQ(0, memcmp(Sid(1).data(), dd->sid_other, DDELEG_OTHERSIZE));
+	free(dd);
+	EXPECT_EQ(0, nfs4_ddeleg_pop_returning(&dd, 1));
+}
+
+TEST_F(TC_DirDelegTest, DelegationsRecalledBeforeAddedAreReturned)
+{
+	EXPECT_FALSE(nfs4_ddeleg_recall(Sid(1).data()));
+	Add("/foo", 1);
+	EXPECT_FALSE(nfs4_ddeleg_held("/foo"));
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopReturning());
+
+	// Only once.
+	Add("/foo", 1);
+	EXPECT_TRUE(nfs4_ddeleg_held("/foo"));
+}
+
+TEST_F(TC_DirDelegTest, DelegationsBeyondCapacityAreReturned)
+{
+	for (int i = 1; i <= 4; ++i) {
+		Add(("/" + std::to_string(i)).c_str(), i);
+	}
+	EXPECT_FALSE(nfs4_ddeleg_wanted("/5"));
+	Add("/5", 5);
+	EXPECT_FALSE(nfs4_ddeleg_held("/5"));
+	EXPECT_EQ(std::vector<string>{"/5"}, PopReturning());
+
+	// Returning one makes room for another.
+	EXPECT_TRUE(nfs4_ddeleg_recall(Sid(1).data()));
+	EXPECT_TRUE(nfs4_ddeleg_wanted("/5"));
+
+	nfs4_ddeleg_deinit();
+	EXPECT_FALSE(nfs4_ddeleg_enabled());
+	EXPECT_FALSE(nfs4_ddeleg_wanted("/6"));
+	Add("/6", 6);
+	EXPECT_FALSE(nfs4_ddeleg_held("/6"));
+}
+
+TEST_F(TC_DirDelegTest, NotifiedChangesArePoppedInOrder)
+{
+	struct glist_head changes;
+	struct nfs4_dir_change *c;
+
+	glist_init(&changes);
+	EXPECT_FALSE(nfs4_ddeleg_pop_changes("/foo", &changes));
+
+	Add("/foo", 1);
+	EXPECT_TRUE(nfs4_ddeleg_notify(
+	    Sid(1).data(), NewChange(NFS4_DIR_ENTRY_ADDED, "a")));
+	EXPECT_TRUE(nfs4_ddeleg_notify(
+	    Sid(1).data(), NewChange(NFS4_DIR_ENTRY_REMOVED, "b")));
+	EXPECT_FALSE(nfs4_ddeleg_notify(
+	    Sid(2).data(), NewChange(NFS4_DIR_ENTRY_ADDED, "c")));
+
+	EXPECT_TRUE(nfs4_ddeleg_pop_changes("/foo", &changes));
+	c = PopChange(&changes);
+	ASSERT_NE(nullptr, c);
+	EXPECT_EQ(NFS4_DIR_ENTRY_ADDED, c->type);
+	EXPECT_STREQ("a", c->name);
+	free(c);
+	c = PopChange(&changes);
+	ASSERT_NE(nullptr, c);
+	EXPECT_EQ(NFS4_DIR_ENTRY_REMOVED, c->type);
+	EXPECT_STREQ("b", c->name);
+	free(c);
+	EXPECT_TRUE(glist_empty(&changes));
+
+	// Nothing new.
+	EXPECT_TRUE(nfs4_ddeleg_pop_changes("/foo", &changes));
+	EXPECT_TRUE(glist_empty(&changes));
+}
+
+TEST_F(TC_DirDelegTest, TooManyChangesReturnDelegation)
+{
+	Add("/foo", 1);
+	for (int i = 0; i < DDELEG_MAX_CHANGES; ++i) {
+		EXPECT_TRUE(nfs4_ddeleg_notify(
+		    Sid(1).data(), NewChange(NFS4_DIR_ENTRY_ADDED, "a")));
+	}
+	EXPECT_FALSE(nfs4_ddeleg_notify(
+	    Sid(1).data(), NewChange(NFS4_DIR_ENTRY_ADDED, "a")));
+	EXPECT_FALSE(nfs4_ddeleg_held("/foo"));
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopReturning());
+}
+
+TEST_F(TC_DirDelegTest, InvalidateDropsDelegationsOfSubtree)
+{
+	Add("/foo", 1);
+	Add("/foo/bar", 2);
+	Add("/foobar", 3);
+	Add("/baz", 4);
+
+	nfs4_ddeleg_invalidate("/foo/");
+	EXPECT_FALSE(nfs4_ddeleg_held("/foo"));
+	EXPECT_FALSE(nfs4_ddeleg_held("/foo/bar"));
+	// Only paths under the directory, not those sharing its prefix.
+	EXPECT_TRUE(nfs4_ddeleg_held("/foobar"));
+	EXPECT_TRUE(nfs4_ddeleg_held("/baz"));
+	EXPECT_EQ(2, PopReturning().size());
+
+	nfs4_ddeleg_drop_all();
+	EXPECT_FALSE(nfs4_ddeleg_held("/foobar"));
+	EXPECT_FALSE(nfs4_ddeleg_held("/baz"));
+	EXPECT_EQ(2, PopReturning().size());
+}
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/param.h>
 #include <sys/time.h>
 #include <linux/limits.h>
 #include <assert.h>
@@ -32,6 +33,7 @@
 #include "sys/stat.h"
 #include "tc_helper.h"
 #include "tc_nfs.h"
+#include "tc_batch.h"
 
 static vres TC_OKAY = { .index = -1, .err_no = 0, };
 
@@ -104,9 +106,17 @@ void *vinit(const char *config_path, const char *log_path, uint16_t export_id)
 	if (TC_IMPL_IS_NFS4) {
 		struct cache_context *cc = (struct cache_context*)context;
 		init_page_cache(cc->cache_size,
-				cc->cache_expiration);
+				cc->cache_expiration,
+				cc->attr_cache_reg_min,
+				cc->attr_cache_reg_max,
+				cc->attr_cache_dir_min,
+				cc->attr_cache_dir_max);
 		init_data_cache(cc->data_cache_size,
-				cc->data_cache_expiration);
+				cc->data_cache_expiration,
+				cc->data_cache_huge_pages,
+				cc->data_cache_disk_path,
+				cc->data_cache_disk_size,
+				cc->data_cache_shm_name);
 	}
 
 	return context;
@@ -140,7 +150,15 @@ vfile *vec_open(const char **paths, int count, int *flags, mode_t *modes)
 
 	TC_START_COUNTER(open);
 	if (TC_IMPL_IS_NFS4) {
-		tcfs = nfs_openv(paths, count, flags, modes);
+		vres res;
+		tcfs = nfs_openv(paths, count, flags, modes, &res);
+		if (!vokay(res)) {
+			if (tcfs) {
+				nfs_closev(tcfs, res.index);
+			}
+			tcfs = NULL;
+			errno = res.err_no;
+		}
 	} else {
 		tcfs = posix_openv(paths, count, flags, modes);
 	}
@@ -149,6 +167,25 @@ vfile *vec_open(const char **paths, int count, int *flags, mode_t *modes)
 	return tcfs;
 }
 
+vfile *vec_open_partly(const char **paths, int count, int *flags,
+		       mode_t *modes, vres *res)
+{
+	vfile *tcfs;
+	TC_DECLARE_COUNTER(open_partly);
+
+	TC_START_COUNTER(open_partly);
+	if (TC_IMPL_IS_NFS4) {
+		tcfs = nfs_openv(paths, count, flags, modes, res);
+	} else {
+		/* errors of each file are in its fd */
+		tcfs = posix_openv(paths, count, flags, modes);
+		*res = tcfs ? vfailure(count, 0) : vfailure(0, ENOMEM);
+	}
+	TC_STOP_COUNTER(open_partly, count, vokay(*res));
+
+	return tcfs;
+}
+
 vfile *vec_open_simple(const char **paths, int count, int flags, mode_t mode)
 {
 	vfile *tcfs;
@@ -201,6 +238,9 @@ off_t sca_fseek(vfile *tcf, off_t offset, int whence)
 
 vfile* sca_open_by_path(int dirfd, const char *pathname, int flags, mode_t mode)
 {
+	if (tc_batching_enabled()) {
+		return tc_batch_open(pathname, flags, mode);
+	}
 	return vec_open(&pathname, 1, &flags, &mode);
 }
 
@@ -235,6 +275,38 @@ vres vec_read(struct viovec *reads, int count, bool is_transaction)
 	return tcres;
 }
 
+vres vec_read_leased(struct viovec *reads, int count, bool is_transaction,
+		     struct vleased_read *leases)
+{
+	vres tcres;
+	TC_DECLARE_COUNTER(read);
+
+	TC_START_COUNTER(read);
+	for (int i = 0; i < count; ++i) {
+		leases[i].count = 0;
+		leases[i].leases = NULL;
+		if (reads[i].is_creation) {
+			TC_STOP_COUNTER(read, count, false);
+			return vfailure(i, EINVAL);
+		}
+	}
+	if (TC_IMPL_IS_NFS4) {
+		tcres = nfs_readv_leased(reads, count, is_transaction, leases);
+	} else {
+		tcres = posix_readv(reads, count, is_transaction);
+	}
+	TC_STOP_COUNTER(read, count, vokay(tcres));
+
+	return tcres;
+}
+
+void vec_release_leases(struct vleased_read *leases, int count)
+{
+	if (TC_IMPL_IS_NFS4) {
+		nfs_release_leases(leases, count);
+	}
+}
+
 vres vec_write(struct viovec *writes, int count, bool is_transaction)
 {
 	vres tcres;
@@ -252,6 +324,125 @@ vres vec_write(struct viovec *writes, int count, bool is_transaction)
 }
 
 
+/**
+ * The path that a symlink at "link" with content "target" points to, which
+ * the caller frees; NULL if the path is too long.
+ */
+static char *symlink_target_path(const char *link, const char *target)
+{
+	char *path = (char *)malloc(PATH_MAX);
+	buf_t bf = BUF_INITIALIZER(path, PATH_MAX);
+	slice_t dir = target[0] == '/' ? toslice("") : tc_path_dirname(link);
+
+	if (tc_path_join_s(dir, toslice(target), &bf) < 0 ||
+	    !buf_append_null(&bf)) {
+		free(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+/**
+ * Get "attrs", whose masks must include the mode, following symlinks.  For
+ * each attrs[i] that is a symlink, it is replaced by the attributes of the
+ * final target (except attrs[i].file), whose path is saved in targets[i] for
+ * the caller to free; targets[i] is NULL if attrs[i] is not a symlink.
+ *
+ * Each hop takes a READLINK and a GETATTR of the targets, which are batched
+ * across all files.  Link contents and attributes are served from the cache
+ * when fresh, so that following a known link needs no round trip at all.
+ */
+static vres follow_symlinks(struct vattrs *attrs, int count, char **targets,
+			    bool is_transaction)
+{
+	vres res;
+	int i;
+	int j;
+	int n;
+	int hops;
+	int indices[count];
+	const char *paths[count];
+	char *bufs[count];
+	size_t bufsizes[count];
+	struct vattrs tattrs[count];
+
+	for (i = 0; i < count; i++) {
+		targets[i] = NULL;
+	}
+
+	res = vec_lgetattrs(attrs, count, is_transaction);
+
+	for (hops = 0; vokay(res); hops++) {
+		n = 0;
+		for (i = 0; i < count; i++) {
+			if (!S_ISLNK(attrs[i].mode)) {
+				continue;
+			}
+			if (targets[i]) {
+				paths[n] = targets[i];
+			} else if (attrs[i].file.type == VFILE_PATH) {
+				paths[n] = attrs[i].file.path;
+			} else {
+				continue;
+			}
+			indices[n++] = i;
+		}
+		if (n == 0) {
+			return res;
+		}
+		if (hops >= MAXSYMLINKS) {
+			res = vfailure(indices[0], ELOOP);
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			bufs[j] = (char *)malloc(PATH_MAX);
+			bufsizes[j] = PATH_MAX;
+		}
+		res = vec_readlink(paths, bufs, bufsizes, n, false);
+		for (j = 0; j < n; j++) {
+			char *t = NULL;
+			if (vokay(res)) {
+				t = symlink_target_path(paths[j], bufs[j]);
+				if (t == NULL) {
+					res = vfailure(j, ENAMETOOLONG);
+				}
+			}
+			free(bufs[j]);
+			if (t) {
+				free(targets[indices[j]]);
+				targets[indices[j]] = t;
+			}
+		}
+		if (!vokay(res)) {
+			res.index = indices[res.index];
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			tattrs[j] = attrs[indices[j]];
+			tattrs[j].file = vfile_from_path(targets[indices[j]]);
+		}
+		res = vec_lgetattrs(tattrs, n, is_transaction);
+		if (!vokay(res)) {
+			res.index = indices[res.index];
+			break;
+		}
+		for (j = 0; j < n; j++) {
+			vfile file = attrs[indices[j]].file;
+			attrs[indices[j]] = tattrs[j];
+			attrs[indices[j]].file = file;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		free(targets[i]);
+		targets[i] = NULL;
+	}
+	return res;
+}
+
 struct syminfo {
 	const char *src_path; // path of file to be checked for symlink; can be
 			      // NULL if file does not have path (eg, is fd)
@@ -263,27 +454,21 @@ bool resolve_symlinks(struct syminfo *syms, int count, vres *err) {
 	int i;
 	struct vattrs attrs[count];
 	int attrs_original_indices[count];
+	char *targets[count];
 	int attrs_count = 0;
-	const char **paths;
-	int *paths_original_indices;
-	int path_count = 0;
-	char **bufs;
-	size_t *bufsizes;
-	bool res = true;
+	bool res = false;
 
 	*err = TC_OKAY;
 
 	for (i = 0; i < count; i++) {
-		struct syminfo sym = syms[i];
-		if (sym.src_path) {
+		syms[i].target_path = NULL;
+		if (syms[i].src_path) {
 			attrs[attrs_count].file =
-			    vfile_from_path(sym.src_path);
+			    vfile_from_path(syms[i].src_path);
 			attrs[attrs_count].masks = VATTRS_MASK_NONE;
 			attrs[attrs_count].masks.has_mode = true;
 			attrs_original_indices[attrs_count] = i;
 			attrs_count++;
-		} else {
-		    sym.target_path = NULL;
 		}
 	}
 
@@ -291,67 +476,20 @@ bool resolve_symlinks(struct syminfo *syms, int count, vres *err) {
 		return false;
 	}
 
-	*err = vec_lgetattrs(attrs, attrs_count, false);
+	*err = follow_symlinks(attrs, attrs_count, targets, false);
 	if (!vokay(*err)) {
 		err->index = attrs_original_indices[err->index];
 		return false;
 	}
 
-	paths = (const char **) calloc(attrs_count, sizeof(char *));
-	bufs = (char **) calloc(attrs_count, sizeof(char *));
-	bufsizes = (size_t *) calloc(attrs_count, sizeof(size_t));
-	paths_original_indices = (int *) calloc(attrs_count, sizeof(int));
-
 	for (i = 0; i < attrs_count; i++) {
-		if (S_ISLNK(attrs[i].mode))	{
-			paths[path_count] = attrs[i].file.path;
-
-			bufs[path_count] = (char*) malloc(sizeof(char) * PATH_MAX);
-			bufsizes[path_count] = PATH_MAX;
-
-			paths_original_indices[path_count] = i;
-
-			path_count++;
-		} else {
-			syms[attrs_original_indices[i]].target_path = NULL;
-		}
-	}
-
-	if (path_count == 0) {
-		res = false;
-		goto exit;
-	}
-
-	*err = vec_readlink(paths, bufs, bufsizes, path_count, false);
-	//TODO: what if vec_readlink() returns symlinks (symlink to symlink)?
-	if (!vokay(*err)) {
-		err->index =
-		    paths_original_indices[attrs_original_indices[err->index]];
-		res = false;
-		goto exit;
-	}
-
-	for (i = 0; i < path_count; i++) {
-		struct syminfo *sym =
-		    &syms[attrs_original_indices[paths_original_indices[i]]];
-		if (sym->src_path[0] == '/' && bufs[i][0] != '/') {
-			char *path = (char*) malloc(sizeof(char) * PATH_MAX);
-			slice_t dirname = tc_path_dirname(strdup(sym->src_path));
-			((char*) dirname.data)[dirname.size] = '\0';
-			tc_path_join(dirname.data, bufs[i], path, PATH_MAX);
-			free(bufs[i]);
-			free((char*)dirname.data);
-			sym->target_path = path;
-		} else {
-			sym->target_path = bufs[i];
+		if (targets[i]) {
+			syms[attrs_original_indices[i]].target_path =
+			    targets[i];
+			res = true;
 		}
 	}
 
-exit:
-	free(paths_original_indices);
-	free(bufsizes);
-	free(bufs);
-	free(paths);
 	return res;
 }
 
@@ -367,90 +505,29 @@ void free_syminfo(struct syminfo *syminfo, int count) {
 vres vec_getattrs(struct vattrs *attrs, int count, bool is_transaction)
 {
 	vres res;
-	const char *paths[count];
-	vfile original_files[count];
 	struct vattrs_masks old_masks[count];
 	mode_t old_modes[count];
-	int mode_original_indices[count];
-	int original_indices[count];
-
-	char *bufs[count];
-	size_t bufsizes[count];
-
-	int old_mode_count = 0;
-	int link_count = 0;
+	char *targets[count];
 	int i;
 
+	// The mode tells symlinks apart; restore the old one afterwards if the
+	// caller does not want it.
 	for (i = 0; i < count; i++) {
-		// if caller doesn't want to get a mode, save old mode before
-		// passing attrs into lgetattrsv to determine if files are
-		// symlinks
-		if (!attrs[i].masks.has_mode) {
-			old_modes[old_mode_count] = attrs[i].mode;
-			old_masks[old_mode_count] = attrs[i].masks;
-			attrs[i].masks.has_mode = true;
-			mode_original_indices[old_mode_count] = i;
-			old_mode_count++;
-		}
+		old_masks[i] = attrs[i].masks;
+		old_modes[i] = attrs[i].mode;
+		attrs[i].masks.has_mode = true;
 	}
 
-	res = vec_lgetattrs(attrs, count, false);
+	res = follow_symlinks(attrs, count, targets, is_transaction);
 
 	for (i = 0; i < count; i++) {
-		if (S_ISLNK(attrs[i].mode)) {
-			vfile file = attrs[i].file;
-			assert(file.type == VFILE_PATH);
-
-			paths[link_count] = file.path;
-
-			bufs[link_count] = (char *) malloc(sizeof(char) * PATH_MAX);
-			bufsizes[link_count] = PATH_MAX;
-			original_indices[link_count] = i;
-
-			link_count++;
+		if (!old_masks[i].has_mode) {
+			attrs[i].mode = old_modes[i];
+			attrs[i].masks = old_masks[i];
 		}
+		free(targets[i]);
 	}
 
-	for (i = 0; i < old_mode_count; i++) {
-		attrs[mode_original_indices[i]].mode = old_modes[i];
-		attrs[mode_original_indices[i]].masks = old_masks[i];
-	}
-
-	// if nothing was a symlink, then our prior call to vec_lgetattrs()
-	// sufficed, so we're done
-	if (!vokay(res) || link_count == 0) {
-		goto exit;
-	}
-
-
-	res = vec_readlink(paths, bufs, bufsizes, link_count, false);
-	// TODO: what if vec_readlink() returns another symlink (symlink to
-	// symlink)?
-
-	if (!vokay(res)) {
-		res.index = original_indices[res.index];
-		goto exit;
-	}
-
-	for (i = 0; i < link_count; i++) {
-		original_files[i] = attrs[original_indices[i]].file;
-		attrs[original_indices[i]].file = vfile_from_path(bufs[i]);
-	}
-
-	res = vec_lgetattrs(attrs, link_count, is_transaction);
-
-	if (!vokay(res)) {
-		res.index = original_indices[res.index];
-	}
-
-	for (i = 0; i < link_count; i++) {
-		attrs[original_indices[i]].file = original_files[i];
-	}
-
-exit:
-	for (i = 0; i < link_count; ++i) {
-		free(bufs[i]);
-	}
 	return res;
 }
 
@@ -482,9 +559,16 @@ static int sca_stat_impl(vfile tcf, struct stat *buf, bool readlink)
 		.masks = VATTRS_MASK_ALL,
 	};
 
-	tcres = vec_lgetattrs(&tca, 1, false);
-	if (!vokay(tcres)) {
-		return tcres.err_no;
+	if (tc_batching_enabled()) {
+		ret = tc_batch_lgetattrs(&tca);
+		if (ret != 0) {
+			return ret;
+		}
+	} else {
+		tcres = vec_lgetattrs(&tca, 1, false);
+		if (!vokay(tcres)) {
+			return tcres.err_no;
+		}
 	}
 
 	if (!readlink || !S_ISLNK(tca.mode)) {
@@ -654,11 +738,39 @@ vres sca_listdir(const char *dir, struct vattrs_masks masks, int max_count,
 	return tcres;
 }
 
+struct _listdir_cb_adapter {
+	vec_listdir_cb cb;
+	vec_listdir_batch_cb batch_cb;
+	void *cbarg;
+};
+
+static bool listdir_batch_to_each(const struct vattrs *entries, int count,
+				  const char *dir, void *cbarg)
+{
+	struct _listdir_cb_adapter *a = (struct _listdir_cb_adapter *)cbarg;
+
+	for (int i = 0; i < count; ++i) {
+		if (!a->cb(&entries[i], dir, a->cbarg)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool listdir_each_to_batch(const struct vattrs *entry, const char *dir,
+				  void *cbarg)
+{
+	struct _listdir_cb_adapter *a = (struct _listdir_cb_adapter *)cbarg;
+
+	return a->batch_cb(entry, 1, dir, a->cbarg);
+}
+
 vres vec_listdir(const char **dirs, int count, struct vattrs_masks masks,
 		   int max_entries, bool recursive, vec_listdir_cb cb,
 		   void *cbarg, bool is_transaction)
 {
 	vres tcres;
+	struct _listdir_cb_adapter adapter = { cb, NULL, cbarg };
 	TC_DECLARE_COUNTER(listdir);
 
 	if (count == 0) return TC_OKAY;
@@ -666,7 +778,8 @@ vres vec_listdir(const char **dirs, int count, struct vattrs_masks masks,
 	TC_START_COUNTER(listdir);
 	if (TC_IMPL_IS_NFS4) {
 		tcres = nfs_listdirv(dirs, count, masks, max_entries, recursive,
-				     cb, cbarg, is_transaction);
+				     listdir_batch_to_each, &adapter,
+				     is_transaction);
 	} else {
 		tcres = posix_listdirv(dirs, count, masks, max_entries,
 				      recursive, cb, cbarg, is_transaction);
@@ -676,6 +789,39 @@ vres vec_listdir(const char **dirs, int count, struct vattrs_masks masks,
 	return tcres;
 }
 
+vres vec_listdir_batch(const char **dirs, int count,
+		       struct vattrs_masks masks, int max_entries,
+		       bool recursive, vec_listdir_batch_cb cb, void *cbarg,
+		       bool is_transaction)
+{
+	vres tcres;
+	struct _listdir_cb_adapter adapter = { NULL, cb, cbarg };
+	TC_DECLARE_COUNTER(listdir_batch);
+
+	if (count == 0) return TC_OKAY;
+
+	TC_START_COUNTER(listdir_batch);
+	if (TC_IMPL_IS_NFS4) {
+		tcres = nfs_listdirv(dirs, count, masks, max_entries, recursive,
+				     cb, cbarg, is_transaction);
+	} else {
+		/* readdir(3) gives one entry at a time anyway */
+		tcres = posix_listdirv(dirs, count, masks, max_entries,
+				      recursive, listdir_each_to_batch,
+				      &adapter, is_transaction);
+	}
+	TC_STOP_COUNTER(listdir_batch, count, vokay(tcres));
+
+	return tcres;
+}
+
+void vec_set_listdir_parallelism(unsigned int n)
+{
+	if (TC_IMPL_IS_NFS4) {
+		nfs4_set_listdir_parallelism(n);
+	}
+}
+
 vres vec_rename(vfile_pair *pairs, int count, bool is_transaction)
 {
 	vres tcres;
@@ -711,6 +857,9 @@ vres vec_remove(vfile *files, int count, bool is_transaction)
 int sca_unlink(const char *path)
 {
 	vfile tcf = vfile_from_path(path);
+	if (tc_batching_enabled()) {
+		return tc_batch_remove(&tcf);
+	}
 	return vec_remove(&tcf, 1, false).err_no;
 }
 
@@ -924,54 +1073,210 @@ vres vec_copy(struct vextent_pair *pairs, int count, bool is_transaction)
 	return tc_pair(pairs, count, is_transaction, vec_lcopy);
 }
 
-/**
- * FIXME: allow moving files larger than RAM.
+/*
+ * vec_ldup() streams the data through a bounded pool of buffers: chunks of up
+ * to TC_DUP_CHUNK bytes of one or more files are read in batches of up to
+ * TC_DUP_BATCH_BYTES, and each batch is written asynchronously while the next
+ * is being read.  At most TC_DUP_WRITES_IN_FLIGHT batches are being written
+ * at a time, so the memory used is bounded however large the files are.
  */
+#define TC_DUP_CHUNK (512 * 1024)
+#define TC_DUP_BATCH_BYTES (4 * 1024 * 1024)
+#define TC_DUP_MAX_CHUNKS_PER_BATCH 64
+#define TC_DUP_WRITES_IN_FLIGHT 2
+
+struct _dup_batch {
+	char *buf;
+	struct viovec iovs[TC_DUP_MAX_CHUNKS_PER_BATCH];
+	int owners[TC_DUP_MAX_CHUNKS_PER_BATCH];   /* index of the pair */
+	size_t wanted[TC_DUP_MAX_CHUNKS_PER_BATCH]; /* bytes asked to read */
+	int count;
+	bool writing;
+};
+
+struct _dup_state {
+	struct vextent_pair *pairs;
+	int count;
+	int next;	/* the first pair not read to the end */
+	size_t done;	/* bytes of "next" read so far */
+	bool *eof;	/* whether the source of each pair ended early */
+	vres res;
+};
+
+/* Record the failure of "iovs" of "b", unless an earlier one is recorded. */
+static void dup_fail(struct _dup_state *st, struct _dup_batch *b, vres res,
+		     bool reading)
+{
+	int i = b->owners[res.index];
+
+	if (!vokay(st->res)) {
+		return;
+	}
+	fprintf(stderr, "vec_ldup failed when %s %s (%d-th file): %s\n",
+		reading ? "reading" : "writing",
+		reading ? st->pairs[i].src_path : st->pairs[i].dst_path, i,
+		strerror(res.err_no));
+	st->res = vfailure(i, res.err_no);
+}
+
+/* Fill "b" with the reads of the next chunks; "bufsize" is the size of
+ * "b->buf". */
+static void dup_fill_batch(struct _dup_state *st, struct _dup_batch *b,
+			   size_t bufsize)
+{
+	struct vextent_pair *p;
+	size_t used = 0;
+	size_t len;
+
+	b->count = 0;
+	while (st->next < st->count && used < bufsize &&
+	       b->count < TC_DUP_MAX_CHUNKS_PER_BATCH) {
+		p = &st->pairs[st->next];
+		if (st->eof[st->next]) {
+			++st->next;
+			st->done = 0;
+			continue;
+		}
+		/* an empty pair still creates its destination */
+		len = MIN(p->length - st->done, TC_DUP_CHUNK);
+		len = MIN(len, bufsize - used);
+		viov2path(&b->iovs[b->count], p->src_path,
+			  p->src_offset + st->done, len, b->buf + used);
+		b->owners[b->count] = st->next;
+		b->wanted[b->count] = len;
+		++b->count;
+		used += len;
+		st->done += len;
+		if (st->done == p->length) {
+			++st->next;
+			st->done = 0;
+		}
+	}
+}
+
+/* Turn the reads of "b" into the writes of the data read. */
+static void dup_reads_to_writes(struct _dup_state *st, struct _dup_batch *b)
+{
+	struct vextent_pair *p;
+	struct viovec *iov;
+	int i;
+
+	for (i = 0; i < b->count; ++i) {
+		iov = &b->iovs[i];
+		p = &st->pairs[b->owners[i]];
+		if (iov->length < b->wanted[i] || iov->is_eof) {
+			st->eof[b->owners[i]] = true;
+		}
+		iov->file = vfile_from_path(p->dst_path);
+		iov->offset = iov->offset - p->src_offset + p->dst_offset;
+		iov->is_creation = true;
+		iov->is_write_stable = false;
+		iov->is_failure = false;
+		iov->is_direct_io = false;
+		iov->is_eof = false;
+	}
+}
+
+/* Wait for one write to complete; return false if none is in flight. */
+static bool dup_reap(vqueue *q, struct _dup_state *st)
+{
+	struct vcompletion cpl;
+	struct _dup_batch *b;
+
+	if (vqueue_wait(q, &cpl, 1, 1) == 0) {
+		return false;
+	}
+	b = (struct _dup_batch *)cpl.cbarg;
+	b->writing = false;
+	if (!vokay(cpl.res)) {
+		dup_fail(st, b, cpl.res, false);
+	}
+	return true;
+}
+
 vres vec_ldup(struct vextent_pair *pairs, int count, bool is_transaction)
 {
-	vres tcres;
-	struct viovec *iovs;
+	struct _dup_state st;
+	struct _dup_batch *batches;
+	struct _dup_batch *b;
+	vqueue *q = NULL;
+	size_t total = 0;
+	size_t bufsize;
+	int nbatches = 1;
+	vres res;
 	int i;
 
-	iovs = (struct viovec*) malloc(count * sizeof(*iovs));
-	assert(iovs);
 	for (i = 0; i < count; ++i) {
-		viov2path(&iovs[i], pairs[i].src_path, pairs[i].src_offset,
-			  pairs[i].length, (char *)malloc(pairs[i].length));
+		total += pairs[i].length;
+	}
+	bufsize = MAX(MIN(total, (size_t)TC_DUP_BATCH_BYTES), (size_t)1);
+	/* no pipelining for what is read in one go */
+	if (total > bufsize || count > TC_DUP_MAX_CHUNKS_PER_BATCH) {
+		q = vqueue_create(TC_DUP_WRITES_IN_FLIGHT);
+		if (q) {
+			nbatches = TC_DUP_WRITES_IN_FLIGHT + 1;
+		}
 	}
 
-	tcres = vec_read(iovs, count, is_transaction);
-	if (!vokay(tcres)) {
-		fprintf(stderr,
-			"vec_ldup failed when reading %s (%d-th file): %s",
-			pairs[tcres.index].src_path, tcres.index,
-			strerror(tcres.err_no));
-		goto exit;
+	st.pairs = pairs;
+	st.count = count;
+	st.next = 0;
+	st.done = 0;
+	st.eof = (bool *)calloc(count, sizeof(bool));
+	st.res = TC_OKAY;
+	batches = (struct _dup_batch *)calloc(nbatches, sizeof(*batches));
+	for (i = 0; batches && i < nbatches; ++i) {
+		batches[i].buf = (char *)malloc(bufsize);
+		if (!batches[i].buf) {
+			st.res = vfailure(0, ENOMEM);
+		}
+	}
+	if (!st.eof || !batches) {
+		st.res = vfailure(0, ENOMEM);
 	}
 
-	for (i = 0; i < count; ++i) {
-		iovs[i].file = vfile_from_path(pairs[i].dst_path);
-		iovs[i].is_creation = true;
-		iovs[i].is_write_stable = false;
-		iovs[i].is_failure = false;
-		iovs[i].is_direct_io = false;
-		iovs[i].is_eof = false;
-	}
-	tcres = vec_write(iovs, count, is_transaction);
-	if (!vokay(tcres)) {
-		fprintf(stderr,
-			"vec_ldup failed when writing %s (%d-th file): %s",
-			pairs[i].dst_path, i, strerror(tcres.err_no));
-		goto exit;
+	for (i = 0; vokay(st.res); i = (i + 1) % nbatches) {
+		b = &batches[i];
+		while (b->writing && dup_reap(q, &st))
+			;
+		if (!vokay(st.res)) {
+			break;
+		}
+
+		dup_fill_batch(&st, b, bufsize);
+		if (b->count == 0) {
+			break;
+		}
+		res = vec_read(b->iovs, b->count, is_transaction);
+		if (!vokay(res)) {
+			dup_fail(&st, b, res, true);
+			break;
+		}
+
+		dup_reads_to_writes(&st, b);
+		if (q && vec_write_async(q, b->iovs, b->count, is_transaction,
+					 NULL, b) != VTICKET_INVALID) {
+			b->writing = true;
+			continue;
+		}
+		res = vec_write(b->iovs, b->count, is_transaction);
+		if (!vokay(res)) {
+			dup_fail(&st, b, res, false);
+		}
 	}
 
-exit:
-	for (i = 0; i < count; ++i) {
-		free(iovs[i].data);
+	if (q) {
+		while (dup_reap(q, &st))
+			;
+		vqueue_destroy(q);
+	}
+	for (i = 0; batches && i < nbatches; ++i) {
+		free(batches[i].buf);
 	}
-	free(iovs);
+	free(batches);
+	free(st.eof);
 
-	return tcres;
+	return st.res;
 }
 
 vres vec_dup(struct vextent_pair *pairs, int count, bool is_transaction)
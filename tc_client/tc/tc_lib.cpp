@@ -180,7 +180,6 @@ static vres tc_cp_files(vector<struct vattrs> &srcs, const char *src_dir,
 static vres tc_dup_files(const vector<struct vattrs> &srcs,
 			   const char *src_dir, const char *dst_dir)
 {
-	const size_t kSizeLimit = 512 * 1024;
 	const size_t count = srcs.size();
 	vector<struct vattrs> attrs(count);
 	for (size_t i = 0; i < count; ++i) {
@@ -195,68 +194,24 @@ static vres tc_dup_files(const vector<struct vattrs> &srcs,
 		return tcres;
 	}
 
-	vector<struct vextent_pair> small_files;
-	vector<int> big_files_indices;
-	small_files.reserve(count);
+	// vec_ldup() streams the files with bounded memory, however large.
+	vector<struct vextent_pair> pairs(count);
 	vector<const char *> dst_paths(count);
 	for (size_t i = 0; i < count; ++i) {
 		dst_paths[i] =
 		    new_cp_target_path(srcs[i].file.path, src_dir, dst_dir);
-		if (attrs[i].size > kSizeLimit) {
-			big_files_indices.push_back(i);
-			continue;
-		}
-		struct vextent_pair ext = { 0 };
-		ext.src_path = srcs[i].file.path;
-		ext.dst_path = dst_paths[i];
-		ext.src_offset = 0;
-		ext.dst_offset = 0;
-		ext.length = attrs[i].size;
-		small_files.push_back(ext);
-	}
-
-	// Duplicate small files
-	for (size_t i = 0; i < small_files.size(); ) {
-		size_t bytes = 0;
-		size_t n = 0;
-		while (bytes < kSizeLimit && i + n < small_files.size() &&
-		       n++ < 64) {
-			bytes += small_files[i + n].length;
-		}
-		tcres = vec_ldup(small_files.data() + i, n, false);
-		if (!vokay(tcres)) {
-			fprintf(stderr, "failed to duplicate file %s to %s: %s",
-				small_files[i + tcres.index].src_path,
-				small_files[i + tcres.index].dst_path,
-				strerror(tcres.err_no));
-			break;
-		}
-		i += n;
+		pairs[i].src_path = srcs[i].file.path;
+		pairs[i].dst_path = dst_paths[i];
+		pairs[i].src_offset = 0;
+		pairs[i].dst_offset = 0;
+		pairs[i].length = attrs[i].size;
 	}
 
-	// Duplicate large files
-	for (size_t i : big_files_indices) {
-		size_t offset = 0;
-		struct vextent_pair ext;
-		ext.src_path = srcs[i].file.path;
-		ext.dst_path = dst_paths[i];
-		while (offset < attrs[i].size) {
-			ext.src_offset = offset;
-			ext.dst_offset = offset;
-			ext.length = std::min<size_t>(attrs[i].size - offset,
-						      kSizeLimit);
-			tcres = vec_ldup(&ext, 1, false);
-			if (!vokay(tcres)) {
-				fprintf(stderr, "failed to duplicate file %s "
-						"to %s at offset %zu: %s",
-					ext.src_path, ext.dst_path, offset,
-					strerror(tcres.err_no));
-				break;
-			}
-			offset += ext.length;
-		}
-		if (!vokay(tcres))
-			break;
+	tcres = vec_ldup(pairs.data(), count, false);
+	if (!vokay(tcres)) {
+		fprintf(stderr, "failed to duplicate file %s to %s: %s",
+			pairs[tcres.index].src_path,
+			pairs[tcres.index].dst_path, strerror(tcres.err_no));
 	}
 
 	free_paths(&dst_paths);
@@ -0,0 +1,110 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "tc_cache/TC_NegativeCache.h"
+
+using std::string;
+
+static const time_t TTL = 60;
+
+TEST(TC_NegativeCacheTest, MissingPathsAreRemembered)
+{
+	TC_NegativeCache cache(16);
+
+	EXPECT_FALSE(cache.lookup("/foo/missing", 7, TTL));
+	cache.add("/foo/missing", 7);
+	EXPECT_TRUE(cache.lookup("/foo/missing", 7, TTL));
+	// Unknown versions of the parent do not invalidate the entry.
+	EXPECT_TRUE(cache.lookup("/foo/missing", 0, TTL));
+	EXPECT_FALSE(cache.lookup("/foo/other", 7, TTL));
+
+	cache.add("/bar/missing", 0);
+	EXPECT_TRUE(cache.lookup("/bar/missing", 3, TTL));
+}
+
+TEST(TC_NegativeCacheTest, EntriesExpireAfterTTL)
+{
+	TC_NegativeCache cache(16);
+
+	cache.add("/foo/missing", 7);
+	sleep(1);
+	EXPECT_TRUE(cache.lookup("/foo/missing", 7, TTL));
+	EXPECT_FALSE(cache.lookup("/foo/missing", 7, 0));
+	// Expired entries are dropped.
+	EXPECT_FALSE(cache.lookup("/foo/missing", 7, TTL));
+}
+
+TEST(TC_NegativeCacheTest, ChangesOfParentInvalidateEntries)
+{
+	TC_NegativeCache cache(16);
+
+	cache.add("/foo/missing", 7);
+	EXPECT_FALSE(cache.lookup("/foo/missing", 8, TTL));
+	EXPECT_FALSE(cache.lookup("/foo/missing", 7, TTL));
+
+	cache.add("/foo/missing", 8);
+	cache.remove("/foo/missing");
+	EXPECT_FALSE(cache.lookup("/foo/missing", 8, TTL));
+}
+
+TEST(TC_NegativeCacheTest, RemoveUnderDropsEntriesOfSubtree)
+{
+	TC_NegativeCache cache(16);
+
+	cache.add("/foo/a", 1);
+	cache.add("/foo/dir/b", 1);
+	cache.add("/foobar/c", 1);
+	cache.add("/foo", 1);
+
+	cache.removeUnder("/foo");
+	EXPECT_FALSE(cache.lookup("/foo/a", 1, TTL));
+	EXPECT_FALSE(cache.lookup("/foo/dir/b", 1, TTL));
+	// Only paths under the directory, not those sharing its prefix.
+	EXPECT_TRUE(cache.lookup("/foobar/c", 1, TTL));
+	EXPECT_TRUE(cache.lookup("/foo", 1, TTL));
+}
+
+TEST(TC_NegativeCacheTest, OldestEntriesAreEvicted)
+{
+	const int capacity = 4;
+	TC_NegativeCache cache(capacity);
+
+	for (int i = 0; i < 2 * capacity; ++i) {
+		cache.add("/foo/" + std::to_string(i), 1);
+	}
+	for (int i = 0; i < capacity; ++i) {
+		EXPECT_FALSE(cache.lookup("/foo/" + std::to_string(i), 1, TTL));
+	}
+	for (int i = capacity; i < 2 * capacity; ++i) {
+		EXPECT_TRUE(cache.lookup("/foo/" + std::to_string(i), 1, TTL));
+	}
+
+	// Adding a cached path again makes it the newest.
+	cache.add("/foo/" + std::to_string(capacity), 1);
+	cache.add("/foo/new", 1);
+	EXPECT_TRUE(cache.lookup("/foo/" + std::to_string(capacity), 1, TTL));
+	EXPECT_FALSE(
+	    cache.lookup("/foo/" + std::to_string(capacity + 1), 1, TTL));
+
+	TC_NegativeCache disabled(0);
+	disabled.add("/foo/missing", 1);
+	EXPECT_FALSE(disabled.lookup("/foo/missing", 1, TTL));
+}
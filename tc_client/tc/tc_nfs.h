@@ -13,20 +13,36 @@
  */
 
 /*
- * Initialize POCO page cache
+ * Initialize POCO page cache.  Cached attributes of regular files (and other
+ * non-directories) are used without asking the server for "reg_min" to
+ * "reg_max" seconds, and those of directories for "dir_min" to "dir_max"
+ * seconds, depending on how long they have stayed unchanged.
  */
-void init_page_cache(uint64_t size, uint64_t time);
+void init_page_cache(uint64_t size, uint64_t time, uint32_t reg_min,
+		     uint32_t reg_max, uint32_t dir_min, uint32_t dir_max);
 
 /*
  * De-Initialize POCO page cache
  */
 void deinit_page_cache();
 
-void init_data_cache(uint64_t size, uint64_t time);
+/*
+ * Initialize the data cache with "size" blocks of CACHE_BLOCK_SIZE bytes in
+ * memory, and "disk_size" blocks in directory "disk_path" if not NULL.  If
+ * "shm_name" is not NULL, the data cache is in the shared memory segment of
+ * that name instead.
+ */
+void init_data_cache(uint64_t size, uint64_t time, bool huge_pages,
+		     const char *disk_path, uint64_t disk_size,
+		     const char *shm_name);
 
 void deinit_data_cache();
 
-vfile *nfs_openv(const char **paths, int count, int *flags, mode_t *modes);
+/**
+ * See vec_open_partly().
+ */
+vfile *nfs_openv(const char **paths, int count, int *flags, mode_t *modes,
+		 vres *res);
 
 vres nfs_closev(vfile *tcfs, int count);
 
@@ -44,7 +60,7 @@ vres nfs_removev(vfile *vfiles, int count, bool is_transaction);
 vres nfs_mkdirv(struct vattrs *dirs, int count, bool is_transaction);
 
 vres nfs_listdirv(const char **dirs, int count, struct vattrs_masks masks,
-                     int max_entries, bool recursive, vec_listdir_cb cb,
+                     int max_entries, bool recursive, vec_listdir_batch_cb cb,
                      void *cbarg, bool is_transaction);
 
 vres nfs_lcopyv(struct vextent_pair *pairs, int count, bool is_transaction);
@@ -60,6 +76,11 @@ vres nfs_readlinkv(const char **paths, char **bufs, size_t *bufsizes,
 
 vres nfs_readv(struct viovec *iovs, int count, bool istxn);
 
+vres nfs_readv_leased(struct viovec *iovs, int count, bool istxn,
+		      struct vleased_read *leases);
+
+void nfs_release_leases(struct vleased_read *leases, int count);
+
 vres nfs_lgetattrsv(struct vattrs *attrs, int count, bool is_transaction);
 
 int nfs_chdir(const char *path);
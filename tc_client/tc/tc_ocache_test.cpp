@@ -0,0 +1,170 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <gtest/gtest.h>
+#include "nfs4/nfs4_ocache.h"
+
+using std::string;
+
+namespace {
+
+const char FH[] = "filehandle";
+
+// A stateid "other" unique to "i", which is not 0.
+string Sid(int i)
+{
+	string sid(OCACHE_OTHERSIZE, '\0');
+	memcpy(&sid[0], &i, sizeof(i));
+	return sid;
+}
+
+// Add "path" opened with the stateid "i", and the delegation "deleg" if it
+// is not 0.
+void Add(const char *path, int i, int deleg = 0)
+{
+	nfs4_ocache_add(path, FH, sizeof(FH), i, Sid(i).data(), deleg,
+			deleg ? Sid(deleg).data() : NULL);
+}
+
+// Pop all files to close, and free them; returns their paths.
+std::vector<string> PopClosing(std::vector<bool> *delegs = nullptr)
+{
+	std::vector<string> paths;
+	struct nfs4_open_file *files[4];
+	int n;
+
+	while ((n = nfs4_ocache_pop_closing(files, 4)) > 0) {
+		for (int i = 0; i < n; ++i) {
+			paths.push_back(files[i]->path);
+			if (delegs)
+				delegs->push_back(files[i]->deleg);
+			free(files[i]);
+		}
+	}
+	return paths;
+}
+
+} // namespace
+
+class TC_OpenCacheTest : public ::testing::Test
+{
+protected:
+	void SetUp() override { nfs4_ocache_init(4, 60 * 1000); }
+
+	void TearDown() override
+	{
+		nfs4_ocache_deinit();
+		PopClosing();
+	}
+};
+
+TEST_F(TC_OpenCacheTest, DelegationsAreHeldUntilRecalled)
+{
+	struct nfs4_open_file *of;
+	std::vector<bool> delegs;
+
+	Add("/foo", 1, 101);
+	Add("/bar", 2);
+	EXPECT_TRUE(nfs4_ocache_has_deleg("/foo"));
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/bar"));
+
+	EXPECT_TRUE(nfs4_ocache_recall(Sid(101).data()));
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/foo"));
+	EXPECT_EQ(nullptr, nfs4_ocache_get("/foo"));
+	// Recalling it again is fine before it is returned.
+	EXPECT_TRUE(nfs4_ocache_recall(Sid(101).data()));
+
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopClosing(&delegs));
+	EXPECT_EQ(std::vector<bool>{true}, delegs);
+
+	of = nfs4_ocache_get("/bar");
+	ASSERT_NE(nullptr, of);
+	nfs4_ocache_put(of);
+}
+
+TEST_F(TC_OpenCacheTest, DelegationsInUseAreReturnedByLastUser)
+{
+	struct nfs4_open_file *of;
+
+	Add("/foo", 1, 101);
+	of = nfs4_ocache_get("/foo");
+	ASSERT_NE(nullptr, of);
+
+	EXPECT_TRUE(nfs4_ocache_recall(Sid(101).data()));
+	EXPECT_EQ(0, nfs4_ocache_closing_count());
+	// Still to be returned.
+	EXPECT_TRUE(nfs4_ocache_recall(Sid(101).data()));
+
+	nfs4_ocache_put(of);
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopClosing());
+}
+
+TEST_F(TC_OpenCacheTest, DelegationsRecalledBeforeAddedAreReturned)
+{
+	std::vector<bool> delegs;
+
+	EXPECT_FALSE(nfs4_ocache_recall(Sid(101).data()));
+	Add("/foo", 1, 101);
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/foo"));
+	EXPECT_EQ(nullptr, nfs4_ocache_get("/foo"));
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopClosing(&delegs));
+	EXPECT_EQ(std::vector<bool>{true}, delegs);
+
+	// Only once.
+	Add("/foo", 2, 101);
+	EXPECT_TRUE(nfs4_ocache_has_deleg("/foo"));
+}
+
+TEST_F(TC_OpenCacheTest, DelegationOfReopenedFileMovesToCachedOne)
+{
+	std::vector<bool> delegs;
+
+	Add("/foo", 1);
+	Add("/foo", 2, 101);
+	EXPECT_TRUE(nfs4_ocache_has_deleg("/foo"));
+	// The second open is closed without the delegation.
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopClosing(&delegs));
+	EXPECT_EQ(std::vector<bool>{false}, delegs);
+
+	EXPECT_TRUE(nfs4_ocache_return_deleg("/foo"));
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/foo"));
+	delegs.clear();
+	EXPECT_EQ(std::vector<string>{"/foo"}, PopClosing(&delegs));
+	EXPECT_EQ(std::vector<bool>{true}, delegs);
+}
+
+TEST_F(TC_OpenCacheTest, InvalidateReportsDelegations)
+{
+	Add("/foo", 1);
+	Add("/foo/bar", 2, 102);
+	Add("/foobar", 3, 103);
+
+	EXPECT_TRUE(nfs4_ocache_invalidate("/foo/"));
+	EXPECT_EQ(nullptr, nfs4_ocache_get("/foo"));
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/foo/bar"));
+	// Only paths under the directory, not those sharing its prefix.
+	EXPECT_TRUE(nfs4_ocache_has_deleg("/foobar"));
+	EXPECT_EQ(2, PopClosing().size());
+
+	nfs4_ocache_drop_delegs();
+	EXPECT_FALSE(nfs4_ocache_has_deleg("/foobar"));
+	EXPECT_EQ(std::vector<string>{"/foobar"}, PopClosing());
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright (C) Stony Brook University 2017
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "tc_cache/TC_SingleFlight.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const int kNumThreads = 16;
+const string KEY = "/foo/bar";
+
+// A cache of ints that counts its misses.
+class FakeCache
+{
+	std::mutex mu_;
+	std::map<string, int> values_;
+
+public:
+	std::atomic<int> misses{0};
+
+	bool lookup(const string &key, int *value)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto it = values_.find(key);
+		if (it == values_.end()) {
+			misses++;
+			return false;
+		}
+		*value = it->second;
+		return true;
+	}
+
+	void put(const string &key, int value)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		values_[key] = value;
+	}
+
+	bool has(const string &key)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		return values_.count(key) > 0;
+	}
+};
+
+// Get the value of "key", loading it with "loader" upon a miss, in the way
+// tc_cache.cpp uses TC_SingleFlight.
+bool CachedLoad(TC_SingleFlight *flights, FakeCache *cache, const string &key,
+		std::function<bool(int *)> loader, int *value)
+{
+	vector<string> keys{key};
+	vector<string> led;
+
+	if (cache->lookup(key, value))
+		return true;
+	if (!flights->begin(keys, &led)) {
+		flights->end(led);
+		led.clear();
+		flights->wait(keys);
+		if (cache->lookup(key, value))
+			return true;
+		flights->begin(keys, &led);
+	}
+	bool ok = loader(value);
+	if (ok)
+		cache->put(key, *value);
+	flights->end(led);
+	return ok;
+}
+
+// Run "loader" once all threads have missed the cache, so that they all
+// find the load in flight.
+std::function<bool(int *)> AfterAllMissed(FakeCache *cache,
+					  std::atomic<int> *nloads, bool ok)
+{
+	return [cache, nloads, ok](int *value) {
+		(*nloads)++;
+		while (cache->misses < kNumThreads)
+			std::this_thread::yield();
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		*value = 42;
+		return ok;
+	};
+}
+
+} // namespace
+
+TEST(TC_SingleFlightTest, ConcurrentMissesAreLoadedOnce)
+{
+	TC_SingleFlight flights;
+	FakeCache cache;
+	std::atomic<int> nloads{0};
+	auto loader = AfterAllMissed(&cache, &nloads, true);
+	vector<int> values(kNumThreads, 0);
+	vector<bool> oks(kNumThreads, false);
+	vector<std::thread> threads;
+
+	for (int i = 0; i < kNumThreads; ++i) {
+		threads.emplace_back([&, i] {
+			oks[i] = CachedLoad(&flights, &cache, KEY, loader,
+					    &values[i]);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	EXPECT_EQ(1, nloads);
+	for (int i = 0; i < kNumThreads; ++i) {
+		EXPECT_TRUE(oks[i]);
+		EXPECT_EQ(42, values[i]);
+	}
+}
+
+TEST(TC_SingleFlightTest, FailuresReachWaitersWithoutBeingCached)
+{
+	TC_SingleFlight flights;
+	FakeCache cache;
+	std::atomic<int> nloads{0};
+	auto loader = AfterAllMissed(&cache, &nloads, false);
+	vector<bool> oks(kNumThreads, true);
+	vector<std::thread> threads;
+
+	for (int i = 0; i < kNumThreads; ++i) {
+		threads.emplace_back([&, i] {
+			int value;
+			oks[i] = CachedLoad(&flights, &cache, KEY, loader,
+					    &value);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	// Waiters find nothing cached, and try by themselves.
+	EXPECT_GE(nloads, 1);
+	for (int i = 0; i < kNumThreads; ++i) {
+		EXPECT_FALSE(oks[i]);
+	}
+	EXPECT_FALSE(cache.has(KEY));
+
+	// Nothing is left in flight.
+	int value = 0;
+	EXPECT_TRUE(CachedLoad(&flights, &cache, KEY,
+			       [](int *v) {
+				       *v = 7;
+				       return true;
+			       },
+			       &value));
+	EXPECT_EQ(7, value);
+}
+
+TEST(TC_SingleFlightTest, DisjointKeysAreLoadedConcurrently)
+{
+	TC_SingleFlight flights;
+	vector<string> led1;
+	vector<string> led2;
+
+	EXPECT_TRUE(flights.begin({"/a", "/b"}, &led1));
+	EXPECT_FALSE(flights.begin({"/b", "/c"}, &led2));
+	// Only the keys not in flight are led.
+	ASSERT_EQ(1, led2.size());
+	EXPECT_EQ("/c", led2[0]);
+
+	std::thread waiter([&] { flights.wait({"/b"}); });
+	flights.end(led1);
+	waiter.join();
+	flights.end(led2);
+}
@@ -33,6 +33,7 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
 #include <random>
 #include <string>
 #include <thread>
@@ -568,6 +569,37 @@ TYPED_TEST_P(TcTest, ListLargeDir)
 	vfree_attrs(contents, count, true);
 }
 
+static bool listdir_batch_test_cb(const struct vattrs *entries, int count,
+				  const char *dir, void *cbarg)
+{
+	std::set<std::string> *objs = (std::set<std::string> *)cbarg;
+	for (int i = 0; i < count; ++i) {
+		EXPECT_EQ(0, strncmp(dir, entries[i].file.path, strlen(dir)));
+		objs->emplace(entries[i].file.path);
+	}
+	return true;
+}
+
+TYPED_TEST_P(TcTest, ListLargeDirInBatches)
+{
+	const char *ROOTDIR = "TcTest-ListLargeDirInBatches";
+	EXPECT_OK(sca_ensure_dir(ROOTDIR, 0755, 0));
+	buf_t *name = new_auto_buf(PATH_MAX);
+	std::set<std::string> expected;
+	const int N = 512;
+	for (int i = 1; i <= N; ++i) {
+		buf_printf(name, "%s/large-file%05d", ROOTDIR, i);
+		tc_touch(asstr(name), i);
+		expected.emplace(asstr(name));
+	}
+
+	struct vattrs_masks listdir_mask = { .has_mode = true };
+	std::set<std::string> objs;
+	EXPECT_OK(vec_listdir_batch(&ROOTDIR, 1, listdir_mask, 0, false,
+				    listdir_batch_test_cb, &objs, false));
+	EXPECT_THAT(objs, testing::ContainerEq(expected));
+}
+
 TYPED_TEST_P(TcTest, ListDirRecursively)
 {
 	EXPECT_OK(sca_ensure_dir("TcTest-ListDirRecursively/00/00", 0755, 0));
@@ -603,6 +635,99 @@ TYPED_TEST_P(TcTest, ListDirRecursively)
 	vfree_attrs(contents, count, true);
 }
 
+typedef std::map<std::string, std::vector<std::string>> DirListings;
+
+static bool listdir_in_order_cb(const struct vattrs *entries, int count,
+				const char *dir, void *cbarg)
+{
+	DirListings *listings = (DirListings *)cbarg;
+	std::vector<std::string> &paths = (*listings)[dir];
+	for (int i = 0; i < count; ++i) {
+		EXPECT_EQ(0, strncmp(dir, entries[i].file.path, strlen(dir)));
+		paths.emplace_back(entries[i].file.path);
+	}
+	return true;
+}
+
+/**
+ * List "root" recursively into "listings", which keep the entries of each
+ * directory in the order they are passed to the callback.  Returns the
+ * number of entries listed.
+ */
+static size_t listdir_in_order(const char *root, int max_entries,
+			       DirListings *listings)
+{
+	// removing an entry makes the next listing go to the server
+	std::string marker = std::string(root) + "/marker";
+	const char *path = marker.c_str();
+	tc_touch(path, 0);
+	EXPECT_TRUE(Removev(&path, 1));
+
+	struct vattrs_masks listdir_mask = { .has_mode = true };
+	EXPECT_OK(vec_listdir_batch(&root, 1, listdir_mask, max_entries, true,
+				    listdir_in_order_cb, listings, false));
+	size_t n = 0;
+	for (const auto &dir : *listings) {
+		n += dir.second.size();
+	}
+	return n;
+}
+
+TYPED_TEST_P(TcTest, ListDirRecursivelyInParallel)
+{
+	const char *ROOTDIR = "TcTest-ListDirRecursivelyInParallel";
+	std::vector<std::string> files;
+	std::vector<const char *> paths;
+	size_t count = 0;
+
+	for (int i = 0; i < 8; ++i) {
+		for (int j = 0; j < 2; ++j) {
+			std::string dir = std::string(ROOTDIR) + "/" +
+					  std::to_string(i) + "/" +
+					  std::to_string(j);
+			EXPECT_OK(sca_ensure_dir(dir.c_str(), 0755, 0));
+			for (int k = 0; k < 20; ++k) {
+				files.emplace_back(dir + "/" +
+						   std::to_string(k));
+			}
+		}
+		for (int k = 0; k < 100; ++k) {
+			files.emplace_back(std::string(ROOTDIR) + "/" +
+					   std::to_string(i) + "/file" +
+					   std::to_string(k));
+		}
+		count += 1 + 2;
+	}
+	for (const auto &f : files) {
+		paths.push_back(f.c_str());
+	}
+	tc_touchv(paths.data(), paths.size(), 0);
+	count += files.size();
+
+	DirListings serial;
+	vec_set_listdir_parallelism(1);
+	EXPECT_EQ(count, listdir_in_order(ROOTDIR, 0, &serial));
+
+	// the entries of each directory are still listed in order
+	DirListings parallel;
+	vec_set_listdir_parallelism(4);
+	EXPECT_EQ(count, listdir_in_order(ROOTDIR, 0, &parallel));
+	EXPECT_THAT(parallel, testing::ContainerEq(serial));
+
+	// and stop at "max_entries"
+	DirListings limited;
+	EXPECT_EQ(count / 2, listdir_in_order(ROOTDIR, count / 2, &limited));
+	for (const auto &dir : limited) {
+		const std::vector<std::string> &all = serial[dir.first];
+		ASSERT_LE(dir.second.size(), all.size());
+		EXPECT_TRUE(std::equal(dir.second.begin(), dir.second.end(),
+				       all.begin()))
+		    << "entries of " << dir.first << " are out of order";
+	}
+
+	vec_set_listdir_parallelism(1);
+}
+
 /**
  * Rename File Test
  */
@@ -894,6 +1019,27 @@ TYPED_TEST_P(TcTest, CopyFiles)
 	CopyOrDupFiles("TestCopy", true, 64);
 }
 
+// A destination found missing before the copy is found after it.
+TYPED_TEST_P(TcTest, CopyToMissingFile)
+{
+	const char *SRC = "TcTest-CopyToMissingFile-src.dat";
+	const char *DST = "TcTest-CopyToMissingFile-dst.dat";
+	struct vextent_pair pair;
+	struct stat st;
+
+	tc_touch(SRC, 4_KB);
+	sca_unlink(DST);
+	EXPECT_EQ(ENOENT, sca_stat(DST, &st));
+
+	vfill_extent_pair(&pair, SRC, 0, DST, 0, 4_KB);
+	EXPECT_OK(vec_copy(&pair, 1, false));
+	EXPECT_EQ(0, sca_stat(DST, &st));
+	EXPECT_EQ(4_KB, st.st_size);
+
+	Removev(&SRC, 1);
+	Removev(&DST, 1);
+}
+
 TYPED_TEST_P(TcTest, DupFiles)
 {
 	SCOPED_TRACE("DupFiles");
@@ -901,6 +1047,34 @@ TYPED_TEST_P(TcTest, DupFiles)
 	CopyOrDupFiles("TestDup", false, 64);
 }
 
+// Larger than a batch of vec_ldup(), so that reads and writes are pipelined.
+TYPED_TEST_P(TcTest, DupLargeFile)
+{
+	const size_t N = 11 * 1024 * 1024 + 3;
+	const char *src = "TestDupLargeFile-src";
+	const char *dst = "TestDupLargeFile-dst";
+	struct viovec iov;
+	struct viovec read_iov;
+	struct vextent_pair pair;
+
+	viov4creation(&iov, src, N, getRandomBytes(N));
+	EXPECT_NOTNULL(iov.data);
+	EXPECT_OK(vec_write(&iov, 1, false));
+
+	vfill_extent_pair(&pair, src, 0, dst, 0, N);
+	EXPECT_OK(vec_dup(&pair, 1, false));
+
+	viov2path(&read_iov, dst, 0, N, (char *)malloc(N));
+	EXPECT_NOTNULL(read_iov.data);
+	EXPECT_OK(vec_read(&read_iov, 1, false));
+	compare_content(&iov, &read_iov, 1);
+
+	free(iov.data);
+	free(read_iov.data);
+	vec_unlink(&src, 1);
+	vec_unlink(&dst, 1);
+}
+
 TYPED_TEST_P(TcTest, CopyLargeDirectory)
 {
 	int i;
@@ -1180,6 +1354,29 @@ TYPED_TEST_P(TcTest, RdWrLargeThanRPCLimit)
 	free(data2);
 }
 
+// A new file larger than a compound is created before its later parts are
+// written.
+TYPED_TEST_P(TcTest, WriteLargeNewFile)
+{
+	const char *PATH = "TcTest-WriteLargeNewFile.dat";
+	struct viovec iov = {0};
+	char *data1 = getRandomBytes(8_MB);
+
+	Removev(&PATH, 1);
+	viov4creation(&iov, PATH, 8_MB, data1);
+	EXPECT_OK(vec_write(&iov, 1, false));
+	EXPECT_EQ(8_MB, iov.length);
+
+	char *data2 = (char *)malloc(8_MB);
+	viov2path(&iov, PATH, 0, 8_MB, data2);
+	EXPECT_OK(vec_read(&iov, 1, false));
+	EXPECT_EQ(8_MB, iov.length);
+	EXPECT_EQ(0, memcmp(data1, data2, 8_MB));
+
+	free(data1);
+	free(data2);
+}
+
 TYPED_TEST_P(TcTest, CompressDeepPaths)
 {
 	const char *PATHS[] = { "TcTest-CompressDeepPaths/a/b/c0/001.dat",
@@ -1284,6 +1481,51 @@ TYPED_TEST_P(TcTest, SymlinkBasics)
 	delete[] bufsizes;
 }
 
+// Chains of absolute and relative symlinks are followed to the final target,
+// and a loop of symlinks fails with ELOOP.
+TYPED_TEST_P(TcTest, FollowSymlinkChains)
+{
+	const char *DIR = "TcTest-FollowSymlinkChains";
+	const char *TARGET = "TcTest-FollowSymlinkChains/target.dat";
+	const char *LINKS[] = { "TcTest-FollowSymlinkChains/link1",
+				"TcTest-FollowSymlinkChains/link2",
+				"TcTest-FollowSymlinkChains/link3",
+				"TcTest-FollowSymlinkChains/loop1",
+				"TcTest-FollowSymlinkChains/loop2", };
+	char *cwd = sca_getcwd();
+	ASSERT_TRUE(cwd != NULL);
+	std::string abs_link3 = std::string(cwd) + "/" + LINKS[2];
+	free(cwd);
+	const char *CONTENTS[] = { "link2", abs_link3.c_str(), "target.dat",
+				   "loop2", "loop1", };
+	const int N = sizeof(LINKS) / sizeof(LINKS[0]);
+	struct vattrs attrs;
+
+	EXPECT_OK(vec_unlink_recursive(&DIR, 1));
+	EXPECT_OK(sca_ensure_dir(DIR, 0755, NULL));
+	tc_touch(TARGET, 8_KB);
+	EXPECT_OK(vec_symlink(CONTENTS, LINKS, N, false));
+
+	memset(&attrs, 0, sizeof(attrs));
+	attrs.file = vfile_from_path(LINKS[0]);
+	attrs.masks = VATTRS_MASK_ALL;
+	EXPECT_OK(vec_getattrs(&attrs, 1, false));
+	EXPECT_TRUE(S_ISREG(attrs.mode));
+	EXPECT_EQ(8_KB, attrs.size);
+
+	// The link itself is not followed by lgetattrs.
+	attrs.file = vfile_from_path(LINKS[0]);
+	attrs.masks = VATTRS_MASK_ALL;
+	EXPECT_OK(vec_lgetattrs(&attrs, 1, false));
+	EXPECT_TRUE(S_ISLNK(attrs.mode));
+
+	attrs.file = vfile_from_path(LINKS[3]);
+	attrs.masks = VATTRS_MASK_ALL;
+	EXPECT_EQ(ELOOP, vec_getattrs(&attrs, 1, false).err_no);
+
+	EXPECT_OK(vec_unlink_recursive(&DIR, 1));
+}
+
 TYPED_TEST_P(TcTest, ManyLinksDontFitInOneCompound)
 {
 	const int NLINKS = 64;
@@ -1562,6 +1804,111 @@ TYPED_TEST_P(TcTest, UnalignedCacheWrite)
         free_iovec(readv, count);
 }
 
+TYPED_TEST_P(TcTest, AsyncRdWr)
+{
+	const char *PATH = "TcTest-AsyncRdWr.dat";
+	const int N = 8;
+	const int S = 4096;
+	struct viovec iovs[N];
+	struct vcompletion cpls[N];
+	vticket tickets[N];
+	vqueue *q;
+
+	tc_touch(PATH, N * S);
+	q = vqueue_create(4);
+	ASSERT_TRUE(q != NULL);
+
+	char *data1 = getRandomBytes(N * S);
+	char *data2 = (char *)malloc(N * S);
+	for (int i = 0; i < N; ++i) {
+		viov2path(&iovs[i], PATH, i * S, S, data1 + i * S);
+		tickets[i] = vec_write_async(q, &iovs[i], 1, false, NULL, NULL);
+		EXPECT_NE(VTICKET_INVALID, tickets[i]);
+	}
+	EXPECT_EQ(N, vqueue_wait(q, cpls, N, N));
+	for (int i = 0; i < N; ++i) {
+		EXPECT_OK(cpls[i].res);
+	}
+	EXPECT_EQ(0, vqueue_pending(q));
+
+	for (int i = 0; i < N; ++i) {
+		viov2path(&iovs[i], PATH, i * S, S, data2 + i * S);
+	}
+	tickets[0] = vec_read_async(q, iovs, N, false, NULL, data2);
+	EXPECT_EQ(1, vqueue_wait(q, cpls, 1, N));
+	EXPECT_EQ(tickets[0], cpls[0].ticket);
+	EXPECT_EQ(data2, cpls[0].cbarg);
+	EXPECT_OK(cpls[0].res);
+	EXPECT_EQ(0, memcmp(data1, data2, N * S));
+	EXPECT_EQ(0, vqueue_poll(q, cpls, N));
+
+	vqueue_destroy(q);
+	free(data1);
+	free(data2);
+}
+
+TYPED_TEST_P(TcTest, BatchScalarCalls)
+{
+	const int T = 8;  /* # of threads */
+	std::vector<std::string> paths;
+	for (int t = 0; t < T; ++t) {
+		paths.push_back("TcTest-BatchScalarCalls-" + std::to_string(t));
+		tc_touch(paths[t].c_str(), 4_KB * (t + 1));
+	}
+
+	sca_set_batching(2000, T);
+	DoParallel(T, [&paths](int i) {
+		struct stat st;
+		EXPECT_EQ(0, sca_stat(paths[i].c_str(), &st));
+		EXPECT_EQ(4_KB * (i + 1), st.st_size);
+
+		vfile *tcf = sca_open(paths[i].c_str(), O_RDONLY, 0);
+		ASSERT_TRUE(tcf != NULL);
+		EXPECT_EQ(0, sca_close(tcf));
+
+		EXPECT_EQ(0, sca_unlink(paths[i].c_str()));
+		EXPECT_EQ(ENOENT, sca_stat(paths[i].c_str(), &st));
+	});
+	sca_set_batching(0, 1);
+}
+
+// A batched open that fails does not fail the others batched with it.
+TYPED_TEST_P(TcTest, BatchOpensWithMissingFiles)
+{
+	const int T = 8;  /* # of threads */
+	std::vector<std::string> paths;
+	for (int t = 0; t < T; ++t) {
+		paths.push_back("TcTest-BatchOpensWithMissingFiles-" +
+				std::to_string(t));
+		if (t % 2 == 0) {
+			tc_touch(paths[t].c_str(), 4_KB);
+		} else {
+			sca_unlink(paths[t].c_str());
+		}
+	}
+
+	sca_set_batching(2000, T);
+	DoParallel(T, [&paths](int i) {
+		vfile *tcf = sca_open(paths[i].c_str(), O_RDONLY, 0);
+		if (i % 2 == 0) {
+			ASSERT_TRUE(tcf != NULL);
+			EXPECT_GE(tcf->fd, 0);
+			EXPECT_EQ(0, sca_close(tcf));
+		} else if (tcf == NULL) {
+			EXPECT_EQ(ENOENT, errno);
+		} else {
+			/* the POSIX implementation returns -errno as fd */
+			EXPECT_EQ(-ENOENT, tcf->fd);
+			free(tcf);
+		}
+	});
+	sca_set_batching(0, 1);
+
+	for (int t = 0; t < T; t += 2) {
+		EXPECT_EQ(0, sca_unlink(paths[t].c_str()));
+	}
+}
+
 // TODO; add test interaction between data cache and writes to TC_OFFSET_CUR
 // See tc_cache.cpp:nfs_writev.
 
@@ -1574,7 +1921,9 @@ REGISTER_TYPED_TEST_CASE_P(TcTest,
 			   SetAttrsOfManyFiles,
 			   ListDirContents,
 			   ListLargeDir,
+			   ListLargeDirInBatches,
 			   ListDirRecursively,
+			   ListDirRecursivelyInParallel,
 			   RenameFile,
 			   RemoveFileTest,
 			   MakeDirectories,
@@ -1584,7 +1933,9 @@ REGISTER_TYPED_TEST_CASE_P(TcTest,
 			   SuccessiveWrites,
 			   SessionTimeout,
 			   CopyFiles,
+			   CopyToMissingFile,
 			   DupFiles,
+			   DupLargeFile,
 			   CopyFirstHalfAsSecondHalf,
 			   CopyManyFilesDontFitInOneCompound,
 			   WriteManyDontFitInOneCompound,
@@ -1593,10 +1944,12 @@ REGISTER_TYPED_TEST_CASE_P(TcTest,
 			   ShuffledRdWr,
 			   ParallelRdWrAFile,
 			   RdWrLargeThanRPCLimit,
+			   WriteLargeNewFile,
 			   CompressDeepPaths,
 			   CompressPathForRemove,
 			   TestHardLinks,
 			   SymlinkBasics,
+			   FollowSymlinkChains,
 			   ManyLinksDontFitInOneCompound,
 			   TcStatBasics,
 			   CopyLargeDirectory,
@@ -1606,7 +1959,10 @@ REGISTER_TYPED_TEST_CASE_P(TcTest,
 			   TcRmRecursive,
 			   RequestDoesNotFitIntoOneCompound,
 			   UnalignedCacheRead,
-			   UnalignedCacheWrite);
+			   UnalignedCacheWrite,
+			   AsyncRdWr,
+			   BatchScalarCalls,
+			   BatchOpensWithMissingFiles);
 
 typedef ::testing::Types<TcNFS4Impl, TcPosixImpl> TcImpls;
 INSTANTIATE_TYPED_TEST_CASE_P(TC, TcTest, TcImpls);
@@ -0,0 +1,179 @@
+//
+// TC_CacheUtil.h
+//
+// Definitions shared by the data caches.
+//
+#ifndef TC_CacheUtil_INCLUDED
+#define TC_CacheUtil_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_BLOCK_SIZE (256 * 1024)
+
+#define CACHE_EXPIRE_SECONDS (60 * 1000)
+
+#define DATA_REFRESH_TIME_SECONDS 5
+
+#define CACHE_HUGE_PAGE_SIZE (2UL << 20)
+
+// FNV-1a of the path.
+static inline uint64_t HashPath(const char *path, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ static_cast<unsigned char>(path[i])) *
+		    1099511628211ULL;
+	}
+	return h;
+}
+
+static inline uint64_t HashPath(const std::string &path)
+{
+	return HashPath(path.data(), path.size());
+}
+
+// The path of a file as the key of its cached data: the caller's string,
+// which is not copied, and its hash, which is computed once per call.
+struct CachePath {
+	const char *data;
+	size_t size;
+	uint64_t hash;
+
+	CachePath(const char *p, size_t n)
+	    : data(p), size(n), hash(HashPath(p, n)) {}
+	CachePath(const char *p) : CachePath(p, strlen(p)) {}
+	CachePath(const std::string &s) : CachePath(s.data(), s.size()) {}
+
+	bool equals(const char *p, size_t n) const
+	{
+		return n == size && memcmp(p, data, size) == 0;
+	}
+	bool operator==(const std::string &s) const
+	{
+		return equals(s.data(), s.size());
+	}
+	std::string str() const { return std::string(data, size); }
+};
+
+// Mix the block number into the hash of its file (finalizer of splitmix64).
+static inline uint64_t HashBlock(uint64_t path_hash, size_t block_no)
+{
+	uint64_t h = path_hash + block_no * 0x9e3779b97f4a7c15ULL;
+
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static inline bool HasCtime(const struct timespec &ctime)
+{
+	return ctime.tv_sec != 0 || ctime.tv_nsec != 0;
+}
+
+static inline bool SameCtime(const struct timespec &a,
+			     const struct timespec &b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static inline uint64_t NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		   std::chrono::steady_clock::now().time_since_epoch())
+	    .count();
+}
+
+// A [begin, end) range of valid bytes within a block.  Extents of a block
+// are sorted, disjoint and non-adjacent.
+typedef std::pair<size_t, size_t> Extent;
+
+static inline void AddMiss(size_t b, size_t e, size_t *miss_begin,
+			   size_t *miss_end)
+{
+	if (*miss_begin == *miss_end) {
+		*miss_begin = b;
+		*miss_end = e;
+	} else {
+		*miss_begin = std::min(*miss_begin, b);
+		*miss_end = std::max(*miss_end, e);
+	}
+}
+
+// Copy the valid bytes within [start, end) of "data" to "buf", and extend
+// [*miss_begin, *miss_end) to cover the invalid ones.
+static inline void ReadExtents(const Extent *exts, size_t n, const char *data,
+			       size_t start, size_t end, char *buf,
+			       size_t *miss_begin, size_t *miss_end)
+{
+	size_t pos = start;
+
+	for (size_t i = 0; i < n; ++i) {
+		if (exts[i].second <= pos)
+			continue;
+		if (exts[i].first >= end)
+			break;
+		if (exts[i].first > pos)
+			AddMiss(pos, exts[i].first, miss_begin, miss_end);
+		size_t b = std::max(pos, exts[i].first);
+		size_t e = std::min(end, exts[i].second);
+		memcpy(buf + (b - start), data + b, e - b);
+		pos = e;
+	}
+	if (pos < end)
+		AddMiss(pos, end, miss_begin, miss_end);
+}
+
+// Whether all bytes within [start, end) are valid.
+static inline bool CoversExtents(const Extent *exts, size_t n, size_t start,
+				 size_t end)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (exts[i].second >= end)
+			return exts[i].first <= start;
+	}
+	return start == end;
+}
+
+// Add [start, end) to the "n" extents in "exts", which has room for "cap"
+// extents, and return the new number of extents.  If there is no room, the
+// other extents are forgotten.
+static inline size_t AddExtent(Extent *exts, size_t n, size_t cap,
+			       size_t start, size_t end)
+{
+	size_t i = 0;
+
+	while (i < n && exts[i].second < start)
+		++i;
+	size_t j = i;
+	while (j < n && exts[j].first <= end) {
+		start = std::min(start, exts[j].first);
+		end = std::max(end, exts[j].second);
+		++j;
+	}
+	if (i == j && n == cap) {
+		exts[0] = Extent(start, end);
+		return 1;
+	}
+	if (i == j)
+		std::copy_backward(exts + j, exts + n, exts + n + 1);
+	else
+		std::copy(exts + j, exts + n, exts + i + 1);
+	exts[i] = Extent(start, end);
+	return n - (j - i) + 1;
+}
+
+// A read-only lease of cached data; see TC_DataCache::lease().
+struct DataLease {
+	const char *data;
+	size_t length;
+	void *block;
+};
+
+#endif // TC_CacheUtil_INCLUDED
@@ -1,8 +1,16 @@
 //
 // TC_DataCache.h
 //
-// Creating anther version of ExpireLRUCache as Metadata cache,
-// by inheriting AbstractCache.h
+// Block cache of file data.
+//
+// File data is cached in blocks of CACHE_BLOCK_SIZE bytes, and each block
+// tracks which byte ranges in it are valid.  Blocks are spread over shards
+// by (file, block number); each shard has its own lock, a fixed number of
+// block slots carved out of one memory slab, and evicts blocks in CLOCK
+// order.  The memory used is thus bounded by the byte budget of the cache.
+// Evicted blocks can be spilled to a second tier on local storage; see
+// TC_DiskCache.h.  Alternatively, the cache can live in shared memory so that
+// it is shared by all client processes on the host; see TC_ShmDataCache.h.
 //
 // Definition of the TC_DataCache class.
 //
@@ -10,384 +18,513 @@
 #define TC_DataCache_INCLUDED
 
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include <mutex>
-#include <map>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <unordered_set>
-#include "Poco/AbstractCache.h"
-#include "Poco/StrategyCollection.h"
-#include "Poco/SharedPtr.h"
-#include "Poco/ExpireStrategy.h"
-#include "Poco/LRUStrategy.h"
+#include "TC_CacheUtil.h"
 #include "TC_Debug.h"
-//remove this
-using namespace Poco;
-
-#define CACHE_BLOCK_SIZE (256 * 1024)
-
-#define CACHE_EXPIRE_SECONDS (60 * 1000)
-
-#define DATA_REFRESH_TIME_SECONDS 5
-
-/*template <
-        class string,
-        class DataBlock,
-        class FastMutex = FastMutex,
-        class  FastMutex = FastMutex
->*/
-class DataBlock;
-
-static inline uint32_t Decode(const char* data, size_t l) {
-	uint32_t h = 0;
-	switch (l) {
-	case 4:
-		h += static_cast<unsigned char>(data[3]) << 24;
-	case 3:
-		h += static_cast<unsigned char>(data[2]) << 16;
-	case 2:
-		h += static_cast<unsigned char>(data[1]) << 8;
-	case 1:
-		h += static_cast<unsigned char>(data[0]);
-		break;
-	}
-	return h;
-}
-
-static inline uint32_t Hash(const std::string& str, uint32_t seed=8887) {
-	const uint32_t m = 0xc6a4a793;
-	const char* data = str.data();
-	size_t n = str.length();
-	uint32_t h = seed ^ (n * m);
-
-	while (n > 0) {
-		size_t l = std::min<uint32_t>(n, 4);
-		uint32_t w = Decode(data, l);
-		data += l;
-		n -= l;
-		h += w;
-		h *= m;
-		h ^= (h >> 16);
-	}
-
-	return h;
-}
-
-static inline std::string GetBlockKey(const std::string &path, size_t block_no)
-{
-  return  path + std::to_string(block_no);
-}
-
-// FIXME: use FastMutex or not?
-typedef AbstractCache<std::string, DataBlock,
-			 StrategyCollection<std::string, DataBlock>, FastMutex,
-			 FastMutex> DataCacheBase;
+#include "TC_DiskCache.h"
+#include "TC_ShmDataCache.h"
 
-class DataCacheShard : public DataCacheBase
-{
-	std::mutex mu_;
-	std::unordered_map<std::string, std::unordered_set<size_t>> cached_blocks;
+class DataBlock {
 public:
-  DataCacheShard(long cacheSize = 102400,
-	       Timestamp::TimeDiff expire = CACHE_EXPIRE_SECONDS)
-      : DataCacheBase(StrategyCollection<std::string, DataBlock>())
+	char *data = nullptr;	// CACHE_BLOCK_SIZE bytes in the slab
+	size_t block_no = 0;
+	// Path of the file in DataCacheShard::files_, and its hash; nullptr
+	// if the block is not linked into the cache.  Protected by the lock of
+	// the shard.
+	const std::string *path = nullptr;
+	uint64_t path_hash = 0;
+	// CLOCK reference bit; protected by the lock of the shard.
+	bool referenced = false;
+	// # of users copying data from or to the block, or holding leases of
+	// it; a pinned block is not reused.  Like "leases" and "writers", it
+	// is incremented only with the lock of the shard held.
+	std::atomic<int> pins{0};
+	// # of read-only leases; the data of a leased block is not changed,
+	// so writers copy the block instead.
+	std::atomic<int> leases{0};
+	std::atomic<int> writers{0};
+	std::atomic<time_t> timestamp{0};	// time of the last fill
+	std::atomic<uint64_t> expire_ms{0};
+
+	// Protects "data", "extents" and "ctime".
+	std::mutex mu;
+	// Ranges of valid bytes within the block.
+	std::vector<Extent> extents;
+	// ctime of the file as of the last fill; zero if unknown.
+	struct timespec ctime = {0, 0};
+
+	// Copy "size" bytes to the block at "start" and mark them valid.
+	// Bytes cached under another ctime are dropped.
+	void fill(size_t start, const char *d, size_t size,
+		  const struct timespec *ct = nullptr)
 	{
-#ifdef _DEBUG
-                std::cout << "DataCacheShard - Constructor" << std::endl;
-#endif
-		_strategy.pushBack(
-		    new LRUStrategy<std::string, DataBlock>(cacheSize));
-		_strategy.pushBack(
-		    new ExpireStrategy<std::string, DataBlock>(expire));
-	}
+		std::lock_guard<std::mutex> lock(mu);
+		struct timespec new_ctime = ct ? *ct : timespec{0, 0};
+		size_t end = start + size;
 
-        ~DataCacheShard()
-        {
-#ifdef _DEBUG
-                std::cout << "DataCacheShard - Destructor" << std::endl;
-#endif
-        }
+		memcpy(data + start, d, size);
+		timestamp = time(NULL);
+		if (!SameCtime(ctime, new_ctime)) {
+			extents.clear();
+			ctime = new_ctime;
+		}
 
-        void AddBlockToMap(const std::string& path, size_t block_no)
-        {
-		std::lock_guard<std::mutex> lock(mu_);
-		cached_blocks[path].insert(block_no);
-        }
+		// Merge all extents overlapping or adjacent to [start, end).
+		auto it = extents.begin();
+		while (it != extents.end() && it->second < start)
+			++it;
+		auto first = it;
+		while (it != extents.end() && it->first <= end) {
+			start = std::min(start, it->first);
+			end = std::max(end, it->second);
+			++it;
+		}
+		it = extents.erase(first, it);
+		extents.insert(it, std::make_pair(start, end));
+	}
 
-	void RemoveBlockFromMap(const std::string &path, size_t block_no)
+	// Copy the valid bytes within [start, end) of the block to "buf", and
+	// extend [*miss_begin, *miss_end) to cover the invalid ones.  Offsets
+	// of the miss range are relative to the block.
+	void read(size_t start, size_t end, char *buf, size_t *miss_begin,
+		  size_t *miss_end)
 	{
-		std::lock_guard<std::mutex> lock(mu_);
-		auto it = cached_blocks.find(path);
-                if (it != cached_blocks.end())
-                        it->second.erase(block_no);
-        }
-	bool isCached(const std::string& path)
+		std::lock_guard<std::mutex> lock(mu);
+		ReadExtents(extents.data(), extents.size(), data, start, end,
+			    buf, miss_begin, miss_end);
+	}
+
+	// Whether the data was cached when the ctime of the file was "ct", or
+	// when the ctime was unknown.
+	bool matchesCtime(const struct timespec &ct)
 	{
-		// FIXME: we need to remove blocks from "cached_blocks"
-		// accordingly when the caching library evicts blocks.
-		std::lock_guard<std::mutex> lock(mu_);
-		auto it = cached_blocks.find(path);
-		return (it != cached_blocks.end()) && !it->second.empty();
+		std::lock_guard<std::mutex> lock(mu);
+		return !HasCtime(ctime) || SameCtime(ctime, ct);
 	}
-	void put(const std::string& path, size_t offset, size_t length,
-		 char *data);
-	void remove(const std::string& path);
-	void remove(const std::string& path, size_t offset, size_t length);
-	int get(const std::string& path, size_t offset, size_t length,
-		char *buf, bool *revalidate);
 
-private:
-        DataCacheShard(const DataCacheShard& aCache);
-	DataCacheShard &operator=(const DataCacheShard &aCache);
+	// Whether all bytes within [start, end) of the block are valid.
+	bool covers(size_t start, size_t end)
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		return CoversExtents(extents.data(), extents.size(), start,
+				     end);
+	}
+
+	// Copy the valid data of "src", which must not be being written.
+	void copyFrom(DataBlock *src)
+	{
+		std::lock_guard<std::mutex> lock(src->mu);
+
+		for (const auto &ext : src->extents) {
+			memcpy(data + ext.first, src->data + ext.first,
+			       ext.second - ext.first);
+		}
+		extents = src->extents;
+		ctime = src->ctime;
+		timestamp.store(src->timestamp);
+	}
 };
 
-class DataBlock {
-public:
-	char *data;
-	size_t len;
-	int start_idx;	
+// A block evicted from memory, to be saved to the disk cache.  The data is
+// still in "block", which is locked until saved, unless the slot is reused
+// right away, in which case the data is copied to "data".
+struct DataSpill {
 	std::string path;
 	size_t block_no;
-	DataCacheShard *data_cache;
-	time_t timestamp;
+	std::vector<std::pair<size_t, size_t>> extents;
+	struct timespec ctime;
+	DataBlock *block = nullptr;
+	char *data = nullptr;	// page aligned for O_DIRECT
+
+	DataSpill() = default;
+	DataSpill(const DataSpill &) = delete;
+	DataSpill &operator=(const DataSpill &) = delete;
+	~DataSpill() { free(data); }
+
+	// Copy the data out of "block" and unlock it.
+	void detach()
+	{
+		if (!block)
+			return;
+		void *p;
+		if (posix_memalign(&p, 4096, CACHE_BLOCK_SIZE) == 0) {
+			data = (char *)p;
+			memcpy(data, block->data, CACHE_BLOCK_SIZE);
+		}
+		block->mu.unlock();
+		block = nullptr;
+	}
+};
+
+class DataCacheShard
+{
+	typedef std::unordered_map<size_t, DataBlock *> BlockMap;
+
+	struct FileBlocks {
+		std::string path;
+		BlockMap blocks;	// block number -> block
+	};
 
-	DataBlock(char *d, size_t size, int start, std::string p, size_t b,
-		  DataCacheShard *dc)
+	std::mutex mu_;
+	// Files by the hash of their paths, so that lookups need not copy the
+	// path.  Of paths with the same hash, only one is cached at a time.
+	std::unordered_map<uint64_t, FileBlocks> files_;
+	std::vector<DataBlock> blocks_;
+	char *slab_ = nullptr;
+	size_t slab_size_ = 0;
+	size_t nfresh_ = 0;	// # of slots that have never been used
+	size_t hand_ = 0;	// CLOCK hand
+	uint64_t expire_ms_;
+
+public:
+	DataCacheShard(size_t nblocks, uint64_t expire_ms, bool huge_pages)
+	    : blocks_(nblocks), expire_ms_(expire_ms)
 	{
-		data = (char *) malloc(CACHE_BLOCK_SIZE);
-		len = size;
-		start_idx = start;
-		memcpy(data + start, d, size);
-		path = p;
-		block_no = b;
-		data_cache = dc;
-		timestamp = time(NULL);
+		if (nblocks == 0)
+			return;
+		slab_size_ = nblocks * CACHE_BLOCK_SIZE;
+		if (huge_pages) {
+			slab_size_ = (slab_size_ + CACHE_HUGE_PAGE_SIZE - 1) &
+				     ~(CACHE_HUGE_PAGE_SIZE - 1);
+			slab_ = (char *)mmap(NULL, slab_size_,
+					     PROT_READ | PROT_WRITE,
+					     MAP_PRIVATE | MAP_ANONYMOUS |
+						 MAP_NORESERVE | MAP_HUGETLB,
+					     -1, 0);
+		}
+		if (!huge_pages || slab_ == MAP_FAILED) {
+			slab_ = (char *)mmap(NULL, slab_size_,
+					     PROT_READ | PROT_WRITE,
+					     MAP_PRIVATE | MAP_ANONYMOUS |
+						 MAP_NORESERVE,
+					     -1, 0);
+			if (huge_pages && slab_ != MAP_FAILED)
+				madvise(slab_, slab_size_, MADV_HUGEPAGE);
+		}
+		if (slab_ == MAP_FAILED) {
+			std::cerr << "cannot allocate " << slab_size_
+				  << " bytes for data cache" << std::endl;
+			slab_ = nullptr;
+			slab_size_ = 0;
+			blocks_.clear();
+			return;
+		}
+		for (size_t i = 0; i < blocks_.size(); ++i) {
+			blocks_[i].data = slab_ + i * CACHE_BLOCK_SIZE;
+		}
 	}
 
-	~DataBlock() {
-#ifdef _DEBUG
-		cout << "DataBlock: destructor "<<path<<block_no<<endl;
-#endif
-		if (data != NULL) {
-			free(data);
+	~DataCacheShard()
+	{
+		if (slab_)
+			munmap(slab_, slab_size_);
+	}
+
+	bool isCached(const CachePath &path)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		return findFile(path) != nullptr;
+	}
+
+	// Get the block, pinned, if it is cached and has not expired.
+	DataBlock *pin(const CachePath &path, size_t block_no)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		FileBlocks *f = findFile(path);
+		if (!f)
+			return nullptr;
+		auto bit = f->blocks.find(block_no);
+		if (bit == f->blocks.end())
+			return nullptr;
+		DataBlock *b = bit->second;
+		if (b->expire_ms < NowMs()) {
+			unlink(b);
+			return nullptr;
 		}
-		data_cache->RemoveBlockFromMap(path, block_no);
-#ifdef _DEBUG
-		cout<<"Destructor for "<<path<<block_no;
-#endif
-		//pthread_rwlock_destroy(&dataLock);
+		b->referenced = true;
+		b->pins++;
+		return b;
 	}
-};
 
-void DataCacheShard::put(const std::string& path, size_t offset, size_t length,
-		       char *data)
-{
-	size_t i = 0;
-	size_t write_len = 0;
-	int delta_offset = offset % CACHE_BLOCK_SIZE;
-	if (length < CACHE_BLOCK_SIZE) {
-		return;
+	// Lease the block if [start, end) of it is cached, has not expired,
+	// and is not being written.
+	DataBlock *lease(const CachePath &path, size_t block_no, size_t start,
+			 size_t end, const struct timespec *ctime)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		FileBlocks *f = findFile(path);
+		if (!f)
+			return nullptr;
+		auto bit = f->blocks.find(block_no);
+		if (bit == f->blocks.end())
+			return nullptr;
+		DataBlock *b = bit->second;
+		if (b->expire_ms < NowMs()) {
+			unlink(b);
+			return nullptr;
+		}
+		if (b->writers > 0 || !b->covers(start, end) ||
+		    (ctime && !b->matchesCtime(*ctime)))
+			return nullptr;
+		b->referenced = true;
+		b->pins++;
+		b->leases++;
+		return b;
 	}
-	if (offset % CACHE_BLOCK_SIZE != 0) {
-#ifdef _DEBUG
-		printf("Not alligned with cache block");
-#endif
-		offset = offset - delta_offset;
-		std::string key = GetBlockKey(path, offset / CACHE_BLOCK_SIZE);
-		SharedPtr<DataBlock> ptrElem = DataCacheBase::get(key);
-		if (!ptrElem.isNull()) {
-			memcpy(ptrElem->data + delta_offset, data,
-			       CACHE_BLOCK_SIZE - delta_offset);
-
-			if (ptrElem->start_idx > delta_offset) {
-				ptrElem->start_idx = delta_offset;
-				ptrElem->len = CACHE_BLOCK_SIZE - delta_offset;
+
+	// Get the block, pinned for writing, creating it if it is not cached.
+	// A leased block is replaced by a copy.  Returns nullptr if all blocks
+	// are pinned.  If "spill" is not nullptr, it receives the block evicted
+	// to make room, if any.
+	DataBlock *pinForWrite(const CachePath &path, size_t block_no,
+			       DataSpill *spill = nullptr)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		DataBlock *old = nullptr;
+		FileBlocks *f = findFile(path);
+		if (f) {
+			auto bit = f->blocks.find(block_no);
+			if (bit != f->blocks.end()) {
+				DataBlock *b = bit->second;
+				b->expire_ms = NowMs() + expire_ms_;
+				if (b->leases == 0) {
+					b->referenced = true;
+					b->pins++;
+					b->writers++;
+					return b;
+				}
+				old = b;
 			}
-			ptrElem->timestamp = time(NULL);
-			DataCacheBase::add(key, ptrElem);
-			AddBlockToMap(path, offset / CACHE_BLOCK_SIZE);
-#ifdef _DEBUG
-			cout << "Updated " << key << std::endl;
-#endif
-		} else {
-			DataBlock *db = new DataBlock(
-			    data, CACHE_BLOCK_SIZE - delta_offset, delta_offset,
-			    path, offset / CACHE_BLOCK_SIZE, this);
-			DataCacheBase::add(key, db);
-			AddBlockToMap(path, offset / CACHE_BLOCK_SIZE);
-#ifdef _DEBUG
-			cout << "Added " << key << std::endl;
-#endif
 		}
-		write_len += CACHE_BLOCK_SIZE - delta_offset;
-		i += CACHE_BLOCK_SIZE;
-	}
-	while (write_len < length) {
-		std::string key =
-		    GetBlockKey(path, (offset + i) / CACHE_BLOCK_SIZE);
-		if (length - write_len < CACHE_BLOCK_SIZE) {
-			SharedPtr<DataBlock> ptrElem = DataCacheBase::get(key);
-			if (!ptrElem.isNull()) {
-				memcpy(ptrElem->data, data + write_len,
-				       length - write_len);
-
-				if (ptrElem->start_idx == 0 &&
-				    ptrElem->len < length - write_len) {
-					ptrElem->len = length - write_len;
-				}
-				/*else if (ptrElem->start_idx > 0){
-					ptrElem->len = length - i +
-				}
-					//What if within a block CCCCCXCCCCCC
-*/
-				ptrElem->timestamp = time(NULL);
-				DataCacheBase::add(key, ptrElem);
-				AddBlockToMap(path,
-					      (offset + i) / CACHE_BLOCK_SIZE);
-#ifdef _DEBUG
-				cout << "Added " << key << std::endl;
-#endif
-			} else {
-				DataBlock *db = new DataBlock(
-				    data + write_len, length - write_len, 0,
-				    path, (offset + i) / CACHE_BLOCK_SIZE,
-				    this);
-				DataCacheBase::add(key, db);
-				AddBlockToMap(path,
-					      (offset + i) / CACHE_BLOCK_SIZE);
-#ifdef _DEBUG
-				cout << "Added " << key << std::endl;
-#endif
+
+		DataBlock *b = allocBlock(spill);
+		if (!b) {
+			// The leased data is about to become stale.
+			if (old)
+				unlink(old);
+			return nullptr;
+		}
+		b->extents.clear();
+		b->ctime = {0, 0};
+		if (old) {
+			// The slot of the spilled block is overwritten below.
+			if (spill)
+				spill->detach();
+			// Keep the cached data unless it is being changed by
+			// other writers.
+			if (old->writers == 0)
+				b->copyFrom(old);
+			unlink(old);
+		}
+		// The eviction may have erased the entry of the file.
+		f = &files_[path.hash];
+		if (!(path == f->path)) {
+			// Make room for the path by dropping the other one.
+			for (auto &kv : f->blocks) {
+				kv.second->path = nullptr;
 			}
-			return;
-		} else {
-			DataBlock *db = new DataBlock(
-			    data + write_len, CACHE_BLOCK_SIZE, 0, path,
-			    (offset + i) / CACHE_BLOCK_SIZE, this);
-			DataCacheBase::add(key, db);
-			AddBlockToMap(path, (offset + i) / CACHE_BLOCK_SIZE);
-#ifdef _DEBUG
-			cout << "Added " << key << std::endl;
-#endif
+			f->blocks.clear();
+			f->path.assign(path.data, path.size);
 		}
-		i += CACHE_BLOCK_SIZE;
-		write_len += CACHE_BLOCK_SIZE;
+		f->blocks[block_no] = b;
+		b->path = &f->path;
+		b->path_hash = path.hash;
+		b->block_no = block_no;
+		b->referenced = false;
+		b->expire_ms = NowMs() + expire_ms_;
+		b->pins++;
+		b->writers++;
+		return b;
 	}
-}
-
-void DataCacheShard::remove(const std::string& path)
-{
-	std::unordered_map<std::string, std::unordered_set<size_t> >::iterator it;
-	std::unordered_set<size_t> blocks;
 
+	void unpin(DataBlock *b)
 	{
-		std::lock_guard<std::mutex> lock(mu_);
-		it = cached_blocks.find(path);
-		if (it == cached_blocks.end())
-			return;
-		blocks.swap(it->second);
-		cached_blocks.erase(it);
+		b->pins--;
 	}
 
-	for (size_t block_no : blocks) {
-		std::string key = GetBlockKey(path, block_no);
-		DataCacheBase::remove(key);
-#ifdef _DEBUG
-		cout << "Removed " << key << std::endl;
-#endif
+	void unpinWrite(DataBlock *b)
+	{
+		b->writers--;
+		b->pins--;
 	}
-}
 
-void DataCacheShard::remove(const std::string& path, size_t offset, size_t length)
-{
-	std::unordered_map<std::string, std::unordered_set<size_t> >::iterator it;
+	static void release(DataBlock *b)
+	{
+		b->leases--;
+		b->pins--;
+	}
 
+	void remove(const CachePath &path)
 	{
 		std::lock_guard<std::mutex> lock(mu_);
-		it = cached_blocks.find(path);
-		if (it == cached_blocks.end())
+		auto fit = files_.find(path.hash);
+		if (fit == files_.end() || !(path == fit->second.path))
 			return;
+		for (auto &kv : fit->second.blocks) {
+			kv.second->path = nullptr;
+		}
+		files_.erase(fit);
 	}
 
-	for (const auto &block_no : it->second) {
-		if (block_no < offset / CACHE_BLOCK_SIZE ||
-		    block_no >= (length + offset) / CACHE_BLOCK_SIZE)
-			continue;
-		std::string key = GetBlockKey(path, block_no);
-		DataCacheBase::remove(key);
-		RemoveBlockFromMap(path, block_no);
-#ifdef _DEBUG
-		cout << "Removed " << key << std::endl;
-#endif
+	// Remove blocks in [first_block, end_block) of the file.
+	void remove(const CachePath &path, size_t first_block,
+		    size_t end_block)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto fit = files_.find(path.hash);
+		if (fit == files_.end() || !(path == fit->second.path))
+			return;
+		BlockMap &blocks = fit->second.blocks;
+		for (auto it = blocks.begin(); it != blocks.end();) {
+			if (it->first >= first_block && it->first < end_block) {
+				it->second->path = nullptr;
+				it = blocks.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (blocks.empty())
+			files_.erase(fit);
 	}
 
+	// Save all cached blocks to "disk".
+	void spillAll(TC_DiskCache *disk)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+
+		for (auto &b : blocks_) {
+			if (b.path && b.pins == 0 && HasCtime(b.ctime)) {
+				disk->store(*b.path, b.block_no, b.extents,
+					    b.ctime, b.data);
+			}
+		}
+	}
 
-	if (it->second.empty()) {
+	void clear()
+	{
 		std::lock_guard<std::mutex> lock(mu_);
-		cached_blocks.erase(path);
+		bool pinned = false;
+
+		for (auto &b : blocks_) {
+			b.path = nullptr;
+			pinned = pinned || b.pins > 0;
+		}
+		files_.clear();
+		if (!pinned && slab_) {
+			// Give the memory back; it is zero-filled on next use.
+			madvise(slab_, slab_size_, MADV_DONTNEED);
+			nfresh_ = 0;
+		}
 	}
-}
 
-int DataCacheShard::get(const std::string &path, size_t offset, size_t length,
-			char *buf, bool *revalidate)
-{
-	size_t i = 0;
-	size_t read_len = 0;
-	size_t delta_offset = offset % CACHE_BLOCK_SIZE;
-	*revalidate = false;
-
-	if (length < CACHE_BLOCK_SIZE) {
-		return 0;
-	}
-	while (true) {
-		if (offset % CACHE_BLOCK_SIZE != 0)
-			offset = offset - delta_offset;
-		std::string key = GetBlockKey(path, (offset + i) / CACHE_BLOCK_SIZE);
-		SharedPtr<DataBlock> ptrElem = DataCacheBase::get(key);
-		if (ptrElem.isNull() || ptrElem->start_idx != 0) {
-#ifdef _DEBUG
-			cout << "Found " << key << "Bytes " << read_len
-			     << std::endl;
-#endif
-			return read_len;
-		}
-		if (ptrElem->len - delta_offset < length - read_len) {
-			memcpy(buf + read_len, ptrElem->data + delta_offset,
-			       ptrElem->len - delta_offset);
-			read_len += ptrElem->len - delta_offset;
-		} else {
-			memcpy(buf + read_len, ptrElem->data + delta_offset,
-			       length - read_len);
-			read_len = length;
-		}
-		if (time(NULL) - ptrElem->timestamp >= DATA_REFRESH_TIME_SECONDS)
-			*revalidate = true;
-		// Handle case when less len needs to be copied
-		delta_offset = 0;
-		if (length <= read_len) {
-#ifdef _DEBUG
-			cout << "Found " << key << "Bytes " << read_len
-			     << std::endl;
-#endif
-			return read_len;
+private:
+	// Caller must hold mu_.
+	FileBlocks *findFile(const CachePath &path)
+	{
+		auto fit = files_.find(path.hash);
+		if (fit == files_.end() || !(path == fit->second.path))
+			return nullptr;
+		return &fit->second;
+	}
+
+	// Caller must hold mu_.
+	void unlink(DataBlock *b)
+	{
+		auto fit = files_.find(b->path_hash);
+		fit->second.blocks.erase(b->block_no);
+		if (fit->second.blocks.empty())
+			files_.erase(fit);
+		b->path = nullptr;
+	}
+
+	// Find a slot for a new block: a never used one, or the first one the
+	// CLOCK hand finds unpinned and either unlinked or not referenced
+	// since the last sweep.  Caller must hold mu_.
+	DataBlock *allocBlock(DataSpill *spill)
+	{
+		const size_t n = blocks_.size();
+
+		if (nfresh_ < n)
+			return &blocks_[nfresh_++];
+		for (size_t scanned = 0; scanned < 2 * n; ++scanned) {
+			DataBlock *b = &blocks_[hand_];
+			hand_ = (hand_ + 1) % n;
+			if (b->pins > 0)
+				continue;
+			if (b->path && b->referenced) {
+				b->referenced = false;
+				continue;
+			}
+			if (!b->path)
+				return b;
+			if (spill && !b->extents.empty() && HasCtime(b->ctime)) {
+				spill->path = *b->path;
+				spill->block_no = b->block_no;
+				spill->extents.swap(b->extents);
+				spill->ctime = b->ctime;
+				spill->block = b;
+				b->mu.lock();
+			}
+			unlink(b);
+			return b;
 		}
-		i += CACHE_BLOCK_SIZE;
+		return nullptr;
 	}
-}
+
+	DataCacheShard(const DataCacheShard& aCache);
+	DataCacheShard &operator=(const DataCacheShard &aCache);
+};
 
 const int kNumCacheShards = 16;
 
 class TC_DataCache
 {
 public:
-	TC_DataCache(long cacheSize = 102400,
-			Timestamp::TimeDiff expire = CACHE_EXPIRE_SECONDS) {
-		long sizePerShard = cacheSize / kNumCacheShards;
+	// "capacity" is the budget of the cache in bytes, and "expire" is in
+	// milliseconds.  If "disk_dir" is not empty, blocks evicted from memory
+	// are kept in up to "disk_blocks" blocks of storage in that directory.
+	// If "shm_name" is not empty, the cache is kept in the shared memory
+	// segment of that name instead, without the disk cache.
+	TC_DataCache(uint64_t capacity, uint64_t expire = CACHE_EXPIRE_SECONDS,
+		     bool huge_pages = false, const std::string &disk_dir = "",
+		     size_t disk_blocks = 0, const std::string &shm_name = "")
+	{
+		if (!shm_name.empty()) {
+			shm_.reset(new TC_ShmDataCache(shm_name, capacity,
+						       expire, huge_pages));
+			if (shm_->enabled())
+				capacity = 0;
+			else
+				shm_.reset();
+		}
+		size_t nblocks = capacity / CACHE_BLOCK_SIZE;
+		size_t blocksPerShard =
+		    (nblocks + kNumCacheShards - 1) / kNumCacheShards;
 		for (int i = 0; i < kNumCacheShards; ++i) {
-			shards_[i] = new DataCacheShard(sizePerShard, expire);
+			shards_[i] = new DataCacheShard(blocksPerShard, expire,
+							huge_pages);
+		}
+		if (!shm_ && !disk_dir.empty() && disk_blocks > 0) {
+			disk_.reset(new TC_DiskCache(disk_dir, disk_blocks));
+			if (!disk_->enabled()) {
+				std::cerr << "cannot use " << disk_dir
+					  << " for data cache: "
+					  << disk_->error() << std::endl;
+				disk_.reset();
+			}
 		}
 	}
 	~TC_DataCache() {
@@ -395,41 +532,256 @@ public:
 			delete shards_[i];
 		}
 	}
-	void AddBlockToMap(const std::string &path, size_t block_no) {
-		shard(path)->AddBlockToMap(path, block_no);
+	bool isCached(const CachePath &path) {
+		if (shm_)
+			return shm_->isCached(path);
+		for (int i = 0; i < kNumCacheShards; ++i) {
+			if (shards_[i]->isCached(path))
+				return true;
+		}
+		return false;
 	}
-	void RemoveBlockFromMap(const std::string &path, size_t block_no) {
-		shard(path)->RemoveBlockFromMap(path, block_no);
+	// "ctime" is the ctime of the file the data belongs to; blocks are
+	// saved to the disk cache only if it is known.
+	void put(const CachePath &path, size_t offset, size_t length,
+		 const char *data, const struct timespec *ctime = nullptr) {
+		uint64_t h = path.hash;
+		size_t done = 0;
+
+		if (shm_) {
+			shm_->put(path, offset, length, data, ctime);
+			return;
+		}
+
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			DataCacheShard *s = shard(h, block_no);
+			DataSpill spill;
+			DataBlock *b = s->pinForWrite(
+			    path, block_no, disk_ ? &spill : nullptr);
+			if (b) {
+				saveSpill(&spill);
+				b->fill(start, data + done, n, ctime);
+				s->unpinWrite(b);
+			}
+			done += n;
+		}
 	}
-	bool isCached(const std::string &path) {
-		return shard(path)->isCached(path);
+	void remove(const CachePath &path) {
+		if (shm_) {
+			shm_->remove(path);
+			return;
+		}
+		for (int i = 0; i < kNumCacheShards; ++i) {
+			shards_[i]->remove(path);
+		}
+		if (disk_)
+			disk_->remove(path.hash);
 	}
-	void put(const std::string &path, size_t offset, size_t length,
-		 char *data) {
-		shard(path)->put(path, offset, length, data);
+	void remove(const CachePath &path, size_t offset, size_t length) {
+		size_t first = offset / CACHE_BLOCK_SIZE;
+		size_t end = (offset + length + CACHE_BLOCK_SIZE - 1) /
+			     CACHE_BLOCK_SIZE;
+		if (shm_) {
+			shm_->remove(path, offset, length);
+			return;
+		}
+		for (int i = 0; i < kNumCacheShards; ++i) {
+			shards_[i]->remove(path, first, end);
+		}
+		if (disk_)
+			disk_->remove(path.hash, first, end);
 	}
-	void remove(const std::string &path) {
-		shard(path)->remove(path);
+	// Whether blocks of the file within [offset, offset + length) may be
+	// loaded from the disk cache, given its ctime.
+	bool isOnDisk(const CachePath &path, size_t offset, size_t length) {
+		if (!disk_)
+			return false;
+		uint64_t h = path.hash;
+		size_t end = (offset + length + CACHE_BLOCK_SIZE - 1) /
+			     CACHE_BLOCK_SIZE;
+		for (size_t i = offset / CACHE_BLOCK_SIZE; i < end; ++i) {
+			if (disk_->has(h, i))
+				return true;
+		}
+		return false;
 	}
-	void remove(const std::string &path, size_t offset, size_t length) {
-		shard(path)->remove(path, offset, length);
+	// Copy the cached bytes of [offset, offset + length) to "buf".  Bytes
+	// not cached are within the range [*miss_offset, *miss_offset +
+	// *miss_length), which is empty upon a full hit.  Returns the number of
+	// bytes outside of the miss range, i.e., the bytes served by the cache.
+	//
+	// If "ctime", the ctime of the file just validated with the server, is
+	// given, blocks cached with other ctimes are treated as missing, and
+	// blocks not in memory are loaded from the disk cache.
+	int get(const CachePath &path, size_t offset, size_t length,
+		char *buf, bool *revalidate, size_t *miss_offset = nullptr,
+		size_t *miss_length = nullptr,
+		const struct timespec *ctime = nullptr) {
+		if (shm_) {
+			return shm_->get(path, offset, length, buf, revalidate,
+					 miss_offset, miss_length, ctime);
+		}
+		uint64_t h = path.hash;
+		size_t done = 0;
+		size_t miss_begin = 0;	// absolute offsets of the miss range
+		size_t miss_end = 0;
+		time_t now = time(NULL);
+		*revalidate = false;
+
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			size_t block_off = block_no * CACHE_BLOCK_SIZE;
+			DataCacheShard *s = shard(h, block_no);
+			DataBlock *b = s->pin(path, block_no);
+			bool loaded = false;
+			size_t mb = start;
+			size_t me = start + n;
+
+			if (!b && ctime && disk_ && disk_->has(h, block_no)) {
+				b = load(s, path, block_no, *ctime);
+				loaded = b != nullptr;
+			}
+			if (b && (!ctime || b->matchesCtime(*ctime))) {
+				mb = me = 0;
+				b->read(start, start + n, buf + done, &mb,
+					&me);
+			}
+			if (b) {
+				if (now - b->timestamp >=
+				    DATA_REFRESH_TIME_SECONDS)
+					*revalidate = true;
+				if (loaded)
+					s->unpinWrite(b);
+				else
+					s->unpin(b);
+			}
+			if (mb != me) {
+				if (miss_begin == miss_end)
+					miss_begin = block_off + mb;
+				miss_end = block_off + me;
+			}
+			done += n;
+		}
+
+		if (miss_begin == miss_end) {
+			miss_begin = miss_end = offset + length;
+		}
+		if (miss_offset)
+			*miss_offset = miss_begin;
+		if (miss_length)
+			*miss_length = miss_end - miss_begin;
+#ifdef _DEBUG
+		std::cout << "Found " << path.str() << " bytes "
+			  << length - (miss_end - miss_begin) << std::endl;
+#endif
+		return length - (miss_end - miss_begin);
+	}
+	// Get read-only leases of the cached data in [offset, offset + length)
+	// without copying it; each lease covers the part of the range in one
+	// block.  The blocks stay in memory, and their data unchanged, until the
+	// leases are released.  Fails, leasing nothing, unless the whole range
+	// is cached.  As in get(), blocks cached with a ctime other than
+	// "ctime" are treated as missing.
+	bool lease(const CachePath &path, size_t offset, size_t length,
+		   std::vector<DataLease> *leases, bool *revalidate,
+		   const struct timespec *ctime = nullptr) {
+		if (shm_)
+			return shm_->lease(path, offset, length, leases,
+					   revalidate, ctime);
+		uint64_t h = path.hash;
+		size_t done = 0;
+		size_t nleased = leases->size();
+		time_t now = time(NULL);
+		*revalidate = false;
+
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			DataBlock *b =
+			    shard(h, block_no)->lease(path, block_no, start,
+						      start + n, ctime);
+			if (!b) {
+				while (leases->size() > nleased) {
+					release(leases->back());
+					leases->pop_back();
+				}
+				return false;
+			}
+			if (now - b->timestamp >= DATA_REFRESH_TIME_SECONDS)
+				*revalidate = true;
+			leases->push_back(DataLease{b->data + start, n, b});
+			done += n;
+		}
+		return true;
 	}
-	int get(const std::string &path, size_t offset, size_t length,
-		char *buf, bool *revalidate) {
-		return shard(path)->get(path, offset, length, buf, revalidate);
+	void release(const DataLease &lease) {
+		if (shm_) {
+			shm_->release(lease);
+			return;
+		}
+		DataCacheShard::release(static_cast<DataBlock *>(lease.block));
 	}
+	// Drop all blocks in memory; they are saved to the disk cache first.
+	// The shared memory cache is left for other processes.
 	void clear() {
 		for (int i = 0; i < kNumCacheShards; ++i) {
+			if (disk_)
+				shards_[i]->spillAll(disk_.get());
 			shards_[i]->clear();
 		}
 	}
 
 private:
-	DataCacheShard* shard(const std::string& path) {
-		return shards_[Hash(path) % kNumCacheShards];
+	void saveSpill(DataSpill *spill) {
+		if (spill->data) {
+			disk_->store(spill->path, spill->block_no,
+				     spill->extents, spill->ctime, spill->data);
+			return;
+		}
+		if (!spill->block)
+			return;
+		disk_->store(spill->path, spill->block_no, spill->extents,
+			     spill->ctime, spill->block->data);
+		spill->block->mu.unlock();
+	}
+
+	// Load a block from the disk cache into memory; returns the block
+	// pinned for writing.
+	DataBlock *load(DataCacheShard *s, const CachePath &path,
+			size_t block_no, const struct timespec &ctime) {
+		DataSpill spill;
+		DataBlock *b = s->pinForWrite(path, block_no, &spill);
+		if (!b)
+			return nullptr;
+		saveSpill(&spill);
+
+		std::lock_guard<std::mutex> lock(b->mu);
+		// Someone else may have filled the block meanwhile.
+		if (b->extents.empty() &&
+		    disk_->load(path, block_no, ctime, b->data, &b->extents)) {
+			b->ctime = ctime;
+			b->timestamp = time(NULL);
+		}
+		return b;
+	}
+
+	DataCacheShard* shard(uint64_t path_hash, size_t block_no) {
+		return shards_[HashBlock(path_hash, block_no) %
+			       kNumCacheShards];
 	}
 
 	DataCacheShard* shards_[kNumCacheShards];
+	std::unique_ptr<TC_DiskCache> disk_;
+	std::unique_ptr<TC_ShmDataCache> shm_;
 };
 
 #endif // TC_DataCache_INCLUDED
@@ -0,0 +1,409 @@
+//
+// TC_DiskCache.h
+//
+// Second tier of the data cache on local storage.
+//
+// Blocks evicted from TC_DataCache are spilled into fixed-size slots of a
+// data file, and found again through an index file that is mmap'ed and thus
+// persists across restarts.  Each slot is tagged with the ctime of the file
+// when the block was cached, and a block is loaded back only if the ctime
+// still matches the one from the server.  Slots are reused in FIFO order.
+// The directory is locked while in use, so that processes do not share it.
+//
+// Definition of the TC_DiskCache class.
+//
+#ifndef TC_DiskCache_INCLUDED
+#define TC_DiskCache_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "TC_CacheUtil.h"
+
+#define DISK_CACHE_MAGIC 0x54434449534b3031ULL	// "TCDISK01"
+#define DISK_CACHE_SLOT_HEADER 4096
+#define DISK_CACHE_MAX_EXTENTS 4
+
+class TC_DiskCache
+{
+	// Header of the index file.
+	struct IndexHeader {
+		uint64_t magic;
+		uint64_t nslots;
+		uint64_t block_size;
+		uint64_t reserved;
+	};
+
+	// Index entry of a slot.  Blocks with more extents keep only the first
+	// DISK_CACHE_MAX_EXTENTS of them.
+	struct IndexEntry {
+		uint64_t path_hash;
+		uint64_t block_no;
+		int64_t ctime_sec;
+		int64_t ctime_nsec;
+		uint32_t valid;
+		uint32_t nextents;
+		uint32_t extents[DISK_CACHE_MAX_EXTENTS][2];
+	};
+
+	// Header of a slot in the data file; it keeps the full path so that
+	// paths with the same hash are told apart.
+	struct SlotHeader {
+		uint64_t magic;
+		uint64_t block_no;
+		uint32_t path_len;
+		char path[DISK_CACHE_SLOT_HEADER - 20];
+	};
+
+	typedef std::unordered_map<size_t, uint32_t> SlotMap;
+
+	std::mutex mu_;
+	int dir_fd_ = -1;
+	int data_fd_ = -1;
+	int index_fd_ = -1;
+	size_t nslots_ = 0;
+	size_t index_size_ = 0;
+	IndexHeader *header_ = nullptr;
+	IndexEntry *index_ = nullptr;
+	// Even while a slot is stable, and odd while it is being written; a
+	// load checks it did not change while reading the slot.
+	std::unique_ptr<std::atomic<uint32_t>[]> gens_;
+	// path hash -> (block number -> slot)
+	std::unordered_map<uint64_t, SlotMap> slots_;
+	std::vector<uint32_t> free_;
+	size_t hand_ = 0;
+	std::string error_;
+
+public:
+	// Use "nslots" blocks of storage in directory "dir", reusing the blocks
+	// cached there by previous runs.
+	TC_DiskCache(const std::string &dir, size_t nslots) : nslots_(nslots)
+	{
+		std::string data_path = dir + "/data";
+		std::string index_path = dir + "/index";
+
+		if (nslots == 0)
+			return;
+		mkdir(dir.c_str(), 0700);
+		dir_fd_ = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (dir_fd_ < 0 || flock(dir_fd_, LOCK_EX | LOCK_NB) != 0) {
+			error_ = errno == EWOULDBLOCK
+				     ? "in use by another process"
+				     : strerror(errno);
+			closeFiles();
+			return;
+		}
+		data_fd_ = open(data_path.c_str(), O_RDWR | O_CREAT | O_DIRECT,
+				0600);
+		if (data_fd_ < 0 && errno == EINVAL) {
+			// The file system does not support O_DIRECT.
+			data_fd_ = open(data_path.c_str(), O_RDWR | O_CREAT,
+					0600);
+		}
+		index_fd_ = open(index_path.c_str(), O_RDWR | O_CREAT, 0600);
+		index_size_ = sizeof(IndexHeader) + nslots * sizeof(IndexEntry);
+		if (data_fd_ < 0 || index_fd_ < 0 ||
+		    ftruncate(data_fd_, nslots * slotSize()) != 0 ||
+		    ftruncate(index_fd_, index_size_) != 0) {
+			error_ = strerror(errno);
+			closeFiles();
+			return;
+		}
+		void *p = mmap(NULL, index_size_, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, index_fd_, 0);
+		if (p == MAP_FAILED) {
+			error_ = strerror(errno);
+			closeFiles();
+			return;
+		}
+		header_ = (IndexHeader *)p;
+		index_ = (IndexEntry *)(header_ + 1);
+		gens_.reset(new std::atomic<uint32_t>[nslots]);
+
+		if (header_->magic != DISK_CACHE_MAGIC ||
+		    header_->nslots != nslots ||
+		    header_->block_size != CACHE_BLOCK_SIZE) {
+			// Formatted differently; start afresh.
+			memset(p, 0, index_size_);
+			header_->nslots = nslots;
+			header_->block_size = CACHE_BLOCK_SIZE;
+			header_->magic = DISK_CACHE_MAGIC;
+		}
+		for (size_t i = 0; i < nslots; ++i) {
+			gens_[i] = 0;
+			if (index_[i].valid) {
+				slots_[index_[i].path_hash]
+				      [index_[i].block_no] = i;
+			} else {
+				free_.push_back(i);
+			}
+		}
+	}
+
+	~TC_DiskCache()
+	{
+		if (header_)
+			munmap(header_, index_size_);
+		closeFiles();
+	}
+
+	bool enabled() const { return header_ != nullptr; }
+
+	// Why the cache could not be opened.
+	const std::string &error() const { return error_; }
+
+	bool has(uint64_t path_hash, size_t block_no)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		return findSlot(path_hash, block_no) >= 0;
+	}
+
+	// Save a block whose valid ranges are "extents" and whose file had
+	// "ctime".  "data" should be aligned to the page size.
+	void store(const CachePath &path, size_t block_no,
+		   const std::vector<std::pair<size_t, size_t>> &extents,
+		   const struct timespec &ctime, const char *data)
+	{
+		uint64_t path_hash = path.hash;
+
+		if (!enabled() || extents.empty() ||
+		    path.size >= sizeof(SlotHeader::path))
+			return;
+
+		SlotHeader *hdr = allocHeader();
+		if (!hdr)
+			return;
+		hdr->magic = DISK_CACHE_MAGIC;
+		hdr->block_no = block_no;
+		hdr->path_len = path.size;
+		memcpy(hdr->path, path.data, path.size);
+
+		uint32_t slot;
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			int old = findSlot(path_hash, block_no);
+			if (old >= 0)
+				freeSlot(old);
+			int s = allocSlot();
+			if (s < 0) {
+				free(hdr);
+				return;
+			}
+			slot = s;
+			gens_[slot]++;
+		}
+
+		struct iovec iov[2];
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = DISK_CACHE_SLOT_HEADER;
+		iov[1].iov_base = const_cast<char *>(data);
+		iov[1].iov_len = CACHE_BLOCK_SIZE;
+		ssize_t n = pwritev(data_fd_, iov, 2, slot * slotSize());
+		free(hdr);
+
+		std::lock_guard<std::mutex> lock(mu_);
+		gens_[slot]++;
+		if (n != (ssize_t)slotSize()) {
+			free_.push_back(slot);
+			return;
+		}
+		IndexEntry *e = index_ + slot;
+		e->path_hash = path_hash;
+		e->block_no = block_no;
+		e->ctime_sec = ctime.tv_sec;
+		e->ctime_nsec = ctime.tv_nsec;
+		e->nextents = std::min<size_t>(extents.size(),
+					       DISK_CACHE_MAX_EXTENTS);
+		for (uint32_t i = 0; i < e->nextents; ++i) {
+			e->extents[i][0] = extents[i].first;
+			e->extents[i][1] = extents[i].second;
+		}
+		// Someone may have stored the same block meanwhile.
+		int old = findSlot(path_hash, block_no);
+		if (old >= 0)
+			freeSlot(old);
+		e->valid = 1;
+		slots_[path_hash][block_no] = slot;
+	}
+
+	// Read a block into "data", which should be CACHE_BLOCK_SIZE bytes
+	// aligned to the page size, and its valid ranges into "extents".  Fails
+	// if the block is not cached, or was cached when the ctime of the file
+	// was not "ctime", in which case the block is dropped.
+	bool load(const CachePath &path, size_t block_no,
+		  const struct timespec &ctime, char *data,
+		  std::vector<std::pair<size_t, size_t>> *extents)
+	{
+		uint64_t path_hash = path.hash;
+		IndexEntry e;
+		uint32_t slot;
+		uint32_t gen;
+
+		if (!enabled())
+			return false;
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			int s = findSlot(path_hash, block_no);
+			if (s < 0)
+				return false;
+			slot = s;
+			e = index_[slot];
+			if (e.ctime_sec != ctime.tv_sec ||
+			    e.ctime_nsec != ctime.tv_nsec) {
+				freeSlot(slot);
+				return false;
+			}
+			gen = gens_[slot];
+		}
+
+		SlotHeader *hdr = allocHeader();
+		if (!hdr)
+			return false;
+		struct iovec iov[2];
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = DISK_CACHE_SLOT_HEADER;
+		iov[1].iov_base = data;
+		iov[1].iov_len = CACHE_BLOCK_SIZE;
+		ssize_t n = preadv(data_fd_, iov, 2, slot * slotSize());
+		bool ok = n == (ssize_t)slotSize() && gens_[slot] == gen &&
+			  hdr->magic == DISK_CACHE_MAGIC &&
+			  hdr->block_no == block_no &&
+			  hdr->path_len < sizeof(hdr->path) &&
+			  path.equals(hdr->path, hdr->path_len);
+		free(hdr);
+		if (!ok)
+			return false;
+
+		extents->clear();
+		for (uint32_t i = 0; i < e.nextents; ++i) {
+			extents->push_back(
+			    std::make_pair(e.extents[i][0], e.extents[i][1]));
+		}
+		return true;
+	}
+
+	// Drop all blocks of the file.
+	void remove(uint64_t path_hash)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto it = slots_.find(path_hash);
+		if (it == slots_.end())
+			return;
+		std::vector<uint32_t> victims;
+		for (const auto &kv : it->second)
+			victims.push_back(kv.second);
+		for (uint32_t slot : victims)
+			freeSlot(slot);
+	}
+
+	// Drop blocks in [first_block, end_block) of the file.
+	void remove(uint64_t path_hash, size_t first_block, size_t end_block)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto it = slots_.find(path_hash);
+		if (it == slots_.end())
+			return;
+		std::vector<uint32_t> victims;
+		for (const auto &kv : it->second) {
+			if (kv.first >= first_block && kv.first < end_block)
+				victims.push_back(kv.second);
+		}
+		for (uint32_t slot : victims)
+			freeSlot(slot);
+	}
+
+private:
+	static size_t slotSize()
+	{
+		return DISK_CACHE_SLOT_HEADER + CACHE_BLOCK_SIZE;
+	}
+
+	static SlotHeader *allocHeader()
+	{
+		void *p = nullptr;
+
+		if (posix_memalign(&p, DISK_CACHE_SLOT_HEADER,
+				   DISK_CACHE_SLOT_HEADER) != 0)
+			return nullptr;
+		memset(p, 0, DISK_CACHE_SLOT_HEADER);
+		return (SlotHeader *)p;
+	}
+
+	void closeFiles()
+	{
+		if (data_fd_ >= 0)
+			close(data_fd_);
+		if (index_fd_ >= 0)
+			close(index_fd_);
+		// Closing the directory releases the lock.
+		if (dir_fd_ >= 0)
+			close(dir_fd_);
+		dir_fd_ = data_fd_ = index_fd_ = -1;
+		header_ = nullptr;
+		index_ = nullptr;
+	}
+
+	// Caller must hold mu_.
+	int findSlot(uint64_t path_hash, size_t block_no)
+	{
+		auto it = slots_.find(path_hash);
+		if (it == slots_.end())
+			return -1;
+		auto sit = it->second.find(block_no);
+		return sit == it->second.end() ? -1 : (int)sit->second;
+	}
+
+	// Caller must hold mu_.
+	void freeSlot(uint32_t slot)
+	{
+		IndexEntry *e = index_ + slot;
+		auto it = slots_.find(e->path_hash);
+
+		e->valid = 0;
+		if (it != slots_.end()) {
+			it->second.erase(e->block_no);
+			if (it->second.empty())
+				slots_.erase(it);
+		}
+		free_.push_back(slot);
+	}
+
+	// Take a free slot, or the next one in FIFO order; returns -1 if all
+	// slots are being written.  The slot is not indexed until it is
+	// written.  Caller must hold mu_.
+	int allocSlot()
+	{
+		for (size_t i = 0; free_.empty() && i < nslots_; ++i) {
+			uint32_t slot = hand_;
+			hand_ = (hand_ + 1) % nslots_;
+			if (index_[slot].valid)
+				freeSlot(slot);
+		}
+		if (free_.empty())
+			return -1;
+		uint32_t slot = free_.back();
+		free_.pop_back();
+		return slot;
+	}
+
+	TC_DiskCache(const TC_DiskCache &);
+	TC_DiskCache &operator=(const TC_DiskCache &);
+};
+
+#endif // TC_DiskCache_INCLUDED
@@ -15,10 +15,12 @@
 #include <fcntl.h>
 
 
+#include <algorithm>
 #include <string>
 #include <map>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "Poco/AbstractCache.h"
@@ -35,6 +37,20 @@ using namespace Poco;
 
 #define MD_REFRESH_TIME 5
 
+// Bounds, in seconds, of how long cached attributes are used without asking
+// the server, like acregmin/acregmax and acdirmin/acdirmax of the NFS client.
+// The timeout of an entry starts at the minimum, and doubles each time the
+// entry is found unchanged, up to the maximum.
+struct AttrCacheTimeouts {
+	time_t reg_min;
+	time_t reg_max;
+	time_t dir_min;
+	time_t dir_max;
+};
+
+// beyond which doubling the timeout makes no difference
+#define MD_MAX_DOUBLINGS 16
+
 static inline struct file_handle *copyFH(const struct file_handle *old)
 {
 	size_t oldLen = old->handle_bytes;
@@ -63,6 +79,36 @@ private:
 	struct file_handle *fh = nullptr;
 	struct stat attrs_;
 	bool has_listdir_ = false;
+	bool has_change_ = false;
+	uint64_t change_ = 0;
+	// revalidations in a row that found the entry unchanged
+	unsigned int stable_ = 0;
+	// content of a symlink, if read
+	std::string link_;
+
+	// Whether "va" is of the same version of the file as the cached
+	// attributes.  The change attribute is changed by any modification
+	// the server sees, whereas ctime may be too coarse to tell two
+	// modifications apart, so ctime is only used when the server does not
+	// give us the change attribute.  Caller must hold mu_.
+	bool sameVersion(const struct vattrs *va) const
+	{
+		if (has_change_ && va->masks.has_change) {
+			return change_ == va->change;
+		}
+		return va->masks.has_ctime &&
+		       matchTime(&attrs_.st_ctim, &va->ctime);
+	}
+
+	// Caller must hold mu_.
+	void setAttrs(const struct vattrs *va)
+	{
+		vattrs2stat(va, &attrs_);
+		if (va->masks.has_change) {
+			change_ = va->change;
+			has_change_ = true;
+		}
+	}
 
 public:
 	SharedPtr<DirEntry> parent;
@@ -77,7 +123,7 @@ public:
 		cout << "DirEntry: constructor \n";
 #endif
 		if (va) {
-			vattrs2stat(va, &attrs_);
+			setAttrs(va);
 		}
 		timestamp_ = time(NULL);
 	}
@@ -86,14 +132,16 @@ public:
 	{
 		assert(va->file.type == VFILE_PATH);
 		path_ = va->file.path;
-		vattrs2stat(va, &attrs_);
+		setAttrs(va);
 		timestamp_ = time(NULL);
 	}
 
 	DirEntry(const DirEntry &de)
 	    : path_(de.path_), fh(de.fh), attrs_(de.attrs_),
-	      has_listdir_(de.has_listdir_), parent(de.parent),
-	      children(de.children)
+	      has_listdir_(de.has_listdir_), has_change_(de.has_change_),
+	      change_(de.change_), stable_(de.stable_), link_(de.link_),
+	      parent(de.parent),
+	      children(de.children), timestamp_(de.timestamp_)
 	{
 	}
 
@@ -113,10 +161,29 @@ public:
 		children[p] = child;
 	}
 
+	// Add the children listed by one READDIR under one lock.
+	void addChildren(
+	    const std::vector<std::pair<std::string, SharedPtr<DirEntry>>> &cs)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		for (const auto &c : cs)
+			children[c.first] = c.second;
+	}
+
+	void removeChild(const std::string &p)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		children.erase(p);
+	}
+
 	struct vattrs* getAttrs(struct vattrs *va) const
 	{
+		bool want_change = va->masks.has_change;
 		std::lock_guard<std::mutex> lock(mu_);
 		vstat2attrs(&attrs_, va);
+		if (want_change && has_change_) {
+			vattrs_set_change(va, change_);
+		}
 		return va;
 	}
 
@@ -132,18 +199,75 @@ public:
 		timestamp_ = tm;
 	}
 
-	// Return false if "validate" failed.
+	// Return false if "validate" failed.  The timeout of the entry grows if
+	// "va" is of the cached version, and is reset otherwise.
 	bool refreshAttrs(const struct vattrs *va, bool validate)
 	{
 		std::lock_guard<std::mutex> lock(mu_);
-		if (validate && !matchTime(&attrs_.st_ctim, &va->ctime)) {
+		bool same = sameVersion(va);
+		if (validate && !same) {
 			return false;
 		}
-		vattrs2stat(va, &attrs_);
+		stable_ = same ? std::min(stable_ + 1, (unsigned)MD_MAX_DOUBLINGS)
+			       : 0;
+		if (!same) {
+			link_.clear();
+		}
+		setAttrs(va);
 		timestamp_ = time(NULL);
 		return true;
 	}
 
+	/**
+	 * Whether the entry has been validated recently enough to be used
+	 * without asking the server.
+	 */
+	bool isFresh(const struct AttrCacheTimeouts &to) const
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		bool dir = S_ISDIR(attrs_.st_mode);
+		time_t lo = dir ? to.dir_min : to.reg_min;
+		time_t hi = dir ? to.dir_max : to.reg_max;
+		time_t ttl = std::min(hi, lo << stable_);
+
+		return time(NULL) - timestamp_ <= ttl;
+	}
+
+	// The change attribute if known, or else the ctime, which tells
+	// whether the file has changed; 0 if neither is known.
+	uint64_t version() const
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		if (has_change_) {
+			return change_;
+		}
+		return attrs_.st_ctim.tv_sec * 1000000000ULL +
+		       attrs_.st_ctim.tv_nsec;
+	}
+
+	// Return false if the content of the symlink is not cached.
+	bool getLinkTarget(std::string *target) const
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		if (link_.empty()) {
+			return false;
+		}
+		*target = link_;
+		return true;
+	}
+
+	void setLinkTarget(const std::string &target)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		link_ = target;
+	}
+
+	struct timespec getCtime() const
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		return attrs_.st_ctim;
+	}
+
 	size_t getFileSize() const
 	{
 		std::lock_guard<std::mutex> lock(mu_);
@@ -157,20 +281,20 @@ public:
 	}
 
 	/**
-	 * Validate memtadata cache by comparing the timestamp of cached entry
-	 * with the latest timestamp from the server side.
+	 * Validate memtadata cache by comparing the change attribute (or the
+	 * ctime) of cached entry with the latest one from the server side.
 	 * Return whether the metadata cache entry is valid.
 	 */
-	bool validate(const struct timespec *ts) const
+	bool validate(const struct vattrs *va) const
 	{
 		std::lock_guard<std::mutex> lock(mu_);
-		return matchTime(&attrs_.st_ctim, ts);
+		return sameVersion(va);
 	}
 
 	void setAttrsAndParent(const struct vattrs *va, SharedPtr<DirEntry> pa)
 	{
 		std::lock_guard<std::mutex> lock(mu_);
-		vattrs2stat(va, &attrs_);
+		setAttrs(va);
 		parent = pa;
 	}
 
@@ -0,0 +1,118 @@
+//
+// TC_NegativeCache.h
+//
+// Cache of paths known not to exist, so that repeated lookups of missing
+// files (e.g., search paths probed by compilers and interpreters) are
+// answered without asking the server.
+//
+// Each entry remembers the version (the change attribute, or the ctime) of
+// its parent directory when the lookup failed.  An entry is used only within
+// a timeout, and only while the parent, if cached, is still of that version,
+// i.e., no entry has been added to it since.  The oldest entries are evicted
+// when the cache is full.
+//
+// Definition of the TC_NegativeCache class.
+//
+#ifndef TC_NegativeCache_INCLUDED
+#define TC_NegativeCache_INCLUDED
+
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+
+class TC_NegativeCache
+{
+	struct Entry {
+		uint64_t dir_version;	// 0 if the parent was not cached
+		time_t timestamp;
+		std::list<std::string>::iterator pos;
+	};
+
+	std::mutex mu_;
+	size_t capacity_;
+	std::unordered_map<std::string, Entry> entries_;
+	std::list<std::string> order_;	// oldest first
+
+	// Caller must hold mu_.
+	void erase(std::unordered_map<std::string, Entry>::iterator it)
+	{
+		order_.erase(it->second.pos);
+		entries_.erase(it);
+	}
+
+public:
+	explicit TC_NegativeCache(size_t capacity) : capacity_(capacity) {}
+
+	// Remember that "path" does not exist, as of version "dir_version" of
+	// its parent.
+	void add(const std::string &path, uint64_t dir_version)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		if (capacity_ == 0)
+			return;
+		auto it = entries_.find(path);
+		if (it != entries_.end())
+			erase(it);
+		while (entries_.size() >= capacity_)
+			erase(entries_.find(order_.front()));
+		order_.push_back(path);
+		entries_[path] = Entry{dir_version, time(NULL),
+				       std::prev(order_.end())};
+	}
+
+	// Whether "path" is known not to exist, given its parent is of version
+	// "dir_version" now (0 if unknown).  Entries older than "ttl" seconds,
+	// or recorded before the parent changed, are dropped.
+	bool lookup(const std::string &path, uint64_t dir_version, time_t ttl)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto it = entries_.find(path);
+		if (it == entries_.end())
+			return false;
+		const Entry &e = it->second;
+		if (time(NULL) - e.timestamp > ttl ||
+		    (e.dir_version != 0 && dir_version != 0 &&
+		     e.dir_version != dir_version)) {
+			erase(it);
+			return false;
+		}
+		return true;
+	}
+
+	void remove(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		auto it = entries_.find(path);
+		if (it != entries_.end())
+			erase(it);
+	}
+
+	// Remove the entries under directory "dir", e.g., because another
+	// directory has been renamed to it.
+	void removeUnder(const std::string &dir)
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		for (auto it = entries_.begin(); it != entries_.end();) {
+			const std::string &p = it->first;
+			auto next = std::next(it);
+			if (p.size() > dir.size() &&
+			    p.compare(0, dir.size(), dir) == 0 &&
+			    p[dir.size()] == '/')
+				erase(it);
+			it = next;
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mu_);
+		entries_.clear();
+		order_.clear();
+	}
+};
+
+#endif // TC_NegativeCache_INCLUDED
@@ -0,0 +1,707 @@
+//
+// TC_ShmDataCache.h
+//
+// Block cache of file data in a shared memory segment.
+//
+// The same as the in-memory TC_DataCache, but all the state, including the
+// index, lives in a POSIX shared memory segment so that all TC client
+// processes on a host opening the segment by the same name share the
+// cached data; a miss of one process warms the cache for all others.
+//
+// The segment is laid out as: a header, the shards, the block descriptors,
+// the hash buckets, and then the block data.  Blocks are referenced by
+// their indexes within their shards rather than pointers, because the
+// segment is mapped at different addresses.  Locks are robust, process-shared
+// mutexes; when a process dies holding the lock of a shard, the index of the
+// shard is reset, and when it dies holding the lock of a block, the data of
+// the block is dropped.  Blocks pinned by a process that dies stay pinned.
+//
+// Definition of the TC_ShmDataCache class.
+//
+#ifndef TC_ShmDataCache_INCLUDED
+#define TC_ShmDataCache_INCLUDED
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "TC_CacheUtil.h"
+
+#define SHM_CACHE_MAGIC 0x5443534d43303031ULL	// "TCSMC001"
+#define SHM_CACHE_PATH_MAX 256
+#define SHM_CACHE_MAX_EXTENTS 8
+#define SHM_CACHE_NIL UINT32_MAX
+#define SHM_CACHE_WAIT_MS 5000
+
+class TC_ShmDataCache
+{
+	struct Block {
+		// Protects "ctime", "nextents", "extents", and the data.
+		pthread_mutex_t mu;
+		// Fields below up to "path" are protected by the lock of the
+		// shard.
+		uint32_t linked;
+		uint32_t referenced;
+		uint32_t next;		// in the chain of its hash bucket
+		uint32_t file_prev;	// in the chain of its file bucket
+		uint32_t file_next;
+		uint64_t path_hash;
+		uint64_t block_no;
+		char path[SHM_CACHE_PATH_MAX];
+		// Incremented only with the lock of the shard held; see
+		// DataBlock.
+		std::atomic<int32_t> pins;
+		std::atomic<int32_t> leases;
+		std::atomic<int32_t> writers;
+		std::atomic<int64_t> timestamp;
+		std::atomic<uint64_t> expire_ms;
+		int64_t ctime_sec;
+		int64_t ctime_nsec;
+		uint32_t nextents;
+		Extent extents[SHM_CACHE_MAX_EXTENTS];
+	};
+
+	struct Shard {
+		pthread_mutex_t mu;
+		uint32_t nfresh;	// # of blocks that have never been used
+		uint32_t hand;		// CLOCK hand
+	};
+
+	struct Header {
+		std::atomic<uint64_t> magic;	// set last by the creator
+		uint64_t nshards;
+		uint64_t blocks_per_shard;
+		uint64_t nbuckets;		// per shard; a power of 2
+		uint64_t size;
+		uint64_t expire_ms;
+	};
+
+	static const size_t kNumShards = 16;
+
+	char *base_ = nullptr;
+	size_t size_ = 0;
+	size_t bps_ = 0;	// blocks per shard
+	size_t nbuckets_ = 0;
+	size_t off_blocks_ = 0;
+	size_t off_buckets_ = 0;
+	size_t off_file_buckets_ = 0;
+	size_t off_data_ = 0;
+	uint64_t expire_ms_ = 0;
+
+public:
+	// Open, or create, the segment "name" of "capacity" bytes of data.
+	// All processes sharing the segment should use the same capacity and
+	// expiration time in milliseconds.
+	TC_ShmDataCache(const std::string &name, uint64_t capacity,
+			uint64_t expire_ms, bool huge_pages = false)
+	    : expire_ms_(expire_ms)
+	{
+		size_t nblocks = capacity / CACHE_BLOCK_SIZE;
+
+		bps_ = (nblocks + kNumShards - 1) / kNumShards;
+		if (bps_ == 0)
+			return;
+		nbuckets_ = 1;
+		while (nbuckets_ < bps_)
+			nbuckets_ <<= 1;
+		size_t off_shards = align(sizeof(Header), 64);
+		off_blocks_ = align(off_shards + kNumShards * sizeof(Shard), 64);
+		off_buckets_ = off_blocks_ + kNumShards * bps_ * sizeof(Block);
+		off_file_buckets_ =
+		    off_buckets_ + kNumShards * nbuckets_ * sizeof(uint32_t);
+		off_data_ = align(off_file_buckets_ +
+				      kNumShards * nbuckets_ * sizeof(uint32_t),
+				  CACHE_HUGE_PAGE_SIZE);
+		size_ = off_data_ + kNumShards * bps_ * CACHE_BLOCK_SIZE;
+
+		bool creator = true;
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			creator = false;
+			fd = shm_open(name.c_str(), O_RDWR, 0);
+		}
+		if (fd < 0) {
+			std::cerr << "cannot open shared memory " << name
+				  << ": " << strerror(errno) << std::endl;
+			return;
+		}
+		// Allocate all pages up front: touching a page of a sparse
+		// segment on a full tmpfs raises SIGBUS, whereas this fails
+		// with ENOSPC and leaves us to the per-process cache.
+		if (creator && (errno = posix_fallocate(fd, 0, size_)) != 0) {
+			std::cerr << "cannot allocate shared memory " << name
+				  << ": " << strerror(errno) << std::endl;
+			shm_unlink(name.c_str());
+			close(fd);
+			return;
+		}
+		if (!creator && !waitForSize(fd, size_)) {
+			std::cerr << "cannot use shared memory " << name
+				  << " of a different size" << std::endl;
+			close(fd);
+			return;
+		}
+		void *p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+			       fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return;
+		base_ = (char *)p;
+		if (huge_pages)
+			madvise(base_ + off_data_, size_ - off_data_,
+				MADV_HUGEPAGE);
+
+		if (creator) {
+			format();
+		} else if (!waitForFormat()) {
+			std::cerr << "cannot use shared memory " << name
+				  << " of a different layout" << std::endl;
+			munmap(base_, size_);
+			base_ = nullptr;
+		}
+	}
+
+	// The segment is left for other processes.
+	~TC_ShmDataCache()
+	{
+		if (base_)
+			munmap(base_, size_);
+	}
+
+	bool enabled() const { return base_ != nullptr; }
+
+	bool isCached(const CachePath &path)
+	{
+		uint64_t h = path.hash;
+
+		for (size_t s = 0; s < kNumShards; ++s) {
+			ShardLock lock(this, s);
+			for (uint32_t i = fileBucket(s, h); i != SHM_CACHE_NIL;
+			     i = block(s, i)->file_next) {
+				if (matchPath(block(s, i), h, path))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	void put(const CachePath &path, size_t offset, size_t length,
+		 const char *data, const struct timespec *ctime = nullptr)
+	{
+		uint64_t h = path.hash;
+		size_t done = 0;
+
+		if (path.size >= SHM_CACHE_PATH_MAX)
+			return;
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			size_t s = shardOf(h, block_no);
+			uint32_t i = pinForWrite(s, path, h, block_no);
+			if (i != SHM_CACHE_NIL) {
+				Block *b = block(s, i);
+				lockBlock(b);
+				memcpy(blockData(s, i) + start, data + done, n);
+				// Bytes cached under another ctime are stale.
+				int64_t sec = ctime ? ctime->tv_sec : 0;
+				int64_t nsec = ctime ? ctime->tv_nsec : 0;
+				if (b->ctime_sec != sec || b->ctime_nsec != nsec) {
+					b->nextents = 0;
+					b->ctime_sec = sec;
+					b->ctime_nsec = nsec;
+				}
+				b->nextents = AddExtent(b->extents, b->nextents,
+							SHM_CACHE_MAX_EXTENTS,
+							start, start + n);
+				b->timestamp = time(NULL);
+				pthread_mutex_unlock(&b->mu);
+				b->writers--;
+				b->pins--;
+			}
+			done += n;
+		}
+	}
+
+	// See TC_DataCache::get(); blocks cached with a ctime other than
+	// "ctime" are treated as missing.
+	int get(const CachePath &path, size_t offset, size_t length,
+		char *buf, bool *revalidate, size_t *miss_offset = nullptr,
+		size_t *miss_length = nullptr,
+		const struct timespec *ctime = nullptr)
+	{
+		uint64_t h = path.hash;
+		size_t done = 0;
+		size_t miss_begin = 0;
+		size_t miss_end = 0;
+		time_t now = time(NULL);
+		*revalidate = false;
+
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			size_t block_off = block_no * CACHE_BLOCK_SIZE;
+			size_t s = shardOf(h, block_no);
+			uint32_t i = pin(s, path, h, block_no);
+			size_t mb = start;
+			size_t me = start + n;
+
+			if (i != SHM_CACHE_NIL) {
+				Block *b = block(s, i);
+				lockBlock(b);
+				if (!ctime || matchCtime(b, *ctime)) {
+					mb = me = 0;
+					ReadExtents(b->extents, b->nextents,
+						    blockData(s, i), start,
+						    start + n, buf + done, &mb,
+						    &me);
+				}
+				pthread_mutex_unlock(&b->mu);
+				if (now - b->timestamp >=
+				    DATA_REFRESH_TIME_SECONDS)
+					*revalidate = true;
+				b->pins--;
+			}
+			if (mb != me) {
+				if (miss_begin == miss_end)
+					miss_begin = block_off + mb;
+				miss_end = block_off + me;
+			}
+			done += n;
+		}
+
+		if (miss_begin == miss_end)
+			miss_begin = miss_end = offset + length;
+		if (miss_offset)
+			*miss_offset = miss_begin;
+		if (miss_length)
+			*miss_length = miss_end - miss_begin;
+		return length - (miss_end - miss_begin);
+	}
+
+	// See TC_DataCache::lease().
+	bool lease(const CachePath &path, size_t offset, size_t length,
+		   std::vector<DataLease> *leases, bool *revalidate,
+		   const struct timespec *ctime = nullptr)
+	{
+		uint64_t h = path.hash;
+		size_t done = 0;
+		size_t nleased = leases->size();
+		time_t now = time(NULL);
+		*revalidate = false;
+
+		while (done < length) {
+			size_t block_no = (offset + done) / CACHE_BLOCK_SIZE;
+			size_t start = (offset + done) % CACHE_BLOCK_SIZE;
+			size_t n =
+			    std::min(length - done, CACHE_BLOCK_SIZE - start);
+			size_t s = shardOf(h, block_no);
+			uint32_t i = SHM_CACHE_NIL;
+			{
+				ShardLock lock(this, s);
+				i = find(s, path, h, block_no);
+				if (i != SHM_CACHE_NIL) {
+					Block *b = block(s, i);
+					lockBlock(b);
+					bool ok = b->writers == 0 &&
+						  CoversExtents(b->extents,
+								b->nextents,
+								start,
+								start + n) &&
+						  (!ctime ||
+						   matchCtime(b, *ctime));
+					pthread_mutex_unlock(&b->mu);
+					if (ok) {
+						b->referenced = 1;
+						b->pins++;
+						b->leases++;
+					} else {
+						i = SHM_CACHE_NIL;
+					}
+				}
+			}
+			if (i == SHM_CACHE_NIL) {
+				while (leases->size() > nleased) {
+					release(leases->back());
+					leases->pop_back();
+				}
+				return false;
+			}
+			Block *b = block(s, i);
+			if (now - b->timestamp >= DATA_REFRESH_TIME_SECONDS)
+				*revalidate = true;
+			leases->push_back(
+			    DataLease{blockData(s, i) + start, n, b});
+			done += n;
+		}
+		return true;
+	}
+
+	void release(const DataLease &lease)
+	{
+		Block *b = static_cast<Block *>(lease.block);
+		b->leases--;
+		b->pins--;
+	}
+
+	void remove(const CachePath &path)
+	{
+		remove(path, 0, SIZE_MAX);
+	}
+
+	void remove(const CachePath &path, size_t offset, size_t length)
+	{
+		uint64_t h = path.hash;
+		size_t first = offset / CACHE_BLOCK_SIZE;
+		size_t end = length == SIZE_MAX
+				 ? SIZE_MAX
+				 : (offset + length + CACHE_BLOCK_SIZE - 1) /
+				       CACHE_BLOCK_SIZE;
+
+		for (size_t s = 0; s < kNumShards; ++s) {
+			ShardLock lock(this, s);
+			uint32_t i = fileBucket(s, h);
+			while (i != SHM_CACHE_NIL) {
+				Block *b = block(s, i);
+				uint32_t next = b->file_next;
+				if (matchPath(b, h, path) &&
+				    b->block_no >= first && b->block_no < end)
+					unlink(s, i);
+				i = next;
+			}
+		}
+	}
+
+private:
+	class ShardLock {
+		TC_ShmDataCache *cache_;
+		size_t s_;
+	public:
+		ShardLock(TC_ShmDataCache *cache, size_t s)
+		    : cache_(cache), s_(s)
+		{
+			Shard *shard = cache_->shard(s_);
+			if (pthread_mutex_lock(&shard->mu) == EOWNERDEAD) {
+				// The index may be half updated.
+				cache_->resetShard(s_);
+				pthread_mutex_consistent(&shard->mu);
+			}
+		}
+		~ShardLock()
+		{
+			pthread_mutex_unlock(&cache_->shard(s_)->mu);
+		}
+	};
+
+	static size_t align(size_t n, size_t a)
+	{
+		return (n + a - 1) / a * a;
+	}
+
+	static void initMutex(pthread_mutex_t *mu)
+	{
+		pthread_mutexattr_t attr;
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(mu, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+
+	static void lockBlock(Block *b)
+	{
+		if (pthread_mutex_lock(&b->mu) == EOWNERDEAD) {
+			// The data may be half written.
+			b->nextents = 0;
+			pthread_mutex_consistent(&b->mu);
+		}
+	}
+
+	static bool waitForSize(int fd, size_t size)
+	{
+		struct stat st;
+
+		for (int ms = 0; ms < SHM_CACHE_WAIT_MS; ms += 10) {
+			if (fstat(fd, &st) != 0)
+				return false;
+			if ((size_t)st.st_size == size)
+				return true;
+			if (st.st_size != 0)
+				return false;
+			usleep(10000);
+		}
+		return false;
+	}
+
+	bool waitForFormat()
+	{
+		Header *hdr = header();
+
+		for (int ms = 0; ms < SHM_CACHE_WAIT_MS; ms += 10) {
+			if (hdr->magic.load(std::memory_order_acquire) ==
+			    SHM_CACHE_MAGIC) {
+				return hdr->nshards == kNumShards &&
+				       hdr->blocks_per_shard == bps_ &&
+				       hdr->nbuckets == nbuckets_ &&
+				       hdr->size == size_;
+			}
+			usleep(10000);
+		}
+		return false;
+	}
+
+	void format()
+	{
+		Header *hdr = header();
+
+		hdr->nshards = kNumShards;
+		hdr->blocks_per_shard = bps_;
+		hdr->nbuckets = nbuckets_;
+		hdr->size = size_;
+		hdr->expire_ms = expire_ms_;
+		for (size_t s = 0; s < kNumShards; ++s) {
+			initMutex(&shard(s)->mu);
+			for (uint32_t i = 0; i < bps_; ++i)
+				initMutex(&block(s, i)->mu);
+			resetShard(s);
+		}
+		hdr->magic.store(SHM_CACHE_MAGIC, std::memory_order_release);
+	}
+
+	// Unlink all blocks of the shard.  Pinned blocks are reused only
+	// after being unpinned.
+	void resetShard(size_t s)
+	{
+		for (size_t k = 0; k < nbuckets_; ++k) {
+			buckets(s)[k] = SHM_CACHE_NIL;
+			fileBuckets(s)[k] = SHM_CACHE_NIL;
+		}
+		for (uint32_t i = 0; i < bps_; ++i)
+			block(s, i)->linked = 0;
+		shard(s)->hand = 0;
+	}
+
+	Header *header() { return (Header *)base_; }
+
+	Shard *shard(size_t s)
+	{
+		return (Shard *)(base_ + align(sizeof(Header), 64)) + s;
+	}
+
+	Block *block(size_t s, uint32_t i)
+	{
+		return (Block *)(base_ + off_blocks_) + s * bps_ + i;
+	}
+
+	char *blockData(size_t s, uint32_t i)
+	{
+		return base_ + off_data_ + (s * bps_ + i) * CACHE_BLOCK_SIZE;
+	}
+
+	uint32_t *buckets(size_t s)
+	{
+		return (uint32_t *)(base_ + off_buckets_) + s * nbuckets_;
+	}
+
+	uint32_t *fileBuckets(size_t s)
+	{
+		return (uint32_t *)(base_ + off_file_buckets_) + s * nbuckets_;
+	}
+
+	uint32_t &bucket(size_t s, uint64_t h, size_t block_no)
+	{
+		return buckets(s)[(HashBlock(h, block_no) >> 8) &
+				  (nbuckets_ - 1)];
+	}
+
+	uint32_t &fileBucket(size_t s, uint64_t h)
+	{
+		return fileBuckets(s)[h & (nbuckets_ - 1)];
+	}
+
+	size_t shardOf(uint64_t h, size_t block_no)
+	{
+		return HashBlock(h, block_no) % kNumShards;
+	}
+
+	static bool matchPath(const Block *b, uint64_t h,
+			      const CachePath &path)
+	{
+		return b->path_hash == h && path.size < SHM_CACHE_PATH_MAX &&
+		       b->path[path.size] == '\0' &&
+		       memcmp(b->path, path.data, path.size) == 0;
+	}
+
+	static bool matchCtime(const Block *b, const struct timespec &ctime)
+	{
+		return (b->ctime_sec == 0 && b->ctime_nsec == 0) ||
+		       (b->ctime_sec == ctime.tv_sec &&
+			b->ctime_nsec == ctime.tv_nsec);
+	}
+
+	// Caller must hold the lock of the shard.
+	uint32_t find(size_t s, const CachePath &path, uint64_t h,
+		      size_t block_no)
+	{
+		for (uint32_t i = bucket(s, h, block_no); i != SHM_CACHE_NIL;
+		     i = block(s, i)->next) {
+			Block *b = block(s, i);
+			if (b->block_no == block_no && matchPath(b, h, path)) {
+				if (b->expire_ms < NowMs()) {
+					unlink(s, i);
+					return SHM_CACHE_NIL;
+				}
+				return i;
+			}
+		}
+		return SHM_CACHE_NIL;
+	}
+
+	uint32_t pin(size_t s, const CachePath &path, uint64_t h,
+		     size_t block_no)
+	{
+		ShardLock lock(this, s);
+		uint32_t i = find(s, path, h, block_no);
+		if (i != SHM_CACHE_NIL) {
+			block(s, i)->referenced = 1;
+			block(s, i)->pins++;
+		}
+		return i;
+	}
+
+	// See DataCacheShard::pinForWrite().
+	uint32_t pinForWrite(size_t s, const CachePath &path, uint64_t h,
+			     size_t block_no)
+	{
+		ShardLock lock(this, s);
+		uint32_t old = find(s, path, h, block_no);
+		if (old != SHM_CACHE_NIL) {
+			Block *b = block(s, old);
+			b->expire_ms = NowMs() + expire_ms_;
+			if (b->leases == 0) {
+				b->referenced = 1;
+				b->pins++;
+				b->writers++;
+				return old;
+			}
+		}
+
+		uint32_t i = allocBlock(s);
+		if (i == SHM_CACHE_NIL) {
+			if (old != SHM_CACHE_NIL)
+				unlink(s, old);
+			return SHM_CACHE_NIL;
+		}
+		Block *b = block(s, i);
+		b->nextents = 0;
+		b->ctime_sec = b->ctime_nsec = 0;
+		if (old != SHM_CACHE_NIL) {
+			Block *o = block(s, old);
+			lockBlock(o);
+			if (o->writers == 0) {
+				for (uint32_t k = 0; k < o->nextents; ++k) {
+					const Extent &e = o->extents[k];
+					memcpy(blockData(s, i) + e.first,
+					       blockData(s, old) + e.first,
+					       e.second - e.first);
+					b->extents[k] = e;
+				}
+				b->nextents = o->nextents;
+				b->ctime_sec = o->ctime_sec;
+				b->ctime_nsec = o->ctime_nsec;
+				b->timestamp.store(o->timestamp);
+			}
+			pthread_mutex_unlock(&o->mu);
+			unlink(s, old);
+		}
+		link(s, i, path, h, block_no);
+		b->referenced = 0;
+		b->expire_ms = NowMs() + expire_ms_;
+		b->pins++;
+		b->writers++;
+		return i;
+	}
+
+	// Caller must hold the lock of the shard.
+	void link(size_t s, uint32_t i, const CachePath &path, uint64_t h,
+		  size_t block_no)
+	{
+		Block *b = block(s, i);
+		uint32_t &head = bucket(s, h, block_no);
+		uint32_t &fhead = fileBucket(s, h);
+
+		memcpy(b->path, path.data, path.size);
+		b->path[path.size] = '\0';
+		b->path_hash = h;
+		b->block_no = block_no;
+		b->next = head;
+		head = i;
+		b->file_prev = SHM_CACHE_NIL;
+		b->file_next = fhead;
+		if (fhead != SHM_CACHE_NIL)
+			block(s, fhead)->file_prev = i;
+		fhead = i;
+		b->linked = 1;
+	}
+
+	// Caller must hold the lock of the shard.
+	void unlink(size_t s, uint32_t i)
+	{
+		Block *b = block(s, i);
+		uint32_t *p = &bucket(s, b->path_hash, b->block_no);
+
+		while (*p != i)
+			p = &block(s, *p)->next;
+		*p = b->next;
+		if (b->file_prev != SHM_CACHE_NIL)
+			block(s, b->file_prev)->file_next = b->file_next;
+		else
+			fileBucket(s, b->path_hash) = b->file_next;
+		if (b->file_next != SHM_CACHE_NIL)
+			block(s, b->file_next)->file_prev = b->file_prev;
+		b->linked = 0;
+	}
+
+	// See DataCacheShard::allocBlock().  Caller must hold the lock of the
+	// shard.
+	uint32_t allocBlock(size_t s)
+	{
+		Shard *sh = shard(s);
+
+		if (sh->nfresh < bps_)
+			return sh->nfresh++;
+		for (size_t scanned = 0; scanned < 2 * bps_; ++scanned) {
+			uint32_t i = sh->hand;
+			Block *b = block(s, i);
+			sh->hand = (sh->hand + 1) % bps_;
+			if (b->pins > 0)
+				continue;
+			if (b->linked && b->referenced) {
+				b->referenced = 0;
+				continue;
+			}
+			if (b->linked)
+				unlink(s, i);
+			return i;
+		}
+		return SHM_CACHE_NIL;
+	}
+
+	TC_ShmDataCache(const TC_ShmDataCache &);
+	TC_ShmDataCache &operator=(const TC_ShmDataCache &);
+};
+
+#endif // TC_ShmDataCache_INCLUDED
@@ -0,0 +1,81 @@
+//
+// TC_SingleFlight.h
+//
+// Tracking of the cache misses being fetched from the server, so that when
+// many threads miss the same data at once, only the first one fetches it
+// and the others wait for it to be cached instead of sending the same
+// requests.
+//
+// A key names the missing data, e.g., the attributes of a path, or a block
+// of a file.  A thread that leads the fetch of some keys must end() them
+// once the fetched data is in the cache, or once the fetch failed.  Waiting
+// threads then look up the cache again, and fetch what is still missing.
+//
+// Definition of the TC_SingleFlight class.
+//
+#ifndef TC_SingleFlight_INCLUDED
+#define TC_SingleFlight_INCLUDED
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class TC_SingleFlight
+{
+	std::mutex mu_;
+	std::condition_variable cv_;
+	std::unordered_set<std::string> inflight_;
+
+	// Caller must hold mu_.
+	bool anyInFlight(const std::vector<std::string> &keys) const
+	{
+		for (const auto &k : keys) {
+			if (inflight_.count(k))
+				return true;
+		}
+		return false;
+	}
+
+public:
+	// Lead the fetches of "keys" that are not in flight yet, and append
+	// them to "led".  Returns false if some of "keys" are being fetched by
+	// other threads.
+	bool begin(const std::vector<std::string> &keys,
+		   std::vector<std::string> *led)
+	{
+		bool all = true;
+		std::lock_guard<std::mutex> lock(mu_);
+
+		for (const auto &k : keys) {
+			if (inflight_.insert(k).second)
+				led->push_back(k);
+			else
+				all = false;
+		}
+		return all;
+	}
+
+	void end(const std::vector<std::string> &keys)
+	{
+		if (keys.empty())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			for (const auto &k : keys)
+				inflight_.erase(k);
+		}
+		cv_.notify_all();
+	}
+
+	// Wait until none of "keys" is in flight.  The caller must not lead
+	// any fetch while waiting, lest two threads wait for each other.
+	void wait(const std::vector<std::string> &keys)
+	{
+		std::unique_lock<std::mutex> lock(mu_);
+		cv_.wait(lock, [&] { return !anyInFlight(keys); });
+	}
+};
+
+#endif // TC_SingleFlight_INCLUDED
@@ -245,8 +245,227 @@ bool vrestore_iov_array(struct viov_array *iova,
 	return res;
 }
 
-bool tc_merge_iov_array(struct viov_array *iova)
+bool tc_iov_parts_are_independent(const struct viov_array *parts,
+				  int nparts)
 {
-	return false;
+	typedef std::pair<int, const struct viovec *> PartIov;
+	// (part, viovec) of each file, in the order each file first appears
+	std::vector<std::vector<PartIov>> files;
+
+	for (int n = 0; n < nparts; ++n) {
+		for (int i = 0; i < parts[n].size; ++i) {
+			const struct viovec *iov = parts[n].iovs + i;
+			if (iov->file.type == VFILE_CURRENT ||
+			    iov->file.type == VFILE_SAVED) {
+				return false;
+			}
+			auto it = std::find_if(
+			    files.begin(), files.end(),
+			    [iov](const std::vector<PartIov> &f) {
+				    return tc_cmp_file(&f[0].second->file,
+						       &iov->file);
+			    });
+			if (it == files.end()) {
+				files.emplace_back(1, std::make_pair(n, iov));
+			} else {
+				it->emplace_back(n, iov);
+			}
+		}
+	}
+
+	auto conflict = [](const struct viovec *a, const struct viovec *b) {
+		if (a->is_creation || b->is_creation ||
+		    a->offset >= TC_OFFSET_CUR || b->offset >= TC_OFFSET_CUR) {
+			return true;
+		}
+		return a->offset < b->offset + b->length &&
+		       b->offset < a->offset + a->length;
+	};
+	for (auto &f : files) {
+		for (size_t i = 0; i < f.size(); ++i) {
+			for (size_t j = i + 1; j < f.size(); ++j) {
+				if (f[i].first != f[j].first &&
+				    conflict(f[i].second, f[j].second)) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+struct viov_merge *tc_merge_iov_array(const struct viov_array *iova,
+				      size_t size_limit, bool is_write)
+{
+	// Indices of the original viovecs of each file, in the order each
+	// file first appears.
+	std::vector<std::vector<int>> files;
+
+	for (int i = 0; i < iova->size; ++i) {
+		const struct viovec *iov = iova->iovs + i;
+		// The current and saved filehandles depend on the order of
+		// viovecs, which merging changes.
+		if (iov->file.type == VFILE_CURRENT ||
+		    iov->file.type == VFILE_SAVED) {
+			return NULL;
+		}
+		auto it = std::find_if(
+		    files.begin(), files.end(), [iova, iov](std::vector<int> &f) {
+			    return tc_cmp_file(&iova->iovs[f[0]].file, &iov->file);
+		    });
+		if (it == files.end()) {
+			files.emplace_back(1, i);
+		} else {
+			it->push_back(i);
+		}
+	}
+
+	std::vector<std::vector<int>> groups; // original viovecs of each merged
+	for (auto &f : files) {
+		// Creation has to come first, and special offsets can not be
+		// compared, so leave such files alone.
+		bool sortable = std::none_of(f.begin(), f.end(), [iova](int i) {
+			const struct viovec *iov = iova->iovs + i;
+			return iov->is_creation || iov->offset == TC_OFFSET_END ||
+			       iov->offset == TC_OFFSET_CUR;
+		});
+		if (!sortable) {
+			for (int i : f) {
+				groups.emplace_back(1, i);
+			}
+			continue;
+		}
+
+		std::stable_sort(f.begin(), f.end(), [iova](int a, int b) {
+			return iova->iovs[a].offset < iova->iovs[b].offset;
+		});
+		size_t start = 0;
+		size_t end = 0;
+		for (size_t k = 0; k < f.size(); ++k) {
+			const struct viovec *iov = iova->iovs + f[k];
+			size_t iov_end = iov->offset + iov->length;
+			if (k > 0 && iov->offset <= end &&
+			    std::max(end, iov_end) - start <= size_limit &&
+			    iov->is_direct_io ==
+				iova->iovs[groups.back()[0]].is_direct_io) {
+				groups.back().push_back(f[k]);
+				end = std::max(end, iov_end);
+			} else {
+				groups.emplace_back(1, f[k]);
+				start = iov->offset;
+				end = iov_end;
+			}
+		}
+	}
+
+	if ((int)groups.size() == iova->size) {
+		return NULL;
+	}
+
+	struct viov_merge *merge =
+	    (struct viov_merge *)calloc(1, sizeof(*merge));
+	if (!merge) {
+		return NULL;
+	}
+	merge->merged.iovs =
+	    (struct viovec *)malloc(sizeof(struct viovec) * groups.size());
+	merge->owners = (int *)malloc(sizeof(int) * iova->size);
+	merge->nmembers = (int *)calloc(groups.size(), sizeof(int));
+	if (!merge->merged.iovs || !merge->owners || !merge->nmembers) {
+		tc_free_iov_merge(&merge);
+		return NULL;
+	}
+	merge->merged.size = groups.size();
+
+	for (size_t m = 0; m < groups.size(); ++m) {
+		auto &g = groups[m];
+		struct viovec *miov = merge->merged.iovs + m;
+		*miov = iova->iovs[g[0]];
+		merge->nmembers[m] = g.size();
+		for (int i : g) {
+			merge->owners[i] = m;
+		}
+		if (g.size() == 1) {
+			continue; // use the original buffer
+		}
+
+		size_t end = miov->offset;
+		for (int i : g) {
+			const struct viovec *iov = iova->iovs + i;
+			end = std::max(end, iov->offset + iov->length);
+			miov->is_write_stable |= iov->is_write_stable;
+		}
+		miov->length = end - miov->offset;
+		miov->data = (char *)malloc(miov->length);
+		if (!miov->data) {
+			// merging is only an optimization
+			tc_free_iov_merge(&merge);
+			return NULL;
+		}
+		if (is_write) {
+			// copy in the original order so the last write wins
+			std::sort(g.begin(), g.end());
+			for (int i : g) {
+				const struct viovec *iov = iova->iovs + i;
+				memmove(miov->data + (iov->offset - miov->offset),
+					iov->data, iov->length);
+			}
+		}
+	}
+
+	return merge;
+}
+
+void tc_unmerge_iov_array(struct viov_array *iova, struct viov_merge **merge,
+			  bool is_write, vres *res)
+{
+	struct viov_merge *mg = *merge;
+	bool index_fixed = false;
+
+	for (int i = 0; i < iova->size; ++i) {
+		int m = mg->owners[i];
+		struct viovec *iov = iova->iovs + i;
+		const struct viovec *miov = mg->merged.iovs + m;
+
+		if (res && !vokay(*res) && !index_fixed && m == res->index) {
+			res->index = i;
+			index_fixed = true;
+		}
+		if (mg->nmembers[m] == 1) {
+			*iov = *miov;
+			continue;
+		}
+
+		// # of bytes the merged viovec read or wrote for this one
+		size_t rel = iov->offset - miov->offset;
+		size_t done = miov->length > rel ? miov->length - rel : 0;
+		done = std::min(done, iov->length);
+		if (!is_write) {
+			memmove(iov->data, miov->data + rel, done);
+		} else {
+			iov->is_write_stable = miov->is_write_stable;
+		}
+		iov->is_eof = miov->is_eof && (rel + iov->length >= miov->length);
+		iov->is_failure = miov->is_failure;
+		iov->length = done;
+	}
+
+	tc_free_iov_merge(merge);
+}
+
+void tc_free_iov_merge(struct viov_merge **merge)
+{
+	struct viov_merge *mg = *merge;
+
+	for (int m = 0; m < mg->merged.size; ++m) {
+		if (mg->nmembers[m] > 1) {
+			free(mg->merged.iovs[m].data);
+		}
+	}
+	free(mg->merged.iovs);
+	free(mg->owners);
+	free(mg->nmembers);
+	free(mg);
+	*merge = NULL;
 }
 
@@ -278,3 +278,150 @@ TEST(IovecUtils, LastFlagIsCorrectlySet)
 	delete[] iovs[1].data;
 	delete[] iovs[2].data;
 }
+
+TEST(IovecUtils, MergeAdjacentAndOverlappedReads)
+{
+	struct viovec iovs[4];
+	viov2fd(iovs + 0, (1 << 30) + 1, 8_KB, 4_KB, new char[4_KB]);
+	viov2fd(iovs + 1, (1 << 30) + 2, 0, 4_KB, new char[4_KB]);
+	viov2fd(iovs + 2, (1 << 30) + 1, 0, 8_KB, new char[8_KB]);
+	viov2fd(iovs + 3, (1 << 30) + 1, 4_KB, 8_KB, new char[8_KB]);
+
+	struct viov_array iova = VIOV_ARRAY_INITIALIZER(iovs, 4);
+	auto merge = tc_merge_iov_array(&iova, 1_MB, false);
+	ASSERT_TRUE(merge != NULL);
+	EXPECT_EQ(2, merge->merged.size);
+	EXPECT_EQ(0, merge->merged.iovs[0].offset);
+	EXPECT_EQ(12_KB, merge->merged.iovs[0].length);
+	EXPECT_EQ(iovs[1].data, merge->merged.iovs[1].data);
+
+	// the server returns 10KB of file 1 and reaches EOF
+	struct viovec *miov = merge->merged.iovs;
+	for (size_t i = 0; i < 10_KB; ++i) {
+		miov->data[i] = (char)(i / 1_KB);
+	}
+	miov->length = 10_KB;
+	miov->is_eof = true;
+
+	vres res = { .index = 2, .err_no = 0 };
+	tc_unmerge_iov_array(&iova, &merge, false, &res);
+	EXPECT_EQ(NULL, merge);
+	EXPECT_EQ(2_KB, iovs[0].length);
+	EXPECT_TRUE(iovs[0].is_eof);
+	EXPECT_EQ(8, iovs[0].data[0]);
+	EXPECT_EQ(8_KB, iovs[2].length);
+	EXPECT_FALSE(iovs[2].is_eof);
+	EXPECT_EQ(6_KB, iovs[3].length);
+	EXPECT_TRUE(iovs[3].is_eof);
+	EXPECT_EQ(4, iovs[3].data[0]);
+	EXPECT_EQ(4_KB, iovs[1].length);
+
+	for (int i = 0; i < 4; ++i) {
+		delete[] iovs[i].data;
+	}
+}
+
+TEST(IovecUtils, MergeOverlappedWritesInOrder)
+{
+	struct viovec iovs[2];
+	viov2fd(iovs + 0, (1 << 30) + 1, 0, 8_KB, new char[8_KB]);
+	viov2fd(iovs + 1, (1 << 30) + 1, 4_KB, 8_KB, new char[8_KB]);
+	memset(iovs[0].data, 'a', 8_KB);
+	memset(iovs[1].data, 'b', 8_KB);
+
+	struct viov_array iova = VIOV_ARRAY_INITIALIZER(iovs, 2);
+	auto merge = tc_merge_iov_array(&iova, 1_MB, true);
+	ASSERT_TRUE(merge != NULL);
+	ASSERT_EQ(1, merge->merged.size);
+	EXPECT_EQ(12_KB, merge->merged.iovs[0].length);
+	EXPECT_EQ('a', merge->merged.iovs[0].data[4_KB - 1]);
+	EXPECT_EQ('b', merge->merged.iovs[0].data[4_KB]);
+
+	merge->merged.iovs[0].is_failure = true;
+	vres res = { .index = 0, .err_no = EIO };
+	tc_unmerge_iov_array(&iova, &merge, true, &res);
+	EXPECT_EQ(0, res.index);
+	EXPECT_TRUE(iovs[0].is_failure);
+	EXPECT_TRUE(iovs[1].is_failure);
+
+	delete[] iovs[0].data;
+	delete[] iovs[1].data;
+}
+
+TEST(IovecUtils, DoNotMergeBeyondLimitOrCreation)
+{
+	struct viovec iovs[3];
+	viov2fd(iovs + 0, (1 << 30) + 1, 0, 512_KB, new char[512_KB]);
+	viov2fd(iovs + 1, (1 << 30) + 1, 512_KB, 768_KB, new char[768_KB]);
+	viov4creation(iovs + 2, "DoNotMergeCreation.dat", 4_KB,
+		      new char[4_KB]);
+
+	struct viov_array iova = VIOV_ARRAY_INITIALIZER(iovs, 3);
+	EXPECT_EQ(NULL, tc_merge_iov_array(&iova, 1_MB, true));
+
+	struct viovec cur[2];
+	viov2current(cur + 0, 0, 4_KB, iovs[0].data);
+	viov2current(cur + 1, 4_KB, 4_KB, iovs[1].data);
+	iova = VIOV_ARRAY_INITIALIZER(cur, 2);
+	EXPECT_EQ(NULL, tc_merge_iov_array(&iova, 1_MB, true));
+
+	for (int i = 0; i < 3; ++i) {
+		delete[] iovs[i].data;
+	}
+}
+
+TEST(IovecUtils, FilesWithAndWithoutPathsDiffer)
+{
+	vfile a = vfile_from_path("/foo/bar");
+	vfile b = vfile_from_path("/foo/bar");
+	vfile c = vfile_current();
+	vfile d = vfile_current();
+
+	b.path = NULL;  // as for the same path as the preceding viovec
+	EXPECT_TRUE(tc_cmp_file(&a, &a));
+	EXPECT_FALSE(tc_cmp_file(&a, &b));
+	EXPECT_FALSE(tc_cmp_file(&b, &a));
+	EXPECT_TRUE(tc_cmp_file(&b, &b));
+	EXPECT_TRUE(tc_cmp_file(&c, &d));
+	d.path = "bar";
+	EXPECT_FALSE(tc_cmp_file(&c, &d));
+	EXPECT_FALSE(tc_cmp_file(&d, &c));
+}
+
+TEST(IovecUtils, PartsOfNewOrOverlappedFilesAreDependent)
+{
+	const size_t LEN = 4_MB;
+	char *buf = (char *)malloc(LEN);
+	viovec iovs[2];
+	int nparts;
+
+	// the parts of a new file have to follow its creation
+	viov4creation(&iovs[0], "PartsOfNewFile.dat", LEN, buf);
+	struct viov_array iova = VIOV_ARRAY_INITIALIZER(iovs, 1);
+	auto parts = tc_split_iov_array(&iova, 1_MB, &nparts);
+	EXPECT_GT(nparts, 1);
+	EXPECT_FALSE(tc_iov_parts_are_independent(parts, nparts));
+	vrestore_iov_array(&iova, &parts, nparts);
+
+	iovs[0].is_creation = false;
+	parts = tc_split_iov_array(&iova, 1_MB, &nparts);
+	EXPECT_TRUE(tc_iov_parts_are_independent(parts, nparts));
+	vrestore_iov_array(&iova, &parts, nparts);
+
+	// overlapping writes in different parts
+	viov2path(&iovs[0], "PartsOfOverlappedFile.dat", 0, LEN / 2, buf);
+	viov2path(&iovs[1], "PartsOfOverlappedFile.dat", LEN / 4, LEN / 2,
+		  buf + LEN / 2);
+	iova = VIOV_ARRAY_INITIALIZER(iovs, 2);
+	parts = tc_split_iov_array(&iova, 1_MB, &nparts);
+	EXPECT_FALSE(tc_iov_parts_are_independent(parts, nparts));
+	vrestore_iov_array(&iova, &parts, nparts);
+
+	// adjacent ones
+	iovs[1].offset = LEN / 2;
+	parts = tc_split_iov_array(&iova, 1_MB, &nparts);
+	EXPECT_TRUE(tc_iov_parts_are_independent(parts, nparts));
+	vrestore_iov_array(&iova, &parts, nparts);
+
+	free(buf);
+}